@@ -0,0 +1,262 @@
+#include "./hdiscover.h"
+#include "./hproto.h"
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+
+/* the smallest prefix hl_discover() accepts, a /16 is 65534 hosts */
+#define MIN_PREFIX 16
+
+struct probe
+{
+	int sock; /* -1 if the slot is free */
+	uint32_t addr; /* host byte order */
+	int sent; /* the HA_nothing request went out */
+	iTransactionResponse resp;
+	size_t respoff;
+	unsigned long long start;
+};
+
+struct scan
+{
+	int ep;
+	hProbe *found;
+	size_t amount;
+	size_t alloc;
+};
+
+/* parses "a.b.c.d/prefix" into the first host address and the amount of hosts */
+static int parsecidr(const char *cidr, uint32_t *first, uint32_t *hosts)
+{
+	char ip[INET_ADDRSTRLEN];
+	const char *slash = strchr(cidr, '/');
+	struct in_addr in;
+	unsigned long prefix = 32;
+
+	size_t len = slash ? (size_t) (slash - cidr) : strlen(cidr);
+	if(len >= sizeof(ip)) return -EINVAL;
+	memcpy(ip, cidr, len);
+	ip[len] = '\0';
+	if(inet_pton(AF_INET, ip, &in) != 1) return -EINVAL;
+
+	if(slash)
+	{
+		char *end;
+		errno = 0;
+		prefix = strtoul(slash + 1, &end, 10);
+		if(end == slash + 1 || *end != '\0' || errno != 0 || prefix > 32)
+			return -EINVAL;
+	}
+	if(prefix < MIN_PREFIX) return -ERANGE;
+
+	uint32_t mask = 0xFFFFFFFFU << (32 - prefix);
+	uint32_t net = ntohl(in.s_addr) & mask;
+	uint64_t size = (uint64_t) 1 << (32 - prefix);
+	/* the network and broadcast addresses aren't hosts, except in /31 and /32 */
+	if(size > 2)
+	{
+		*first = net + 1;
+		*hosts = size - 2;
+	}
+	else
+	{
+		*first = net;
+		*hosts = size;
+	}
+	return HE_success;
+}
+
+static void drop(struct scan *s, struct probe *p)
+{
+	epoll_ctl(s->ep, EPOLL_CTL_DEL, p->sock, NULL);
+	close(p->sock);
+	p->sock = -1;
+}
+
+static int record(struct scan *s, struct probe *p, int result)
+{
+	if(s->amount == s->alloc)
+	{
+		size_t alloc = s->alloc ? s->alloc * 2 : 16;
+		hProbe *found = realloc(s->found, alloc * sizeof(hProbe));
+		if(found == NULL) return -ENOMEM;
+		s->found = found;
+		s->alloc = alloc;
+	}
+
+	hProbe *found = &s->found[s->amount];
+	struct in_addr in = { htonl(p->addr) };
+	inet_ntop(AF_INET, &in, found->addr, sizeof(found->addr));
+	found->result = result;
+	found->ms = nowms() - p->start;
+	++s->amount;
+	return HE_success;
+}
+
+/* starts a connection to `addr'; addresses that refuse right away are skipped */
+static int start(struct scan *s, struct probe *p, uint32_t addr)
+{
+	struct sockaddr_in sin;
+	memset(&sin, 0x0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(atoi(PORT));
+	sin.sin_addr.s_addr = htonl(addr);
+
+	int sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if(sock < 0) return -errno;
+	if(connect(sock, (struct sockaddr *) &sin, sizeof(sin)) < 0 && errno != EINPROGRESS)
+	{
+		int err = errno;
+		close(sock);
+		/* running out of sockets is fatal, an unreachable host isn't */
+		return err == EMFILE || err == ENFILE || err == ENOBUFS ? -err : HE_success;
+	}
+
+	struct epoll_event ev;
+	memset(&ev, 0x0, sizeof(ev));
+	ev.events = EPOLLOUT;
+	ev.data.ptr = p;
+	if(epoll_ctl(s->ep, EPOLL_CTL_ADD, sock, &ev) < 0)
+	{ int err = -errno; close(sock); return err; }
+
+	p->sock = sock;
+	p->addr = addr;
+	p->sent = 0;
+	p->respoff = 0;
+	p->start = nowms();
+	return HE_success;
+}
+
+/* advances the handshake of a probe, returns -errno only on fatal errors */
+static int handle(struct scan *s, struct probe *p, uint32_t events)
+{
+	if(!p->sent)
+	{
+		int err;
+		socklen_t len = sizeof(err);
+		if(getsockopt(p->sock, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0)
+		{ drop(s, p); return HE_success; }
+
+		/* the 8 byte request always fits in an empty send buffer */
+		iTransactionHeader header = makeheader(HA_nothing, 0);
+		if(send(p->sock, &header, sizeof(header), MSG_NOSIGNAL) != sizeof(header))
+		{ drop(s, p); return HE_success; }
+		p->sent = 1;
+
+		struct epoll_event ev;
+		memset(&ev, 0x0, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.ptr = p;
+		epoll_ctl(s->ep, EPOLL_CTL_MOD, p->sock, &ev);
+		return HE_success;
+	}
+
+	if(!(events & (EPOLLIN | EPOLLERR | EPOLLHUP)))
+		return HE_success;
+	ssize_t n = recv(p->sock, (char *) &p->resp + p->respoff, sizeof(p->resp) - p->respoff, 0);
+	if(n < 0 && (errno == EAGAIN || errno == EINTR))
+		return HE_success;
+	if(n <= 0)
+	{ drop(s, p); return HE_success; }
+	if((p->respoff += n) != sizeof(p->resp))
+		return HE_success;
+
+	int ret = HE_success;
+	/* something else listening on the port */
+	if(memcmp(p->resp.magic, MAGIC, MAGIC_LEN) == 0)
+		ret = record(s, p, resperror(p->resp.resp));
+	drop(s, p);
+	return ret;
+}
+
+/* orders probes by address */
+static int cmpprobe(const void *a, const void *b)
+{
+	struct in_addr x, y;
+	inet_pton(AF_INET, ((const hProbe *) a)->addr, &x);
+	inet_pton(AF_INET, ((const hProbe *) b)->addr, &y);
+	uint32_t hx = ntohl(x.s_addr), hy = ntohl(y.s_addr);
+	return hx < hy ? -1 : hx > hy;
+}
+
+int hl_discover(const char *cidr, unsigned parallel, unsigned long timeout, hProbe **found, size_t *amount)
+{
+	struct scan s = { -1, NULL, 0, 0 };
+	uint32_t first, hosts, next = 0;
+	int ret;
+
+	if((ret = parsecidr(cidr, &first, &hosts)) != HE_success)
+		return ret;
+	if(parallel == 0) return -EINVAL;
+	if(parallel > hosts) parallel = hosts;
+
+	struct probe *probes = malloc(parallel * sizeof(struct probe));
+	if(probes == NULL) return -ENOMEM;
+	for(unsigned i = 0; i < parallel; ++i)
+		probes[i].sock = -1;
+	if((s.ep = epoll_create1(EPOLL_CLOEXEC)) < 0)
+	{ free(probes); return -errno; }
+
+	struct epoll_event events[64];
+	for(;;)
+	{
+		unsigned long long t = nowms(), deadline = ULLONG_MAX;
+		size_t active = 0;
+		for(unsigned i = 0; i < parallel && ret == HE_success; ++i)
+		{
+			struct probe *p = &probes[i];
+			if(p->sock >= 0 && p->start + timeout <= t)
+				drop(&s, p);
+			/* a slot may be refilled several times if hosts refuse right away */
+			while(p->sock < 0 && next < hosts && ret == HE_success)
+				ret = start(&s, p, first + next++);
+			if(p->sock >= 0)
+			{
+				++active;
+				if(p->start + timeout < deadline)
+					deadline = p->start + timeout;
+			}
+		}
+		if(ret != HE_success || active == 0)
+			break;
+
+		t = nowms();
+		int ms = deadline <= t ? 0 : deadline - t > INT_MAX ? INT_MAX : (int) (deadline - t);
+		int n = epoll_wait(s.ep, events, sizeof(events) / sizeof(events[0]), ms);
+		if(n < 0 && errno != EINTR)
+		{ ret = -errno; break; }
+		for(int i = 0; i < n && ret == HE_success; ++i)
+		{
+			struct probe *p = events[i].data.ptr;
+			if(p->sock >= 0)
+				ret = handle(&s, p, events[i].events);
+		}
+	}
+
+	for(unsigned i = 0; i < parallel; ++i)
+		if(probes[i].sock >= 0)
+			drop(&s, &probes[i]);
+	close(s.ep);
+	free(probes);
+
+	if(ret != HE_success)
+	{
+		free(s.found);
+		return ret;
+	}
+	if(s.amount > 1)
+		qsort(s.found, s.amount, sizeof(hProbe), cmpprobe);
+	*found = s.found;
+	*amount = s.amount;
+	return HE_success;
+}
+
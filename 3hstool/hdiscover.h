@@ -0,0 +1,31 @@
+#ifndef inc_hdiscover_h
+#define inc_hdiscover_h
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "./hlink.h"
+
+#include <arpa/inet.h>
+
+typedef struct hProbe
+{
+	char addr[INET_ADDRSTRLEN];
+	int result; /* HE_success if the 3ds trusts us, HE_notauthed if it doesn't, HE_tryagain if it's busy */
+	unsigned long ms; /* time it took to connect and respond */
+} hProbe;
+
+/* probes every host address of `cidr', like "192.168.1.0/24", for an hLink
+ * server with up to `parallel' connections in flight that each may take
+ * `timeout' milliseconds; the devices that respond are put in `*found',
+ * sorted by address, which has to be freed; prefixes shorter than 16 bits
+ * are refused with -ERANGE; returns HE_success or -errno */
+int hl_discover(const char *cidr, unsigned parallel, unsigned long timeout, hProbe **found, size_t *amount);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
@@ -0,0 +1,631 @@
+
+#include "./hfleet.h"
+#include "./hproto.h"
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+
+/* Every device is a small state machine driven by one epoll loop: it
+ * (re)connects if needed, sends all requests of a step back-to-back,
+ * reads the responses in order and then moves on to the next step. */
+
+enum DState
+{
+	DS_connect,
+	DS_send,
+	DS_recv,
+	DS_wait, /* HS_wait step or waiting before retrying */
+	DS_done,
+};
+
+struct hDeviceState
+{
+	hLink link;
+	int sock;
+	int state; /* enum DState */
+	int reused; /* the connection was kept open from an earlier round */
+	int noreuse; /* the 3ds closes the connection after every transaction */
+	long step; /* -1 while authenticating */
+	unsigned tries; /* retries of the current step */
+	unsigned long long start;
+	unsigned long long deadline;
+
+	/* requests of the current step; the result of a request is -EAGAIN until
+	 * it is sent, -EINPROGRESS while in flight and HE_tryagain if the 3ds was busy */
+	hRequest *reqs;
+	size_t nreqs;
+	void *body;
+	int filefd; /* body of a HS_install_data request */
+	off_t fileoff;
+	int install; /* the step installs something, which can take a while */
+
+	char *out;
+	size_t outlen;
+	size_t outoff;
+
+	size_t inflight; /* responses left in this round */
+	size_t answered; /* responses read in this round */
+	iTransactionResponse resp;
+	size_t respoff;
+	uint32_t bodyleft;
+	uint32_t bodyoff;
+	char msg[ERROR_MAXLEN + 1];
+
+	/* one record per step, `phase' is when the current connect, send or wait began */
+	hMetric metric;
+	int measuring;
+	unsigned long long stepstart;
+	unsigned long long phase;
+};
+
+struct fleet
+{
+	int ep;
+	const hStep *steps;
+	size_t nsteps;
+	const hFleetOptions *opts;
+	size_t active;
+};
+
+static void closesock(struct fleet *f, struct hDeviceState *st)
+{
+	if(st->sock < 0) return;
+	epoll_ctl(f->ep, EPOLL_CTL_DEL, st->sock, NULL);
+	close(st->sock);
+	st->sock = -1;
+	st->reused = 0;
+}
+
+static void setevents(struct fleet *f, hDevice *dev, uint32_t events)
+{
+	struct epoll_event ev;
+	memset(&ev, 0x0, sizeof(ev));
+	ev.events = events;
+	ev.data.ptr = dev;
+	epoll_ctl(f->ep, EPOLL_CTL_MOD, dev->state->sock, &ev);
+}
+
+static void freereqs(struct hDeviceState *st)
+{
+	free(st->reqs);
+	free(st->body);
+	free(st->out);
+	if(st->filefd >= 0)
+		close(st->filefd);
+	st->filefd = -1;
+	st->reqs = NULL;
+	st->body = NULL;
+	st->out = NULL;
+	st->nreqs = 0;
+}
+
+/* records the first error of a device */
+static void setfail(hDevice *dev, int err)
+{
+	if(err == HE_success || dev->result != HE_success)
+		return;
+	dev->result = err;
+	dev->failstep = dev->state->step;
+	if(err == HE_exterror)
+		strcpy(dev->error, dev->state->msg);
+}
+
+/* reports the record of the current step */
+static void measured(hDevice *dev, int result)
+{
+	struct hDeviceState *st = dev->state;
+	if(!st->measuring) return;
+	st->measuring = 0;
+	st->metric.result = result;
+	st->metric.total_us = nowus() - st->stepstart;
+	report(&st->link, &st->metric);
+}
+
+static void finish(struct fleet *f, hDevice *dev, int err)
+{
+	struct hDeviceState *st = dev->state;
+	measured(dev, err);
+	setfail(dev, err);
+	closesock(f, st);
+	freereqs(st);
+	st->state = DS_done;
+	dev->ms = nowms() - st->start;
+	--f->active;
+}
+
+static void loadstep(struct fleet *f, hDevice *dev);
+static void trysend(struct fleet *f, hDevice *dev);
+
+static void startsend(struct fleet *f, hDevice *dev)
+{
+	struct hDeviceState *st = dev->state;
+	st->state = DS_send;
+	st->phase = nowus();
+	trysend(f, dev);
+}
+
+static void startround(struct fleet *f, hDevice *dev)
+{
+	struct hDeviceState *st = dev->state;
+	size_t i;
+
+	st->outlen = st->outoff = 0;
+	st->inflight = st->answered = 0;
+	st->respoff = 0;
+	for(i = 0; i < st->nreqs; ++i)
+	{
+		if(st->reqs[i].result != -EAGAIN)
+			continue;
+		iTransactionHeader header = makeheader(st->reqs[i].action, st->reqs[i].size);
+		memcpy(st->out + st->outlen, &header, sizeof(header));
+		st->outlen += sizeof(header);
+		/* the body of a HS_install_data request is sent from the file in trysend() */
+		if(st->reqs[i].body != NULL)
+		{
+			memcpy(st->out + st->outlen, st->reqs[i].body, st->reqs[i].size);
+			st->outlen += st->reqs[i].size;
+		}
+		st->reqs[i].result = -EINPROGRESS;
+		++st->inflight;
+		/* the 3ds would never read the next request */
+		if(st->noreuse) break;
+	}
+	st->fileoff = 0;
+	st->deadline = nowms() + f->opts->timeout;
+
+	if(st->sock >= 0)
+	{
+		st->metric.reused = 1;
+		startsend(f, dev);
+		return;
+	}
+
+	hLink *link = &st->link;
+	st->sock = socket(link->host->ai_family, link->host->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+		link->host->ai_protocol);
+	if(st->sock < 0) { finish(f, dev, -errno); return; }
+
+	struct epoll_event ev;
+	memset(&ev, 0x0, sizeof(ev));
+	ev.events = EPOLLOUT;
+	ev.data.ptr = dev;
+	if(epoll_ctl(f->ep, EPOLL_CTL_ADD, st->sock, &ev) < 0)
+	{ close(st->sock); st->sock = -1; finish(f, dev, -errno); return; }
+
+	st->phase = nowus();
+	if(connect(st->sock, link->host->ai_addr, link->host->ai_addrlen) == 0)
+	{
+		st->metric.connect_us += nowus() - st->phase;
+		startsend(f, dev);
+	}
+	else if(errno == EINPROGRESS)
+		st->state = DS_connect;
+	else finish(f, dev, -errno);
+}
+
+/* the 3ds closed a connection we kept open before answering everything */
+static void hostclosed(struct fleet *f, hDevice *dev)
+{
+	struct hDeviceState *st = dev->state;
+	st->noreuse = 1;
+	++st->metric.retries;
+	closesock(f, st);
+	for(size_t i = 0; i < st->nreqs; ++i)
+		if(st->reqs[i].result == -EINPROGRESS)
+			st->reqs[i].result = -EAGAIN;
+	startround(f, dev);
+}
+
+static void roundend(struct fleet *f, hDevice *dev)
+{
+	struct hDeviceState *st = dev->state;
+	int busy = 0, unsent = 0, result = HE_success;
+
+	st->reused = 1;
+	if(st->noreuse)
+		closesock(f, st);
+	else setevents(f, dev, 0);
+
+	for(size_t i = 0; i < st->nreqs; ++i)
+	{
+		if(st->reqs[i].result == -EAGAIN) unsent = 1;
+		if(st->reqs[i].result == HE_tryagain) busy = 1;
+		else if(result == HE_success) result = st->reqs[i].result;
+	}
+
+	/* only happens with noreuse, where every request has its own round */
+	if(unsent)
+		startround(f, dev);
+	else if(!busy)
+	{
+		measured(dev, result);
+		++st->step;
+		loadstep(f, dev);
+	}
+	else if(st->tries == f->opts->retries)
+	{
+		measured(dev, HE_tryagain);
+		setfail(dev, HE_tryagain);
+		++st->step;
+		loadstep(f, dev);
+	}
+	else
+	{
+		st->deadline = nowms() + hl_backoff(f->opts->backoff, st->tries);
+		++st->tries;
+		++dev->retries;
+		++st->metric.retries;
+		st->state = DS_wait;
+	}
+}
+
+static void response(struct fleet *f, hDevice *dev)
+{
+	struct hDeviceState *st = dev->state;
+	int err = resperror(st->resp.resp);
+	size_t i;
+
+	if(err == HE_exterror)
+	{
+		if(st->resp.size > ERROR_MAXLEN)
+			strcpy(st->msg, LONG_ERROR);
+		else st->msg[st->resp.size] = '\0';
+	}
+
+	for(i = 0; i < st->nreqs; ++i)
+		if(st->reqs[i].result == -EINPROGRESS)
+			break;
+	st->reqs[i].result = err;
+	--st->inflight;
+	++st->answered;
+	st->respoff = 0;
+	st->metric.received += sizeof(iTransactionResponse) + st->resp.size;
+	if(st->inflight == 0)
+		st->metric.wait_us += nowus() - st->phase;
+
+	if(st->step == -1 && err == HE_notauthed)
+	{ finish(f, dev, err); return; }
+	if(err != HE_tryagain)
+		setfail(dev, err);
+
+	if(st->inflight == 0)
+		roundend(f, dev);
+}
+
+static void tryrecv(struct fleet *f, hDevice *dev)
+{
+	struct hDeviceState *st = dev->state;
+	char scratch[256];
+	ssize_t n;
+
+	while(st->state == DS_recv)
+	{
+		if(st->respoff < sizeof(iTransactionResponse))
+			n = recv(st->sock, (char *) &st->resp + st->respoff, sizeof(iTransactionResponse) - st->respoff, 0);
+		else if(st->resp.resp == HR_error && st->bodyoff < ERROR_MAXLEN)
+			n = recv(st->sock, st->msg + st->bodyoff, st->bodyleft < ERROR_MAXLEN - st->bodyoff
+				? st->bodyleft : ERROR_MAXLEN - st->bodyoff, 0);
+		else n = recv(st->sock, scratch, st->bodyleft < sizeof(scratch) ? st->bodyleft : sizeof(scratch), 0);
+
+		if(n < 0)
+		{
+			if(errno == EAGAIN || errno == EWOULDBLOCK) return;
+			if(errno == EINTR) continue;
+			if(st->respoff == 0 && (st->reused || st->answered) && (errno == ECONNRESET || errno == EPIPE))
+				hostclosed(f, dev);
+			else finish(f, dev, -errno);
+			return;
+		}
+		if(n == 0)
+		{
+			if(st->respoff == 0 && (st->reused || st->answered))
+				hostclosed(f, dev);
+			else finish(f, dev, -ECONNRESET);
+			return;
+		}
+
+		/* the timeout is for a device that stopped responding */
+		st->deadline = nowms() + f->opts->timeout;
+		if(st->respoff < sizeof(iTransactionResponse))
+		{
+			st->respoff += n;
+			if(st->respoff < sizeof(iTransactionResponse))
+				continue;
+			st->resp.size = ntohl(st->resp.size);
+			st->bodyleft = st->resp.size;
+			st->bodyoff = 0;
+		}
+		else
+		{
+			if(st->resp.resp == HR_error && st->bodyoff < ERROR_MAXLEN)
+				st->bodyoff += n;
+			st->bodyleft -= n;
+		}
+
+		if(st->bodyleft == 0)
+			response(f, dev);
+	}
+}
+
+static void trysend(struct fleet *f, hDevice *dev)
+{
+	struct hDeviceState *st = dev->state;
+
+	while(st->outoff < st->outlen)
+	{
+		ssize_t n = send(st->sock, st->out + st->outoff, st->outlen - st->outoff, MSG_NOSIGNAL);
+		if(n < 0)
+		{
+			if(errno == EAGAIN || errno == EWOULDBLOCK)
+			{ setevents(f, dev, EPOLLOUT); return; }
+			if(errno == EINTR) continue;
+			if(st->reused && (errno == ECONNRESET || errno == EPIPE))
+				hostclosed(f, dev);
+			else finish(f, dev, -errno);
+			return;
+		}
+		st->outoff += n;
+		st->deadline = nowms() + f->opts->timeout;
+	}
+
+	while(st->filefd >= 0 && st->fileoff < (off_t) st->reqs[0].size)
+	{
+		ssize_t n = sendfile(st->sock, st->filefd, &st->fileoff, st->reqs[0].size - st->fileoff);
+		if(n < 0)
+		{
+			if(errno == EAGAIN || errno == EWOULDBLOCK)
+			{ setevents(f, dev, EPOLLOUT); return; }
+			if(errno == EINTR) continue;
+			/* a half-closed connection usually still takes the header */
+			if(st->reused && (errno == ECONNRESET || errno == EPIPE))
+				hostclosed(f, dev);
+			else finish(f, dev, -errno);
+			return;
+		}
+		/* the file was truncated */
+		if(n == 0) { finish(f, dev, -EIO); return; }
+		st->deadline = nowms() + f->opts->timeout;
+	}
+
+	st->metric.send_us += nowus() - st->phase;
+	st->metric.sent += st->outlen + (st->filefd >= 0 ? st->fileoff : 0);
+	st->phase = nowus();
+
+	if(st->install)
+		st->deadline = nowms() + f->opts->installtimeout;
+	st->state = DS_recv;
+	setevents(f, dev, EPOLLIN);
+	tryrecv(f, dev);
+}
+
+static void addreq(struct hDeviceState *st, uint8_t action, const void *body, uint32_t size)
+{
+	hRequest *req = &st->reqs[st->nreqs++];
+	req->action = action;
+	req->body = body;
+	req->size = size;
+	req->result = -EAGAIN;
+}
+
+static void loadstep(struct fleet *f, hDevice *dev)
+{
+	struct hDeviceState *st = dev->state;
+	const hStep *step = NULL;
+	size_t batches = 1, amount = 1;
+
+	freereqs(st);
+	st->tries = 0;
+	st->install = 0;
+
+	if(st->step == (long) f->nsteps)
+	{ finish(f, dev, HE_success); return; }
+	if(st->step != -1)
+		step = &f->steps[st->step];
+
+	if(st->step != -1 && step->type == HS_wait)
+	{
+		st->state = DS_wait;
+		st->deadline = nowms() + step->ms;
+		return;
+	}
+
+	size_t bodysize = sizeof(uint64_t);
+	if(st->step != -1 && step->type == HS_addqueue)
+	{
+		amount = step->amount;
+		batches = amount ? (amount + HL_QUEUE_BATCH - 1) / HL_QUEUE_BATCH : 1;
+		bodysize = amount * sizeof(uint64_t);
+	}
+	else if(st->step != -1 && step->type == HS_install_url)
+		bodysize = strlen(step->url);
+	st->reqs = malloc(batches * sizeof(hRequest));
+	st->body = malloc(bodysize ? bodysize : 1);
+	st->out = malloc(batches * sizeof(iTransactionHeader) + bodysize);
+	if(st->reqs == NULL || st->body == NULL || st->out == NULL)
+	{ finish(f, dev, -ENOMEM); return; }
+
+	if(st->step == -1)
+		addreq(st, HA_nothing, NULL, 0);
+	else if(step->type == HS_sleep)
+		addreq(st, HA_sleep, NULL, 0);
+	else if(step->type == HS_launch)
+	{
+		uint64_t *tid = st->body;
+		*tid = htonll(step->tid);
+		addreq(st, HA_launch, tid, sizeof(uint64_t));
+	}
+	else if(step->type == HS_install_url)
+	{
+		memcpy(st->body, step->url, bodysize);
+		addreq(st, HA_install_url, st->body, bodysize);
+		st->install = 1;
+	}
+	else if(step->type == HS_install_data)
+	{
+		struct stat sb;
+		if((st->filefd = open(step->path, O_RDONLY | O_CLOEXEC)) < 0 || fstat(st->filefd, &sb) < 0)
+		{ finish(f, dev, -errno); return; }
+		/* the size of a request is 32-bit */
+		if((uint64_t) sb.st_size > UINT32_MAX)
+		{ finish(f, dev, -EFBIG); return; }
+		addreq(st, HA_install_data, NULL, sb.st_size);
+		st->install = 1;
+	}
+	else
+	{
+		uint64_t *ids = st->body;
+		for(size_t i = 0; i < amount; ++i)
+			ids[i] = htonll(step->ids[i]);
+		for(size_t i = 0; i < batches; ++i)
+		{
+			size_t left = amount - i * HL_QUEUE_BATCH;
+			addreq(st, HA_add_queue, &ids[i * HL_QUEUE_BATCH],
+				(left > HL_QUEUE_BATCH ? HL_QUEUE_BATCH : left) * sizeof(uint64_t));
+		}
+	}
+
+	memset(&st->metric, 0x0, sizeof(st->metric));
+	st->metric.action = st->reqs[0].action;
+	st->metric.requests = st->nreqs;
+	st->measuring = 1;
+	st->stepstart = nowus();
+	startround(f, dev);
+}
+
+static void handle(struct fleet *f, hDevice *dev, uint32_t events)
+{
+	struct hDeviceState *st = dev->state;
+	int err;
+	socklen_t len = sizeof(err);
+
+	switch(st->state)
+	{
+	case DS_connect:
+		if(getsockopt(st->sock, SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+			err = errno;
+		if(err != 0)
+		{ finish(f, dev, -err); break; }
+		st->metric.connect_us += nowus() - st->phase;
+		startsend(f, dev);
+		break;
+	case DS_send:
+		trysend(f, dev);
+		break;
+	case DS_recv:
+		tryrecv(f, dev);
+		break;
+	case DS_wait:
+		/* the 3ds closed the idle connection */
+		if(events & (EPOLLERR | EPOLLHUP))
+			closesock(f, st);
+		break;
+	}
+}
+
+static void expire(struct fleet *f, hDevice *dev)
+{
+	struct hDeviceState *st = dev->state;
+	if(st->state != DS_wait)
+	{
+		finish(f, dev, -ETIMEDOUT);
+		return;
+	}
+	if(st->nreqs)
+	{
+		for(size_t i = 0; i < st->nreqs; ++i)
+			if(st->reqs[i].result == HE_tryagain)
+				st->reqs[i].result = -EAGAIN;
+		startround(f, dev);
+	}
+	else
+	{
+		++st->step;
+		loadstep(f, dev);
+	}
+}
+
+int hl_fleet_run(hDevice *devs, size_t amount, const hStep *steps, size_t nsteps, const hFleetOptions *opts)
+{
+	struct fleet f = { -1, steps, nsteps, opts, amount };
+	struct hDeviceState *states = calloc(amount, sizeof(struct hDeviceState));
+	if(states == NULL) return -ENOMEM;
+	if((f.ep = epoll_create1(EPOLL_CLOEXEC)) < 0)
+	{ free(states); return -errno; }
+
+	for(size_t i = 0; i < amount; ++i)
+	{
+		hDevice *dev = &devs[i];
+		struct hDeviceState *st = &states[i];
+		dev->state = st;
+		dev->result = HE_success;
+		dev->failstep = 0;
+		dev->retries = 0;
+		dev->error[0] = '\0';
+		st->sock = -1;
+		st->filefd = -1;
+		st->step = -1;
+		st->start = nowms();
+		if(hl_makelink(&st->link, dev->addr) != HE_success)
+			finish(&f, dev, -ENXIO);
+		else
+		{
+			hl_setmetrics(&st->link, opts->metrics, opts->metricsdata);
+			loadstep(&f, dev);
+		}
+	}
+
+	struct epoll_event events[64];
+	while(f.active)
+	{
+		unsigned long long t = nowms(), next = ULLONG_MAX;
+		for(size_t i = 0; i < amount; ++i)
+		{
+			if(states[i].state == DS_done)
+				continue;
+			if(states[i].deadline <= t)
+				expire(&f, &devs[i]);
+			/* expire() may have started a new round or finished */
+			if(states[i].state != DS_done && states[i].deadline < next)
+				next = states[i].deadline;
+		}
+		if(!f.active) break;
+
+		t = nowms();
+		int timeout = next <= t ? 0 : next - t > INT_MAX ? INT_MAX : (int) (next - t);
+		int n = epoll_wait(f.ep, events, sizeof(events) / sizeof(events[0]), timeout);
+		if(n < 0 && errno != EINTR)
+		{
+			int err = -errno;
+			for(size_t i = 0; i < amount; ++i)
+				if(states[i].state != DS_done)
+					finish(&f, &devs[i], err);
+			break;
+		}
+		for(int i = 0; i < n; ++i)
+			handle(&f, events[i].data.ptr, events[i].events);
+	}
+
+	int failed = 0;
+	for(size_t i = 0; i < amount; ++i)
+	{
+		if(devs[i].result != HE_success)
+			++failed;
+		hl_destroylink(&states[i].link);
+		devs[i].state = NULL;
+	}
+	close(f.ep);
+	free(states);
+	return failed;
+}
+
@@ -0,0 +1,62 @@
+#ifndef inc_hfleet_h
+#define inc_hfleet_h
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "./hlink.h"
+
+enum HStep
+{
+	HS_sleep        = 0,
+	HS_addqueue     = 1,
+	HS_launch       = 2,
+	HS_wait         = 3,
+	HS_install_data = 4,
+	HS_install_url  = 5,
+};
+
+typedef struct hStep
+{
+	int type; /* enum HStep */
+	uint64_t *ids; /* HS_addqueue */
+	size_t amount; /* HS_addqueue */
+	uint64_t tid; /* HS_launch */
+	unsigned long ms; /* HS_wait */
+	const char *path; /* HS_install_data */
+	const char *url; /* HS_install_url */
+} hStep;
+
+typedef struct hFleetOptions
+{
+	unsigned long timeout; /* milliseconds a device may take to connect and respond */
+	unsigned retries; /* times a step is retried if the device is busy */
+	unsigned long backoff; /* milliseconds before the first retry, doubled for every next one */
+	unsigned long installtimeout; /* milliseconds a device may take to install a CIA */
+	hMetricsCallback metrics; /* gets one record per step and device if set, see hl_setmetrics() */
+	void *metricsdata;
+} hFleetOptions;
+
+typedef struct hDevice
+{
+	const char *addr;
+	int result; /* first error, like the return value of the hl_* functions */
+	long failstep; /* step `result' comes from, -1 for authenticating */
+	unsigned retries; /* amount of retries because the device was busy */
+	unsigned long ms; /* time it took to run all steps */
+	char error[HL_ERROR_MAXLEN + 1]; /* message from the 3ds if `result' is HE_exterror */
+	struct hDeviceState *state;
+} hDevice;
+
+/* runs `steps' on every device concurrently; a device stops at the first
+ * error that isn't an error response from the 3ds, the results are put in
+ * `devs'; returns the amount of devices that failed or -errno */
+int hl_fleet_run(hDevice *devs, size_t amount, const hStep *steps, size_t nsteps, const hFleetOptions *opts);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
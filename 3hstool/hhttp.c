@@ -0,0 +1,350 @@
+#define _GNU_SOURCE
+
+#include "./hhttp.h"
+#include "./hproto.h"
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <stdio.h>
+#include <ctype.h>
+
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+
+#define REQUEST_MAXLEN 4096
+/* a download that doesn't make progress for this long is dropped */
+#define CONN_TIMEOUT 30
+#define SEND_CHUNK (1 << 20)
+
+struct conn
+{
+	hServer *srv;
+	int sock;
+};
+
+static void activity(hServer *srv, int active, int completed, uint64_t sent)
+{
+	pthread_mutex_lock(&srv->lock);
+	srv->active += active;
+	srv->completed += completed;
+	srv->sent += sent;
+	srv->lastactivity = nowms();
+	pthread_cond_broadcast(&srv->cond);
+	pthread_mutex_unlock(&srv->lock);
+}
+
+static int sendstr(int sock, const char *str)
+{
+	size_t len = strlen(str);
+	while(len)
+	{
+		ssize_t n = send(sock, str, len, MSG_NOSIGNAL);
+		if(n < 0 && errno == EINTR) continue;
+		if(n < 0) return -errno;
+		str += n;
+		len -= n;
+	}
+	return HE_success;
+}
+
+/* reads the request line and headers */
+static int readrequest(int sock, char *buf)
+{
+	size_t len = 0;
+	while(len < REQUEST_MAXLEN)
+	{
+		ssize_t n = recv(sock, buf + len, REQUEST_MAXLEN - len, 0);
+		if(n < 0 && errno == EINTR) continue;
+		if(n <= 0) return 0;
+		len += n;
+		buf[len] = '\0';
+		if(strstr(buf, "\r\n\r\n")) return 1;
+	}
+	return 0;
+}
+
+/* parses a single "bytes=first-last", "bytes=first-" or "bytes=-suffix" range */
+static int parserange(const char *value, uint64_t size, uint64_t *first, uint64_t *last)
+{
+	unsigned long long a, b;
+	char *end;
+	value += strspn(value, " \t");
+	if(strncasecmp(value, "bytes=", 6) != 0) return 0;
+	value += 6;
+
+	if(*value == '-')
+	{
+		/* the last `b' bytes */
+		if(!isdigit((unsigned char) value[1])) return 0;
+		b = strtoull(value + 1, &end, 10);
+		if(b == 0) return 0;
+		*first = b < size ? size - b : 0;
+	}
+	else
+	{
+		if(!isdigit((unsigned char) *value)) return 0;
+		a = strtoull(value, &end, 10);
+		if(*end++ != '-') return 0;
+		*first = a;
+		b = size - 1;
+		if(isdigit((unsigned char) *end))
+		{
+			if((b = strtoull(end, &end, 10)) < a) return 0;
+			if(b >= size) b = size - 1;
+		}
+	}
+	*last = *value == '-' ? size - 1 : b;
+
+	/* multiple ranges aren't supported */
+	if(*end != '\r' && *end != '\0') return 0;
+	return *first < size;
+}
+
+static void *serveconn(void *arg)
+{
+	struct conn *conn = arg;
+	hServer *srv = conn->srv;
+	int sock = conn->sock;
+	char req[REQUEST_MAXLEN + 1];
+	char hdr[512];
+	int completed = 0;
+	free(conn);
+
+	struct timeval tv = { CONN_TIMEOUT, 0 };
+	setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+	if(!readrequest(sock, req))
+		goto out;
+
+	char *line = strstr(req, "\r\n");
+	*line = '\0';
+	char *method = req, *target = strchr(req, ' ');
+	if(target == NULL) goto out;
+	*target++ = '\0';
+	target[strcspn(target, " ?")] = '\0';
+
+	int head = strcmp(method, "HEAD") == 0;
+	if(!head && strcmp(method, "GET") != 0)
+	{
+		sendstr(sock, "HTTP/1.1 405 Method Not Allowed\r\nAllow: GET, HEAD\r\nContent-Length: 0\r\nConnection: close\r\n\r\n");
+		goto out;
+	}
+	if(strcmp(target, srv->path) != 0)
+	{
+		sendstr(sock, "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n");
+		goto out;
+	}
+
+	uint64_t first = 0, last = srv->size - 1;
+	int partial = 0;
+	for(char *h = line + 2; *h != '\r' && *h != '\0'; h = strstr(h, "\r\n") + 2)
+	{
+		if(strncasecmp(h, "Range:", 6) != 0)
+			continue;
+		if(!parserange(h + 6, srv->size, &first, &last))
+		{
+			snprintf(hdr, sizeof(hdr), "HTTP/1.1 416 Range Not Satisfiable\r\nContent-Range: bytes */%llu\r\n"
+				"Content-Length: 0\r\nConnection: close\r\n\r\n", (unsigned long long) srv->size);
+			sendstr(sock, hdr);
+			goto out;
+		}
+		partial = 1;
+		break;
+	}
+
+	uint64_t len = srv->size ? last - first + 1 : 0;
+	if(partial)
+		snprintf(hdr, sizeof(hdr), "HTTP/1.1 206 Partial Content\r\nContent-Range: bytes %llu-%llu/%llu\r\n",
+			(unsigned long long) first, (unsigned long long) last, (unsigned long long) srv->size);
+	else strcpy(hdr, "HTTP/1.1 200 OK\r\n");
+	snprintf(hdr + strlen(hdr), sizeof(hdr) - strlen(hdr), "Content-Type: application/octet-stream\r\n"
+		"Content-Length: %llu\r\nAccept-Ranges: bytes\r\nConnection: close\r\n\r\n", (unsigned long long) len);
+	if(sendstr(sock, hdr) != HE_success || head)
+		goto out;
+
+	off_t off = first;
+	uint64_t left = len;
+	while(left && !srv->stopping)
+	{
+		ssize_t n = sendfile(sock, srv->fd, &off, left > SEND_CHUNK ? SEND_CHUNK : left);
+		if(n < 0 && errno == EINTR) continue;
+		if(n <= 0) break;
+		left -= n;
+		activity(srv, 0, 0, n);
+	}
+	completed = left == 0 && (uint64_t) off == srv->size;
+
+out:
+	close(sock);
+	activity(srv, -1, completed, 0);
+	return NULL;
+}
+
+static void *serve(void *arg)
+{
+	hServer *srv = arg;
+	struct pollfd fds[2] = {
+		{ srv->sock, POLLIN, 0 },
+		{ srv->wake[0], POLLIN, 0 },
+	};
+
+	while(!srv->stopping)
+	{
+		if(poll(fds, 2, -1) < 0 && errno != EINTR)
+			break;
+		if(!(fds[0].revents & POLLIN))
+			continue;
+
+		int sock = accept4(srv->sock, NULL, NULL, SOCK_CLOEXEC);
+		if(sock < 0) continue;
+		struct conn *conn = malloc(sizeof(struct conn));
+		pthread_t thread;
+		if(conn == NULL) { close(sock); continue; }
+		conn->srv = srv;
+		conn->sock = sock;
+		/* counted as active right away so hl_server_stop() waits for it */
+		activity(srv, 1, 0, 0);
+		if(pthread_create(&thread, NULL, serveconn, conn) != 0)
+		{ close(sock); free(conn); activity(srv, -1, 0, 0); continue; }
+		pthread_detach(thread);
+	}
+
+	return NULL;
+}
+
+/* percent-encodes `str' to be used in a url */
+static void urlencode(char *out, size_t outlen, const char *str)
+{
+	static const char hex[] = "0123456789ABCDEF";
+	for(; *str != '\0' && outlen > 3; ++str)
+	{
+		unsigned char c = *str;
+		if((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || strchr("-._~", c))
+		{ *out++ = c; --outlen; continue; }
+		*out++ = '%';
+		*out++ = hex[c >> 4];
+		*out++ = hex[c & 0xF];
+		outlen -= 3;
+	}
+	*out = '\0';
+}
+
+int hl_serve_file(hServer *srv, const char *path, const hLink *link)
+{
+	struct sockaddr_in local;
+	socklen_t len = sizeof(local);
+	struct stat st;
+	int ret;
+
+	if(link->host == NULL) return -ENXIO;
+
+	/* the address the 3ds can reach us at, connecting a
+	 * datagram socket only looks up the route */
+	int udp = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if(udp < 0) return -errno;
+	if(connect(udp, link->host->ai_addr, link->host->ai_addrlen) < 0
+		|| getsockname(udp, (struct sockaddr *) &local, &len) < 0)
+	{ ret = -errno; close(udp); return ret; }
+	close(udp);
+
+	if((srv->fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+		return -errno;
+	if(fstat(srv->fd, &st) < 0)
+	{ ret = -errno; close(srv->fd); return ret; }
+	srv->size = st.st_size;
+
+	local.sin_port = 0;
+	if((srv->sock = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+	{ ret = -errno; close(srv->fd); return ret; }
+	len = sizeof(local);
+	if(bind(srv->sock, (struct sockaddr *) &local, sizeof(local)) < 0 || listen(srv->sock, 16) < 0
+		|| getsockname(srv->sock, (struct sockaddr *) &local, &len) < 0)
+		goto err;
+	if(pipe2(srv->wake, O_CLOEXEC) < 0)
+		goto err;
+
+	const char *base = strrchr(path, '/');
+	srv->path[0] = '/';
+	urlencode(srv->path + 1, sizeof(srv->path) - 1, base ? base + 1 : path);
+	char ip[INET_ADDRSTRLEN];
+	inet_ntop(AF_INET, &local.sin_addr, ip, sizeof(ip));
+	snprintf(srv->url, sizeof(srv->url), "http://%s:%u%s", ip, ntohs(local.sin_port), srv->path);
+
+	srv->stopping = 0;
+	srv->active = srv->completed = 0;
+	srv->sent = 0;
+	srv->lastactivity = nowms();
+	pthread_mutex_init(&srv->lock, NULL);
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&srv->cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	if((ret = pthread_create(&srv->thread, NULL, serve, srv)) != 0)
+	{
+		pthread_cond_destroy(&srv->cond);
+		pthread_mutex_destroy(&srv->lock);
+		close(srv->wake[0]);
+		close(srv->wake[1]);
+		close(srv->sock);
+		close(srv->fd);
+		return -ret;
+	}
+
+	return HE_success;
+
+err:
+	ret = -errno;
+	close(srv->sock);
+	close(srv->fd);
+	return ret;
+}
+
+void hl_server_wait(hServer *srv, unsigned completed, unsigned long idle)
+{
+	pthread_mutex_lock(&srv->lock);
+	while(srv->completed < completed)
+	{
+		unsigned long long until = srv->lastactivity + idle;
+		if(srv->active == 0 && nowms() >= until)
+			break;
+		if(srv->active != 0)
+			until = nowms() + idle;
+		struct timespec ts = { until / 1000, (until % 1000) * 1000000 };
+		pthread_cond_timedwait(&srv->cond, &srv->lock, &ts);
+	}
+	pthread_mutex_unlock(&srv->lock);
+}
+
+void hl_server_stop(hServer *srv)
+{
+	srv->stopping = 1;
+	while(write(srv->wake[1], "", 1) < 0 && errno == EINTR)
+		;
+	pthread_join(srv->thread, NULL);
+
+	/* downloads notice `stopping' after their current chunk */
+	pthread_mutex_lock(&srv->lock);
+	while(srv->active != 0)
+		pthread_cond_wait(&srv->cond, &srv->lock);
+	pthread_mutex_unlock(&srv->lock);
+
+	pthread_cond_destroy(&srv->cond);
+	pthread_mutex_destroy(&srv->lock);
+	close(srv->wake[0]);
+	close(srv->wake[1]);
+	close(srv->sock);
+	close(srv->fd);
+}
+
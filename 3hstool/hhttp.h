@@ -0,0 +1,45 @@
+#ifndef inc_hhttp_h
+#define inc_hhttp_h
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "./hlink.h"
+
+#include <pthread.h>
+
+typedef struct hServer
+{
+	int sock;
+	int fd; /* file being served */
+	uint64_t size;
+	char path[256]; /* path the file is served at */
+	char url[320];
+	volatile int stopping;
+	int wake[2]; /* pipe to stop the server thread */
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	unsigned active; /* downloads in progress */
+	unsigned completed; /* downloads that sent the last byte of the file */
+	uint64_t sent; /* bytes sent */
+	unsigned long long lastactivity;
+} hServer;
+
+/* serves a file over HTTP with support for ranges, so interrupted downloads
+ * can be resumed; it listens on the local address used to reach `link' and
+ * the file can be downloaded from `srv->url'; returns HE_success or -errno */
+int hl_serve_file(hServer *srv, const char *path, const hLink *link);
+/* waits until `completed' downloads sent the entire file, or until there
+ * were no downloads in progress for `idle' milliseconds */
+void hl_server_wait(hServer *srv, unsigned completed, unsigned long idle);
+/* stops serving and waits for downloads in progress to stop */
+void hl_server_stop(hServer *srv);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
@@ -1,115 +1,313 @@
 
-#include "./hlink.h"
+#include "./hproto.h"
 
 #include <stdlib.h>
+#include <limits.h>
 #include <stdint.h>
 #include <string.h>
 
+#include <sys/sendfile.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 #include <sys/types.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <errno.h>
 #include <netdb.h>
 #include <stdio.h>
+#include <poll.h>
 
-#define MAGIC_LEN 3
-#define MAGIC "HLT"
-#define PORT "37283"
-
-#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
-// Why do these not exist already?
-static uint64_t htonll(uint64_t n)
-{ return __builtin_bswap64(n); }
-
-static uint64_t ntohll(uint64_t n)
-{ return __builtin_bswap64(n); }
-#elif __BYTE_ORDER == __ORDER_BIG_ENDIAN__
-#define htonll(n) n
-#define ntohll(n) n
-#else
-#error "Unsupported endian"
-#endif
-
-typedef struct iTransactionHeader
-{
-	char magic[MAGIC_LEN];
-	uint8_t action; // enum HAction
-	uint32_t size;
-} __attribute__((__packed__)) iTransactionHeader;
-
-typedef struct iTransactionResponse
-{
-	char magic[MAGIC_LEN];
-	uint8_t resp; // enum HResponse
-	uint32_t size;
-} __attribute__((__packed__)) iTransactionResponse;
-
-#define ERROR_MAXLEN 100
 #define ERROR_OFFSET (sizeof("3ds: ")-1)
 static char g_lasterror[ERROR_MAXLEN + 1 + 5 /* "3ds: " */] = "3ds: ";
 
+/* waits until `sock' is ready for `events'; sockets are non-blocking and every
+ * wait gives up after `timeout' milliseconds without progress, 0 waits forever */
+static int waitsock(int sock, short events, unsigned long timeout)
+{
+	struct pollfd pfd = { sock, events, 0 };
+	int n;
+	int ms = timeout == 0 ? -1 : timeout > INT_MAX ? INT_MAX : (int) timeout;
+	while((n = poll(&pfd, 1, ms)) < 0 && errno == EINTR)
+		;
+	if(n < 0) return -errno;
+	if(n == 0) return -ETIMEDOUT;
+	return HE_success;
+}
+
 static int makesock(hLink *link)
 {
 	if(link->host == NULL) return -ENXIO;
 
-	int sock = socket(link->host->ai_family, link->host->ai_socktype, link->host->ai_protocol);
+	int sock = socket(link->host->ai_family, link->host->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+		link->host->ai_protocol), ret, err;
+	socklen_t len = sizeof(err);
 	if(sock < 0) return -errno;
 
 	if(connect(sock, link->host->ai_addr, link->host->ai_addrlen) < 0)
-	{ close(sock); return -errno; }
+	{
+		if(errno != EINPROGRESS)
+		{ ret = -errno; close(sock); return ret; }
+		if((ret = waitsock(sock, POLLOUT, link->timeout)) != HE_success)
+		{ close(sock); return ret; }
+		if(getsockopt(sock, SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+			err = errno;
+		if(err != 0)
+		{ close(sock); return -err; }
+	}
 
 	return sock;
 }
 
-static int readresp(iTransactionResponse *resp, int sock)
+static int recvall(int sock, void *buf, size_t size, unsigned long timeout)
 {
-	ssize_t recvd = recv(sock, resp, sizeof(iTransactionResponse), 0);
-	if(recvd < 0) return -errno;
-	resp->size = ntohll(resp->size);
+	while(size)
+	{
+		ssize_t n = recv(sock, buf, size, 0);
+		if(n < 0)
+		{
+			int ret = HE_success;
+			if(errno == EAGAIN || errno == EWOULDBLOCK)
+				ret = waitsock(sock, POLLIN, timeout);
+			else if(errno != EINTR)
+				ret = -errno;
+			if(ret != HE_success) return ret;
+			continue;
+		}
+		/* the host closed the connection */
+		if(n == 0) return -ECONNRESET;
+		buf = (char *) buf + n;
+		size -= n;
+	}
 	return HE_success;
 }
 
-static int readcheckresp(iTransactionResponse *resp, int sock)
+static int readresp(iTransactionResponse *resp, int sock, unsigned long timeout)
 {
-	int ret = readresp(resp, sock);
+	int ret = recvall(sock, resp, sizeof(iTransactionResponse), timeout);
+	if(ret != HE_success) return ret;
+	/* not a response, nothing after it can be trusted either */
+	if(memcmp(resp->magic, MAGIC, MAGIC_LEN) != 0)
+		return -EPROTO;
+	resp->size = ntohl(resp->size);
+	return HE_success;
+}
+
+static int skipbody(int sock, uint32_t size, unsigned long timeout)
+{
+	char buf[64];
+	int ret = HE_success;
+	while(size && ret == HE_success)
+	{
+		uint32_t part = size > sizeof(buf) ? sizeof(buf) : size;
+		ret = recvall(sock, buf, part, timeout);
+		size -= part;
+	}
+	return ret;
+}
+
+static int readcheckresp(iTransactionResponse *resp, int sock, unsigned long timeout)
+{
+	int ret = readresp(resp, sock, timeout);
 	if(ret != HE_success) return ret;
 
-	if(resp->resp == HR_untrusted)
-		return HE_notauthed;
-	if(resp->resp == HR_busy)
-		return HE_tryagain;
 	if(resp->resp == HR_error)
 	{
 		if(resp->size > ERROR_MAXLEN)
 		{
-			strcpy(g_lasterror, "INTERNAL ERROR: error message from 3ds too long.");
-			return HE_exterror;
+			strcpy(g_lasterror, LONG_ERROR);
+			/* the next response starts after the message */
+			return (ret = skipbody(sock, resp->size, timeout)) != HE_success ? ret : HE_exterror;
 		}
 
-		int amount = recv(sock, g_lasterror + ERROR_OFFSET, ERROR_MAXLEN, 0);
-		g_lasterror[amount + ERROR_OFFSET] = '\0';
+		if((ret = recvall(sock, g_lasterror + ERROR_OFFSET, resp->size, timeout)) != HE_success)
+			return ret;
+		g_lasterror[resp->size + ERROR_OFFSET] = '\0';
 
 		return HE_exterror;
 	}
-	if(resp->resp == HR_notfound)
-		return HE_tidnotfound;
+
+	/* other responses have no body, but the next response starts after it if there is one */
+	if(resp->size && (ret = skipbody(sock, resp->size, timeout)) != HE_success)
+		return ret;
+	return resperror(resp->resp);
+}
+
+/* sends everything in `iov', which is modified in the process;
+ * the amount of bytes sent is put in `sent', also on failure */
+static int sendv(int sock, struct iovec *iov, int iovcnt, size_t *sent, unsigned long timeout)
+{
+	struct msghdr msg;
+	memset(&msg, 0x0, sizeof(msg));
+	*sent = 0;
+
+	while(iovcnt)
+	{
+		msg.msg_iov = iov;
+		msg.msg_iovlen = iovcnt;
+		ssize_t n = sendmsg(sock, &msg, MSG_NOSIGNAL);
+		if(n < 0)
+		{
+			int ret = HE_success;
+			if(errno == EAGAIN || errno == EWOULDBLOCK)
+				ret = waitsock(sock, POLLOUT, timeout);
+			else if(errno != EINTR)
+				ret = -errno;
+			if(ret != HE_success) return ret;
+			continue;
+		}
+		*sent += n;
+		for(; iovcnt && (size_t) n >= iov->iov_len; ++iov, --iovcnt)
+			n -= iov->iov_len;
+		if(n)
+		{
+			iov->iov_base = (char *) iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
 
 	return HE_success;
 }
 
-static int readdiscard(int sock)
+#define SEND_BATCH 32
+
+/* sends the headers and bodies of `reqs' with as few calls as possible;
+ * the amount of requests sent entirely is put in `sent', also on failure */
+static int sendreqs(int sock, hRequest *reqs, size_t amount, size_t *sent, unsigned long timeout)
 {
-	iTransactionResponse resp;
-	return readcheckresp(&resp, sock);
+	iTransactionHeader headers[SEND_BATCH];
+	struct iovec iov[SEND_BATCH * 2];
+	*sent = 0;
+
+	while(*sent < amount)
+	{
+		size_t n = amount - *sent > SEND_BATCH ? SEND_BATCH : amount - *sent, bytes;
+		for(size_t i = 0; i < n; ++i)
+		{
+			headers[i] = makeheader(reqs[*sent + i].action, reqs[*sent + i].size);
+			iov[i * 2].iov_base = &headers[i];
+			iov[i * 2].iov_len = sizeof(iTransactionHeader);
+			iov[i * 2 + 1].iov_base = (void *) reqs[*sent + i].body;
+			iov[i * 2 + 1].iov_len = reqs[*sent + i].size;
+		}
+
+		int ret = sendv(sock, iov, n * 2, &bytes, timeout);
+		if(ret != HE_success)
+		{
+			for(; bytes >= sizeof(iTransactionHeader) + reqs[*sent].size; ++*sent)
+				bytes -= sizeof(iTransactionHeader) + reqs[*sent].size;
+			return ret;
+		}
+		*sent += n;
+	}
+
+	return HE_success;
 }
 
-static iTransactionHeader makeheader(uint8_t action, uint32_t size)
+/* sends the header of a request of which the body is sent separately */
+static int sendheader(int sock, uint8_t action, uint32_t size, unsigned long timeout)
 {
-	iTransactionHeader header;
-	memcpy(header.magic, MAGIC, MAGIC_LEN);
-	header.size = htonl(size);
-	header.action = action;
-	return header;
+	iTransactionHeader header = makeheader(action, size);
+	struct iovec iov = { &header, sizeof(iTransactionHeader) };
+	size_t sent;
+	return sendv(sock, &iov, 1, &sent, timeout);
+}
+
+static int sendreq(int sock, uint8_t action, const void *body, uint32_t size, unsigned long timeout)
+{
+	hRequest req = { action, body, size, HE_success };
+	size_t sent;
+	return sendreqs(sock, &req, 1, &sent, timeout);
+}
+
+/* the host closed a connection we kept open */
+static int closedbyhost(int err)
+{
+	return err == -ECONNRESET || err == -EPIPE;
+}
+
+static void endsession(hLink *link)
+{
+	if(link->sock >= 0)
+		close(link->sock);
+	link->sock = -1;
+}
+
+/* gets the connection to send a request over; `reused' is set if it
+ * was kept open from a previous request */
+static int getsock(hLink *link, int *reused)
+{
+	*reused = link->sock >= 0;
+	return *reused ? link->sock : makesock(link);
+}
+
+/* keeps the connection open in session mode, closes it otherwise or if it failed */
+static void putsock(hLink *link, int sock, int ret)
+{
+	if(link->session == 1 && ret >= 0)
+		link->sock = sock;
+	else if(sock == link->sock)
+		endsession(link);
+	else close(sock);
+}
+
+/* a response was read if readcheckresp() didn't fail with -errno */
+static uint64_t respbytes(const iTransactionResponse *resp, int ret)
+{
+	return ret < 0 ? 0 : sizeof(iTransactionResponse) + resp->size;
+}
+
+static int transact(hLink *link, uint8_t action, const void *body, uint32_t size)
+{
+	hMetric m = { .action = action, .requests = 1 };
+	unsigned long long start = nowus(), t;
+	unsigned busytries = 0;
+	int reused, ret;
+
+	for(;;)
+	{
+		t = nowus();
+		int sock = getsock(link, &reused);
+		if(sock < 0) { ret = sock; break; }
+		m.reused = reused;
+		m.connect_us = reused ? 0 : nowus() - t;
+
+		iTransactionResponse resp;
+		t = nowus();
+		ret = sendreq(sock, action, body, size, link->timeout);
+		m.send_us = nowus() - t;
+		if(ret == HE_success)
+		{
+			m.sent += sizeof(iTransactionHeader) + size;
+			t = nowus();
+			ret = readcheckresp(&resp, sock, link->timeout);
+			m.wait_us = nowus() - t;
+			m.received += respbytes(&resp, ret);
+		}
+
+		if(reused && closedbyhost(ret))
+		{
+			/* the host only handles one transaction per connection */
+			endsession(link);
+			link->session = -1;
+			++m.retries;
+			continue;
+		}
+
+		putsock(link, sock, ret);
+		if(ret == HE_tryagain && busytries < link->retries)
+		{
+			usleep(hl_backoff(link->backoff, busytries++) * 1000);
+			++m.retries;
+			continue;
+		}
+		break;
+	}
+
+	m.result = ret;
+	m.total_us = nowus() - start;
+	report(link, &m);
+	return ret;
 }
 
 const char *hl_makelink_geterror(int errcode)
@@ -150,103 +348,319 @@ int hl_makelink(hLink *link, const char *addr)
 	hints.ai_family = AF_INET; // 3ds only supports IPv4
 	hints.ai_socktype = SOCK_STREAM;
 
+	/* hl_destroylink() must be safe on a link that failed to resolve */
+	link->host = NULL;
+	link->sock = -1;
+	link->metrics = NULL;
+	link->metricsdata = NULL;
+
+	unsigned long long start = nowus();
 	int res = getaddrinfo(addr, PORT, &hints, &link->host);
-	if(res < 0) { link->host = NULL; return res; }
+	if(res != 0) { link->host = NULL; return res; }
+	link->resolveus = nowus() - start;
+	link->resolvepending = 1;
 
 	link->isauthed = 0;
+	link->session = 0;
+	link->retries = 0;
+	link->backoff = 100;
+	link->timeout = HL_TIMEOUT;
+	link->installtimeout = HL_INSTALL_TIMEOUT;
 	return HE_success;
 }
 
 void hl_destroylink(hLink *link)
 {
+	endsession(link);
 	if(link->host != NULL)
 		freeaddrinfo(link->host);
 }
 
-int hl_auth(hLink *link)
+void hl_settimeout(hLink *link, unsigned long timeout, unsigned long installtimeout)
 {
-	if(link->isauthed) return HE_success;
-	int sock = makesock(link);
-	if(sock < 0) return sock;
+	link->timeout = timeout;
+	link->installtimeout = installtimeout;
+}
 
-	iTransactionHeader header = makeheader(HA_nothing, 0);
-	if(send(sock, &header, sizeof(iTransactionHeader), 0) < 0)
-	{ close(sock); return -errno; }
+void hl_setretries(hLink *link, unsigned retries, unsigned long backoff)
+{
+	link->retries = retries;
+	link->backoff = backoff;
+}
 
-	iTransactionResponse resp;
-	int ret = readresp(&resp, sock);
+unsigned long hl_backoff(unsigned long backoff, unsigned tries)
+{
+	/* doubling forever would overflow */
+	return backoff << (tries < 16 ? tries : 16);
+}
 
-	if(ret == HE_success)
+void hl_setmetrics(hLink *link, hMetricsCallback cb, void *udata)
+{
+	link->metrics = cb;
+	link->metricsdata = udata;
+}
+
+void hl_session(hLink *link, int enable)
+{
+	if(!enable)
 	{
-		if(resp.resp == HR_busy)
-			ret = HE_tryagain;
-		else if(resp.resp == HR_untrusted)
-			ret = HE_notauthed;
-		else link->isauthed = 1;
+		endsession(link);
+		link->session = 0;
 	}
+	else if(link->session == 0)
+		link->session = 1;
+}
+
+int hl_auth(hLink *link)
+{
+	if(link->isauthed) return HE_success;
+
+	int ret = transact(link, HA_nothing, NULL, 0);
+	if(ret == HE_success)
+		link->isauthed = 1;
 
-	close(sock);
 	return ret;
 }
 
 int hl_addqueue(hLink *link, uint64_t *ids, size_t amount)
 {
 	if(!link->isauthed) return HE_notauthed;
-	int sock = makesock(link);
-	if(sock < 0) return -errno;
-
-	iTransactionHeader header = makeheader(HA_add_queue, amount * sizeof(uint64_t));
-	if(send(sock, &header, sizeof(iTransactionHeader), 0) < 0)
-	{ close(sock); return -errno; }
+	if(amount == 0) return transact(link, HA_add_queue, NULL, 0);
 
+	size_t batches = (amount + HL_QUEUE_BATCH - 1) / HL_QUEUE_BATCH;
 	uint64_t *body = malloc(amount * sizeof(uint64_t));
+	hRequest *reqs = malloc(batches * sizeof(hRequest));
+	if(body == NULL || reqs == NULL)
+	{ free(body); free(reqs); return -ENOMEM; }
+
 	for(size_t i = 0; i < amount; ++i)
 		body[i] = htonll(ids[i]);
-	ssize_t sent = send(sock, body, amount * sizeof(uint64_t), 0);
+	for(size_t i = 0; i < batches; ++i)
+	{
+		size_t left = amount - i * HL_QUEUE_BATCH;
+		reqs[i].action = HA_add_queue;
+		reqs[i].body = &body[i * HL_QUEUE_BATCH];
+		reqs[i].size = (left > HL_QUEUE_BATCH ? HL_QUEUE_BATCH : left) * sizeof(uint64_t);
+	}
+	int ret = hl_pipeline(link, reqs, batches);
+
 	free(body);
+	free(reqs);
+	return ret;
+}
+
+int hl_launch(hLink *link, uint64_t tid)
+{
+	if(!link->isauthed) return HE_notauthed;
+
+	uint64_t ntid = htonll(tid);
+	return transact(link, HA_launch, &ntid, sizeof(uint64_t));
+}
+
+int hl_sleep(hLink *link)
+{
+	if(!link->isauthed) return HE_notauthed;
+
+	return transact(link, HA_sleep, NULL, 0);
+}
 
-	if(sent < 0)
-	{ close(sock); return -errno; }
+int hl_install_url(hLink *link, const char *url)
+{
+	if(!link->isauthed) return HE_notauthed;
 
-	int ret = readdiscard(sock);
+	return transact(link, HA_install_url, url, strlen(url));
+}
+
+/* the amount of data sent between progress callbacks */
+#define INSTALL_CHUNK (1 << 20)
+
+static int installdata(hLink *link, const char *path, hProgress progress, void *udata, unsigned busytries)
+{
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if(fd < 0) return -errno;
+	struct stat st;
+	if(fstat(fd, &st) < 0)
+	{ int ret = -errno; close(fd); return ret; }
+	/* the size of a request is 32-bit */
+	if((uint64_t) st.st_size > UINT32_MAX)
+	{ close(fd); return -EFBIG; }
+	uint32_t size = st.st_size;
+
+	hMetric m = { .action = HA_install_data, .requests = 1, .retries = busytries };
+	unsigned long long start = nowus(), t;
+	iTransactionResponse resp;
+	int reused, ret, sock;
+	off_t off;
 
-	close(sock);
+	for(;;)
+	{
+		t = nowus();
+		if((sock = getsock(link, &reused)) < 0)
+		{ close(fd); return sock; }
+		m.reused = reused;
+		m.connect_us = reused ? 0 : nowus() - t;
+
+		t = nowus();
+		ret = sendheader(sock, HA_install_data, size, link->timeout);
+		/* the file goes straight from the page cache to the socket */
+		off = 0;
+		while(ret == HE_success && off < (off_t) size)
+		{
+			size_t chunk = size - off > INSTALL_CHUNK ? INSTALL_CHUNK : size - off;
+			ssize_t n = sendfile(sock, fd, &off, chunk);
+			if(n < 0 && errno == EINTR) continue;
+			if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+				ret = waitsock(sock, POLLOUT, link->timeout);
+			else if(n < 0) ret = -errno;
+			else if(n == 0) ret = -EIO; /* the file was truncated */
+			else if(progress != NULL) progress(off, size, udata);
+		}
+		m.send_us = nowus() - t;
+		m.sent += sizeof(iTransactionHeader) + off;
+
+		/* the 3ds responds once the CIA is installed */
+		if(ret == HE_success)
+		{
+			t = nowus();
+			ret = readcheckresp(&resp, sock, link->installtimeout);
+			m.wait_us = nowus() - t;
+			m.received += respbytes(&resp, ret);
+		}
+
+		if(reused && closedbyhost(ret))
+		{
+			/* the host only handles one transaction per connection,
+			 * a half-closed one usually still takes the header */
+			endsession(link);
+			link->session = -1;
+			++m.retries;
+			continue;
+		}
+		break;
+	}
+	close(fd);
+
+	putsock(link, sock, ret);
+	m.result = ret;
+	m.total_us = nowus() - start;
+	report(link, &m);
 	return ret;
 }
 
-int hl_launch(hLink *link, uint64_t tid)
+int hl_install_data(hLink *link, const char *path, hProgress progress, void *udata)
 {
 	if(!link->isauthed) return HE_notauthed;
-	int sock = makesock(link);
-	if(sock < 0) return -errno;
 
-	iTransactionHeader header = makeheader(HA_launch, sizeof(uint64_t));
-	if(send(sock, &header, sizeof(iTransactionHeader), 0) < 0)
-	{ close(sock); return -errno; }
+	int ret;
+	for(unsigned tries = 0; ; ++tries)
+	{
+		if((ret = installdata(link, path, progress, udata, tries)) != HE_tryagain || tries == link->retries)
+			return ret;
+		usleep(hl_backoff(link->backoff, tries) * 1000);
+	}
+}
+
+static int pipeline(hLink *link, hRequest *reqs, size_t amount)
+{
+	size_t i = 0;
+	int ret;
 
-	uint64_t ntid = htonll(tid);
-	if(send(sock, &ntid, sizeof(uint64_t), 0) < 0)
-	{ close(sock); return -errno; }
+	if(link->session != -1)
+	{
+		unsigned long long start = nowus(), sentat, last;
+		int reused, err = HE_success;
+		int sock = getsock(link, &reused);
+		if(sock < 0) return sock;
+		unsigned long connectus = reused ? 0 : nowus() - start;
+
+		/* the host reads the next request after responding to the previous one,
+		 * so this only works without deadlocking because requests are small */
+		size_t sent, reported;
+		last = nowus();
+		err = sendreqs(sock, reqs, amount, &sent, link->timeout);
+		sentat = nowus();
+		unsigned long sendus = sentat - last;
+
+		for(; i < sent; ++i)
+		{
+			iTransactionResponse resp;
+			reqs[i].result = readcheckresp(&resp, sock, link->timeout);
+
+			/* the whole batch is sent at once, so the first request gets its send
+			 * time; the wait is since the previous response */
+			hMetric m = { .action = reqs[i].action, .result = reqs[i].result, .requests = 1,
+				.reused = reused || i != 0, .connect_us = i == 0 ? connectus : 0, .send_us = i == 0 ? sendus : 0,
+				.sent = sizeof(iTransactionHeader) + reqs[i].size, .received = respbytes(&resp, reqs[i].result) };
+			unsigned long long t = nowus();
+			m.wait_us = t - (i == 0 ? sentat : last);
+			m.total_us = t - start;
+			last = t;
+			if(reqs[i].result >= 0 || !closedbyhost(reqs[i].result) || !(reused || i != 0))
+				report(link, &m);
+
+			if(reqs[i].result < 0)
+			{ err = reqs[i].result; break; }
+		}
+		reported = i < sent ? i + 1 : i;
+
+		/* `i' is the first request without a response now */
+		if(i != amount && closedbyhost(err) && (reused || i != 0))
+			/* the host closed the connection after the previous response,
+			 * so it never got to this request; send the rest one by one */
+			link->session = -1;
+		else for(; i < amount; ++i)
+		{
+			hMetric m = { .action = reqs[i].action, .result = err, .requests = 1, .reused = 1 };
+			reqs[i].result = err;
+			if(i >= reported) report(link, &m);
+		}
+
+		putsock(link, sock, err);
+	}
 
-	int ret = readdiscard(sock);
+	for(; i < amount; ++i)
+		reqs[i].result = transact(link, reqs[i].action, reqs[i].body, reqs[i].size);
 
-	close(sock);
+	ret = HE_success;
+	for(i = 0; i < amount && ret == HE_success; ++i)
+		ret = reqs[i].result;
 	return ret;
 }
 
-int hl_sleep(hLink *link)
+int hl_pipeline(hLink *link, hRequest *reqs, size_t amount)
 {
 	if(!link->isauthed) return HE_notauthed;
-	int sock = makesock(link);
-	if(sock < 0) return -errno;
+	if(amount == 0) return HE_success;
 
-	iTransactionHeader header = makeheader(HA_sleep, 0);
-	if(send(sock, &header, sizeof(iTransactionHeader), 0) < 0)
-	{ close(sock); return -errno; }
+	int ret = pipeline(link, reqs, amount);
+	if(ret != HE_tryagain || link->retries == 0)
+		return ret;
 
-	int ret = readdiscard(sock);
+	/* only the requests the 3ds was too busy for are sent again */
+	hRequest *busy = malloc(amount * sizeof(hRequest));
+	size_t *from = malloc(amount * sizeof(size_t));
+	for(unsigned tries = 0; busy != NULL && from != NULL && tries < link->retries; ++tries)
+	{
+		size_t n = 0;
+		for(size_t i = 0; i < amount; ++i)
+			if(reqs[i].result == HE_tryagain)
+			{
+				from[n] = i;
+				busy[n++] = reqs[i];
+			}
+		if(n == 0) break;
+
+		usleep(hl_backoff(link->backoff, tries) * 1000);
+		pipeline(link, busy, n);
+		for(size_t i = 0; i < n; ++i)
+			reqs[from[i]].result = busy[i].result;
+	}
+	free(busy);
+	free(from);
 
-	close(sock);
+	ret = HE_success;
+	for(size_t i = 0; i < amount && ret == HE_success; ++i)
+		ret = reqs[i].result;
 	return ret;
 }
 
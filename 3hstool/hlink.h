@@ -6,6 +6,8 @@
 extern "C" {
 #endif
 
+#include <stdint.h>
+#include <stddef.h>
 #include <netdb.h>
 
 enum HAction
@@ -38,12 +40,64 @@ enum HError
 	HE_exterror     = 4, /* extended error. an error message from the 3ds */
 };
 
+/* the amount of IDs hl_addqueue() sends in one request */
+#define HL_QUEUE_BATCH 10
+/* the maximum length of an error message from the 3ds */
+#define HL_ERROR_MAXLEN 100
+/* default milliseconds to wait for a device that doesn't make progress */
+#define HL_TIMEOUT 5000
+/* default milliseconds to wait for the response to an install, the 3ds responds once it's done */
+#define HL_INSTALL_TIMEOUT 600000
+
+struct hLink;
+
+typedef struct hMetric
+{
+	uint8_t action; /* enum HAction, of the first request if there are more */
+	int result; /* like the return value of the hl_* functions */
+	unsigned requests; /* requests measured together, more than 1 for fleet steps */
+	unsigned retries; /* times requests were sent again after the 3ds was busy or closed the connection */
+	int reused; /* went over a connection that was already open */
+	int resolved; /* the first record of a link, the only one with resolve_us */
+	unsigned long resolve_us; /* looking up the address */
+	unsigned long connect_us; /* 0 if the connection was reused */
+	unsigned long send_us; /* until the last byte of the request was sent */
+	unsigned long wait_us; /* from the last byte sent to the response, the time the 3ds took */
+	unsigned long total_us; /* from starting the request until the response was read */
+	uint64_t sent; /* bytes */
+	uint64_t received;
+} hMetric;
+
+/* called with the measurements of every request on a link */
+typedef void (*hMetricsCallback)(const struct hLink *link, const hMetric *metric, void *udata);
+
 typedef struct hLink
 {
 	struct addrinfo *host;
 	int isauthed;
+	int session; /* 1 if session mode is on, -1 if the host doesn't support it */
+	int sock; /* connection kept open in session mode, -1 if there is none */
+	unsigned long timeout; /* see hl_settimeout() */
+	unsigned long installtimeout;
+	unsigned retries; /* see hl_setretries() */
+	unsigned long backoff;
+	hMetricsCallback metrics; /* see hl_setmetrics() */
+	void *metricsdata;
+	unsigned long resolveus;
+	int resolvepending; /* resolveus wasn't reported yet */
 } hLink;
 
+/* called with the amount of bytes sent so far and the total */
+typedef void (*hProgress)(uint64_t done, uint64_t total, void *udata);
+
+typedef struct hRequest
+{
+	uint8_t action; /* enum HAction */
+	const void *body; /* body in network byte order */
+	uint32_t size;
+	int result; /* set by hl_pipeline() */
+} hRequest;
+
 /* connects a link, get an error with hl_makelink_geterror */
 int hl_makelink(hLink *link, const char *addr);
 /* frees memory used by link */
@@ -56,12 +110,37 @@ const char *hl_geterror(int errcode);
 int hl_auth(hLink *link);
 /* launch a title on the 3ds with a title id */
 int hl_launch(hLink *link, uint64_t tid);
-/* sends hshop ids to add to the queue */
+/* sends hshop ids to add to the queue, in as many requests as needed */
 int hl_addqueue(hLink *link, uint64_t *ids, size_t amount);
 /* sleeps the 3ds for 5 seconds */
 int hl_sleep(hLink *link);
+/* makes the 3ds download and install a CIA from a url */
+int hl_install_url(hLink *link, const char *url);
+/* sends a CIA file to the 3ds to install with sendfile(2), which raises SIGPIPE if
+ * the connection is lost; the response may take up to the install timeout,
+ * `progress' may be NULL, CIAs of 4 GiB or more can't be sent */
+int hl_install_data(hLink *link, const char *path, hProgress progress, void *udata);
 /* wait on host for a bit because the 3ds is garbage */
 void hl_waittimeout(void);
+/* sets how many milliseconds connecting, sending and receiving may go without
+ * progress before failing with -ETIMEDOUT, and how long the 3ds may take to
+ * respond to an install; 0 waits forever, the defaults are HL_TIMEOUT and
+ * HL_INSTALL_TIMEOUT */
+void hl_settimeout(hLink *link, unsigned long timeout, unsigned long installtimeout);
+/* sends requests the 3ds was too busy for again up to `retries' times, waiting
+ * `backoff' milliseconds before the first retry and twice as long before every
+ * next one; the default is 0 retries, which returns HE_tryagain right away */
+void hl_setretries(hLink *link, unsigned retries, unsigned long backoff);
+/* milliseconds to wait before retry `tries' (counting from 0) with hl_setretries() */
+unsigned long hl_backoff(unsigned long backoff, unsigned tries);
+/* makes every request on the link report its timing and sizes to `cb', NULL turns it off */
+void hl_setmetrics(hLink *link, hMetricsCallback cb, void *udata);
+/* keeps one connection open for all commands instead of connecting for every
+ * command, falls back to the latter if the host closes the connection */
+void hl_session(hLink *link, int enable);
+/* sends all requests back-to-back over one connection and reads the responses
+ * in order, returns the first error or HE_success if all requests succeeded */
+int hl_pipeline(hLink *link, hRequest *reqs, size_t amount);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,91 @@
+#ifndef inc_hproto_h
+#define inc_hproto_h
+
+/* the hLink wire format and helpers shared by the hLink clients */
+
+#include "./hlink.h"
+
+#include <arpa/inet.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#define MAGIC_LEN 3
+#define MAGIC "HLT"
+#define PORT "37283"
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+// Why do these not exist already?
+static inline uint64_t htonll(uint64_t n)
+{ return __builtin_bswap64(n); }
+#elif __BYTE_ORDER == __ORDER_BIG_ENDIAN__
+#define htonll(n) n
+#else
+#error "Unsupported endian"
+#endif
+
+typedef struct iTransactionHeader
+{
+	char magic[MAGIC_LEN];
+	uint8_t action; // enum HAction
+	uint32_t size;
+} __attribute__((__packed__)) iTransactionHeader;
+
+typedef struct iTransactionResponse
+{
+	char magic[MAGIC_LEN];
+	uint8_t resp; // enum HResponse
+	uint32_t size;
+} __attribute__((__packed__)) iTransactionResponse;
+
+#define ERROR_MAXLEN HL_ERROR_MAXLEN
+/* put in place of an error message that doesn't fit */
+#define LONG_ERROR "INTERNAL ERROR: error message from 3ds too long."
+
+static inline iTransactionHeader makeheader(uint8_t action, uint32_t size)
+{
+	iTransactionHeader header;
+	memcpy(header.magic, MAGIC, MAGIC_LEN);
+	header.size = htonl(size);
+	header.action = action;
+	return header;
+}
+
+/* the error for a response, HR_error is HE_exterror and has a message as body */
+static inline int resperror(uint8_t resp)
+{
+	switch(resp)
+	{
+	case HR_untrusted: return HE_notauthed;
+	case HR_busy: return HE_tryagain;
+	case HR_error: return HE_exterror;
+	case HR_notfound: return HE_tidnotfound;
+	}
+	return HE_success;
+}
+
+static inline unsigned long long nowms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+static inline unsigned long long nowus(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+/* hands a measurement to the metrics callback of a link */
+static inline void report(hLink *link, hMetric *m)
+{
+	if(link->metrics == NULL) return;
+	m->resolved = link->resolvepending;
+	m->resolve_us = link->resolvepending ? link->resolveus : 0;
+	link->resolvepending = 0;
+	link->metrics(link, m, link->metricsdata);
+}
+
+#endif
@@ -0,0 +1,692 @@
+#include "./hsession.h"
+#include "./hscript.h"
+#include "./hproto.h"
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <ctype.h>
+
+#include <sys/epoll.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+
+#define MAX_ARGS 256
+#define MAX_DEPTH 16
+
+struct line
+{
+	unsigned no;
+	int argc;
+	char **argv;
+};
+
+struct var
+{
+	const char *name;
+	const char *value;
+};
+
+struct parser
+{
+	const char *path;
+	char *err;
+	size_t errlen;
+	struct line *lines;
+	size_t nlines;
+	hScript *script;
+
+	/* the group being planned */
+	uint64_t *ids;
+	size_t nids, idalloc;
+	hRequest *reqs;
+	size_t nreqs, reqalloc;
+	unsigned groupline;
+};
+
+static int fail(struct parser *p, unsigned line, const char *fmt, ...)
+{
+	va_list args;
+	int len = snprintf(p->err, p->errlen, "%s:%u: ", p->path, line);
+	if(len >= 0 && (size_t) len < p->errlen)
+	{
+		va_start(args, fmt);
+		vsnprintf(p->err + len, p->errlen - len, fmt, args);
+		va_end(args);
+	}
+	return -EINVAL;
+}
+
+static void freeargs(int argc, char **argv)
+{
+	for(int i = 0; i < argc; ++i)
+		free(argv[i]);
+	free(argv);
+}
+
+/* splits `str' into words, a word starting with '#' ends the line */
+static int splitwords(char *str, int *argc, char ***argv)
+{
+	char **words = NULL;
+	int amount = 0;
+	for(char *word = strtok(str, " \t\r\n"); word != NULL && word[0] != '#'; word = strtok(NULL, " \t\r\n"))
+	{
+		char **n = realloc(words, (amount + 1) * sizeof(char *));
+		if(n == NULL || (n[amount] = strdup(word)) == NULL)
+		{
+			freeargs(amount, n ? n : words);
+			return -ENOMEM;
+		}
+		words = n;
+		++amount;
+	}
+	*argc = amount;
+	*argv = words;
+	return HE_success;
+}
+
+static int readlines(struct parser *p)
+{
+	FILE *f = fopen(p->path, "r");
+	if(f == NULL)
+	{
+		snprintf(p->err, p->errlen, "%s: %s", p->path, strerror(errno));
+		return -errno;
+	}
+
+	char buf[4096];
+	unsigned no = 0;
+	int ret = HE_success;
+	while(ret == HE_success && fgets(buf, sizeof(buf), f))
+	{
+		struct line line = { ++no, 0, NULL };
+		if((ret = splitwords(buf, &line.argc, &line.argv)) != HE_success)
+			break;
+		if(line.argc == 0)
+			continue;
+		struct line *n = realloc(p->lines, (p->nlines + 1) * sizeof(struct line));
+		if(n == NULL)
+		{
+			freeargs(line.argc, line.argv);
+			ret = -ENOMEM;
+			break;
+		}
+		p->lines = n;
+		p->lines[p->nlines++] = line;
+	}
+
+	fclose(f);
+	return ret;
+}
+
+/* replaces every $NAME in `word' by the innermost loop variable with that name */
+static char *subst(const char *word, const struct var *vars, size_t nvars)
+{
+	size_t len = 0, alloc = strlen(word) + 1;
+	char *out = malloc(alloc);
+	if(out == NULL) return NULL;
+
+	while(*word != '\0')
+	{
+		const char *value = NULL;
+		size_t namelen = 0;
+		if(*word == '$')
+		{
+			for(size_t i = nvars; i-- > 0 && value == NULL;)
+			{
+				size_t n = strlen(vars[i].name);
+				if(strncmp(word + 1, vars[i].name, n) == 0
+					&& !isalnum((unsigned char) word[n + 1]) && word[n + 1] != '_')
+				{
+					value = vars[i].value;
+					namelen = n + 1;
+				}
+			}
+		}
+		if(value == NULL)
+		{
+			value = word;
+			namelen = 1;
+		}
+		size_t vlen = value == word ? 1 : strlen(value);
+		if(len + vlen + strlen(word + namelen) + 1 > alloc)
+		{
+			alloc = (len + vlen + strlen(word + namelen) + 1) * 2;
+			char *n = realloc(out, alloc);
+			if(n == NULL) { free(out); return NULL; }
+			out = n;
+		}
+		memcpy(out + len, value, vlen);
+		len += vlen;
+		word += namelen;
+	}
+
+	out[len] = '\0';
+	return out;
+}
+
+static int pushreq(struct parser *p, uint8_t action, void *body, uint32_t size)
+{
+	if(p->nreqs == p->reqalloc)
+	{
+		size_t alloc = p->reqalloc ? p->reqalloc * 2 : 8;
+		hRequest *n = realloc(p->reqs, alloc * sizeof(hRequest));
+		if(n == NULL) { free(body); return -ENOMEM; }
+		p->reqs = n;
+		p->reqalloc = alloc;
+	}
+	p->reqs[p->nreqs++] = (hRequest) { action, body, size, HE_success };
+	return HE_success;
+}
+
+/* turns the commands since the last barrier into a group */
+static int flush(struct parser *p)
+{
+	if(p->nids == 0 && p->nreqs == 0)
+		return HE_success;
+
+	size_t batches = (p->nids + HL_QUEUE_BATCH - 1) / HL_QUEUE_BATCH;
+	hScriptGroup group = { NULL, 0, 0, p->groupline };
+	hScriptGroup *groups = realloc(p->script->groups, (p->script->ngroups + 1) * sizeof(hScriptGroup));
+	if(groups == NULL) return -ENOMEM;
+	p->script->groups = groups;
+	if((group.reqs = malloc((batches + p->nreqs) * sizeof(hRequest))) == NULL)
+		return -ENOMEM;
+
+	/* all add-queues of the group go first, in as few requests as possible */
+	for(size_t i = 0; i < batches; ++i)
+	{
+		size_t amount = p->nids - i * HL_QUEUE_BATCH;
+		if(amount > HL_QUEUE_BATCH) amount = HL_QUEUE_BATCH;
+		uint64_t *body = malloc(amount * sizeof(uint64_t));
+		if(body == NULL)
+		{
+			groups[p->script->ngroups++] = group;
+			return -ENOMEM;
+		}
+		for(size_t j = 0; j < amount; ++j)
+			body[j] = htonll(p->ids[i * HL_QUEUE_BATCH + j]);
+		group.reqs[group.nreqs++] = (hRequest) { HA_add_queue, body, amount * sizeof(uint64_t), HE_success };
+	}
+	memcpy(&group.reqs[group.nreqs], p->reqs, p->nreqs * sizeof(hRequest));
+	group.nreqs += p->nreqs;
+
+	groups[p->script->ngroups++] = group;
+	p->nids = 0;
+	p->nreqs = 0;
+	return HE_success;
+}
+
+static int addwait(struct parser *p, unsigned line, unsigned long ms)
+{
+	int ret = flush(p);
+	if(ret != HE_success) return ret;
+	hScriptGroup *groups = realloc(p->script->groups, (p->script->ngroups + 1) * sizeof(hScriptGroup));
+	if(groups == NULL) return -ENOMEM;
+	p->script->groups = groups;
+	groups[p->script->ngroups++] = (hScriptGroup) { NULL, 0, ms, line };
+	return HE_success;
+}
+
+/* a request that has to run on its own */
+static int addalone(struct parser *p, unsigned line, uint8_t action, void *body, uint32_t size)
+{
+	int ret = flush(p);
+	if(ret != HE_success) { free(body); return ret; }
+	p->groupline = line;
+	if((ret = pushreq(p, action, body, size)) != HE_success)
+		return ret;
+	return flush(p);
+}
+
+static int command(struct parser *p, unsigned line, int argc, char **argv)
+{
+	const char *cmd = argv[0];
+	char *end;
+
+	if(p->nids == 0 && p->nreqs == 0)
+		p->groupline = line;
+
+	if(strcmp(cmd, "add-queue") == 0)
+	{
+		if(argc < 2) return fail(p, line, "add-queue: expected IDs");
+		for(int i = 1; i < argc; ++i)
+		{
+			errno = 0;
+			uint64_t id = strtoull(argv[i], &end, 10);
+			if(end == argv[i] || *end != '\0' || errno != 0)
+				return fail(p, line, "add-queue: invalid ID '%s'", argv[i]);
+			if(p->nids == p->idalloc)
+			{
+				size_t alloc = p->idalloc ? p->idalloc * 2 : 64;
+				uint64_t *n = realloc(p->ids, alloc * sizeof(uint64_t));
+				if(n == NULL) return -ENOMEM;
+				p->ids = n;
+				p->idalloc = alloc;
+			}
+			p->ids[p->nids++] = id;
+		}
+		return HE_success;
+	}
+	if(strcmp(cmd, "install-url") == 0)
+	{
+		if(argc != 2) return fail(p, line, "install-url: expected a url");
+		char *url = strdup(argv[1]);
+		if(url == NULL) return -ENOMEM;
+		return pushreq(p, HA_install_url, url, strlen(url));
+	}
+	if(strcmp(cmd, "launch") == 0)
+	{
+		if(argc != 2) return fail(p, line, "launch: expected a title id");
+		errno = 0;
+		uint64_t tid = strtoull(argv[1], &end, 16);
+		if(strncmp(argv[1], "0004", 4) != 0 || *end != '\0' || errno != 0)
+			return fail(p, line, "launch: invalid title id '%s'", argv[1]);
+		uint64_t *body = malloc(sizeof(uint64_t));
+		if(body == NULL) return -ENOMEM;
+		*body = htonll(tid);
+		return addalone(p, line, HA_launch, body, sizeof(uint64_t));
+	}
+	if(strcmp(cmd, "sleep") == 0)
+	{
+		if(argc != 1) return fail(p, line, "sleep: unexpected argument");
+		return addalone(p, line, HA_sleep, NULL, 0);
+	}
+	if(strcmp(cmd, "wait") == 0)
+	{
+		errno = 0;
+		unsigned long ms = argc == 2 ? strtoul(argv[1], &end, 10) : 0;
+		if(argc != 2 || end == argv[1] || *end != '\0' || errno != 0)
+			return fail(p, line, "wait: expected milliseconds");
+		return addwait(p, line, ms);
+	}
+	if(strcmp(cmd, "barrier") == 0)
+	{
+		if(argc != 1) return fail(p, line, "barrier: unexpected argument");
+		return flush(p);
+	}
+	return fail(p, line, "unknown command '%s'", cmd);
+}
+
+/* reads the words of a file for `for NAME in @FILE' */
+static int readvalues(struct parser *p, unsigned line, const char *path, int *argc, char ***argv)
+{
+	FILE *f = fopen(path, "r");
+	if(f == NULL)
+		return fail(p, line, "%s: %s", path, strerror(errno));
+
+	char buf[4096];
+	int ret = HE_success;
+	*argc = 0;
+	*argv = NULL;
+	while(ret == HE_success && fgets(buf, sizeof(buf), f))
+	{
+		int n;
+		char **words;
+		if((ret = splitwords(buf, &n, &words)) != HE_success)
+			break;
+		char **all = realloc(*argv, (*argc + n) * sizeof(char *));
+		if(all == NULL && *argc + n != 0)
+		{
+			freeargs(n, words);
+			ret = -ENOMEM;
+			break;
+		}
+		*argv = all;
+		memcpy(*argv + *argc, words, n * sizeof(char *));
+		*argc += n;
+		free(words);
+	}
+
+	fclose(f);
+	if(ret != HE_success)
+	{
+		freeargs(*argc, *argv);
+		*argc = 0;
+		*argv = NULL;
+	}
+	return ret;
+}
+
+static int expand(struct parser *p, size_t from, size_t to, struct var *vars, size_t nvars)
+{
+	for(size_t i = from; i < to; ++i)
+	{
+		struct line *line = &p->lines[i];
+		char *argv[MAX_ARGS];
+		int argc = line->argc, ret = HE_success;
+		if(argc > MAX_ARGS)
+			return fail(p, line->no, "too many arguments");
+
+		for(int j = 0; j < argc; ++j)
+		{
+			if((argv[j] = subst(line->argv[j], vars, nvars)) == NULL)
+			{
+				for(int k = 0; k < j; ++k) free(argv[k]);
+				return -ENOMEM;
+			}
+		}
+
+		if(strcmp(argv[0], "for") == 0)
+		{
+			/* find the matching end */
+			size_t end = i + 1;
+			for(int depth = 1; end < to; ++end)
+			{
+				if(strcmp(p->lines[end].argv[0], "for") == 0) ++depth;
+				else if(strcmp(p->lines[end].argv[0], "end") == 0 && --depth == 0) break;
+			}
+
+			int nvalues = argc - 3;
+			char **values = &argv[3];
+			char **filevalues = NULL;
+			if(argc < 4 || strcmp(argv[2], "in") != 0)
+				ret = fail(p, line->no, "expected 'for NAME in WORD...' or 'for NAME in @FILE'");
+			else if(end == to)
+				ret = fail(p, line->no, "for without end");
+			else if(nvars == MAX_DEPTH)
+				ret = fail(p, line->no, "loops nested too deep");
+			else if(argv[3][0] == '@' && argc == 4)
+			{
+				ret = readvalues(p, line->no, argv[3] + 1, &nvalues, &filevalues);
+				values = filevalues;
+			}
+
+			for(int j = 0; j < nvalues && ret == HE_success; ++j)
+			{
+				vars[nvars] = (struct var) { argv[1], values[j] };
+				ret = expand(p, i + 1, end, vars, nvars + 1);
+			}
+			if(filevalues)
+				freeargs(nvalues, filevalues);
+			i = end;
+		}
+		else if(strcmp(argv[0], "end") == 0)
+			ret = fail(p, line->no, "end without for");
+		else ret = command(p, line->no, argc, argv);
+
+		for(int j = 0; j < argc; ++j)
+			free(argv[j]);
+		if(ret != HE_success)
+			return ret;
+	}
+	return HE_success;
+}
+
+int hl_script_load(hScript *script, const char *path, char *err, size_t errlen)
+{
+	struct parser p;
+	struct var vars[MAX_DEPTH];
+	memset(&p, 0x0, sizeof(p));
+	p.path = path;
+	p.err = err;
+	p.errlen = errlen;
+	p.script = script;
+	script->groups = NULL;
+	script->ngroups = 0;
+	err[0] = '\0';
+
+	int ret = readlines(&p);
+	if(ret == HE_success)
+		ret = expand(&p, 0, p.nlines, vars, 0);
+	if(ret == HE_success)
+		ret = flush(&p);
+
+	for(size_t i = 0; i < p.nlines; ++i)
+		freeargs(p.lines[i].argc, p.lines[i].argv);
+	free(p.lines);
+	for(size_t i = 0; i < p.nreqs; ++i)
+		free((void *) p.reqs[i].body);
+	free(p.reqs);
+	free(p.ids);
+
+	if(ret != HE_success)
+	{
+		if(err[0] == '\0')
+			snprintf(err, errlen, "%s: %s", path, strerror(-ret));
+		hl_script_free(script);
+	}
+	return ret;
+}
+
+void hl_script_free(hScript *script)
+{
+	for(size_t i = 0; i < script->ngroups; ++i)
+	{
+		for(size_t j = 0; j < script->groups[i].nreqs; ++j)
+			free((void *) script->groups[i].reqs[j].body);
+		free(script->groups[i].reqs);
+	}
+	free(script->groups);
+	script->groups = NULL;
+	script->ngroups = 0;
+}
+
+/* running */
+
+struct runner;
+
+struct pending
+{
+	struct runner *r;
+	size_t req;
+};
+
+struct runner
+{
+	hDevice *dev;
+	hSession *s;
+	const hScript *script;
+	const hFleetOptions *opts;
+	size_t group;
+	size_t outstanding; /* requests of the group without a final result */
+	size_t *retry; /* requests of the group to send again because the 3ds was busy */
+	size_t nretry;
+	unsigned tries;
+	int stop; /* an error that ends the script for this device */
+	int done;
+	unsigned long long waituntil; /* 0 if not waiting */
+	unsigned long long start;
+	struct pending *pending;
+};
+
+static void setfail(struct runner *r, int err, const char *msg)
+{
+	hDevice *dev = r->dev;
+	if(dev->result != HE_success)
+		return;
+	dev->result = err;
+	dev->failstep = r->group;
+	if(err == HE_exterror && msg != NULL)
+	{
+		strncpy(dev->error, msg, HL_ERROR_MAXLEN);
+		dev->error[HL_ERROR_MAXLEN] = '\0';
+	}
+}
+
+static void completed(hSession *s, long handle, int result, const char *error, void *udata)
+{
+	struct pending *pending = udata;
+	struct runner *r = pending->r;
+	(void) s; (void) handle;
+
+	--r->outstanding;
+	if(result == HE_tryagain && r->tries < r->opts->retries)
+		r->retry[r->nretry++] = pending->req;
+	else if(result != HE_success)
+	{
+		setfail(r, result, error);
+		/* error responses only concern that request */
+		if(result != HE_exterror && result != HE_tidnotfound)
+			r->stop = 1;
+	}
+}
+
+static int submit(struct runner *r, size_t req)
+{
+	const hRequest *q = &r->script->groups[r->group].reqs[req];
+	long ret = hl_session_submit(r->s, q->action, q->body, q->size, completed, &r->pending[req]);
+	if(ret < 0) return ret;
+	++r->outstanding;
+	return HE_success;
+}
+
+static void finish(struct runner *r)
+{
+	r->done = 1;
+	r->dev->ms = nowms() - r->start;
+}
+
+/* moves a device on once its requests are done, returns 1 if it's finished */
+static int advance(struct runner *r)
+{
+	while(!r->done && r->outstanding == 0)
+	{
+		unsigned long long t = nowms();
+		int ret = HE_success;
+
+		if(r->stop)
+			finish(r);
+		else if(r->nretry && r->waituntil == 0)
+		{
+			r->waituntil = t + hl_backoff(r->opts->backoff, r->tries);
+			++r->tries;
+			++r->dev->retries;
+		}
+		else if(r->waituntil > t)
+			break;
+		else if(r->nretry)
+		{
+			size_t n = r->nretry;
+			r->nretry = 0;
+			r->waituntil = 0;
+			for(size_t i = 0; i < n && ret == HE_success; ++i)
+				ret = submit(r, r->retry[i]);
+		}
+		else if(++r->group >= r->script->ngroups)
+			finish(r);
+		else
+		{
+			const hScriptGroup *g = &r->script->groups[r->group];
+			r->tries = 0;
+			r->waituntil = g->nreqs == 0 ? t + g->ms : 0;
+			for(size_t i = 0; i < g->nreqs && ret == HE_success; ++i)
+				ret = submit(r, i);
+		}
+
+		if(ret != HE_success)
+		{
+			setfail(r, ret, NULL);
+			r->stop = 1;
+		}
+	}
+	return r->done;
+}
+
+int hl_script_run(const hScript *script, hDevice *devs, size_t amount, const hFleetOptions *opts)
+{
+	struct runner *runners = calloc(amount, sizeof(struct runner));
+	size_t maxreqs = 1, active = amount;
+	int ep = -1, ret = HE_success;
+	if(runners == NULL) return -ENOMEM;
+	for(size_t i = 0; i < script->ngroups; ++i)
+		if(script->groups[i].nreqs > maxreqs)
+			maxreqs = script->groups[i].nreqs;
+	if((ep = epoll_create1(EPOLL_CLOEXEC)) < 0)
+	{ free(runners); return -errno; }
+
+	for(size_t i = 0; i < amount && ret == HE_success; ++i)
+	{
+		struct runner *r = &runners[i];
+		hDevice *dev = &devs[i];
+		int err;
+		r->dev = dev;
+		r->script = script;
+		r->opts = opts;
+		r->start = nowms();
+		/* advance() starts at the first group */
+		r->group = (size_t) -1;
+		dev->state = NULL;
+		dev->result = HE_success;
+		dev->failstep = 0;
+		dev->retries = 0;
+		dev->error[0] = '\0';
+
+		if((r->pending = malloc(maxreqs * sizeof(struct pending))) == NULL
+			|| (r->retry = malloc(maxreqs * sizeof(size_t))) == NULL)
+		{ ret = -ENOMEM; break; }
+		for(size_t j = 0; j < maxreqs; ++j)
+			r->pending[j] = (struct pending) { r, j };
+
+		if((r->s = hl_session_open(dev->addr, &err)) == NULL)
+		{
+			/* like hl_fleet_run(), addresses that don't resolve fail on their own */
+			setfail(r, err == -ENOMEM ? -ENOMEM : -ENXIO, NULL);
+			finish(r);
+			continue;
+		}
+		hl_session_settimeout(r->s, opts->timeout, opts->installtimeout);
+		hl_session_setmetrics(r->s, opts->metrics, opts->metricsdata);
+
+		struct epoll_event ev;
+		memset(&ev, 0x0, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.ptr = r;
+		if(epoll_ctl(ep, EPOLL_CTL_ADD, hl_session_fd(r->s), &ev) < 0)
+		{ ret = -errno; break; }
+	}
+
+	struct epoll_event events[64];
+	while(ret == HE_success && active)
+	{
+		/* sessions are cheap to process when they have nothing to do */
+		active = 0;
+		int timeout = -1;
+		unsigned long long t = nowms();
+		for(size_t i = 0; i < amount; ++i)
+		{
+			struct runner *r = &runners[i];
+			if(r->done) continue;
+			if(hl_session_process(r->s) < 0 || advance(r))
+			{
+				if(!r->done) finish(r);
+				continue;
+			}
+			++active;
+
+			int limit = hl_session_timeout(r->s);
+			if(r->waituntil)
+			{
+				unsigned long long left = r->waituntil > t ? r->waituntil - t : 0;
+				if(limit < 0 || left < (unsigned long long) limit)
+					limit = left > INT_MAX ? INT_MAX : (int) left;
+			}
+			if(limit >= 0 && (timeout < 0 || limit < timeout))
+				timeout = limit;
+		}
+		if(active == 0) break;
+
+		if(epoll_wait(ep, events, sizeof(events) / sizeof(events[0]), timeout) < 0 && errno != EINTR)
+			ret = -errno;
+	}
+
+	int failed = 0;
+	for(size_t i = 0; i < amount; ++i)
+	{
+		struct runner *r = &runners[i];
+		if(r->s != NULL)
+			hl_session_close(r->s);
+		free(r->pending);
+		free(r->retry);
+		if(devs[i].result != HE_success)
+			++failed;
+	}
+	close(ep);
+	free(runners);
+	return ret != HE_success ? ret : failed;
+}
+
@@ -0,0 +1,59 @@
+#ifndef inc_hscript_h
+#define inc_hscript_h
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "./hfleet.h"
+#include "./hlink.h"
+
+/* Batch scripts for hlink, one command per line:
+ *
+ *   # comment
+ *   add-queue ID...      add hShop IDs to the queue
+ *   install-url URL      make the 3ds download and install a CIA
+ *   launch TID           launch a title
+ *   sleep                sleep the 3ds for 5 seconds
+ *   wait MS              wait MS milliseconds
+ *   barrier              wait until everything before it is done
+ *   for NAME in WORD...  repeat the lines up to the matching `end' for every
+ *   for NAME in @FILE    word or every word in FILE, with $NAME replaced
+ *   end
+ *
+ * Commands between barriers are independent of each other and form a group
+ * that is sent over one connection in one go, the IDs of all add-queues in a
+ * group are merged into as few requests as possible. `wait', `launch' and
+ * `sleep' act as barriers themselves as they change what the 3ds is doing. */
+
+typedef struct hScriptGroup
+{
+	hRequest *reqs; /* bodies are owned by the group */
+	size_t nreqs;
+	unsigned long ms; /* wait before the next group */
+	unsigned line; /* first script line of the group */
+} hScriptGroup;
+
+typedef struct hScript
+{
+	hScriptGroup *groups;
+	size_t ngroups;
+} hScript;
+
+/* parses and plans a script, on failure a message with the line is put in `err';
+ * returns HE_success or -errno (-EINVAL for syntax errors) */
+int hl_script_load(hScript *script, const char *path, char *err, size_t errlen);
+/* frees memory used by a script */
+void hl_script_free(hScript *script);
+/* runs the groups of `script' on every device concurrently, each device waits
+ * for its own group to finish before starting the next one; busy responses
+ * are retried like hl_fleet_run() does, `failstep' is the failed group;
+ * returns the amount of devices that failed or -errno */
+int hl_script_run(const hScript *script, hDevice *devs, size_t amount, const hFleetOptions *opts);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
@@ -0,0 +1,256 @@
+#define _GNU_SOURCE
+
+#include "./hserve.h"
+#include "./hproto.h"
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <sys/socket.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <errno.h>
+#include <netdb.h>
+#include <poll.h>
+#include <time.h>
+
+/* how often idle connections and the listener check for `stop' */
+#define STOP_POLL 100
+#define BODY_CHUNK (64 * 1024)
+#define SIMULATED_ERROR "simulated error"
+
+typedef struct responder
+{
+	const hResponderOptions *opts;
+	hResponderStats *stats;
+	volatile sig_atomic_t *stop;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	unsigned active; /* open connections */
+	unsigned long count; /* requests so far, to pick the busy and error responses */
+} responder;
+
+struct conn
+{
+	responder *r;
+	int sock;
+};
+
+static int recvall(int sock, void *buf, size_t size)
+{
+	while(size)
+	{
+		ssize_t n = recv(sock, buf, size, MSG_WAITALL);
+		if(n < 0 && errno == EINTR) continue;
+		if(n < 0) return -errno;
+		if(n == 0) return -ECONNRESET;
+		buf = (char *) buf + n;
+		size -= n;
+	}
+	return HE_success;
+}
+
+static int sendall(int sock, const void *buf, size_t size)
+{
+	while(size)
+	{
+		ssize_t n = send(sock, buf, size, MSG_NOSIGNAL);
+		if(n < 0 && errno == EINTR) continue;
+		if(n < 0) return -errno;
+		buf = (const char *) buf + n;
+		size -= n;
+	}
+	return HE_success;
+}
+
+static void sleepms(unsigned long ms)
+{
+	struct timespec ts = { ms / 1000, (ms % 1000) * 1000000 };
+	while(nanosleep(&ts, &ts) < 0 && errno == EINTR)
+		;
+}
+
+/* waits until `sock' is readable, returns 0 if the responder is stopping */
+static int waitreadable(responder *r, int sock)
+{
+	struct pollfd pfd = { sock, POLLIN, 0 };
+	while(!*r->stop)
+	{
+		int n = poll(&pfd, 1, STOP_POLL);
+		if(n < 0 && errno != EINTR) return 0;
+		if(n > 0) return 1;
+	}
+	return 0;
+}
+
+/* picks the response to a request and counts it */
+static uint8_t respond(responder *r, uint8_t action, uint32_t size)
+{
+	const hResponderOptions *opts = r->opts;
+	uint8_t resp = action == HA_nothing ? HR_accept : HR_success;
+
+	pthread_mutex_lock(&r->lock);
+	unsigned long n = ++r->count;
+	if(opts->untrusted)
+		resp = HR_untrusted;
+	else if(opts->busy && n % opts->busy == 0)
+		resp = HR_busy;
+	else if(opts->error && n % opts->error == 0)
+		resp = HR_error;
+
+	if(r->stats)
+	{
+		hResponderStats *st = r->stats;
+		if(action <= HA_sleep) ++st->reqs[action];
+		st->bytes += sizeof(iTransactionHeader) + size;
+		if(resp == HR_busy) ++st->busy;
+		if(resp == HR_error) ++st->errors;
+		if(resp == HR_success && action == HA_add_queue)
+			st->ids += size / sizeof(uint64_t);
+	}
+	pthread_mutex_unlock(&r->lock);
+
+	return resp;
+}
+
+static void *serveconn(void *arg)
+{
+	struct conn *conn = arg;
+	responder *r = conn->r;
+	const hResponderOptions *opts = r->opts;
+	int sock = conn->sock;
+	unsigned seed = (unsigned) sock ^ (unsigned) time(NULL);
+	char *body = malloc(BODY_CHUNK);
+	int one = 1;
+	free(conn);
+
+	/* responses are tiny, don't let Nagle hold them back behind delayed ACKs */
+	setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+	while(body && waitreadable(r, sock))
+	{
+		iTransactionHeader header;
+		if(recvall(sock, &header, sizeof(header)) != HE_success
+			|| memcmp(header.magic, MAGIC, MAGIC_LEN) != 0)
+			break;
+		uint32_t size = ntohl(header.size), left = size;
+		int ret = HE_success;
+		while(left && ret == HE_success)
+		{
+			uint32_t part = left > BODY_CHUNK ? BODY_CHUNK : left;
+			ret = recvall(sock, body, part);
+			left -= part;
+		}
+		if(ret != HE_success)
+			break;
+
+		uint8_t resp = respond(r, header.action, size);
+		unsigned long delay = opts->latency;
+		if(opts->jitter)
+			delay += rand_r(&seed) % (opts->jitter + 1);
+		if(delay)
+			sleepms(delay);
+
+		struct {
+			iTransactionResponse res;
+			char message[sizeof(SIMULATED_ERROR) - 1];
+		} __attribute__((__packed__)) out;
+		uint32_t msglen = resp == HR_error ? sizeof(out.message) : 0;
+		memcpy(out.res.magic, MAGIC, MAGIC_LEN);
+		out.res.resp = resp;
+		out.res.size = htonl(msglen);
+		memcpy(out.message, SIMULATED_ERROR, sizeof(out.message));
+		if(sendall(sock, &out, sizeof(out.res) + msglen) != HE_success)
+			break;
+		if(opts->oneshot)
+			break;
+	}
+
+	free(body);
+	close(sock);
+	pthread_mutex_lock(&r->lock);
+	--r->active;
+	pthread_cond_broadcast(&r->cond);
+	pthread_mutex_unlock(&r->lock);
+	return NULL;
+}
+
+static int listenon(const char *addr)
+{
+	struct addrinfo hints, *res;
+	memset(&hints, 0x0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+
+	int ret = getaddrinfo(addr, PORT, &hints, &res);
+	if(ret != 0) return ret == EAI_SYSTEM ? -errno : -EADDRNOTAVAIL;
+
+	int sock = socket(res->ai_family, res->ai_socktype | SOCK_CLOEXEC, res->ai_protocol), one = 1;
+	if(sock < 0) { ret = -errno; freeaddrinfo(res); return ret; }
+	setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	if(bind(sock, res->ai_addr, res->ai_addrlen) < 0 || listen(sock, 64) < 0)
+	{
+		ret = -errno;
+		close(sock);
+		freeaddrinfo(res);
+		return ret;
+	}
+
+	freeaddrinfo(res);
+	return sock;
+}
+
+int hl_respond(const hResponderOptions *opts, hResponderStats *stats, volatile sig_atomic_t *stop)
+{
+	responder r = { .opts = opts, .stats = stats, .stop = stop };
+	int lsock = listenon(opts->addr);
+	if(lsock < 0) return lsock;
+
+	pthread_mutex_init(&r.lock, NULL);
+	pthread_cond_init(&r.cond, NULL);
+
+	struct pollfd pfd = { lsock, POLLIN, 0 };
+	while(!*stop)
+	{
+		int n = poll(&pfd, 1, STOP_POLL);
+		if(n <= 0) continue;
+
+		int sock = accept4(lsock, NULL, NULL, SOCK_CLOEXEC);
+		if(sock < 0) continue;
+		struct conn *conn = malloc(sizeof(struct conn));
+		pthread_t thread;
+		if(conn == NULL) { close(sock); continue; }
+		conn->r = &r;
+		conn->sock = sock;
+
+		pthread_mutex_lock(&r.lock);
+		++r.active;
+		if(stats) ++stats->conns;
+		pthread_mutex_unlock(&r.lock);
+		if(pthread_create(&thread, NULL, serveconn, conn) != 0)
+		{
+			close(sock);
+			free(conn);
+			pthread_mutex_lock(&r.lock);
+			--r.active;
+			pthread_mutex_unlock(&r.lock);
+			continue;
+		}
+		pthread_detach(thread);
+	}
+
+	close(lsock);
+	/* connections notice `stop' once they're idle */
+	pthread_mutex_lock(&r.lock);
+	while(r.active != 0)
+		pthread_cond_wait(&r.cond, &r.lock);
+	pthread_mutex_unlock(&r.lock);
+
+	pthread_cond_destroy(&r.cond);
+	pthread_mutex_destroy(&r.lock);
+	return HE_success;
+}
+
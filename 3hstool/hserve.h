@@ -0,0 +1,46 @@
+#ifndef inc_hserve_h
+#define inc_hserve_h
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "./hlink.h"
+
+#include <signal.h>
+
+/* a stand-in for the hLink server on the 3ds, to test and measure hlink.c
+ * and hfleet.c without a 3ds */
+
+typedef struct hResponderOptions
+{
+	const char *addr; /* address to listen on, NULL for all addresses */
+	unsigned long latency; /* milliseconds before every response */
+	unsigned long jitter; /* up to this many milliseconds added to `latency' at random */
+	unsigned busy; /* respond busy to every busy'th request, 0 for never */
+	unsigned error; /* respond with an error to every error'th request, 0 for never */
+	int untrusted; /* respond untrusted to every request */
+	int oneshot; /* close the connection after every response */
+} hResponderOptions;
+
+typedef struct hResponderStats
+{
+	unsigned long conns;
+	unsigned long reqs[HA_sleep + 1]; /* requests per enum HAction */
+	unsigned long busy; /* busy responses */
+	unsigned long errors; /* error responses */
+	uint64_t ids; /* IDs added to the queue */
+	uint64_t bytes; /* request bytes received */
+} hResponderStats;
+
+/* responds to hLink requests until `*stop' is set, then waits for the
+ * connections to close; `stats' is updated while running and may be NULL;
+ * returns HE_success or -errno */
+int hl_respond(const hResponderOptions *opts, hResponderStats *stats, volatile sig_atomic_t *stop);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
@@ -0,0 +1,573 @@
+#include "./hsession.h"
+#include "./hproto.h"
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+
+struct req
+{
+	struct req *next;
+	long handle;
+	iTransactionHeader header;
+	void *body;
+	uint32_t size;
+	hCallback cb;
+	void *udata;
+	hMetric metric;
+	unsigned long long start; /* when it was queued */
+	unsigned long long phase; /* when sending began or ended */
+};
+
+struct hSession
+{
+	hLink link; /* the address and timeouts */
+	int ep; /* hl_session_fd(), only ever contains `sock' */
+	int sock;
+	int connecting;
+	int connerr; /* a connect that failed right away, reported by hl_session_process() */
+	int noreuse; /* the host closes the connection after every response */
+	int authed;
+	int authing; /* the authentication request is queued */
+	size_t answered; /* responses on this connection */
+	size_t sentonconn; /* requests sent on this connection */
+	long nexthandle;
+	unsigned long long lastprogress;
+	unsigned long long connstart;
+	unsigned long connectus; /* not reported yet */
+
+	/* requests in order; the first `nsent' are sent and wait for a response,
+	 * `sendnext' is the first one that isn't sent entirely */
+	struct req *head, *tail;
+	struct req *sendnext;
+	size_t sendoff;
+	size_t nsent;
+
+	iTransactionResponse resp;
+	size_t respoff;
+	uint32_t bodyoff;
+	char msg[ERROR_MAXLEN + 1];
+};
+
+static int isinstall(const struct req *r)
+{
+	return r->header.action == HA_install_data || r->header.action == HA_install_url;
+}
+
+/* whether the next request may go out now */
+static int cansend(const hSession *s)
+{
+	if(s->sock < 0 || s->connecting || s->sendnext == NULL)
+		return 0;
+	/* nothing goes out before authenticating, which is always queued first */
+	if(!s->authed && s->sendnext != s->head)
+		return 0;
+	return !s->noreuse || s->sentonconn == 0;
+}
+
+static void setevents(hSession *s)
+{
+	if(s->sock < 0) return;
+	struct epoll_event ev;
+	memset(&ev, 0x0, sizeof(ev));
+	/* reading also notices the host closing an idle connection */
+	ev.events = s->connecting ? EPOLLOUT : EPOLLIN | (cansend(s) ? EPOLLOUT : 0);
+	epoll_ctl(s->ep, EPOLL_CTL_MOD, s->sock, &ev);
+}
+
+/* closes the connection, requests that were sent will be sent again */
+static void dropconn(hSession *s)
+{
+	if(s->sock >= 0)
+	{
+		epoll_ctl(s->ep, EPOLL_CTL_DEL, s->sock, NULL);
+		close(s->sock);
+	}
+	s->sock = -1;
+	s->connecting = 0;
+	s->answered = 0;
+	s->sentonconn = 0;
+	s->sendnext = s->head;
+	s->sendoff = 0;
+	s->nsent = 0;
+	s->respoff = 0;
+	s->bodyoff = 0;
+}
+
+static int connectsock(hSession *s)
+{
+	struct addrinfo *host = s->link.host;
+	int sock = socket(host->ai_family, host->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, host->ai_protocol);
+	if(sock < 0) return -errno;
+
+	s->connecting = 0;
+	s->connstart = nowus();
+	if(connect(sock, host->ai_addr, host->ai_addrlen) < 0)
+	{
+		if(errno != EINPROGRESS)
+		{ int err = -errno; close(sock); return err; }
+		s->connecting = 1;
+	}
+	else s->connectus = nowus() - s->connstart;
+
+	struct epoll_event ev;
+	memset(&ev, 0x0, sizeof(ev));
+	ev.events = EPOLLOUT;
+	if(epoll_ctl(s->ep, EPOLL_CTL_ADD, sock, &ev) < 0)
+	{ int err = -errno; close(sock); return err; }
+
+	s->sock = sock;
+	s->lastprogress = nowms();
+	return HE_success;
+}
+
+/* connects if there are requests and updates what to wait for */
+static void arm(hSession *s)
+{
+	int ret;
+	if(s->sock < 0 && s->head != NULL && s->connerr == HE_success
+		&& (ret = connectsock(s)) != HE_success)
+		s->connerr = ret;
+	setevents(s);
+}
+
+/* hands the record of a finished request to the metrics callback */
+static void measured(hSession *s, struct req *r, int result)
+{
+	r->metric.result = result;
+	r->metric.total_us = nowus() - r->start;
+	report(&s->link, &r->metric);
+}
+
+/* removes a request that isn't in flight and runs its callback */
+static void complete(hSession *s, struct req *r, int result, const char *msg)
+{
+	struct req **link = &s->head, *prev = NULL;
+	while(*link != r)
+	{
+		prev = *link;
+		link = &(*link)->next;
+	}
+	*link = r->next;
+	if(s->tail == r) s->tail = prev;
+	if(s->sendnext == r)
+	{
+		s->sendnext = r->next;
+		s->sendoff = 0;
+	}
+
+	measured(s, r, result);
+	if(r->cb != NULL)
+		r->cb(s, r->handle, result, msg, r->udata);
+	free(r->body);
+	free(r);
+}
+
+/* fails every pending request, the callbacks may queue new ones */
+static void failall(hSession *s, int err)
+{
+	if(s->nsent || s->sendoff)
+		dropconn(s);
+	struct req *r = s->head;
+	s->head = s->tail = s->sendnext = NULL;
+	s->sendoff = 0;
+
+	while(r != NULL)
+	{
+		struct req *next = r->next;
+		measured(s, r, err);
+		if(r->cb != NULL)
+			r->cb(s, r->handle, err, NULL, r->udata);
+		free(r->body);
+		free(r);
+		r = next;
+	}
+}
+
+/* fails the requests in flight, the rest is sent again on a new connection */
+static void failinflight(hSession *s, int err)
+{
+	size_t amount = s->nsent + (s->sendoff != 0);
+	dropconn(s);
+	for(size_t i = 0; i < amount && s->head != NULL; ++i)
+		complete(s, s->head, err, NULL);
+}
+
+static void authdone(hSession *s, long handle, int result, const char *error, void *udata)
+{
+	(void) handle; (void) error; (void) udata;
+	s->authing = 0;
+	if(result == HE_success)
+		s->authed = 1;
+	else failall(s, result);
+}
+
+/* the connection failed or the host closed it */
+static void connlost(hSession *s, int err)
+{
+	int closed = err == -ECONNRESET || err == -EPIPE;
+	if(closed && s->answered != 0)
+	{
+		/* the host only handles one transaction per connection,
+		 * it never got to what was sent after the first one */
+		struct req *r = s->head;
+		for(size_t i = 0; i < s->nsent + (s->sendoff != 0) && r != NULL; ++i, r = r->next)
+			++r->metric.retries;
+		s->noreuse = 1;
+		dropconn(s);
+	}
+	else if(s->nsent || s->sendoff)
+		failinflight(s, err);
+	else dropconn(s);
+}
+
+static int dosend(hSession *s, int *progress)
+{
+	while(cansend(s))
+	{
+		struct req *r = s->sendnext;
+		struct iovec iov[2] = {
+			{ &r->header, sizeof(iTransactionHeader) },
+			{ r->body, r->size },
+		};
+		size_t skip = s->sendoff;
+		int first = 0;
+		if(skip >= sizeof(iTransactionHeader))
+		{
+			skip -= sizeof(iTransactionHeader);
+			first = 1;
+		}
+		iov[first].iov_base = (char *) iov[first].iov_base + skip;
+		iov[first].iov_len -= skip;
+		if(s->sendoff == 0)
+		{
+			r->metric.reused = s->sentonconn != 0;
+			r->metric.connect_us += s->connectus;
+			s->connectus = 0;
+			r->phase = nowus();
+		}
+
+		struct msghdr msg;
+		memset(&msg, 0x0, sizeof(msg));
+		msg.msg_iov = &iov[first];
+		msg.msg_iovlen = 2 - first;
+		ssize_t n = sendmsg(s->sock, &msg, MSG_NOSIGNAL);
+		if(n < 0)
+		{
+			if(errno == EINTR) continue;
+			if(errno == EAGAIN || errno == EWOULDBLOCK) return HE_success;
+			return -errno;
+		}
+
+		*progress = 1;
+		s->sendoff += n;
+		r->metric.sent += n;
+		if(s->sendoff == sizeof(iTransactionHeader) + r->size)
+		{
+			unsigned long long t = nowus();
+			r->metric.send_us += t - r->phase;
+			r->phase = t;
+			s->sendnext = r->next;
+			s->sendoff = 0;
+			++s->nsent;
+			++s->sentonconn;
+		}
+	}
+	return HE_success;
+}
+
+static int dorecv(hSession *s, int *progress)
+{
+	char skip[256];
+	while(s->sock >= 0)
+	{
+		ssize_t n;
+		if(s->respoff < sizeof(iTransactionResponse))
+			n = recv(s->sock, (char *) &s->resp + s->respoff, sizeof(iTransactionResponse) - s->respoff, 0);
+		else
+		{
+			uint32_t left = s->resp.size - s->bodyoff;
+			if(s->resp.resp == HR_error && s->resp.size <= ERROR_MAXLEN)
+				n = recv(s->sock, s->msg + s->bodyoff, left, 0);
+			else n = recv(s->sock, skip, left > sizeof(skip) ? sizeof(skip) : left, 0);
+		}
+		if(n < 0)
+		{
+			if(errno == EINTR) continue;
+			if(errno == EAGAIN || errno == EWOULDBLOCK) return HE_success;
+			return -errno;
+		}
+		/* the host closed the connection */
+		if(n == 0) return -ECONNRESET;
+
+		*progress = 1;
+		if(s->respoff < sizeof(iTransactionResponse))
+		{
+			if((s->respoff += n) < sizeof(iTransactionResponse))
+				continue;
+			/* a response nobody asked for */
+			if(s->nsent == 0 || memcmp(s->resp.magic, MAGIC, MAGIC_LEN) != 0)
+				return -EPROTO;
+			s->resp.size = ntohl(s->resp.size);
+			s->bodyoff = 0;
+		}
+		else s->bodyoff += n;
+		if(s->bodyoff != s->resp.size)
+			continue;
+
+		int result = resperror(s->resp.resp);
+		const char *msg = NULL;
+		if(result == HE_exterror)
+		{
+			if(s->resp.size > ERROR_MAXLEN)
+				msg = LONG_ERROR;
+			else
+			{
+				s->msg[s->resp.size] = '\0';
+				msg = s->msg;
+			}
+		}
+		s->respoff = 0;
+		--s->nsent;
+		++s->answered;
+		s->head->metric.wait_us = nowus() - s->head->phase;
+		s->head->metric.received += sizeof(iTransactionResponse) + s->resp.size;
+		complete(s, s->head, result, msg);
+
+		if(s->noreuse && s->nsent == 0 && s->sock >= 0)
+			dropconn(s);
+	}
+	return HE_success;
+}
+
+/* how long the session may go without progress right now, 0 if there's nothing to wait for */
+static unsigned long waitlimit(const hSession *s)
+{
+	if(s->sock < 0) return 0;
+	if(s->connecting || s->sendoff) return s->link.timeout;
+	if(s->nsent == 0) return cansend(s) ? s->link.timeout : 0;
+	/* the 3ds responds to an install once it's done */
+	return isinstall(s->head) ? s->link.installtimeout : s->link.timeout;
+}
+
+hSession *hl_session_open(const char *addr, int *err)
+{
+	hSession *s = calloc(1, sizeof(hSession));
+	if(s == NULL) { *err = -ENOMEM; return NULL; }
+
+	if((*err = hl_makelink(&s->link, addr)) != HE_success)
+	{ free(s); return NULL; }
+	if((s->ep = epoll_create1(EPOLL_CLOEXEC)) < 0)
+	{
+		*err = -errno;
+		hl_destroylink(&s->link);
+		free(s);
+		return NULL;
+	}
+	s->sock = -1;
+	return s;
+}
+
+void hl_session_close(hSession *s)
+{
+	dropconn(s);
+	failall(s, -ECANCELED);
+	/* in case a callback queued something */
+	failall(s, -ECANCELED);
+	close(s->ep);
+	hl_destroylink(&s->link);
+	free(s);
+}
+
+int hl_session_fd(const hSession *s)
+{
+	return s->ep;
+}
+
+int hl_session_timeout(const hSession *s)
+{
+	if(s->connerr != HE_success) return 0;
+	unsigned long limit = waitlimit(s);
+	if(limit == 0) return -1;
+	unsigned long long t = nowms(), deadline = s->lastprogress + limit;
+	if(deadline <= t) return 0;
+	return deadline - t > INT_MAX ? INT_MAX : (int) (deadline - t);
+}
+
+int hl_session_process(hSession *s)
+{
+	int ret;
+
+	if(s->connerr != HE_success)
+	{
+		ret = s->connerr;
+		s->connerr = HE_success;
+		failall(s, ret);
+	}
+
+	if(s->sock >= 0 && s->connecting)
+	{
+		struct pollfd pfd = { s->sock, POLLOUT, 0 };
+		if(poll(&pfd, 1, 0) > 0)
+		{
+			int err;
+			socklen_t len = sizeof(err);
+			if(getsockopt(s->sock, SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+				err = errno;
+			if(err != 0)
+			{
+				/* the device can't be reached, which goes for all requests */
+				dropconn(s);
+				failall(s, -err);
+			}
+			else
+			{
+				s->connecting = 0;
+				s->lastprogress = nowms();
+				s->connectus = nowus() - s->connstart;
+			}
+		}
+	}
+
+	while(s->sock >= 0 && !s->connecting)
+	{
+		int progress = 0;
+		if((ret = dosend(s, &progress)) == HE_success)
+			ret = dorecv(s, &progress);
+		if(ret != HE_success)
+		{
+			connlost(s, ret);
+			break;
+		}
+		if(!progress) break;
+		s->lastprogress = nowms();
+	}
+
+	unsigned long limit = waitlimit(s);
+	if(limit != 0 && nowms() >= s->lastprogress + limit)
+	{
+		if(s->connecting)
+		{
+			dropconn(s);
+			failall(s, -ETIMEDOUT);
+		}
+		else failinflight(s, -ETIMEDOUT);
+	}
+
+	arm(s);
+
+	ret = 0;
+	for(struct req *r = s->head; r != NULL; r = r->next)
+		++ret;
+	return ret;
+}
+
+int hl_session_poll(hSession *s, int timeout)
+{
+	int limit = hl_session_timeout(s);
+	if(limit >= 0 && (timeout < 0 || limit < timeout))
+		timeout = limit;
+
+	struct pollfd pfd = { s->ep, POLLIN, 0 };
+	if(poll(&pfd, 1, timeout) < 0 && errno != EINTR)
+		return -errno;
+	return hl_session_process(s);
+}
+
+void hl_session_settimeout(hSession *s, unsigned long timeout, unsigned long installtimeout)
+{
+	hl_settimeout(&s->link, timeout, installtimeout);
+}
+
+void hl_session_setmetrics(hSession *s, hMetricsCallback cb, void *udata)
+{
+	hl_setmetrics(&s->link, cb, udata);
+}
+
+static long enqueue(hSession *s, uint8_t action, const void *body, uint32_t size, hCallback cb, void *udata)
+{
+	struct req *r = malloc(sizeof(struct req));
+	if(r == NULL) return -ENOMEM;
+	r->body = NULL;
+	if(size && (r->body = malloc(size)) == NULL)
+	{ free(r); return -ENOMEM; }
+	if(size) memcpy(r->body, body, size);
+
+	r->next = NULL;
+	r->handle = ++s->nexthandle;
+	r->header = makeheader(action, size);
+	r->size = size;
+	r->cb = cb;
+	r->udata = udata;
+	memset(&r->metric, 0x0, sizeof(r->metric));
+	r->metric.action = action;
+	r->metric.requests = 1;
+	r->start = nowus();
+
+	if(s->tail) s->tail->next = r;
+	else s->head = r;
+	s->tail = r;
+	if(s->sendnext == NULL)
+	{
+		s->sendnext = r;
+		s->sendoff = 0;
+	}
+	return r->handle;
+}
+
+long hl_session_submit(hSession *s, uint8_t action, const void *body, uint32_t size, hCallback cb, void *udata)
+{
+	long ret;
+	if(!s->authed && !s->authing)
+	{
+		/* the queue is empty here, a failed authentication fails everything */
+		if((ret = enqueue(s, HA_nothing, NULL, 0, authdone, NULL)) < 0)
+			return ret;
+		s->authing = 1;
+	}
+	if((ret = enqueue(s, action, body, size, cb, udata)) < 0)
+		return ret;
+	arm(s);
+	return ret;
+}
+
+int hl_session_cancel(hSession *s, long handle)
+{
+	size_t i = 0;
+	for(struct req *r = s->head; r != NULL; r = r->next, ++i)
+	{
+		if(r->handle != handle)
+			continue;
+		if(i < s->nsent || (r == s->sendnext && s->sendoff != 0))
+			return -EBUSY;
+		complete(s, r, -ECANCELED, NULL);
+		setevents(s);
+		return HE_success;
+	}
+	return -ENOENT;
+}
+
+long hl_session_launch(hSession *s, uint64_t tid, hCallback cb, void *udata)
+{
+	uint64_t ntid = htonll(tid);
+	return hl_session_submit(s, HA_launch, &ntid, sizeof(ntid), cb, udata);
+}
+
+long hl_session_addqueue(hSession *s, const uint64_t *ids, size_t amount, hCallback cb, void *udata)
+{
+	uint64_t body[HL_QUEUE_BATCH];
+	if(amount > HL_QUEUE_BATCH) return -E2BIG;
+	for(size_t i = 0; i < amount; ++i)
+		body[i] = htonll(ids[i]);
+	return hl_session_submit(s, HA_add_queue, body, amount * sizeof(uint64_t), cb, udata);
+}
+
@@ -0,0 +1,64 @@
+#ifndef inc_hsession_h
+#define inc_hsession_h
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "./hlink.h"
+
+/* A non-blocking connection to one device for event loops. Requests are
+ * queued and sent back-to-back, and callbacks run from hl_session_process()
+ * when they complete. The session authenticates by itself before the first
+ * request, and it reconnects for every request if the host closes the
+ * connection after each response.
+ *
+ * Add hl_session_fd() to a poll/epoll/libuv loop for reading, call
+ * hl_session_process() when it's readable or hl_session_timeout() passed. */
+
+typedef struct hSession hSession;
+
+/* called when request `handle' completed; `error' is the message from the
+ * 3ds if `result' is HE_exterror and NULL otherwise; the callback may
+ * submit and cancel requests but not close the session */
+typedef void (*hCallback)(hSession *s, long handle, int result, const char *error, void *udata);
+
+/* creates a session for `addr' without connecting yet; returns NULL and sets
+ * `err' to an error for hl_makelink_geterror() on failure */
+hSession *hl_session_open(const char *addr, int *err);
+/* calls the callbacks of all pending requests with -ECANCELED and frees the session */
+void hl_session_close(hSession *s);
+/* the descriptor that is readable when the session has I/O to do,
+ * it stays the same for the lifetime of the session */
+int hl_session_fd(const hSession *s);
+/* milliseconds until hl_session_process() has to be called even if the
+ * descriptor isn't readable, -1 if there's no deadline */
+int hl_session_timeout(const hSession *s);
+/* does all I/O possible without blocking and runs the callbacks of completed
+ * requests; returns the amount of pending requests or -errno */
+int hl_session_process(hSession *s);
+/* waits up to `timeout' milliseconds (-1 for no limit) for the session to
+ * have something to do and processes it, returns like hl_session_process() */
+int hl_session_poll(hSession *s, int timeout);
+/* see hl_settimeout() */
+void hl_session_settimeout(hSession *s, unsigned long timeout, unsigned long installtimeout);
+/* reports every finished request to `cb' like hl_setmetrics(), `link' is that of the session */
+void hl_session_setmetrics(hSession *s, hMetricsCallback cb, void *udata);
+
+/* queues a request, `body' is in network byte order and copied;
+ * returns a handle above 0 or -errno */
+long hl_session_submit(hSession *s, uint8_t action, const void *body, uint32_t size, hCallback cb, void *udata);
+/* removes a request that isn't sent yet and calls its callback with -ECANCELED;
+ * returns -EBUSY if it's already sent and -ENOENT if it isn't pending */
+int hl_session_cancel(hSession *s, long handle);
+/* queues a launch of `tid' */
+long hl_session_launch(hSession *s, uint64_t tid, hCallback cb, void *udata);
+/* queues adding up to HL_QUEUE_BATCH IDs to the queue in one request */
+long hl_session_addqueue(hSession *s, const uint64_t *ids, size_t amount, hCallback cb, void *udata);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
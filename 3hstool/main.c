@@ -1,13 +1,22 @@
 
+#include "./hdiscover.h"
+#include "./hfleet.h"
+#include "./hhttp.h"
 #include "./hlink.h"
+#include "./hproto.h"
+#include "./hscript.h"
+#include "./hserve.h"
 
 #include <stdint.h>
+#include <stddef.h>
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <stdint.h>
+#include <signal.h>
 #include <stdio.h>
 #include <errno.h>
+#include <time.h>
 
 typedef uint64_t u64;
 typedef uint32_t u32;
@@ -42,27 +51,86 @@ static u64 gettid(const char *s)
 		? 0 : ret;
 }
 
-static int hlink(int argc, char *argv[])
+/* reads addresses from a file with one address per line */
+static int readaddrs(const char *path, char ***addrs, size_t *amount, size_t *alloc)
 {
-	if(argc < 2)
+	FILE *f = fopen(path, "r");
+	if(f == NULL)
 	{
-		fprintf(stderr, "Usage: hlink [address] [cmd [arg...]...]\n\n"
-			"Options:\n"
-			"  -s, --sleep           sleep the 3ds for 5 seconds\n"
-			"  -a, --add-queue IDs   add IDs to the 3ds queue\n"
-			"  -l, --launch TID      launch TID on the 3ds\n"
-			"  -w, --wait MS         wait MS milliseconds\n");
-		return 1;
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return 0;
+	}
+
+	char line[256];
+	while(fgets(line, sizeof(line), f))
+	{
+		char *addr = line + strspn(line, " \t");
+		addr[strcspn(addr, " \t\r\n#")] = '\0';
+		if(addr[0] == '\0')
+			continue;
+		if(*amount == *alloc)
+		{
+			char **n = realloc(*addrs, (*alloc *= 2) * sizeof(char *));
+			if(n == NULL) { fclose(f); return 0; }
+			*addrs = n;
+		}
+		if(((*addrs)[*amount] = strdup(addr)) == NULL)
+		{ fclose(f); return 0; }
+		++*amount;
 	}
 
+	fclose(f);
+	return 1;
+}
+
+/* takes the numeric argument of option `argv[*i]' */
+static int takeulong(int argc, char *argv[], int *i, unsigned long *ul)
+{
+	if(++*i == argc || !getulong(argv[*i], ul, 10))
+	{
+		fprintf(stderr, "%s: expected a number\n", argv[*i - 1]);
+		return 0;
+	}
+	return 1;
+}
+
+static const char *stepname(const hStep *step)
+{
+	switch(step->type)
+	{
+	case HS_sleep: return "sleep";
+	case HS_addqueue: return "add-queue";
+	case HS_launch: return "launch";
+	case HS_wait: return "wait";
+	case HS_install_data: return "install";
+	case HS_install_url: return "install-url";
+	}
+	return "unknown";
+}
+
+static void printprogress(uint64_t done, uint64_t total, void *udata)
+{
+	fprintf(stderr, "\r%s: %llu/%llu KiB (%d%%)", (const char *) udata, (unsigned long long) done / 1024,
+		(unsigned long long) total / 1024, total ? (int) (done * 100 / total) : 100);
+	if(done == total)
+		fputc('\n', stderr);
+}
+
+static int runlink(const char *addr, hStep *steps, size_t nsteps, int keepalive, const hFleetOptions *opts)
+{
 	hLink link;
 	int res;
 
-	if((res = hl_makelink(&link, argv[1])) != 0)
+	if((res = hl_makelink(&link, addr)) != 0)
 	{
 		fprintf(stderr, "hl_makelink(): %s\n", hl_makelink_geterror(res));
 		return 1;
 	}
+	hl_settimeout(&link, opts->timeout, opts->installtimeout);
+	hl_setretries(&link, opts->retries, opts->backoff);
+	hl_setmetrics(&link, opts->metrics, opts->metricsdata);
+	if(keepalive)
+		hl_session(&link, 1);
 	if((res = hl_auth(&link)) != 0)
 	{
 		fprintf(stderr, "hl_auth(): %s\n", hl_geterror(res));
@@ -70,19 +138,490 @@ static int hlink(int argc, char *argv[])
 		return 1;
 	}
 
-	const char *arg = NULL;
-#define TAKEARG() ((++i == argc) ? NULL : (argv[i][0] == '-' ? --i, NULL : argv[i]))
+	for(size_t i = 0; i < nsteps; ++i)
+	{
+		/* only needed between connections */
+		if(link.session != 1)
+			hl_waittimeout();
+		switch(steps[i].type)
+		{
+		case HS_sleep:
+			if((res = hl_sleep(&link)) != 0)
+				fprintf(stderr, "hl_sleep(): %s\n", hl_geterror(res));
+			break;
+		case HS_addqueue:
+			if((res = hl_addqueue(&link, steps[i].ids, steps[i].amount)) != 0)
+				fprintf(stderr, "hl_addqueue(): %s\n", hl_geterror(res));
+			break;
+		case HS_launch:
+			if((res = hl_launch(&link, steps[i].tid)) != 0)
+				fprintf(stderr, "hl_launch(): %s\n", hl_geterror(res));
+			break;
+		case HS_wait:
+			usleep(steps[i].ms * 1000);
+			break;
+		case HS_install_data:
+			if((res = hl_install_data(&link, steps[i].path, printprogress, (void *) steps[i].path)) != 0)
+				fprintf(stderr, "hl_install_data(): %s\n", hl_geterror(res));
+			break;
+		case HS_install_url:
+			if((res = hl_install_url(&link, steps[i].url)) != 0)
+				fprintf(stderr, "hl_install_url(): %s\n", hl_geterror(res));
+			break;
+		}
+	}
+
+	hl_destroylink(&link);
+	return 0;
+}
+
+static int runfleet(char **addrs, size_t amount, hStep *steps, size_t nsteps, const hFleetOptions *opts)
+{
+	hDevice *devs = calloc(amount, sizeof(hDevice));
+	if(devs == NULL)
+	{
+		fprintf(stderr, "hlink: out of memory\n");
+		return 1;
+	}
+	for(size_t i = 0; i < amount; ++i)
+		devs[i].addr = addrs[i];
+
+	int failed = hl_fleet_run(devs, amount, steps, nsteps, opts);
+	if(failed < 0)
+	{
+		fprintf(stderr, "hl_fleet_run(): %s\n", hl_geterror(failed));
+		free(devs);
+		return 1;
+	}
+
+	for(size_t i = 0; i < amount; ++i)
+	{
+		hDevice *dev = &devs[i];
+		if(dev->result == HE_success)
+			printf("%s: ok, %lu ms, %u retries\n", dev->addr, dev->ms, dev->retries);
+		else printf("%s: %s failed: %s%s, %lu ms, %u retries\n", dev->addr,
+			dev->failstep == -1 ? "auth" : stepname(&steps[dev->failstep]),
+			dev->result == HE_exterror ? "3ds: " : "",
+			dev->result == HE_exterror ? dev->error : hl_geterror(dev->result),
+			dev->ms, dev->retries);
+	}
+	printf("%zu/%zu devices succeeded\n", amount - failed, amount);
+
+	free(devs);
+	return failed != 0;
+}
+
+static int runscript(char **addrs, size_t amount, const char *path, const hFleetOptions *opts)
+{
+	char err[256];
+	hScript script;
+	int res;
+
+	if((res = hl_script_load(&script, path, err, sizeof(err))) != HE_success)
+	{
+		fprintf(stderr, "%s\n", err);
+		return 1;
+	}
+	hDevice *devs = calloc(amount, sizeof(hDevice));
+	if(devs == NULL)
+	{
+		fprintf(stderr, "hlink: out of memory\n");
+		hl_script_free(&script);
+		return 1;
+	}
+	for(size_t i = 0; i < amount; ++i)
+		devs[i].addr = addrs[i];
+
+	int failed = hl_script_run(&script, devs, amount, opts);
+	if(failed < 0)
+	{
+		fprintf(stderr, "hl_script_run(): %s\n", hl_geterror(failed));
+		free(devs);
+		hl_script_free(&script);
+		return 1;
+	}
+
+	for(size_t i = 0; i < amount; ++i)
+	{
+		hDevice *dev = &devs[i];
+		if(dev->result == HE_success)
+			printf("%s: ok, %lu ms, %u retries\n", dev->addr, dev->ms, dev->retries);
+		else if(dev->failstep == -1)
+			printf("%s: failed: %s\n", dev->addr, hl_geterror(dev->result));
+		else printf("%s: group at %s:%u failed: %s%s, %lu ms, %u retries\n", dev->addr, path,
+			script.groups[dev->failstep].line, dev->result == HE_exterror ? "3ds: " : "",
+			dev->result == HE_exterror ? dev->error : hl_geterror(dev->result), dev->ms, dev->retries);
+	}
+	printf("%zu/%zu devices succeeded\n", amount - failed, amount);
+
+	free(devs);
+	hl_script_free(&script);
+	return failed != 0;
+}
+
+/* how long files are served after the last download ended */
+#define SERVE_IDLE 10000
+
+/* serves the files of --serve steps */
+static int startservers(hServer **servers, size_t *amount, const char *addr, hStep *steps, size_t nsteps)
+{
+	hLink link;
+	int res;
+
+	for(size_t i = 0; i < nsteps; ++i)
+	{
+		if(steps[i].type != HS_install_url || steps[i].url != NULL)
+			continue;
+		if(*servers == NULL && (*servers = malloc(nsteps * sizeof(hServer))) == NULL)
+		{
+			fprintf(stderr, "serve: out of memory\n");
+			goto err;
+		}
+		/* the address the 3ds can reach is the same for all devices in practice */
+		if((res = hl_makelink(&link, addr)) != 0)
+		{
+			fprintf(stderr, "hl_makelink(): %s\n", hl_makelink_geterror(res));
+			goto err;
+		}
+		res = hl_serve_file(&(*servers)[*amount], steps[i].path, &link);
+		hl_destroylink(&link);
+		if(res != 0)
+		{
+			fprintf(stderr, "hl_serve_file(): %s: %s\n", steps[i].path, hl_geterror(res));
+			goto err;
+		}
+		steps[i].url = (*servers)[(*amount)++].url;
+		fprintf(stderr, "serving %s at %s\n", steps[i].path, steps[i].url);
+	}
+	return 1;
+
+err:
+	for(size_t i = 0; i < *amount; ++i)
+		hl_server_stop(&(*servers)[i]);
+	*amount = 0;
+	return 0;
+}
+
+static const char *actions[] = { "add-queue", "install-id", "install-url", "install-data", "nothing", "launch", "sleep" };
+
+static const char *actionname(uint8_t action)
+{
+	return action < sizeof(actions) / sizeof(actions[0]) ? actions[action] : "unknown";
+}
+
+static const char *resultname(int result)
+{
+	switch(result)
+	{
+	case HE_success: return "success";
+	case HE_notauthed: return "untrusted";
+	case HE_tryagain: return "busy";
+	case HE_tidnotfound: return "notfound";
+	case HE_exterror: return "error";
+	}
+	return result < 0 ? strerror(-result) : "unknown";
+}
+
+/* the measurements of one action on one device, for --metrics prometheus */
+struct series
+{
+	char device[NI_MAXHOST];
+	uint8_t action;
+	u64 requests, errors, retries, reused;
+	u64 sent, received;
+	u64 us[5]; /* resolve, connect, send, wait, total */
+	u64 measured[5]; /* records with a time for each phase, a fleet step is one record */
+};
+
+struct metrics
+{
+	FILE *out;
+	int prometheus;
+	struct series *series;
+	size_t amount;
+	size_t alloc;
+};
+
+static const char *phases[] = { "resolve", "connect", "send", "wait", "total" };
+
+static void addmetric(const hLink *link, const hMetric *m, void *udata)
+{
+	struct metrics *mt = udata;
+	char device[NI_MAXHOST];
+	if(getnameinfo(link->host->ai_addr, link->host->ai_addrlen, device, sizeof(device), NULL, 0, NI_NUMERICHOST) != 0)
+		strcpy(device, "unknown");
+	unsigned long us[5] = { m->resolve_us, m->connect_us, m->send_us, m->wait_us, m->total_us };
+
+	if(!mt->prometheus)
+	{
+		fprintf(mt->out, "{\"device\":\"%s\",\"action\":\"%s\",\"result\":\"%s\",\"requests\":%u,"
+			"\"retries\":%u,\"reused\":%s", device, actionname(m->action), resultname(m->result),
+			m->requests, m->retries, m->reused ? "true" : "false");
+		for(size_t i = 0; i < 5; ++i)
+			fprintf(mt->out, ",\"%s_us\":%lu", phases[i], us[i]);
+		fprintf(mt->out, ",\"sent\":%llu,\"received\":%llu}\n",
+			(unsigned long long) m->sent, (unsigned long long) m->received);
+		fflush(mt->out);
+		return;
+	}
+
+	size_t i;
+	for(i = 0; i < mt->amount; ++i)
+		if(mt->series[i].action == m->action && strcmp(mt->series[i].device, device) == 0)
+			break;
+	if(i == mt->amount)
+	{
+		if(mt->amount == mt->alloc)
+		{
+			size_t alloc = mt->alloc ? mt->alloc * 2 : 16;
+			struct series *n = realloc(mt->series, alloc * sizeof(struct series));
+			/* dropping measurements beats failing the commands */
+			if(n == NULL) return;
+			mt->series = n;
+			mt->alloc = alloc;
+		}
+		memset(&mt->series[i], 0x0, sizeof(struct series));
+		strcpy(mt->series[i].device, device);
+		mt->series[i].action = m->action;
+		++mt->amount;
+	}
+
+	struct series *se = &mt->series[i];
+	se->requests += m->requests;
+	se->errors += m->result != HE_success;
+	se->retries += m->retries;
+	se->reused += m->reused;
+	se->sent += m->sent;
+	se->received += m->received;
+	for(size_t j = 0; j < 5; ++j)
+		se->us[j] += us[j];
+	/* the address is only looked up for the first record of a link,
+	 * and a reused connection wasn't connected */
+	se->measured[0] += m->resolved != 0;
+	se->measured[1] += !m->reused;
+	for(size_t j = 2; j < 5; ++j)
+		++se->measured[j];
+}
+
+/* writes the totals in the Prometheus text format */
+static void dumpmetrics(struct metrics *mt)
+{
+	static const struct { const char *name, *type, *help; size_t off; } counters[] = {
+		{ "hlink_requests_total", "counter", "Requests sent, a fleet step counts all its requests.", offsetof(struct series, requests) },
+		{ "hlink_errors_total", "counter", "Measurements that didn't succeed.", offsetof(struct series, errors) },
+		{ "hlink_retries_total", "counter", "Requests sent again because the 3ds was busy or closed the connection.", offsetof(struct series, retries) },
+		{ "hlink_reused_total", "counter", "Measurements over a connection that was already open.", offsetof(struct series, reused) },
+		{ "hlink_sent_bytes_total", "counter", "Bytes sent.", offsetof(struct series, sent) },
+		{ "hlink_received_bytes_total", "counter", "Bytes received.", offsetof(struct series, received) },
+	};
+
+	for(size_t c = 0; c < sizeof(counters) / sizeof(counters[0]); ++c)
+	{
+		fprintf(mt->out, "# HELP %s %s\n# TYPE %s %s\n", counters[c].name, counters[c].help, counters[c].name, counters[c].type);
+		for(size_t i = 0; i < mt->amount; ++i)
+			fprintf(mt->out, "%s{device=\"%s\",action=\"%s\"} %llu\n", counters[c].name, mt->series[i].device,
+				actionname(mt->series[i].action), (unsigned long long) *(u64 *) ((char *) &mt->series[i] + counters[c].off));
+	}
+
+	fprintf(mt->out, "# HELP hlink_phase_seconds Time spent in each phase, counted per measurement; a fleet step is measured as a whole.\n# TYPE hlink_phase_seconds summary\n");
+	for(size_t i = 0; i < mt->amount; ++i)
+	{
+		struct series *se = &mt->series[i];
+		for(size_t j = 0; j < 5; ++j)
+		{
+			fprintf(mt->out, "hlink_phase_seconds_sum{device=\"%s\",action=\"%s\",phase=\"%s\"} %.6f\n",
+				se->device, actionname(se->action), phases[j], se->us[j] / 1e6);
+			fprintf(mt->out, "hlink_phase_seconds_count{device=\"%s\",action=\"%s\",phase=\"%s\"} %llu\n",
+				se->device, actionname(se->action), phases[j], (unsigned long long) se->measured[j]);
+		}
+	}
+	fflush(mt->out);
+}
+
+static const char *authstate(int result)
+{
+	switch(result)
+	{
+	case HE_success: return "trusted";
+	case HE_notauthed: return "untrusted";
+	case HE_tryagain: return "busy";
+	}
+	return "error";
+}
+
+/* probes a subnet for devices and optionally writes the usable ones to a file for @file */
+static int discover(int argc, char *argv[])
+{
+	unsigned long timeout = 1000, parallel = 256;
+	const char *cidr = NULL, *out = NULL;
+	hProbe *found;
+	size_t amount;
+	int res;
+
 	for(int i = 2; i < argc; ++i)
 	{
-		hl_waittimeout();
+		if(argv[i][0] != '-' && cidr == NULL)
+			cidr = argv[i];
+		else if(strcmp(argv[i], "-t") == 0 || strcmp(argv[i], "--timeout") == 0)
+		{ if(!takeulong(argc, argv, &i, &timeout)) return 1; }
+		else if(strcmp(argv[i], "-p") == 0 || strcmp(argv[i], "--parallel") == 0)
+		{ if(!takeulong(argc, argv, &i, &parallel)) return 1; }
+		else if((strcmp(argv[i], "-o") == 0 || strcmp(argv[i], "--output") == 0) && i + 1 < argc)
+			out = argv[++i];
+		else { cidr = NULL; break; }
+	}
+	if(cidr == NULL)
+	{
+		fprintf(stderr, "Usage: hlink --discover CIDR [options...]\n\n"
+			"Finds devices running hLink on a subnet, like 192.168.1.0/24.\n\n"
+			"Options:\n"
+			"  -t, --timeout MS      give up on an address after MS milliseconds (default: 1000)\n"
+			"  -p, --parallel N      probe N addresses at once (default: 256)\n"
+			"  -o, --output FILE     write the trusted and busy devices to FILE, to be used as @FILE\n");
+		return 1;
+	}
+
+	unsigned long long start = nowus();
+	if((res = hl_discover(cidr, parallel, timeout, &found, &amount)) != HE_success)
+	{
+		fprintf(stderr, "hl_discover(): %s: %s\n", cidr, hl_geterror(res));
+		return 1;
+	}
+	for(size_t i = 0; i < amount; ++i)
+		printf("%-15s  %-9s  %lu ms\n", found[i].addr, authstate(found[i].result), found[i].ms);
+	printf("found %zu devices in %.2f s\n", amount, (nowus() - start) / 1e6);
+
+	if(out != NULL)
+	{
+		FILE *f = fopen(out, "w");
+		if(f == NULL)
+		{
+			fprintf(stderr, "%s: %s\n", out, strerror(errno));
+			free(found);
+			return 1;
+		}
+		fprintf(f, "# hlink --discover %s\n", cidr);
+		for(size_t i = 0; i < amount; ++i)
+		{
+			/* untrusted devices have to allow this host on the 3ds first,
+			 * busy ones are likely fine but that's not known yet */
+			if(found[i].result == HE_success)
+				fprintf(f, "%s\n", found[i].addr);
+			else if(found[i].result == HE_tryagain)
+				fprintf(f, "%s # busy\n", found[i].addr);
+			else fprintf(f, "# %s %s\n", found[i].addr, authstate(found[i].result));
+		}
+		fclose(f);
+	}
+
+	free(found);
+	return 0;
+}
+
+static int hlink(int argc, char *argv[])
+{
+	if(argc >= 2 && (strcmp(argv[1], "--discover") == 0 || strcmp(argv[1], "-d") == 0))
+		return discover(argc, argv);
+	if(argc < 2)
+	{
+		fprintf(stderr, "Usage: hlink [address | @file]... [cmd [arg...]...]\n"
+			"       hlink --discover CIDR [-t MS] [-p N] [-o FILE]\n\n"
+			"Commands run on all addresses concurrently if there are multiple,\n"
+			"@file reads addresses from a file with one address per line.\n\n"
+			"Options:\n"
+			"  -s, --sleep           sleep the 3ds for 5 seconds\n"
+			"  -a, --add-queue IDs   add IDs to the 3ds queue\n"
+			"  -l, --launch TID      launch TID on the 3ds\n"
+			"  -w, --wait MS         wait MS milliseconds\n"
+			"  -k, --keep-alive      use one connection for all commands\n"
+			"  -t, --timeout MS      give up on a device after MS milliseconds without a response (default: 5000)\n"
+			"  -r, --retries N       retry a command N times if a device is busy (default: 5)\n"
+			"  -i, --install FILE    send FILE to the 3ds and install it\n"
+			"  -u, --install-url URL make the 3ds download URL and install it\n"
+			"  -H, --serve FILE      serve FILE over HTTP and make the 3ds download and install it\n"
+			"  -x, --script FILE     run the commands in FILE, grouping independent ones\n"
+			"  -m, --metrics FORMAT [FILE]\n"
+			"                        write request timings, sizes and retries to FILE (default: stdout),\n"
+			"                        FORMAT is json for a line per request or prometheus for totals\n");
+		return 1;
+	}
+
+	int i, ret = 1;
+	hFleetOptions opts = { HL_TIMEOUT, 5, 100, HL_INSTALL_TIMEOUT, NULL, NULL };
+	struct metrics metrics = { NULL, 0, NULL, 0, 0 };
+	size_t naddrs = 0, addralloc = 8, nsteps = 0, nids = 0, nservers = 0;
+	hServer *servers = NULL;
+	char **addrs = malloc(addralloc * sizeof(char *));
+	/* every argument adds at most one step, except grouped short options
+	 * which add at most one per letter; there can't be more IDs than arguments */
+	size_t maxsteps = 0;
+	for(i = 1; i < argc; ++i)
+		maxsteps += strlen(argv[i]) + 1;
+	hStep *steps = malloc(maxsteps * sizeof(hStep));
+	u64 *ids = malloc(argc * sizeof(u64));
+
+	if(addrs == NULL || steps == NULL || ids == NULL)
+	{
+		fprintf(stderr, "hlink: out of memory\n");
+		goto out;
+	}
+
+	for(i = 1; i < argc && argv[i][0] != '-'; ++i)
+	{
+		if(argv[i][0] == '@')
+		{
+			if(!readaddrs(argv[i] + 1, &addrs, &naddrs, &addralloc))
+				goto out;
+			continue;
+		}
+		if(naddrs == addralloc)
+		{
+			char **n = realloc(addrs, (addralloc *= 2) * sizeof(char *));
+			if(n == NULL) goto out;
+			addrs = n;
+		}
+		if((addrs[naddrs] = strdup(argv[i])) == NULL)
+			goto out;
+		++naddrs;
+	}
+	if(naddrs == 0)
+	{
+		fprintf(stderr, "hlink: expected an address\n");
+		goto out;
+	}
+
+	const char *arg = NULL, *script = NULL;
+	int keepalive = 0;
+	unsigned long ul;
+#define TAKEARG() ((++i == argc) ? NULL : (argv[i][0] == '-' ? --i, NULL : argv[i]))
+#define ADDSTEP(...) do { if(nsteps == maxsteps) { fprintf(stderr, "hlink: too many commands\n"); goto out; } \
+	steps[nsteps++] = (hStep) __VA_ARGS__; } while(0)
+	for(; i < argc; ++i)
+	{
 		if(strcmp(argv[i], "--sleep") == 0)
-			goto opt_sleep;
+			ADDSTEP({ .type = HS_sleep });
 		else if(strcmp(argv[i], "--wait") == 0)
 			goto opt_wait;
 		else if(strcmp(argv[i], "--add-queue") == 0)
 			goto opt_add_queue;
 		else if(strcmp(argv[i], "--launch") == 0)
 			goto opt_launch;
+		else if(strcmp(argv[i], "--timeout") == 0)
+			goto opt_timeout;
+		else if(strcmp(argv[i], "--retries") == 0)
+			goto opt_retries;
+		else if(strcmp(argv[i], "--install") == 0)
+			goto opt_install;
+		else if(strcmp(argv[i], "--install-url") == 0)
+			goto opt_install_url;
+		else if(strcmp(argv[i], "--serve") == 0)
+			goto opt_serve;
+		else if(strcmp(argv[i], "--script") == 0)
+			goto opt_script;
+		else if(strcmp(argv[i], "--metrics") == 0)
+			goto opt_metrics;
+		else if(strcmp(argv[i], "--keep-alive") == 0)
+			keepalive = 1;
 		else if(strncmp(argv[i], "--", 2) == 0)
 			fprintf(stderr, "unknown option: '%s'\n", argv[i]);
 		else if(argv[i][0] == '-')
@@ -92,33 +631,28 @@ static int hlink(int argc, char *argv[])
 				switch(argv[i][j])
 				{
 				case 's':
-opt_sleep:
-					if((res = hl_sleep(&link)) != 0)
-						fprintf(stderr, "hl_sleep(): %s\n", hl_geterror(res));
+					ADDSTEP({ .type = HS_sleep });
 					break;
 opt_wait:
 				case 'w':
 					while((arg = TAKEARG()))
 					{
-						unsigned long t;
-						if(!getulong(arg, &t, 10))
+						if(!getulong(arg, &ul, 10))
 							continue;
-						usleep(t * 1000);
+						ADDSTEP({ .type = HS_wait, .ms = ul });
 					}
 					goto break_loop;
 opt_add_queue:
 				case 'a':
 				{
-					const int maxtids = 10;
-					int amount = 0;
-					u64 ids[10];
-					while(amount < maxtids && (arg = TAKEARG()))
+					size_t amount = 0;
+					while((arg = TAKEARG()))
 					{
-						if(get64(arg, &ids[amount]))
+						if(get64(arg, &ids[nids + amount]))
 							++amount;
 					}
-					if((res = hl_addqueue(&link, ids, amount)) != 0)
-						fprintf(stderr, "hl_addqueue(): %s\n", hl_geterror(res));
+					ADDSTEP({ .type = HS_addqueue, .ids = &ids[nids], .amount = amount });
+					nids += amount;
 					goto break_loop;
 				}
 opt_launch:
@@ -129,10 +663,68 @@ opt_launch:
 						fprintf(stderr, "launch: expected argument\n");
 					else if((tid = gettid(arg)) == 0)
 						fprintf(stderr, "launch: failed to parse title id\n");
-					else if((res = hl_launch(&link, tid)) != 0)
-						fprintf(stderr, "hl_launch(): %s\n", hl_geterror(res));
+					else ADDSTEP({ .type = HS_launch, .tid = tid });
 					goto break_loop;
 				}
+opt_timeout:
+				case 't':
+					if(!(arg = TAKEARG()) || !getulong(arg, &ul, 10))
+						fprintf(stderr, "timeout: expected milliseconds\n");
+					else opts.timeout = ul;
+					goto break_loop;
+opt_retries:
+				case 'r':
+					if(!(arg = TAKEARG()) || !getulong(arg, &ul, 10))
+						fprintf(stderr, "retries: expected a number\n");
+					else opts.retries = ul;
+					goto break_loop;
+opt_install:
+				case 'i':
+					if(!(arg = TAKEARG()))
+						fprintf(stderr, "install: expected a file\n");
+					else ADDSTEP({ .type = HS_install_data, .path = arg });
+					goto break_loop;
+opt_install_url:
+				case 'u':
+					if(!(arg = TAKEARG()))
+						fprintf(stderr, "install-url: expected a url\n");
+					else ADDSTEP({ .type = HS_install_url, .url = arg });
+					goto break_loop;
+opt_serve:
+				case 'H':
+					/* the url is filled in once the file is served */
+					if(!(arg = TAKEARG()))
+						fprintf(stderr, "serve: expected a file\n");
+					else ADDSTEP({ .type = HS_install_url, .path = arg });
+					goto break_loop;
+opt_script:
+				case 'x':
+					if(!(arg = TAKEARG()))
+						fprintf(stderr, "script: expected a file\n");
+					else script = arg;
+					goto break_loop;
+opt_metrics:
+				case 'm':
+					if(!(arg = TAKEARG()) || (strcmp(arg, "json") != 0 && strcmp(arg, "prometheus") != 0))
+					{
+						fprintf(stderr, "metrics: expected json or prometheus\n");
+						goto break_loop;
+					}
+					metrics.prometheus = strcmp(arg, "prometheus") == 0;
+					if(metrics.out != NULL && metrics.out != stdout)
+						fclose(metrics.out);
+					metrics.out = stdout;
+					if((arg = TAKEARG()) && (metrics.out = fopen(arg, "w")) == NULL)
+					{
+						fprintf(stderr, "%s: %s\n", arg, strerror(errno));
+						goto out;
+					}
+					opts.metrics = addmetric;
+					opts.metricsdata = &metrics;
+					goto break_loop;
+				case 'k':
+					keepalive = 1;
+					break;
 				default:
 					fprintf(stderr, "unknown option: '-%c'\n", argv[i][j]);
 					break;
@@ -144,10 +736,258 @@ break_loop:
 		continue;
 	}
 
-	hl_destroylink(&link);
+	if(script != NULL)
+	{
+		if(nsteps != 0)
+			fprintf(stderr, "hlink: commands can't be combined with a script\n");
+		else
+		{
+			signal(SIGPIPE, SIG_IGN);
+			ret = runscript(addrs, naddrs, script, &opts);
+		}
+		goto out;
+	}
+
+	if(!startservers(&servers, &nservers, addrs[0], steps, nsteps))
+		goto out;
+
+	/* sendfile(2) can't be told not to raise it */
+	signal(SIGPIPE, SIG_IGN);
+	ret = naddrs == 1
+		? runlink(addrs[0], steps, nsteps, keepalive, &opts)
+		: runfleet(addrs, naddrs, steps, nsteps, &opts);
+
+	for(size_t j = 0; j < nservers; ++j)
+	{
+		/* the 3ds may still be downloading after responding */
+		hl_server_wait(&servers[j], naddrs, SERVE_IDLE);
+		hl_server_stop(&servers[j]);
+	}
+
+out:
+	if(metrics.out != NULL)
+	{
+		if(metrics.prometheus)
+			dumpmetrics(&metrics);
+		if(metrics.out != stdout)
+			fclose(metrics.out);
+	}
+	free(metrics.series);
+	if(addrs != NULL)
+		for(size_t j = 0; j < naddrs; ++j)
+			free(addrs[j]);
+	free(addrs);
+	free(steps);
+	free(ids);
+	free(servers);
+	return ret;
+}
+
+static volatile sig_atomic_t g_stop = 0;
+
+static void stop(int sig)
+{
+	(void) sig;
+	g_stop = 1;
+}
+
+static int hlinkserve(int argc, char *argv[])
+{
+	hResponderOptions opts = { NULL, 0, 0, 0, 0, 0, 0 };
+	hResponderStats stats;
+	unsigned long ul;
+	int i, ret;
+
+	for(i = 1; i < argc; ++i)
+	{
+		if(argv[i][0] != '-' && opts.addr == NULL)
+			opts.addr = argv[i];
+		else if(strcmp(argv[i], "-l") == 0 || strcmp(argv[i], "--latency") == 0)
+		{ if(!takeulong(argc, argv, &i, &opts.latency)) return 1; }
+		else if(strcmp(argv[i], "-j") == 0 || strcmp(argv[i], "--jitter") == 0)
+		{ if(!takeulong(argc, argv, &i, &opts.jitter)) return 1; }
+		else if(strcmp(argv[i], "-b") == 0 || strcmp(argv[i], "--busy") == 0)
+		{ if(!takeulong(argc, argv, &i, &ul)) return 1; opts.busy = ul; }
+		else if(strcmp(argv[i], "-e") == 0 || strcmp(argv[i], "--error") == 0)
+		{ if(!takeulong(argc, argv, &i, &ul)) return 1; opts.error = ul; }
+		else if(strcmp(argv[i], "-u") == 0 || strcmp(argv[i], "--untrusted") == 0)
+			opts.untrusted = 1;
+		else if(strcmp(argv[i], "-1") == 0 || strcmp(argv[i], "--oneshot") == 0)
+			opts.oneshot = 1;
+		else
+		{
+			fprintf(stderr, "Usage: hlink-serve [address] [options...]\n\n"
+				"Responds to hLink requests like a 3ds until interrupted.\n\n"
+				"Options:\n"
+				"  -l, --latency MS      wait MS milliseconds before every response\n"
+				"  -j, --jitter MS       wait up to MS more milliseconds at random\n"
+				"  -b, --busy N          respond busy to every Nth request\n"
+				"  -e, --error N         respond with an error to every Nth request\n"
+				"  -u, --untrusted       respond untrusted to every request\n"
+				"  -1, --oneshot         close the connection after every response\n");
+			return 1;
+		}
+	}
+
+	memset(&stats, 0x0, sizeof(stats));
+	signal(SIGINT, stop);
+	signal(SIGTERM, stop);
+	signal(SIGPIPE, SIG_IGN);
+	if((ret = hl_respond(&opts, &stats, &g_stop)) != HE_success)
+	{
+		fprintf(stderr, "hl_respond(): %s\n", hl_geterror(ret));
+		return 1;
+	}
+
+	printf("connections: %lu\n", stats.conns);
+	for(i = 0; i <= HA_sleep; ++i)
+		printf("%s: %lu requests\n", actions[i], stats.reqs[i]);
+	printf("busy: %lu, errors: %lu\n", stats.busy, stats.errors);
+	printf("IDs added: %llu, bytes received: %llu\n", (unsigned long long) stats.ids, (unsigned long long) stats.bytes);
 	return 0;
 }
 
+static int cmpu64(const void *a, const void *b)
+{
+	u64 x = *(const u64 *) a, y = *(const u64 *) b;
+	return x < y ? -1 : x > y;
+}
+
+/* nearest-rank percentile of sorted `times' */
+static double percentile(const u64 *times, size_t amount, unsigned p)
+{
+	size_t rank = (amount * p + 99) / 100;
+	return times[rank ? rank - 1 : 0] / 1000.0;
+}
+
+/* times `rounds' single requests, busy and error responses aren't counted */
+static void benchaction(hLink *link, const char *name, uint8_t action, const void *body, uint32_t size, u64 *times, size_t rounds)
+{
+	size_t ok = 0, busy = 0, failed = 0;
+	int res, lasterr = HE_success;
+
+	for(size_t i = 0; i < rounds; ++i)
+	{
+		hRequest req = { action, body, size, 0 };
+		u64 start = nowus();
+		res = hl_pipeline(link, &req, 1);
+		if(res == HE_success)
+			times[ok++] = nowus() - start;
+		else if(res == HE_tryagain)
+			++busy;
+		else ++failed, lasterr = res;
+	}
+
+	printf("%-12s", name);
+	if(ok == 0)
+		printf(" no successful requests");
+	else
+	{
+		qsort(times, ok, sizeof(u64), cmpu64);
+		printf(" min %.3f p50 %.3f p90 %.3f p99 %.3f max %.3f ms", times[0] / 1000.0, percentile(times, ok, 50),
+			percentile(times, ok, 90), percentile(times, ok, 99), times[ok - 1] / 1000.0);
+	}
+	printf(", %zu busy, %zu failed\n", busy, failed);
+	if(failed)
+		printf("             last error: %s\n", hl_geterror(lasterr));
+}
+
+static int hlinkbench(int argc, char *argv[])
+{
+	unsigned long rounds = 100, nids = 1000;
+	const char *addr = NULL;
+	int keepalive = 0, res;
+	hLink link;
+
+	for(int i = 1; i < argc; ++i)
+	{
+		if(argv[i][0] != '-' && addr == NULL)
+			addr = argv[i];
+		else if(strcmp(argv[i], "-n") == 0 || strcmp(argv[i], "--rounds") == 0)
+		{ if(!takeulong(argc, argv, &i, &rounds)) return 1; }
+		else if(strcmp(argv[i], "-q") == 0 || strcmp(argv[i], "--ids") == 0)
+		{ if(!takeulong(argc, argv, &i, &nids)) return 1; }
+		else if(strcmp(argv[i], "-k") == 0 || strcmp(argv[i], "--keep-alive") == 0)
+			keepalive = 1;
+		else { addr = NULL; break; }
+	}
+	if(addr == NULL || rounds == 0)
+	{
+		fprintf(stderr, "Usage: hlink-bench address [options...]\n\n"
+			"Measures hLink round trips and queue throughput, meant for hlink-serve;\n"
+			"on a 3ds this adds title ID 1 to the queue many times.\n\n"
+			"Options:\n"
+			"  -n, --rounds N        time N requests per action (default: 100)\n"
+			"  -q, --ids N           add N IDs to the queue for the throughput (default: 1000)\n"
+			"  -k, --keep-alive      use one connection for all requests\n");
+		return 1;
+	}
+
+	u64 *times = malloc(rounds * sizeof(u64));
+	u64 *ids = malloc((nids ? nids : 1) * sizeof(u64));
+	hRequest *reqs = malloc(rounds * sizeof(hRequest));
+	if(times == NULL || ids == NULL || reqs == NULL)
+	{
+		fprintf(stderr, "hlink-bench: out of memory\n");
+		res = 1;
+		goto out;
+	}
+
+	if((res = hl_makelink(&link, addr)) != 0)
+	{
+		fprintf(stderr, "hl_makelink(): %s\n", hl_makelink_geterror(res));
+		res = 1;
+		goto out;
+	}
+	signal(SIGPIPE, SIG_IGN);
+	if(keepalive)
+		hl_session(&link, 1);
+	if((res = hl_auth(&link)) != 0)
+	{
+		fprintf(stderr, "hl_auth(): %s\n", hl_geterror(res));
+		res = 1;
+		goto destroy;
+	}
+
+	/* IDs go over the wire in network byte order */
+	u64 id = 1, nid = 0;
+	for(int i = 0; i < 8; ++i)
+		((uint8_t *) &nid)[i] = id >> (56 - i * 8);
+
+	printf("round trips of %lu requests:\n", rounds);
+	benchaction(&link, "nothing", HA_nothing, NULL, 0, times, rounds);
+	benchaction(&link, "add-queue", HA_add_queue, &nid, sizeof(nid), times, rounds);
+
+	for(size_t i = 0; i < rounds; ++i)
+		reqs[i] = (hRequest) { HA_nothing, NULL, 0, 0 };
+	u64 start = nowus();
+	res = hl_pipeline(&link, reqs, rounds);
+	u64 took = nowus() - start;
+	printf("pipelined:   %lu requests in %.3f ms, %.0f requests/s (%s)\n", rounds, took / 1000.0,
+		rounds * 1e6 / (took ? took : 1), hl_geterror(res));
+
+	if(nids)
+	{
+		for(size_t i = 0; i < nids; ++i)
+			ids[i] = id;
+		start = nowus();
+		res = hl_addqueue(&link, ids, nids);
+		took = nowus() - start;
+		printf("add-queue:   %lu IDs in %.3f ms, %.0f IDs/s, %.0f requests/s (%s)\n", nids, took / 1000.0,
+			nids * 1e6 / (took ? took : 1), (nids + HL_QUEUE_BATCH - 1) / HL_QUEUE_BATCH * 1e6 / (took ? took : 1),
+			hl_geterror(res));
+	}
+	res = 0;
+
+destroy:
+	hl_destroylink(&link);
+out:
+	free(times);
+	free(ids);
+	free(reqs);
+	return res;
+}
+
 static int maketheme(int argc, char *argv[])
 {
 	if(argc < 3)
@@ -173,11 +1013,15 @@ int main(int argc, char *argv[])
 	if(argc < 2)
 	{
 error:
-		fprintf(stderr, "Usage: %s [hlink | maketheme | makehwav]\n", argv[0]);
+		fprintf(stderr, "Usage: %s [hlink | hlink-serve | hlink-bench | maketheme | makehwav]\n", argv[0]);
 		return 1;
 	}
 	if(strcmp(argv[1], "hlink") == 0)
 		return hlink(argc - 1, &argv[1]);
+	if(strcmp(argv[1], "hlink-serve") == 0)
+		return hlinkserve(argc - 1, &argv[1]);
+	if(strcmp(argv[1], "hlink-bench") == 0)
+		return hlinkbench(argc - 1, &argv[1]);
 	if(strcmp(argv[1], "maketheme") == 0)
 		return maketheme(argc - 1, &argv[1]);
 	if(strcmp(argv[1], "makehwav") == 0)
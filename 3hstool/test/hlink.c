@@ -0,0 +1,379 @@
+/* runs hlink.c, hfleet.c, hsession.c and hscript.c against hl_respond() on
+ * loopback addresses; every responder gets its own 127.0.0.x since the port
+ * is fixed */
+
+#include "../hfleet.h"
+#include "../hlink.h"
+#include "../hscript.h"
+#include "../hserve.h"
+#include "../hsession.h"
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+
+#define TID 0x0004000000123400ULL
+
+enum
+{
+	SRV_normal,
+	SRV_oneshot, /* closes the connection after every response */
+	SRV_busy, /* busy for every second request */
+	SRV_busyoneshot,
+	SRV_amount,
+};
+
+struct server
+{
+	hResponderOptions opts;
+	hResponderStats stats;
+	pthread_t thread;
+	int ret;
+};
+
+static struct server servers[SRV_amount] = {
+	[SRV_normal] = { .opts = { .addr = "127.0.0.1" } },
+	[SRV_oneshot] = { .opts = { .addr = "127.0.0.2", .oneshot = 1 } },
+	[SRV_busy] = { .opts = { .addr = "127.0.0.3", .busy = 2 } },
+	[SRV_busyoneshot] = { .opts = { .addr = "127.0.0.4", .busy = 2, .oneshot = 1 } },
+};
+
+static volatile sig_atomic_t g_stop = 0;
+static int g_failed = 0;
+
+#define CHECK(cond) do { if(!(cond)) { fprintf(stderr, "%s:%d: %s: check failed: %s\n", __FILE__, __LINE__, __func__, #cond); ++g_failed; } } while(0)
+
+static void *runserver(void *arg)
+{
+	struct server *srv = arg;
+	srv->ret = hl_respond(&srv->opts, &srv->stats, &g_stop);
+	return NULL;
+}
+
+/* waits until the responder accepts connections */
+static int waitlistening(const char *addr)
+{
+	struct sockaddr_in sin;
+	memset(&sin, 0x0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(37283);
+	inet_pton(AF_INET, addr, &sin.sin_addr);
+
+	for(int tries = 0; tries < 200; ++tries)
+	{
+		int sock = socket(AF_INET, SOCK_STREAM, 0);
+		if(sock < 0) return 0;
+		int ok = connect(sock, (struct sockaddr *) &sin, sizeof(sin)) == 0;
+		close(sock);
+		if(ok) return 1;
+		usleep(10000);
+	}
+	return 0;
+}
+
+static uint64_t ids(int srv)
+{
+	return servers[srv].stats.ids;
+}
+
+static void makeids(uint64_t *out, size_t amount)
+{
+	for(size_t i = 0; i < amount; ++i)
+		out[i] = 1000 + i;
+}
+
+static void test_single(void)
+{
+	uint64_t list[25];
+	makeids(list, 25);
+
+	for(int srv = SRV_normal; srv <= SRV_oneshot; ++srv)
+	{
+		hLink link;
+		uint64_t before = ids(srv);
+		CHECK(hl_makelink(&link, servers[srv].opts.addr) == HE_success);
+		CHECK(hl_auth(&link) == HE_success);
+		CHECK(hl_addqueue(&link, list, 25) == HE_success);
+		CHECK(hl_launch(&link, TID) == HE_success);
+		CHECK(hl_sleep(&link) == HE_success);
+		CHECK(ids(srv) - before == 25);
+		hl_destroylink(&link);
+	}
+
+	/* a link that never resolved must not close anything */
+	hLink link;
+	CHECK(hl_makelink(&link, "nonexistent.invalid") != HE_success);
+	hl_destroylink(&link);
+	CHECK(fcntl(0, F_GETFD) >= 0);
+}
+
+static void test_pipelined(void)
+{
+	uint64_t list[35];
+	makeids(list, 35);
+
+	/* the one-shot host makes the pipeline fall back to a connection per request */
+	for(int srv = SRV_normal; srv <= SRV_oneshot; ++srv)
+	{
+		hLink link;
+		uint64_t before = ids(srv);
+		unsigned long conns = servers[srv].stats.conns;
+		CHECK(hl_makelink(&link, servers[srv].opts.addr) == HE_success);
+		hl_session(&link, 1);
+		CHECK(hl_auth(&link) == HE_success);
+		CHECK(hl_addqueue(&link, list, 35) == HE_success);
+		CHECK(hl_sleep(&link) == HE_success);
+		CHECK(ids(srv) - before == 35);
+		if(srv == SRV_normal)
+			CHECK(servers[srv].stats.conns - conns == 1);
+		hl_destroylink(&link);
+	}
+}
+
+static void test_busy(void)
+{
+	uint64_t list[25];
+	makeids(list, 25);
+
+	for(int srv = SRV_busy; srv <= SRV_busyoneshot; ++srv)
+	{
+		hLink link;
+		CHECK(hl_makelink(&link, servers[srv].opts.addr) == HE_success);
+		hl_setretries(&link, 5, 1);
+		hl_session(&link, 1);
+		CHECK(hl_auth(&link) == HE_success);
+
+		/* busy batches are sent again, the others aren't */
+		uint64_t before = ids(srv);
+		CHECK(hl_addqueue(&link, list, 25) == HE_success);
+		CHECK(ids(srv) - before == 25);
+		CHECK(hl_launch(&link, TID) == HE_success);
+		CHECK(hl_sleep(&link) == HE_success);
+
+		/* every second request is busy, so one of these two is */
+		hl_setretries(&link, 0, 1);
+		int a = hl_sleep(&link), b = hl_sleep(&link);
+		CHECK((a == HE_tryagain) != (b == HE_tryagain));
+		hl_destroylink(&link);
+	}
+}
+
+static void test_fleet(void)
+{
+	uint64_t list[25];
+	makeids(list, 25);
+	hStep steps[] = {
+		{ .type = HS_addqueue, .ids = list, .amount = 25 },
+		{ .type = HS_wait, .ms = 10 },
+		{ .type = HS_launch, .tid = TID },
+		{ .type = HS_sleep },
+	};
+	hDevice devs[SRV_amount + 1];
+	hFleetOptions opts = { 2000, 5, 1, 2000, NULL, NULL };
+	uint64_t before[SRV_amount];
+
+	memset(devs, 0x0, sizeof(devs));
+	for(int srv = 0; srv < SRV_amount; ++srv)
+	{
+		devs[srv].addr = servers[srv].opts.addr;
+		before[srv] = ids(srv);
+	}
+	devs[SRV_amount].addr = "nonexistent.invalid";
+
+	CHECK(hl_fleet_run(devs, SRV_amount + 1, steps, sizeof(steps) / sizeof(steps[0]), &opts) == 1);
+	for(int srv = 0; srv < SRV_amount; ++srv)
+	{
+		CHECK(devs[srv].result == HE_success);
+		CHECK(ids(srv) - before[srv] == 25);
+	}
+	CHECK(devs[SRV_busy].retries > 0);
+	CHECK(devs[SRV_amount].result == -ENXIO);
+	CHECK(fcntl(0, F_GETFD) >= 0);
+
+	/* the busy host gives up once the retries run out */
+	opts.retries = 0;
+	hl_fleet_run(&devs[SRV_busy], 1, steps, sizeof(steps) / sizeof(steps[0]), &opts);
+	CHECK(devs[SRV_busy].result == HE_tryagain);
+}
+
+/* writes a file of `size' bytes to install, returns 0 on failure */
+static int makecia(char *path, size_t size)
+{
+	static char block[0x10000];
+	int fd = mkstemp(path);
+	if(fd < 0) return 0;
+	for(size_t left = size, part; left != 0; left -= part)
+	{
+		part = left > sizeof(block) ? sizeof(block) : left;
+		if(write(fd, block, part) != (ssize_t) part)
+		{ close(fd); unlink(path); return 0; }
+	}
+	close(fd);
+	return 1;
+}
+
+static void test_install(void)
+{
+	char path[] = "/tmp/hlink-test-XXXXXX";
+	int made = makecia(path, 3 << 20);
+	CHECK(made);
+	if(!made) return;
+
+	/* the one-shot host has already closed the connection kept from the
+	 * authentication when the install is sent */
+	for(int srv = SRV_normal; srv <= SRV_oneshot; ++srv)
+	{
+		hLink link;
+		unsigned long before = servers[srv].stats.reqs[HA_install_data];
+		CHECK(hl_makelink(&link, servers[srv].opts.addr) == HE_success);
+		hl_session(&link, 1);
+		CHECK(hl_auth(&link) == HE_success);
+		CHECK(hl_install_data(&link, path, NULL, NULL) == HE_success);
+		CHECK(servers[srv].stats.reqs[HA_install_data] - before == 1);
+		hl_destroylink(&link);
+	}
+
+	hStep steps[] = {
+		{ .type = HS_wait, .ms = 10 },
+		{ .type = HS_install_data, .path = path },
+	};
+	hDevice devs[2];
+	hFleetOptions opts = { 2000, 5, 1, 2000, NULL, NULL };
+	unsigned long before[2];
+	memset(devs, 0x0, sizeof(devs));
+	for(int srv = SRV_normal; srv <= SRV_oneshot; ++srv)
+	{
+		devs[srv].addr = servers[srv].opts.addr;
+		before[srv] = servers[srv].stats.reqs[HA_install_data];
+	}
+	CHECK(hl_fleet_run(devs, 2, steps, sizeof(steps) / sizeof(steps[0]), &opts) == 0);
+	for(int srv = SRV_normal; srv <= SRV_oneshot; ++srv)
+	{
+		CHECK(devs[srv].result == HE_success);
+		CHECK(servers[srv].stats.reqs[HA_install_data] - before[srv] == 1);
+	}
+	unlink(path);
+}
+
+static int g_done, g_ok;
+
+static void sessiondone(hSession *s, long handle, int result, const char *error, void *udata)
+{
+	(void) s; (void) handle; (void) error; (void) udata;
+	++g_done;
+	if(result == HE_success) ++g_ok;
+}
+
+static void test_session(void)
+{
+	for(int srv = SRV_normal; srv <= SRV_oneshot; ++srv)
+	{
+		int err;
+		uint64_t before = ids(srv);
+		hSession *s = hl_session_open(servers[srv].opts.addr, &err);
+		CHECK(s != NULL);
+		if(s == NULL) continue;
+
+		g_done = g_ok = 0;
+		for(uint64_t id = 0; id < 50; ++id)
+			CHECK(hl_session_addqueue(s, &id, 1, sessiondone, NULL) > 0);
+		CHECK(hl_session_launch(s, TID, sessiondone, NULL) > 0);
+		int pending;
+		while((pending = hl_session_poll(s, 1000)) > 0)
+			;
+		CHECK(pending == 0);
+		CHECK(g_done == 51 && g_ok == 51);
+		CHECK(ids(srv) - before == 50);
+		hl_session_close(s);
+	}
+}
+
+static void test_script(void)
+{
+	char path[] = "/tmp/hlink-test-XXXXXX";
+	int fd = mkstemp(path);
+	CHECK(fd >= 0);
+	if(fd < 0) return;
+
+	static const char text[] =
+		"# queue, install and launch\n"
+		"for ID in 1 2 3 4 5 6 7 8 9 10 11 12\n"
+		"add-queue $ID\n"
+		"end\n"
+		"install-url http://127.0.0.1/a.cia\n"
+		"launch 0004000000123400\n"
+		"sleep\n";
+	CHECK(write(fd, text, sizeof(text) - 1) == (ssize_t) sizeof(text) - 1);
+	close(fd);
+
+	hScript script;
+	char err[256];
+	int ret = hl_script_load(&script, path, err, sizeof(err));
+	unlink(path);
+	CHECK(ret == HE_success);
+	if(ret != HE_success) return;
+
+	hDevice devs[SRV_amount];
+	hFleetOptions opts = { 2000, 5, 1, 2000, NULL, NULL };
+	uint64_t before[SRV_amount];
+	memset(devs, 0x0, sizeof(devs));
+	for(int srv = 0; srv < SRV_amount; ++srv)
+	{
+		devs[srv].addr = servers[srv].opts.addr;
+		before[srv] = ids(srv);
+	}
+
+	CHECK(hl_script_run(&script, devs, SRV_amount, &opts) == 0);
+	for(int srv = 0; srv < SRV_amount; ++srv)
+	{
+		CHECK(devs[srv].result == HE_success);
+		CHECK(ids(srv) - before[srv] == 12);
+	}
+	hl_script_free(&script);
+}
+
+int main(void)
+{
+	int started = 0;
+	/* the tests check that stdin isn't closed by accident */
+	if(fcntl(0, F_GETFD) < 0)
+		open("/dev/null", O_RDONLY);
+	/* like main.c; sendfile() to a closed connection would raise it */
+	signal(SIGPIPE, SIG_IGN);
+	for(int srv = 0; srv < SRV_amount; ++srv, ++started)
+	{
+		if(pthread_create(&servers[srv].thread, NULL, runserver, &servers[srv]) != 0
+			|| !waitlistening(servers[srv].opts.addr))
+		{
+			fprintf(stderr, "hlink-test: can't start the responder on %s\n", servers[srv].opts.addr);
+			g_failed = 1;
+			break;
+		}
+	}
+
+	if(!g_failed)
+	{
+#define RUN(test) do { int failed = g_failed; test(); printf("%s: %s\n", #test, failed == g_failed ? "ok" : "FAILED"); } while(0)
+		RUN(test_single);
+		RUN(test_pipelined);
+		RUN(test_busy);
+		RUN(test_fleet);
+		RUN(test_install);
+		RUN(test_session);
+		RUN(test_script);
+#undef RUN
+	}
+
+	g_stop = 1;
+	for(int srv = 0; srv < started; ++srv)
+		pthread_join(servers[srv].thread, NULL);
+	return g_failed != 0;
+}
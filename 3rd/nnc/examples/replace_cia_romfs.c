@@ -15,7 +15,7 @@ int main(int argc, char *argv[])
         return 1;
     }
 
-    nnc_subview certchain, ticket, tmd_strm, plain, logo;
+    nnc_subview certchain, ticket, tmd_strm, meta, plain, logo;
     nnc_buildable_ncch ncch0b;
     nnc_tmd_header tmd;
     nnc_cia_writable_ncch ncch0;
@@ -25,6 +25,7 @@ int main(int argc, char *argv[])
     nnc_ncch_section_stream exheader;
     nnc_ncch_exefs_stream exefs;
     nnc_cia_header cia_hdr;
+    nnc_u8 meta_flag;
     nnc_result res;
     nnc_wfile wf;
     nnc_file f;
@@ -39,6 +40,7 @@ int main(int argc, char *argv[])
     nnc_cia_open_ticket(&cia_hdr, NNC_RSP(&f), &ticket); /* open the ticket for later copying it into the new cia */
     nnc_cia_open_tmd(&cia_hdr, NNC_RSP(&f), &tmd_strm); /* open the tmd which we will modify some things of and then write tot he new cia */
     TRYB(nnc_read_tmd_header(NNC_RSP(&tmd_strm), &tmd), out3); /* parse the ticket */
+    meta_flag = nnc_cia_open_meta(&cia_hdr, NNC_RSP(&f), &meta) == NNC_R_OK ? NNC_CIA_WF_META_STREAM : NNC_CIA_WF_META_OMIT; /* the meta section (with the SMDH) is optional, copy it if it's present */
     TRYB(nnc_cia_make_reader(&cia_hdr, NNC_RSP(&f), nnc_get_default_keyset(), &reader), out3); /* create a content (= NCCH) reader */
     TRYB(nnc_cia_open_content(&reader, 0, &ncch0stream, NULL), out4); /* open the first content (NCCH0) */
     TRYB(nnc_read_ncch_header(NNC_RSP(&ncch0stream), &ncch_hdr), out5); /* parse the NCCH header */
@@ -69,8 +71,8 @@ int main(int argc, char *argv[])
 
     /* and finally write the cia */
     res = nnc_write_cia(
-        NNC_CIA_WF_CERTCHAIN_STREAM | NNC_CIA_WF_TICKET_STREAM | NNC_CIA_WF_TMD_BUILD,
-        &certchain, &ticket, &tmd, 1, &ncch0, NNC_WSP(&wf)
+        NNC_CIA_WF_CERTCHAIN_STREAM | NNC_CIA_WF_TICKET_STREAM | NNC_CIA_WF_TMD_BUILD | meta_flag,
+        &certchain, &ticket, &tmd, meta_flag ? &meta : NULL, 1, &ncch0, NNC_WSP(&wf)
     );
 
     /* cleanup code, with lots of labels to jump to in case of failure depending on where it failed */
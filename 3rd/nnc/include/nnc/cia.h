@@ -33,6 +33,14 @@ NNC_BEGIN
 #define NNC_CINDEX_HAS(cindex, index) \
 	((cindex)[(index) / 8] & (1 << (7 - ((index) % 8))))
 
+/** Amount of title IDs in the dependency list of the CIA meta section. */
+#define NNC_CIA_META_DEPENDENCIES 48
+/** Offset of the SMDH in the CIA meta section. */
+#define NNC_CIA_META_ICON_OFFSET 0x400
+/** Size of the SMDH in the CIA meta section. */
+#define NNC_CIA_META_ICON_SIZE 0x36C0
+/** Size of a CIA meta section including an SMDH. */
+#define NNC_CIA_META_SIZE (NNC_CIA_META_ICON_OFFSET + NNC_CIA_META_ICON_SIZE)
 
 typedef struct nnc_cia_header {
 	nnc_u16 type;                 ///< Type (?).
@@ -53,10 +61,22 @@ typedef struct nnc_cia_content_reader {
 	nnc_rstream *rs;
 } nnc_cia_content_reader;
 
+typedef struct nnc_cia_meta {
+	nnc_u64 dependencies[NNC_CIA_META_DEPENDENCIES]; ///< Title IDs this title depends on, unused entries are 0.
+	nnc_u32 core_version;                            ///< Core version.
+} nnc_cia_meta;
+
+typedef struct nnc_buildable_cia_meta {
+	nnc_cia_meta meta;  ///< Values to write in the meta header.
+	nnc_rstream *icon;  ///< SMDH to copy into the meta section, must be exactly \ref NNC_CIA_META_ICON_SIZE bytes; NULL to copy the "icon" file from the ExeFS of the first content.
+} nnc_buildable_cia_meta;
+
 typedef void* nnc_certchain_or_stream;
 typedef void* nnc_ticket_or_stream;
 typedef void* nnc_ncch_or_stream;
 typedef void* nnc_tmd_or_stream;
+typedef void* nnc_meta_or_stream;
+typedef void* nnc_cdn_dir_or_vfs;
 
 enum nnc_cia_ncch_build_type {
 	NNC_CIA_NCCHBUILD_NONE   = 0, ///< No NCCH; skip the index and go to the next one.
@@ -76,6 +96,16 @@ enum nnc_cia_wflags {
 	NNC_CIA_WF_TICKET_STREAM    = 8,   ///< Copy a ticket from a read stream.
 	NNC_CIA_WF_TMD_BUILD        = 16,  ///< Build a TMD, including the calculation of hashes.
 	NNC_CIA_WF_TMD_STREAM       = 32,  ///< Copy a TMD from a read stream.
+	NNC_CIA_WF_META_BUILD       = 64,  ///< Build a meta section from a #nnc_buildable_cia_meta struct.
+	NNC_CIA_WF_META_STREAM      = 128, ///< Copy a meta section from a read stream.
+	NNC_CIA_WF_META_OMIT        = 0,   ///< Omit the meta section, pass NULL for the `meta` parameter.
+	NNC_CIA_WF_ENCRYPT_CONTENTS = 256, ///< Encrypt the contents with the title key from the ticket, the contents passed must be decrypted.
+};
+
+enum nnc_cdn_flags {
+	NNC_CDN_DIRECTORY = 1, ///< The `cdn` parameter is the path to a directory.
+	NNC_CDN_VFS       = 2, ///< The `cdn` parameter is a #nnc_vfs_directory_node.
+	NNC_CDN_VERIFY    = 4, ///< Decrypt the contents while copying them and check them against the hashes in the TMD, this requires the title key in the ticket to be valid for the default keyset.
 };
 
 /** A pseudo-stream to hold all possible required streams, yet still
@@ -130,6 +160,22 @@ void nnc_cia_open_tmd(nnc_cia_header *cia, nnc_rstream *rs, nnc_subview *sv);
  */
 nnc_result nnc_cia_open_meta(nnc_cia_header *cia, nnc_rstream *rs, nnc_subview *sv);
 
+/** \brief       Reads the header of a CIA meta section.
+ *  \param rs    Stream to read meta from, see \ref nnc_cia_open_meta.
+ *  \param meta  Output meta.
+ *  \returns
+ *  Anything \ref nnc_read_at_exact can return.
+ */
+nnc_result nnc_read_cia_meta(nnc_rstream *rs, nnc_cia_meta *meta);
+
+/** \brief       Open a subview of the SMDH in a CIA meta section.
+ *  \param rs    Stream of the meta section, see \ref nnc_cia_open_meta.
+ *  \param sv    Output subview, this can be passed to \ref nnc_read_smdh directly.
+ *  \returns
+ *  \p NNC_R_NOT_FOUND => The meta section doesn't contain an SMDH.
+ */
+nnc_result nnc_cia_meta_icon(nnc_rstream *rs, nnc_subview *sv);
+
 /** \brief         Open a CIA for content reading.
  *  \param cia     Stream to make reader of.
  *  \param rs      Associated read stream.
@@ -176,21 +222,59 @@ void nnc_cia_get_iv(nnc_u8 iv[0x10], nnc_u16 index);
  *  \param certchain        Certificate chain parameter, see #nnc_cia_wflags.
  *  \param ticket           Ticket parameter, see #nnc_cia_wflags.
  *  \param tmd              TMD parameter, see #nnc_cia_wflags.
+ *  \param meta             Meta parameter, see #nnc_cia_wflags.
  *  \param amount_contents  Amount of contents in this CIA.
  *  \param contents         Writable NCCH contents to put in the CIA container.
  *  \param ws               Output write stream.
  *  \warning                If you use a stream for `tmd` you must ensure yourself that this TMD describes the rest of the contents.
+ *  \note                   The SMDH of a built meta section is copied as-is, if it is taken from the ExeFS of the first content
+ *                          that content must be an NCCH and it is read back from \p ws.
+ *  \note                   With #NNC_CIA_WF_ENCRYPT_CONTENTS the contents are first written decrypted and then encrypted in-place,
+ *                          multiple contents are encrypted at once on separate threads where supported. The title key
+ *                          is decrypted with the default keyset (see \ref nnc_get_default_keyset). If you use a stream
+ *                          for `tmd` it must mark the contents as encrypted.
+ *  \returns
+ *  \p NNC_R_BAD_ALIGN => A content to encrypt is not aligned to 0x10 bytes.\n
+ *  Anything \ref nnc_decrypt_tkey can return.
  */
 nnc_result nnc_write_cia(
-	nnc_u8 wflags,
+	nnc_u16 wflags,
 	nnc_certchain_or_stream certchain,
 	nnc_ticket_or_stream ticket,
 	nnc_tmd_or_stream tmd,
+	nnc_meta_or_stream meta,
 	nnc_u16 amount_contents,
 	nnc_cia_writable_ncch *contents,
 	nnc_wstream *ws
 );
 
+/** \brief            Assemble a CIA from CDN contents.
+ *  \param cflags     Flags, see #nnc_cdn_flags.
+ *  \param cdn        Directory containing the TMD ("tmd" or "tmd.<version>", the highest version is used if there are multiple)
+ *                    and the contents named after their content ID ("%08x" or "%08X").
+ *  \param ticket     Ticket to put in the CIA, certificates appended to it (like in "cetk" files) are not copied.
+ *  \param certchain  Certificate chain to put in the CIA.
+ *  \param ws         Output write stream, this is written sequentially and does not need to support seeking.
+ *  \note             The contents are copied as-is, without decrypting or re-encrypting them. If both ends are files
+ *                    the copy is done by the kernel if possible.
+ *  \note             Optional contents that are not present in \p cdn are left out of the CIA.
+ *  \returns
+ *  \p NNC_R_NOT_FOUND => The TMD or a required content was not found.\n
+ *  \p NNC_R_CORRUPT => A content is smaller than the TMD says it is, or the hash doesn't match with #NNC_CDN_VERIFY.\n
+ *  \p NNC_R_MISMATCH => The ticket is not for the title described by the TMD.\n
+ *  Anything \ref nnc_read_tmd_header can return.\n
+ *  Anything \ref nnc_read_tmd_chunk_records can return.\n
+ *  Anything \ref nnc_ticket_size can return.\n
+ *  Anything \ref nnc_decrypt_tkey can return.
+ */
+nnc_result nnc_cia_from_cdn(
+	nnc_u8 cflags,
+	nnc_cdn_dir_or_vfs cdn,
+	nnc_rstream *ticket,
+	nnc_rstream *certchain,
+	nnc_wstream *ws
+);
+
 NNC_END
 #endif
 
@@ -47,14 +47,40 @@ typedef struct nnc_seeddb {
 		nnc_u8 seed[NNC_SEED_SIZE];
 		nnc_u64 title_id;
 	} *entries;
+	/** Equal to \p entries if they're sorted by title ID, only set by \ref nnc_sort_seeddb;
+	 *  any other value (such as leftovers in a SeedDB built by hand) means they may not be.
+	 *  \note This member was added after \p entries, which changes the size of this struct. */
+	struct nnc_seeddb_entry *sorted;
 } nnc_seeddb;
 
+/** \brief  Thread context, see \ref nnc_set_thread_context.
+ *  \note   Members left NULL fall back to the process-wide defaults.
+ */
+typedef struct nnc_context {
+	nnc_keyset *kset;   ///< Keyset returned by \ref nnc_get_default_keyset.
+	nnc_seeddb *seeddb; ///< SeedDB returned by \ref nnc_get_default_seeddb.
+} nnc_context;
+
 enum nnc_section {
 	NNC_SECTION_EXHEADER  = 1, ///< NCCH extended header section.
 	NNC_SECTION_EXEFS     = 2, ///< NCCH ExeFS section.
 	NNC_SECTION_ROMFS     = 3, ///< NCCH RomFS section.
 };
 
+/** Size of \ref nnc_crypto_ctx_storage. */
+#define NNC_CRYPTO_CTX_STORAGE_SIZE 0x140
+
+/** Space for a context of the cryptographic library used, so that it
+ *  doesn't have to be allocated. If a context does not fit it is
+ *  allocated dynamically instead.
+ *  \note A context may point into itself, so the storage may not be
+ *        moved while it is in use. */
+typedef union nnc_crypto_ctx_storage {
+	nnc_u8 data[NNC_CRYPTO_CTX_STORAGE_SIZE];
+	nnc_u64 align_u64;
+	void *align_ptr;
+} nnc_crypto_ctx_storage;
+
 typedef struct nnc_aes_ctr {
 	const void *funcs;
 	void *crypto_ctx; ///< Context for the cryptographic library used.
@@ -62,6 +88,7 @@ typedef struct nnc_aes_ctr {
 	nnc_u8 last_unaligned_block[0x10];
 	nnc_u8 ctr[0x10];
 	nnc_u128 iv;
+	nnc_u32 offset; ///< Position of the child where the counter starts, only used when writing.
 } nnc_aes_ctr;
 
 typedef struct nnc_aes_cbc {
@@ -86,6 +113,8 @@ typedef struct nnc_hasher_writer {
 	nnc_sha256_incremental_hash hash;
 	nnc_wstream *child;
 	nnc_u32 lim, hashed;
+	void *crypto_ctx; ///< Context for the cryptographic library used, only used by \ref nnc_open_cbc_hasher_writer.
+	nnc_u8 iv[0x10];
 } nnc_hasher_writer;
 
 /** \brief An enumeration containing the possible (builtin) keysets */
@@ -129,6 +158,21 @@ void nnc_crypto_sha256_reset(nnc_sha256_incremental_hash self);
  */
 void nnc_crypto_sha256_free(nnc_sha256_incremental_hash self);
 
+/** \brief          Initializes a SHA256 incremental hasher in caller-supplied storage.
+ *  \param self     The hasher to initialize.
+ *  \param storage  Storage for the hasher, this must stay valid and may not be moved while the hasher is in use.
+ *  \note           Free this hasher with \ref nnc_crypto_sha256_free_in, not \ref nnc_crypto_sha256_free.
+ *  \returns
+ *  \p NNC_R_NOMEM => The hasher didn't fit in \p storage and allocating memory for it failed.
+ */
+nnc_result nnc_crypto_sha256_incremental_in(nnc_sha256_incremental_hash *self, nnc_crypto_ctx_storage *storage);
+
+/** \brief          Frees a hasher from \ref nnc_crypto_sha256_incremental_in.
+ *  \param self     The hasher to free.
+ *  \param storage  Storage given to \ref nnc_crypto_sha256_incremental_in.
+ */
+void nnc_crypto_sha256_free_in(nnc_sha256_incremental_hash self, nnc_crypto_ctx_storage *storage);
+
 /** \brief        Open a hasher writer: the stream form of incremental hashing.
  *  \param self   Output hasher writer.
  *  \param child  Child write stream.
@@ -138,6 +182,15 @@ void nnc_crypto_sha256_free(nnc_sha256_incremental_hash self);
  */
 nnc_result nnc_open_hasher_writer(nnc_hasher_writer *self, nnc_wstream *child, nnc_u32 limit);
 
+/** \brief        Open a hasher writer that hashes the AES-CBC decrypted data, the data itself is written to \p child unchanged.
+ *  \param self   Output hasher writer.
+ *  \param child  Child write stream.
+ *  \param key    AES key.
+ *  \param iv     Initial IV.
+ *  \note         This is useful to verify encrypted data while copying it, writes must be a multiple of 0x10 in size.
+ */
+nnc_result nnc_open_cbc_hasher_writer(nnc_hasher_writer *self, nnc_wstream *child, nnc_u8 key[0x10], nnc_u8 iv[0x10]);
+
 /** \brief         Output the digest of a hasher writer and close it.
  *  \param self    Hasher writer to get the digest of and close.
  *  \param digest  Output digest.
@@ -170,6 +223,19 @@ nnc_result nnc_crypto_sha256_part(nnc_rstream *rs, nnc_sha256_hash digest, nnc_u
  */
 nnc_result nnc_crypto_sha256_stream(nnc_rstream *rs, nnc_sha256_hash digest);
 
+/** \brief         Hash the rest of a \ref nnc_rstream and optionally write it to another stream.
+ *                 The data is processed in chunks small enough to stay in the CPU cache, so with
+ *                 a decrypting stream such as \ref nnc_aes_cbc or a content or section stream
+ *                 every chunk is decrypted, hashed and written before the next one is read.
+ *  \param rs      Stream to read from.
+ *  \param digest  Output digest.
+ *  \param sink    Stream to write the data read from \p rs to, may be NULL.
+ *  \returns
+ *  Anything \ref nnc_crypto_sha256_part can return.\n
+ *  Anything \p sink->write() can return.
+ */
+nnc_result nnc_crypto_decrypt_hash(nnc_rstream *rs, nnc_sha256_hash digest, nnc_wstream *sink);
+
 /** \brief         Hash a buffer.
  *  \param data    Data pointer.
  *  \param size    Data size.
@@ -215,8 +281,11 @@ nnc_result nnc_keyset_default(nnc_keyset *ks, nnc_u8 setsel);
  *  \param seeddb  Output SeedDB.
  *  \note          This function allocates dynamic memory so be sure to free
  *                 it with \ref nnc_free_seeddb.
+ *  \note          The resulting SeedDB is sorted, see \ref nnc_sort_seeddb.
  *  \returns
  *  Anything \p rs->read() can return.\n
+ *  \p NNC_R_TOO_SMALL => The SeedDB is truncated.\n
+ *  \p NNC_R_CORRUPT => The amount of entries is impossibly large.\n
  *  \p NNC_R_NOMEM => Failed to allocate memory for seeds.
  */
 nnc_result nnc_seeds_seeddb(nnc_rstream *rs, nnc_seeddb *seeddb);
@@ -235,6 +304,15 @@ nnc_result nnc_seeds_seeddb(nnc_rstream *rs, nnc_seeddb *seeddb);
  */
 nnc_result nnc_scan_seeddb(nnc_seeddb *seeddb);
 
+/** \brief         Sorts the entries of a SeedDB by title ID so lookups
+ *                 use a binary search instead of a linear scan.
+ *  \param seeddb  SeedDB to sort.
+ *  \note          Use this on SeedDBs you build yourself; SeedDBs read with
+ *                 \ref nnc_seeds_seeddb are already sorted. Sort again after
+ *                 changing the entries in place.
+ */
+void nnc_sort_seeddb(nnc_seeddb *seeddb);
+
 /** \brief         Get a seed from a SeedDB.
  *  \param tid     Title ID to search for.
  *  \param seeddb  SeedDB to search in.
@@ -242,6 +320,15 @@ nnc_result nnc_scan_seeddb(nnc_seeddb *seeddb);
  */
 nnc_u8 *nnc_get_seed(nnc_seeddb *seeddb, nnc_u64 tid);
 
+/** \brief         Get multiple seeds from a SeedDB at once.
+ *  \param seeddb  SeedDB to search in.
+ *  \param tids    Title IDs to search for.
+ *  \param seeds   Output seed pointers, set to NULL for title IDs that are not found.
+ *  \param count   Amount of title IDs in \p tids and \p seeds.
+ *  \returns       The amount of seeds found.
+ */
+nnc_u32 nnc_get_seeds(nnc_seeddb *seeddb, const nnc_u64 *tids, nnc_u8 **seeds, nnc_u32 count);
+
 /** \brief         Frees dynamic memory allocated by \ref nnc_seeds_seeddb or
  *                 \ref nnc_scan_seeddb.
  *  \param seeddb  SeedDB to free.
@@ -313,6 +400,20 @@ nnc_result nnc_get_ncch_iv(struct nnc_ncch_header *ncch, nnc_u8 for_section,
 nnc_result nnc_aes_ctr_open(nnc_aes_ctr *self, nnc_rstream *child, nnc_u128 *key,
 	nnc_u8 iv[0x10]);
 
+/** \brief        Encrypt an AES-CTR stream on-the-fly.
+ *  \param self   Output AES-CTR stream.
+ *  \param child  Child stream to encrypt to, the counter starts at the current position of this stream.
+ *  \param key    Encryption key.
+ *  \param iv     Initial counter.
+ *  \note         This stream can seek if \p child can seek, which is
+ *                required by for example \ref nnc_write_romfs.
+ *  \note         Calling close on this stream doesn't close the substream.
+ *  \returns
+ *  \p NNC_R_NOMEM => Failed to allocate AES-CTR context.
+ */
+nnc_result nnc_aes_ctr_open_w(nnc_aes_ctr *self, nnc_wstream *child, nnc_u128 *key,
+	nnc_u8 iv[0x10]);
+
 /** \brief        Decrypt an AES-CBC stream on-the-fly.
  *  \param self   Output AES-CBC stream.
  *  \param child  Child stream to decrypt from.
@@ -342,6 +443,18 @@ nnc_result nnc_aes_cbc_open(nnc_aes_cbc *self, nnc_rstream *child, nnc_u8 key[0x
 nnc_result nnc_aes_cbc_open_w(nnc_aes_cbc *self, nnc_wstream *child, nnc_u8 key[0x10],
 	nnc_u8 iv[0x10]);
 
+/** \brief       Encrypt a buffer in-place with AES-CBC.
+ *  \param key   Encryption key.
+ *  \param iv    IV, this is updated so that the next call continues the chain.
+ *  \param buf   Buffer to encrypt.
+ *  \param size  Size of \p buf, this must be aligned to 0x10 bytes.
+ *  \note        This function may be called from multiple threads at once.
+ *  \returns
+ *  \p NNC_R_BAD_ALIGN => \p size is not aligned to 0x10 bytes.\n
+ *  \p NNC_R_NOMEM => Failed to allocate memory for the AES context.
+ */
+nnc_result nnc_aes_cbc_encrypt_buffer(nnc_u8 key[0x10], nnc_u8 iv[0x10], nnc_u8 *buf, nnc_u32 size);
+
 /** \brief         Get a key pair for an NCCH.
  *  \param output  Output keypair.
  *  \param ks      Keyset from \ref nnc_keyset_default.
@@ -366,10 +479,25 @@ struct nnc_ticket;
  *  \param ks         Keyset from \ref nnc_keyset_default.
  *  \param decrypted  Output decrypted title key.
  *  \returns
- *  \p NNC_R_CORRUPT => Ticket keyY is invalid.
+ *  \p NNC_R_CORRUPT => Ticket keyY is invalid.\n
+ *  \p NNC_R_NOMEM => Failed to allocate memory for the AES context.
  */
 nnc_result nnc_decrypt_tkey(struct nnc_ticket *tik, nnc_keyset *ks, nnc_u8 decrypted[0x10]);
 
+/** \brief            Decrypt the title keys of many tickets at once.
+ *  \param tiks       Tickets from \ref nnc_read_ticket or \ref nnc_ticket_scan.
+ *  \param count      Amount of tickets in \p tiks and keys in \p decrypted.
+ *  \param ks         Keyset from \ref nnc_keyset_default.
+ *  \param decrypted  Output decrypted title keys.
+ *  \note             Every common key is only set up once, so this is faster
+ *                    than calling \ref nnc_decrypt_tkey for every ticket.
+ *  \returns
+ *  \p NNC_R_CORRUPT => The keyY of one or more tickets is invalid, their keys are set to zeroes
+ *                      but all other keys are decrypted.\n
+ *  \p NNC_R_NOMEM => Failed to allocate memory for an AES context.
+ */
+nnc_result nnc_decrypt_tkeys(struct nnc_ticket *tiks, nnc_u32 count, nnc_keyset *ks, nnc_u8 (*decrypted)[0x10]);
+
 /** \brief     Sets a default seeddb. \see nnc_get_default_seeddb.
  *  \param sdb The seeddb to set.
  *  \returns   A pointer to the old default seeddb.
@@ -379,7 +507,7 @@ nnc_result nnc_decrypt_tkey(struct nnc_ticket *tik, nnc_keyset *ks, nnc_u8 decry
 nnc_seeddb *nnc_set_default_seeddb(struct nnc_seeddb *sdb);
 
 /** \brief   Gets the default seeddb. \see nnc_set_default_seeddb.
- *  \returns A pointer to the global seeddb.
+ *  \returns A pointer to the seeddb of the current thread context (see \ref nnc_set_thread_context) or the global seeddb.
  *  \note    This seeddb will always be valid unless \ref nnc_set_default_seeddb was called improperly.
  */
 nnc_seeddb *nnc_get_default_seeddb(void);
@@ -389,16 +517,27 @@ nnc_seeddb *nnc_get_default_seeddb(void);
  *  \returns     A pointer to the old default keyset.
  *  \warning     \p kset must remain alive until this function is called with another keyset.
  *  \note        If \p kset is NULL, a keyset with retail keys initialized with \ref nnc_keyset_default will be set.
- *  \note        If \p kset is not yet initialized \ref nnc_get_default_keyset will initialize it with retail keys with \ref nnc_keyset_default.
+ *  \note        If \p kset is not yet initialized it will be initialized with retail keys with \ref nnc_keyset_default.
  */
 nnc_keyset *nnc_set_default_keyset(struct nnc_keyset *kset);
 
 /** \brief   Gets the default keyset. \see nnc_set_default_keyset.
- *  \returns A pointer to the default keyset.
+ *  \returns A pointer to the keyset of the current thread context (see \ref nnc_set_thread_context) or the global default keyset.
  *  \note    This keyset will always be valid unless \ref nnc_set_default_keyset was called improperly.
  */
 nnc_keyset *nnc_get_default_keyset(void);
 
+/** \brief       Sets the context of the calling thread, its members override the process-wide defaults on this thread only.
+ *  \param ctx   The context to set, NULL to use the process-wide defaults again.
+ *  \returns     A pointer to the old context of this thread.
+ *  \warning     \p ctx must remain alive until this function is called with another context on the same thread.
+ *  \note        Every function that uses the default keyset or seeddb implicitly (such as \ref nnc_write_cia) uses the context of the calling thread,
+ *               so threads that each need their own keys or seeds can run these functions concurrently without any locking.
+ *  \note        Unlike \ref nnc_set_default_keyset this function does not initialize the keyset in \p ctx.
+ *  \note        On platforms without thread local storage the context is shared by all threads.
+ */
+nnc_context *nnc_set_thread_context(nnc_context *ctx);
+
 NNC_END
 #endif
 
@@ -82,6 +82,11 @@ typedef struct nnc_condensed_ncch_header {
 	nnc_u8 type;
 	char product_code[17];
 	char maker_code[3];
+	/* the fields below are only used with NNC_NCCH_WF_ENCRYPT */
+	nnc_u8 crypt_method; ///< Determines the keys to use, see \ref nnc_ncch_crypt_methods.
+	nnc_u8 crypt_flags;  ///< Only \ref NNC_NCCH_FIXED_KEY and \ref NNC_NCCH_USES_SEED are used from this, see \ref nnc_ncch_flags.
+	nnc_u128 keyy;       ///< KeyY to write in the signature, this is not used with \ref NNC_NCCH_FIXED_KEY.
+	nnc_u8 *seed;        ///< Seed to use with \ref NNC_NCCH_USES_SEED, NULL to look it up in the default SeedDB (see \ref nnc_get_default_seeddb).
 } nnc_condensed_ncch_header;
 
 typedef void* nnc_vfs_or_stream;
@@ -109,6 +114,7 @@ enum nnc_ncch_wflags {
 	NNC_NCCH_WF_EXHEADER_BUILD   = 16,  ///< Write a new exheader based on the exheader field in the union.
 	NNC_NCCH_WF_EXHEADER_STREAM  = 32,  ///< Copy the exheader from a stream.
 	NNC_NCCH_WF_EXHEADER_OMIT    = 0,   ///< Omit the exheader from the NCCH, pass NULL for the `exheader` parameter.
+	NNC_NCCH_WF_ENCRYPT          = 64,  ///< Encrypt the NCCH with the crypto settings in the header, the sections passed must be decrypted.
 };
 
 /** A pseudo-stream to hold all possible required streams, yet still
@@ -125,21 +131,18 @@ typedef struct nnc_ncch_section_stream {
 	} u;
 } nnc_ncch_section_stream;
 
-typedef struct nnc_ncch_exefs_substream {
-	union nnc_ncch_exefs_substream_stype {
-		nnc_ncch_section_stream section;
-		nnc_subview raw;
-	} stream;
-	nnc_u32 offset;
-	nnc_u32 size;
-	nnc_u32 readoff;
+typedef union nnc_ncch_exefs_substream {
+	nnc_ncch_section_stream section;
+	nnc_subview raw;
 } nnc_ncch_exefs_substream;
 
+#define NNC_EXEFS_MAX_SUBSTREAMS ((1 + NNC_EXEFS_MAX_FILES) * 2)
+
+/** A stream for the full ExeFS, made up of the (decrypted) ExeFS
+ *  header, files and the raw data in between them; these are allocated
+ *  while the stream is open so the object itself may be moved. */
 typedef struct nnc_ncch_exefs_stream {
-	const nnc_rstream_funcs *funcs;
-	nnc_ncch_exefs_substream substreams[(1 + NNC_EXEFS_MAX_FILES) * 2];
-	nnc_u32 pos, size;
-	nnc_u8 filecount, streamcount, curstream;
+	nnc_concat concat;
 } nnc_ncch_exefs_stream;
 
 
@@ -197,6 +200,8 @@ nnc_result nnc_ncch_exefs_subview(nnc_ncch_header *ncch, nnc_rstream *rs,
  *  \param ncch  NCCH to open ExeFS file of.
  *  \param rs    Stream associated with NCCH.
  *  \param kp    Keypair from \ref nnc_fill_keypair.
+ *  \returns
+ *  \p NNC_R_NOMEM => Failed to allocate the substreams.
  */
 nnc_result nnc_ncch_exefs_full_stream(nnc_ncch_exefs_stream *self, nnc_ncch_header *ncch, nnc_rstream *rs, nnc_keypair *kp);
 
@@ -253,6 +258,12 @@ void nnc_condense_ncch(nnc_condensed_ncch_header *cnd, nnc_ncch_header *hdr);
  *  \param romfs     RomFS section, for possible types see #nnc_ncch_wflags.
  *  \param ws        The output write stream.
  *  \note            The write stream *must* support seeking.
+ *  \note            With #NNC_NCCH_WF_ENCRYPT the sections are encrypted while they are written, the keys
+ *                   are derived using the default keyset (see \ref nnc_get_default_keyset). The hashes in
+ *                   the header are always over the decrypted data.
+ *  \returns
+ *  \p NNC_R_SEED_NOT_FOUND => The header requires a seed, but none is given nor found.\n
+ *  Anything \ref nnc_fill_keypair can return.
  */
 nnc_result nnc_write_ncch(
 	nnc_condensed_ncch_header *header,
@@ -55,6 +55,33 @@ typedef struct nnc_certchain {
 	int len;                ///< Amount of certificates.
 } nnc_certchain;
 
+/** \brief  Public keys from a certificate chain, parsed once and indexed by certificate name.
+ *  \see    nnc_certstore_open
+ */
+typedef struct nnc_certstore {
+	struct nnc_certstore_key *keys; ///< Keys sorted by name (internal).
+	int len;                        ///< Amount of keys.
+} nnc_certstore;
+
+/** \brief  A single signature to verify with \ref nnc_certstore_verify_batch. */
+typedef struct nnc_sigcheck {
+	nnc_signature *sig; ///< Signature to verify with.
+	nnc_u8 *hash;       ///< Hash to verify, a \ref nnc_sha_hash.
+	nnc_result res;     ///< Output result, see \ref nnc_certstore_verify.
+} nnc_sigcheck;
+
+#define NNC_SIGCACHE_WAYS 8 ///< Amount of entries per set in a \ref nnc_sigcache.
+
+/** \brief  Cache of signature verification results, see \ref nnc_sigcache_verify.
+ *  \note   The cache is set-associative: every result can only be kept in one set of
+ *          \ref NNC_SIGCACHE_WAYS entries, of which the least recently used one is replaced.
+ */
+typedef struct nnc_sigcache {
+	struct nnc_sigcache_entry *entries; ///< Entries (internal).
+	nnc_u32 sets;                       ///< Amount of sets.
+	nnc_u32 clock;                      ///< Counter used to track when entries were last used.
+} nnc_sigcache;
+
 /** \brief      Gets the signature size from the type.
  *  \return     Returns total signature size (<u>including</u> the 4 identifying bytes), <u>not</u> including the issuer (size=0x40) or 0 if invalid.
  *  \param sig  Signature type.
@@ -100,6 +127,84 @@ const char *nnc_sigstr(enum nnc_sigtype sig);
  */
 nnc_result nnc_verify_signature(nnc_certchain *chain, nnc_signature *sig, nnc_sha_hash hash);
 
+/** \brief        Parses the public keys of all certificates in \p chain for faster verification of many signatures.
+ *  \param store  Output certificate store.
+ *  \param chain  Chain to take certificates from. This chain is not referenced after this function returns.
+ *  \note         You should always call \ref nnc_certstore_free after you're done with \p store.
+ *  \return
+ *  \p NNC_R_NOMEM => Failed to allocate memory for the store.
+ */
+nnc_result nnc_certstore_open(nnc_certstore *store, nnc_certchain *chain);
+
+/** \brief        Verifies a signature with a certificate store.
+ *  \param store  Store to select certificate from.
+ *  \param sig    Signature to verify with.
+ *  \param hash   Hash to verify.
+ *  \note         This function may not be called from multiple threads at once with the same \p store, use \ref nnc_certstore_verify_batch instead.
+ *  \return
+ *  Same as \ref nnc_verify_signature.
+ */
+nnc_result nnc_certstore_verify(nnc_certstore *store, nnc_signature *sig, nnc_sha_hash hash);
+
+/** \brief          Verifies many signatures with a certificate store.
+ *  \param store    Store to select certificates from.
+ *  \param checks   Signatures to verify, \ref nnc_sigcheck::res is set for each of them.
+ *  \param count    Amount of elements in \p checks.
+ *  \param threads  Maximum amount of threads to verify on, 0 or 1 to verify everything on the calling thread.
+ *  \return         Amount of signatures that passed verification.
+ */
+nnc_u32 nnc_certstore_verify_batch(nnc_certstore *store, nnc_sigcheck *checks, nnc_u32 count, nnc_u8 threads);
+
+/** \brief        free()s dynamic memory in use by a certificate store.
+ *  \param store  Certificate store to free.
+ */
+void nnc_certstore_free(nnc_certstore *store);
+
+/** \brief          Initializes an empty signature verification cache.
+ *  \param cache    Output cache.
+ *  \param entries  Maximum amount of results to keep, rounded up to a multiple of \ref NNC_SIGCACHE_WAYS.
+ *  \note           You should always call \ref nnc_sigcache_free after you're done with \p cache.
+ *  \return
+ *  \p NNC_R_NOMEM => Failed to allocate memory for the cache.
+ */
+nnc_result nnc_sigcache_init(nnc_sigcache *cache, nnc_u32 entries);
+
+/** \brief        Loads a signature verification cache written by \ref nnc_sigcache_save.
+ *  \param cache  Output cache.
+ *  \param rs     Stream to read cache from.
+ *  \note         The file is a small header followed by the raw entries, the entries are read with a single read.
+ *  \note         You should always call \ref nnc_sigcache_free after you're done with \p cache.
+ *  \return
+ *  Anything rs->read() can return.\n
+ *  \p NNC_R_CORRUPT => Not a (compatible) cache file.\n
+ *  \p NNC_R_NOMEM => Failed to allocate memory for the cache.
+ */
+nnc_result nnc_sigcache_load(nnc_sigcache *cache, nnc_rstream *rs);
+
+/** \brief        Writes a signature verification cache.
+ *  \param cache  Cache to write.
+ *  \param ws     Output stream.
+ */
+nnc_result nnc_sigcache_save(nnc_sigcache *cache, nnc_wstream *ws);
+
+/** \brief        Verifies a signature like \ref nnc_certstore_verify, but remembers the result in \p cache.
+ *  \param cache  Cache to look up and store the result in.
+ *  \param store  Store to select certificate from.
+ *  \param sig    Signature to verify with.
+ *  \param hash   Hash to verify.
+ *  \note         Results are keyed by the signature, \p hash and the public key of the selected certificate,
+ *                so a different certificate with the same name never reuses a result.
+ *  \note         This function may not be called from multiple threads at once with the same \p cache or \p store.
+ *  \return
+ *  Same as \ref nnc_verify_signature.
+ */
+nnc_result nnc_sigcache_verify(nnc_sigcache *cache, nnc_certstore *store, nnc_signature *sig, nnc_sha_hash hash);
+
+/** \brief        free()s dynamic memory in use by a signature verification cache.
+ *  \param cache  Cache to free.
+ */
+void nnc_sigcache_free(nnc_sigcache *cache);
+
 /** \brief         Selects either sha1 or sha256 based on \p sig.
  *  \param rs      Stream to read data from.
  *  \param sig     Signature type.
@@ -40,6 +40,9 @@ typedef nnc_u32 (*nnc_size_func)(struct nnc_rstream *self);
 typedef void (*nnc_close_func)(struct nnc_rstream *self);
 /** Get current position in stream */
 typedef nnc_u32 (*nnc_tell_func)(struct nnc_rstream *self);
+/** Read from an absolute position in the stream without moving the current position. */
+typedef nnc_result (*nnc_read_at_func)(struct nnc_rstream *self, nnc_u32 offset, nnc_u8 *buf,
+		nnc_u32 max, nnc_u32 *totalRead);
 
 /** All functions a stream should have */
 typedef struct nnc_rstream_funcs {
@@ -49,6 +52,7 @@ typedef struct nnc_rstream_funcs {
 	nnc_size_func size;
 	nnc_close_func close;
 	nnc_tell_func tell;
+	nnc_read_at_func read_at; ///< Optional, may be NULL; use \ref nnc_read_at to call.
 } nnc_rstream_funcs;
 
 /** Struct containing just a func table which should be
@@ -87,6 +91,17 @@ typedef struct nnc_subview {
 	nnc_u8 flags;
 } nnc_subview;
 
+/** Stream for reading multiple streams back-to-back as one */
+typedef struct nnc_concat {
+	const nnc_rstream_funcs *funcs;
+	nnc_rstream **children;
+	nnc_u32 *offsets;
+	nnc_u32 count;
+	nnc_u32 pos;
+	nnc_u32 current;
+	void *owned; ///< Freed on close, see \ref nnc_concat_free_on_close.
+} nnc_concat;
+
 /** \brief       Create a new file stream.
  *  \param self  Output stream.
  *  \param name  Filename to open. */
@@ -119,6 +134,32 @@ void nnc_subview_open(nnc_subview *self, nnc_rstream *child, nnc_u32 off, nnc_u3
  */
 void nnc_subview_delete_on_close(nnc_subview *self);
 
+/** \brief           Create a new concatenation stream.
+ *  \param self      Output stream.
+ *  \param children  Streams to concatenate, in order.
+ *  \param offsets   Array of \p count + 1 entries, filled with the starting offset of every child and the total size as last entry.
+ *  \param count     Amount of children.
+ *  \note            Closing this stream closes all children. \p children and \p offsets must stay valid while the stream is open.
+ */
+void nnc_concat_open(nnc_concat *self, nnc_rstream **children, nnc_u32 *offsets, nnc_u32 count);
+
+/** \brief        Free a block of memory when the concatenation stream is closed, after closing the children.
+ *  \param self   Stream to modify.
+ *  \param block  Memory from malloc(), usually the one holding the children and offsets.
+ */
+void nnc_concat_free_on_close(nnc_concat *self, void *block);
+
+/** \brief            Read from an absolute position in a stream.
+ *  \param rs         Stream to read from.
+ *  \param offset     Position to read at.
+ *  \param buf        Output buffer.
+ *  \param max        Maximum amount of bytes to read.
+ *  \param totalRead  Output amount of bytes read.
+ *  \note             Uses the read_at function of the stream if it has one, otherwise seeks and reads,
+ *                    in which case the current position of the stream is changed.
+ */
+nnc_result nnc_read_at(nnc_rstream *rs, nnc_u32 offset, nnc_u8 *buf, nnc_u32 max, nnc_u32 *totalRead);
+
 /** \} */
 
 /** \{
@@ -47,6 +47,18 @@ typedef struct nnc_ticket {
  */
 nnc_result nnc_read_ticket(nnc_rstream *rs, nnc_ticket *tik);
 
+/** \brief       Determines the size of the ticket at the start of a stream.
+ *  \param rs    Stream to read from.
+ *  \param size  Output size.
+ *  \note        The size includes the content index, but not any certificates that may be appended
+ *               after the ticket (like in "cetk" files from the CDN).
+ *  \returns
+ *  \p NNC_R_INVALID_SIG => Invalid signature.\n
+ *  \p NNC_R_TOO_SMALL => Stream is too small to contain the ticket.\n
+ *  Anything rstream read can return.
+ */
+nnc_result nnc_ticket_size(nnc_rstream *rs, nnc_u32 *size);
+
 /** \brief      Writes a ticket.
  *  \param tik  Ticket to write.
  *  \param ws   Output write stream.
@@ -63,6 +75,67 @@ nnc_result nnc_write_ticket(nnc_ticket *tik, nnc_wstream *ws);
  */
 nnc_result nnc_ticket_signature_hash(nnc_rstream *rs, nnc_ticket *tik, nnc_sha_hash digest);
 
+/** \brief         Called by \ref nnc_ticket_scan for every ticket.
+ *  \param tik     The ticket, only valid during the call.
+ *  \param offset  Offset of the ticket in the stream.
+ *  \param size    Size of the ticket, see \ref nnc_ticket_size.
+ *  \param udata   \p udata passed to \ref nnc_ticket_scan.
+ *  \returns       \p NNC_R_OK to continue scanning, anything else stops
+ *                 the scan and is returned by \ref nnc_ticket_scan.
+ */
+typedef nnc_result (*nnc_ticket_scan_func)(nnc_ticket *tik, nnc_u32 offset, nnc_u32 size, void *udata);
+
+/** \brief           Reads every ticket of a stream of concatenated tickets.
+ *  \param rs        Stream to read from, must contain nothing but tickets.
+ *  \param callback  Function to call for every ticket, in stream order.
+ *  \param udata     Passed to \p callback.
+ *  \note            The stream is read in large blocks and the tickets are parsed
+ *                   from memory, so this is a lot faster than calling \ref nnc_ticket_size
+ *                   and \ref nnc_read_ticket for every ticket.
+ *  \returns
+ *  \p NNC_R_NOMEM => Failed to allocate the read buffer.\n
+ *  \p NNC_R_INVALID_SIG => Invalid signature.\n
+ *  \p NNC_R_TOO_SMALL => The last ticket is truncated.\n
+ *  \p NNC_R_CORRUPT => A content index is unreasonably large.\n
+ *  Anything \p callback can return.\n
+ *  Anything rstream read can return.
+ */
+nnc_result nnc_ticket_scan(nnc_rstream *rs, nnc_ticket_scan_func callback, void *udata);
+
+/** Index of the tickets in a stream, see \ref nnc_index_tickets. */
+typedef struct nnc_ticket_index {
+	struct nnc_ticket_index_entry {
+		nnc_u64 title_id; ///< Title ID of the ticket.
+		nnc_u32 offset;   ///< Offset of the ticket in the stream.
+		nnc_u32 size;     ///< Size of the ticket.
+	} *entries;       ///< Entries, sorted by title ID and then offset.
+	nnc_u32 count;    ///< Amount of entries.
+	nnc_u32 alloc;    ///< Amount of allocated entries.
+} nnc_ticket_index;
+
+/** \brief        Builds an index of the tickets in a stream of concatenated tickets.
+ *  \param rs     Stream to read from, see \ref nnc_ticket_scan.
+ *  \param index  Output index, free it with \ref nnc_free_ticket_index.
+ *  \returns
+ *  \p NNC_R_NOMEM => Failed to allocate memory for the index.\n
+ *  Anything \ref nnc_ticket_scan can return.
+ */
+nnc_result nnc_index_tickets(nnc_rstream *rs, nnc_ticket_index *index);
+
+/** \brief        Finds the first ticket for a title ID in an index.
+ *  \param index  Index to search in.
+ *  \param tid    Title ID to search for.
+ *  \returns      Pointer to the entry with the lowest offset if found, else NULL.
+ *  \note         A title may have multiple tickets, those are the entries
+ *                directly after the returned one with the same title ID.
+ */
+struct nnc_ticket_index_entry *nnc_find_ticket(nnc_ticket_index *index, nnc_u64 tid);
+
+/** \brief        Frees dynamic memory allocated by \ref nnc_index_tickets.
+ *  \param index  Index to free.
+ */
+void nnc_free_ticket_index(nnc_ticket_index *index);
+
 NNC_END
 #endif
 
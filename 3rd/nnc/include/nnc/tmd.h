@@ -92,6 +92,7 @@ nnc_result nnc_read_tmd_info_records(nnc_rstream *rs, nnc_tmd_header *tmd,
  *  \param rs       Stream to read TMD from.
  *  \param tmd      TMD header gotten from \ref nnc_read_tmd_header.
  *  \param records  Array of records gotten from one of the read functions.
+ *  \note           All chunk records are read at once, for large TMDs the info records are hashed on multiple threads.
  */
 bool nnc_verify_tmd_chunk_records(nnc_rstream *rs, nnc_tmd_header *tmd, nnc_cinfo_record *records);
 
@@ -100,6 +101,10 @@ bool nnc_verify_tmd_chunk_records(nnc_rstream *rs, nnc_tmd_header *tmd, nnc_cinf
  *  \param tmd      TMD header gotten from \ref nnc_read_tmd_header.
  *  \param records  Array of records with a size of at least tmd->content_count. As a reference,
  *                  Godmode9 statically allocates 383 or 1024 for large TMDs records.
+ *  \return
+ *  Anything \ref nnc_read_at_exact can return.\n
+ *  \p NNC_R_INVALID_SIG => Invalid signature type in \p tmd.\n
+ *  \p NNC_R_NOMEM => Failed to allocate memory to read the records into.
  */
 nnc_result nnc_read_tmd_chunk_records(nnc_rstream *rs, nnc_tmd_header *tmd, nnc_chunk_record *records);
 
@@ -129,7 +129,14 @@ namespace nnc
 		}
 #endif
 
-		/* TODO: Implement meta generally */
+		result meta(nnc_cia_meta& meta)
+		{
+			nnc::subview sv;
+			result r = this->meta_view(sv);
+			if(r == result::ok)
+				r = (result) nnc_read_cia_meta(sv.as_rstream(), &meta);
+			return r;
+		}
 
 	private:
 		struct nnc_cia_header hdr;
@@ -152,7 +152,7 @@ namespace nnc
 			int rflags = (int) flags;
 			/* this is allowed even without NNCPP_ALLOW_IGNORE_ERRORS because it doesn't matter if scanning fails */
 			if(rflags & (int) init_flag::scan) (void) this->scan();
-			else                               { this->seeds.size = 0; this->seeds.entries = nullptr; }
+			else                               { this->seeds.size = 0; this->seeds.entries = this->seeds.sorted = nullptr; }
 			if(rflags & (int) init_flag::use_default)
 				this->use_as_default();
 		}
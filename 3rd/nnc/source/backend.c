@@ -0,0 +1,267 @@
+#include <string.h>
+#include "./backend.h"
+
+#if NNC_CRYPTO_OPENSSL
+
+#include <openssl/param_build.h>
+#include <openssl/crypto.h>
+#include <openssl/rsa.h>
+#include <openssl/bn.h>
+
+enum aes_mode {
+	MODE_NONE,
+	MODE_CBC,
+	MODE_CTR,
+};
+
+bool nnc_be_aes_setkey(nnc_be_aes *ctx, const u8 key[0x10], bool decrypt)
+{
+	if(!(ctx->ctx = EVP_CIPHER_CTX_new()))
+		return false;
+	memcpy(ctx->key, key, 0x10);
+	ctx->decrypt = decrypt;
+	ctx->mode = MODE_NONE;
+	return true;
+}
+
+void nnc_be_aes_free(nnc_be_aes *ctx)
+{
+	EVP_CIPHER_CTX_free(ctx->ctx);
+	OPENSSL_cleanse(ctx->key, sizeof(ctx->key));
+}
+
+/* the same key may be used for both CBC encryption and CTR, so the
+ * cipher is (re)initialized whenever the other one is used */
+static void aes_mode(nnc_be_aes *ctx, enum aes_mode mode, const u8 iv[0x10])
+{
+	if(ctx->mode != mode)
+	{
+		EVP_CipherInit_ex(ctx->ctx, mode == MODE_CBC ? EVP_aes_128_cbc() : EVP_aes_128_ctr(),
+			NULL, ctx->key, iv, mode == MODE_CBC ? !ctx->decrypt : 1);
+		EVP_CIPHER_CTX_set_padding(ctx->ctx, 0);
+		ctx->mode = mode;
+	}
+	else EVP_CipherInit_ex(ctx->ctx, NULL, NULL, NULL, iv, -1);
+}
+
+void nnc_be_aes_cbc(nnc_be_aes *ctx, bool decrypt, u32 size, u8 iv[0x10], const u8 *in, u8 *out)
+{
+	u8 next_iv[0x10];
+	int outl;
+	if(size == 0) return;
+	/* `in' may be `out' */
+	if(decrypt) memcpy(next_iv, &in[size - 0x10], 0x10);
+	aes_mode(ctx, MODE_CBC, iv);
+	EVP_CipherUpdate(ctx->ctx, out, &outl, in, size);
+	memcpy(iv, decrypt ? next_iv : &out[size - 0x10], 0x10);
+}
+
+static void ctr_add(u8 ctr[0x10], u32 blocks)
+{
+	u32 carry = blocks;
+	for(int i = 0xF; i >= 0 && carry; --i)
+	{
+		carry += ctr[i];
+		ctr[i] = carry & 0xFF;
+		carry >>= 8;
+	}
+}
+
+void nnc_be_aes_ctr(nnc_be_aes *ctx, u32 size, size_t *of, u8 ctr[0x10], u8 block[0x10], const u8 *in, u8 *out)
+{
+	u32 full;
+	int outl;
+	/* finish the keystream block we're in */
+	for(; *of != 0 && size != 0; --size)
+	{
+		*out++ = *in++ ^ block[*of];
+		*of = (*of + 1) % 0x10;
+	}
+	/* only whole blocks go through EVP so it never holds on to a partial block */
+	if((full = ALIGN_DOWN(size, 0x10)) != 0)
+	{
+		aes_mode(ctx, MODE_CTR, ctr);
+		EVP_CipherUpdate(ctx->ctx, out, &outl, in, full);
+		ctr_add(ctr, full / 0x10);
+		in += full;
+		out += full;
+		size -= full;
+	}
+	if(size != 0)
+	{
+		memset(block, 0, 0x10);
+		aes_mode(ctx, MODE_CTR, ctr);
+		EVP_CipherUpdate(ctx->ctx, block, &outl, block, 0x10);
+		ctr_add(ctr, 1);
+		for(u32 i = 0; i < size; ++i)
+			out[i] = in[i] ^ block[i];
+		*of = size;
+	}
+}
+
+static bool sha_init(struct nnc_be_sha *ctx, const EVP_MD *md)
+{
+	if(!(ctx->ctx = EVP_MD_CTX_new()))
+		return false;
+	if(EVP_DigestInit_ex(ctx->ctx, md, NULL) != 1)
+	{
+		EVP_MD_CTX_free(ctx->ctx);
+		ctx->ctx = NULL;
+		return false;
+	}
+	return true;
+}
+
+bool nnc_be_sha256_init(nnc_be_sha256 *ctx) { return sha_init(ctx, EVP_sha256()); }
+void nnc_be_sha256_update(nnc_be_sha256 *ctx, const u8 *data, u32 size) { EVP_DigestUpdate(ctx->ctx, data, size); }
+void nnc_be_sha256_finish(nnc_be_sha256 *ctx, u8 digest[0x20]) { EVP_DigestFinal_ex(ctx->ctx, digest, NULL); }
+void nnc_be_sha256_reset(nnc_be_sha256 *ctx) { EVP_DigestInit_ex(ctx->ctx, NULL, NULL); }
+void nnc_be_sha256_free(nnc_be_sha256 *ctx) { EVP_MD_CTX_free(ctx->ctx); }
+
+bool nnc_be_sha1_init(nnc_be_sha1 *ctx) { return sha_init(ctx, EVP_sha1()); }
+void nnc_be_sha1_update(nnc_be_sha1 *ctx, const u8 *data, u32 size) { EVP_DigestUpdate(ctx->ctx, data, size); }
+void nnc_be_sha1_finish(nnc_be_sha1 *ctx, u8 digest[0x14]) { EVP_DigestFinal_ex(ctx->ctx, digest, NULL); }
+void nnc_be_sha1_free(nnc_be_sha1 *ctx) { EVP_MD_CTX_free(ctx->ctx); }
+
+void nnc_be_pk_init(nnc_be_pk *pk)
+{
+	pk->key = NULL;
+}
+
+bool nnc_be_pk_import_rsa(nnc_be_pk *pk, const u8 *mod, u16 mod_size, const u8 exp[0x4])
+{
+	OSSL_PARAM_BLD *bld = OSSL_PARAM_BLD_new();
+	BIGNUM *n = BN_bin2bn(mod, mod_size, NULL);
+	BIGNUM *e = BN_bin2bn(exp, 0x4, NULL);
+	EVP_PKEY_CTX *ctx = EVP_PKEY_CTX_new_from_name(NULL, "RSA", NULL);
+	OSSL_PARAM *params = NULL;
+	bool ret = false;
+
+	if(bld && n && e && ctx
+		&& OSSL_PARAM_BLD_push_BN(bld, "n", n) && OSSL_PARAM_BLD_push_BN(bld, "e", e)
+		&& (params = OSSL_PARAM_BLD_to_param(bld)))
+		ret = EVP_PKEY_fromdata_init(ctx) == 1 && EVP_PKEY_fromdata(ctx, &pk->key, EVP_PKEY_PUBLIC_KEY, params) == 1;
+
+	OSSL_PARAM_free(params);
+	EVP_PKEY_CTX_free(ctx);
+	OSSL_PARAM_BLD_free(bld);
+	BN_free(n);
+	BN_free(e);
+	return ret;
+}
+
+bool nnc_be_pk_verify(nnc_be_pk *pk, bool sha256, const u8 *hash, const u8 *sig, u16 sig_size)
+{
+	/* an EVP_PKEY may be shared between threads, the EVP_PKEY_CTX may not */
+	EVP_PKEY_CTX *ctx = EVP_PKEY_CTX_new(pk->key, NULL);
+	bool ret = ctx
+		&& EVP_PKEY_verify_init(ctx) == 1
+		&& EVP_PKEY_CTX_set_rsa_padding(ctx, RSA_PKCS1_PADDING) == 1
+		&& EVP_PKEY_CTX_set_signature_md(ctx, sha256 ? EVP_sha256() : EVP_sha1()) == 1
+		&& EVP_PKEY_verify(ctx, sig, sig_size, hash, sha256 ? 0x20 : 0x14) == 1;
+	EVP_PKEY_CTX_free(ctx);
+	return ret;
+}
+
+void nnc_be_pk_free(nnc_be_pk *pk)
+{
+	EVP_PKEY_free(pk->key);
+}
+
+#else
+
+#include <mbedtls/version.h>
+
+/* In MbedTLS version 2 the normal functions were marked deprecated
+ * you were supposed to use *_ret, but in mbedTLS version 3+ the
+ * *_ret functions had the functions renamed to have the _ret suffix removed */
+#if MBEDTLS_VERSION_MAJOR == 2
+	#define mbedtls_sha256_starts mbedtls_sha256_starts_ret
+	#define mbedtls_sha256_update mbedtls_sha256_update_ret
+	#define mbedtls_sha256_finish mbedtls_sha256_finish_ret
+	#define mbedtls_sha1_starts mbedtls_sha1_starts_ret
+	#define mbedtls_sha1_update mbedtls_sha1_update_ret
+	#define mbedtls_sha1_finish mbedtls_sha1_finish_ret
+#endif
+
+/* In MbedTLS version 3 struct members are now accessed with MBEDTLS_PRIVATE */
+#if MBEDTLS_VERSION_MAJOR == 3
+	#define ACCESS_PRIV(name) MBEDTLS_PRIVATE(name)
+#else
+	#define ACCESS_PRIV(name) name
+#endif
+
+bool nnc_be_aes_setkey(nnc_be_aes *ctx, const u8 key[0x10], bool decrypt)
+{
+	mbedtls_aes_init(ctx);
+	if(decrypt) mbedtls_aes_setkey_dec(ctx, key, 128);
+	else        mbedtls_aes_setkey_enc(ctx, key, 128);
+	return true;
+}
+
+void nnc_be_aes_free(nnc_be_aes *ctx)
+{
+	mbedtls_aes_free(ctx);
+}
+
+void nnc_be_aes_cbc(nnc_be_aes *ctx, bool decrypt, u32 size, u8 iv[0x10], const u8 *in, u8 *out)
+{
+	mbedtls_aes_crypt_cbc(ctx, decrypt ? MBEDTLS_AES_DECRYPT : MBEDTLS_AES_ENCRYPT, size, iv, in, out);
+}
+
+void nnc_be_aes_ctr(nnc_be_aes *ctx, u32 size, size_t *of, u8 ctr[0x10], u8 block[0x10], const u8 *in, u8 *out)
+{
+	mbedtls_aes_crypt_ctr(ctx, size, of, ctr, block, in, out);
+}
+
+bool nnc_be_sha256_init(nnc_be_sha256 *ctx)
+{
+	mbedtls_sha256_init(ctx);
+	mbedtls_sha256_starts(ctx, 0);
+	return true;
+}
+
+void nnc_be_sha256_update(nnc_be_sha256 *ctx, const u8 *data, u32 size) { mbedtls_sha256_update(ctx, data, size); }
+void nnc_be_sha256_finish(nnc_be_sha256 *ctx, u8 digest[0x20]) { mbedtls_sha256_finish(ctx, digest); }
+void nnc_be_sha256_reset(nnc_be_sha256 *ctx) { mbedtls_sha256_starts(ctx, 0); }
+void nnc_be_sha256_free(nnc_be_sha256 *ctx) { mbedtls_sha256_free(ctx); }
+
+bool nnc_be_sha1_init(nnc_be_sha1 *ctx)
+{
+	mbedtls_sha1_init(ctx);
+	mbedtls_sha1_starts(ctx);
+	return true;
+}
+
+void nnc_be_sha1_update(nnc_be_sha1 *ctx, const u8 *data, u32 size) { mbedtls_sha1_update(ctx, data, size); }
+void nnc_be_sha1_finish(nnc_be_sha1 *ctx, u8 digest[0x14]) { mbedtls_sha1_finish(ctx, digest); }
+void nnc_be_sha1_free(nnc_be_sha1 *ctx) { mbedtls_sha1_free(ctx); }
+
+void nnc_be_pk_init(nnc_be_pk *pk)
+{
+	mbedtls_pk_init(pk);
+}
+
+bool nnc_be_pk_import_rsa(nnc_be_pk *pk, const u8 *mod, u16 mod_size, const u8 exp[0x4])
+{
+	if(mbedtls_pk_setup(pk, mbedtls_pk_info_from_type(MBEDTLS_PK_RSA)) != 0)
+		return false;
+	mbedtls_rsa_context *ctx = mbedtls_pk_rsa(*pk);
+	mbedtls_mpi_read_binary(&ctx->ACCESS_PRIV(N), mod, mod_size);
+	mbedtls_mpi_read_binary(&ctx->ACCESS_PRIV(E), exp, 0x4);
+	ctx->ACCESS_PRIV(len) = mod_size;
+	return true;
+}
+
+bool nnc_be_pk_verify(nnc_be_pk *pk, bool sha256, const u8 *hash, const u8 *sig, u16 sig_size)
+{
+	return mbedtls_pk_verify(pk, sha256 ? MBEDTLS_MD_SHA256 : MBEDTLS_MD_SHA1, hash,
+		sha256 ? 0x20 : 0x14, sig, sig_size) == 0;
+}
+
+void nnc_be_pk_free(nnc_be_pk *pk)
+{
+	mbedtls_pk_free(pk);
+}
+
+#endif
@@ -0,0 +1,83 @@
+#ifndef inc_backend_h
+#define inc_backend_h
+
+/* The cryptographic primitives used by crypto.c and sigcert.c. mbedTLS is
+ * used by default, building with NNC_CRYPTO_OPENSSL defined (`make CRYPTO=openssl')
+ * uses the EVP interface of OpenSSL 3 instead, see backend.c. */
+
+#include "./internal.h"
+
+#if NNC_CRYPTO_OPENSSL
+	#include <openssl/evp.h>
+	typedef struct nnc_be_aes {
+		EVP_CIPHER_CTX *ctx;
+		u8 key[0x10];
+		bool decrypt;
+		u8 mode; /* the mode `ctx' is currently set up for */
+	} nnc_be_aes;
+	typedef struct nnc_be_sha { EVP_MD_CTX *ctx; } nnc_be_sha256;
+	typedef struct nnc_be_sha nnc_be_sha1;
+	typedef struct nnc_be_pk { EVP_PKEY *key; } nnc_be_pk;
+	/* an EVP context holds the IV and counter, so one context can't be used by multiple users */
+	#define BE_AES_SHAREABLE 0
+#else
+	#include <mbedtls/sha256.h>
+	#include <mbedtls/sha1.h>
+	#include <mbedtls/aes.h>
+	#include <mbedtls/pk.h>
+	typedef mbedtls_aes_context nnc_be_aes;
+	typedef mbedtls_sha256_context nnc_be_sha256;
+	typedef mbedtls_sha1_context nnc_be_sha1;
+	typedef mbedtls_pk_context nnc_be_pk;
+	/* mbedTLS never writes to a context while en/decrypting */
+	#define BE_AES_SHAREABLE 1
+#endif
+
+/* expands `key' for en- or decryption; returns false if we're out of memory */
+#define be_aes_setkey nnc_be_aes_setkey
+bool nnc_be_aes_setkey(nnc_be_aes *ctx, const u8 key[0x10], bool decrypt);
+#define be_aes_free nnc_be_aes_free
+void nnc_be_aes_free(nnc_be_aes *ctx);
+/* `size' must be a multiple of 0x10, `iv' is updated for the next call;
+ * `decrypt' must match the key set up with be_aes_setkey */
+#define be_aes_cbc nnc_be_aes_cbc
+void nnc_be_aes_cbc(nnc_be_aes *ctx, bool decrypt, u32 size, u8 iv[0x10], const u8 *in, u8 *out);
+/* same semantics as mbedtls_aes_crypt_ctr(): `ctr' is the next counter block, `block' the
+ * keystream of the current block and `of' the offset in it; the key must be an encryption key */
+#define be_aes_ctr nnc_be_aes_ctr
+void nnc_be_aes_ctr(nnc_be_aes *ctx, u32 size, size_t *of, u8 ctr[0x10], u8 block[0x10], const u8 *in, u8 *out);
+
+/* be_sha*_init returns false if we're out of memory */
+#define be_sha256_init nnc_be_sha256_init
+bool nnc_be_sha256_init(nnc_be_sha256 *ctx);
+#define be_sha256_update nnc_be_sha256_update
+void nnc_be_sha256_update(nnc_be_sha256 *ctx, const u8 *data, u32 size);
+#define be_sha256_finish nnc_be_sha256_finish
+void nnc_be_sha256_finish(nnc_be_sha256 *ctx, u8 digest[0x20]);
+/* starts a new hash with an initialized context */
+#define be_sha256_reset nnc_be_sha256_reset
+void nnc_be_sha256_reset(nnc_be_sha256 *ctx);
+#define be_sha256_free nnc_be_sha256_free
+void nnc_be_sha256_free(nnc_be_sha256 *ctx);
+
+#define be_sha1_init nnc_be_sha1_init
+bool nnc_be_sha1_init(nnc_be_sha1 *ctx);
+#define be_sha1_update nnc_be_sha1_update
+void nnc_be_sha1_update(nnc_be_sha1 *ctx, const u8 *data, u32 size);
+#define be_sha1_finish nnc_be_sha1_finish
+void nnc_be_sha1_finish(nnc_be_sha1 *ctx, u8 digest[0x14]);
+#define be_sha1_free nnc_be_sha1_free
+void nnc_be_sha1_free(nnc_be_sha1 *ctx);
+
+/* a public key, be_pk_free must be called even if importing failed */
+#define be_pk_init nnc_be_pk_init
+void nnc_be_pk_init(nnc_be_pk *pk);
+#define be_pk_import_rsa nnc_be_pk_import_rsa
+bool nnc_be_pk_import_rsa(nnc_be_pk *pk, const u8 *mod, u16 mod_size, const u8 exp[0x4]);
+/* PKCS #1 v1.5 verification of a SHA256 (or SHA1 if `sha256' is false) hash */
+#define be_pk_verify nnc_be_pk_verify
+bool nnc_be_pk_verify(nnc_be_pk *pk, bool sha256, const u8 *hash, const u8 *sig, u16 sig_size);
+#define be_pk_free nnc_be_pk_free
+void nnc_be_pk_free(nnc_be_pk *pk);
+
+#endif
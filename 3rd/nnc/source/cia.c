@@ -1,5 +1,6 @@
 
 #include <nnc/ticket.h>
+#include <nnc/exefs.h>
 #include <nnc/cia.h>
 #include <nnc/tmd.h>
 #include <string.h>
@@ -57,6 +58,27 @@ nnc_result nnc_cia_open_meta(nnc_cia_header *cia, nnc_rstream *rs, nnc_subview *
 	return NNC_R_OK;
 }
 
+nnc_result nnc_read_cia_meta(nnc_rstream *rs, nnc_cia_meta *meta)
+{
+	u8 header[0x304];
+	result ret;
+
+	TRY(read_at_exact(rs, 0, header, sizeof(header)));
+	/* 0x000 */ for(u32 i = 0; i < NNC_CIA_META_DEPENDENCIES; ++i)
+	/* 0x000 */ 	meta->dependencies[i] = LE64P(&header[i * 8]);
+	/* 0x180 */ /* reserved */
+	/* 0x300 */ meta->core_version = LE32P(&header[0x300]);
+	return NNC_R_OK;
+}
+
+nnc_result nnc_cia_meta_icon(nnc_rstream *rs, nnc_subview *sv)
+{
+	if(NNC_RS_PCALL0(rs, size) < NNC_CIA_META_SIZE)
+		return NNC_R_NOT_FOUND;
+	nnc_subview_open(sv, rs, NNC_CIA_META_ICON_OFFSET, NNC_CIA_META_ICON_SIZE);
+	return NNC_R_OK;
+}
+
 void nnc_cia_get_iv(nnc_u8 iv[0x10], u16 index)
 {
 	memset(&iv[2], 0, 0x10 - 2);
@@ -135,11 +157,208 @@ void nnc_cia_free_reader(nnc_cia_content_reader *reader)
 	free(reader->chunks);
 }
 
+/* reads the "icon" file from the ExeFS of the NCCH in `rs' */
+static result read_exefs_icon(rstream *rs, u8 icon[NNC_CIA_META_ICON_SIZE])
+{
+	nnc_exefs_file_header headers[NNC_EXEFS_MAX_FILES];
+	nnc_ncch_section_stream section;
+	nnc_ncch_header ncch;
+	nnc_keypair kp;
+	result ret;
+	i8 index;
+
+	TRY(nnc_read_ncch_header(rs, &ncch));
+	TRY(nnc_fill_keypair(&kp, nnc_get_default_keyset(), nnc_get_default_seeddb(), &ncch));
+	TRY(nnc_ncch_section_exefs_header(&ncch, rs, &kp, &section));
+	ret = nnc_read_exefs_header(NNC_RSP(&section), headers, NULL);
+	NNC_RS_CALL0(section, close);
+	if(ret != NNC_R_OK) return ret;
+	if((index = nnc_find_exefs_file_index("icon", headers)) == -1)
+		return NNC_R_NOT_FOUND;
+	if(headers[index].size != NNC_CIA_META_ICON_SIZE)
+		return NNC_R_CORRUPT;
+	TRY(nnc_ncch_exefs_subview(&ncch, rs, &kp, &section, &headers[index]));
+	ret = read_exact(NNC_RSP(&section), icon, NNC_CIA_META_ICON_SIZE);
+	NNC_RS_CALL0(section, close);
+	return ret;
+}
+
+/* `key' is NULL if the contents are written in plaintext, otherwise
+ * `content_index' is needed for the IV of the first content */
+static result write_meta(nnc_buildable_cia_meta *meta, nnc_wstream *ws,
+	u32 content_off, u32 content_size, u16 content_index, u8 *key, u32 *meta_size)
+{
+	u8 header[NNC_CIA_META_ICON_OFFSET];
+	nnc_subview sv;
+	u32 off, size;
+	result ret;
+
+	memset(header, 0x00, sizeof(header));
+	/* 0x000 */ for(u32 i = 0; i < NNC_CIA_META_DEPENDENCIES; ++i)
+	/* 0x000 */ 	U64P(&header[i * 8]) = LE64(meta->meta.dependencies[i]);
+	/* 0x180 */ /* reserved */
+	/* 0x300 */ U32P(&header[0x300]) = LE32(meta->meta.core_version);
+	/* 0x304 */ /* reserved */
+
+	if(meta->icon)
+	{
+		/* anything else would make a malformed meta section */
+		if(NNC_RS_PCALL0(meta->icon, size) != NNC_CIA_META_ICON_SIZE)
+			return NNC_R_INVAL;
+		TRY(NNC_WS_PCALL(ws, write, header, sizeof(header)));
+		/* the SMDH is copied as-is, we don't need to know anything about it */
+		TRY(nnc_copy(meta->icon, ws, &size));
+	}
+	else
+	{
+		/* the content is read back from the same stream we're writing to,
+		 * so we can't interleave the reading & writing; the icon is small enough to buffer */
+		u8 *icon = malloc(NNC_CIA_META_ICON_SIZE);
+		if(!icon) return NNC_R_NOMEM;
+		if(content_size == 0) { ret = NNC_R_NOT_FOUND; goto free_icon; }
+		off = NNC_WS_PCALL0(ws, tell);
+		TRYLBL(NNC_WS_PCALL(ws, subreadstream, &sv, content_off, content_size), free_icon);
+		if(key)
+		{
+			nnc_aes_cbc dec;
+			u8 iv[0x10];
+			nnc_cia_get_iv(iv, content_index);
+			if((ret = nnc_aes_cbc_open(&dec, NNC_RSP(&sv), key, iv)) == NNC_R_OK)
+			{
+				ret = read_exefs_icon(NNC_RSP(&dec), icon);
+				NNC_RS_CALL0(dec, close);
+			}
+		}
+		else ret = read_exefs_icon(NNC_RSP(&sv), icon);
+		NNC_RS_CALL0(sv, close);
+		if(ret != NNC_R_OK) goto free_icon;
+		TRYLBL(NNC_WS_PCALL(ws, seek, off), free_icon);
+		TRYLBL(NNC_WS_PCALL(ws, write, header, sizeof(header)), free_icon);
+		TRYLBL(NNC_WS_PCALL(ws, write, icon, NNC_CIA_META_ICON_SIZE), free_icon);
+		size = NNC_CIA_META_ICON_SIZE;
+free_icon:
+		free(icon);
+		if(ret != NNC_R_OK) return ret;
+	}
+
+	*meta_size = sizeof(header) + size;
+	return NNC_R_OK;
+}
+
+#define CRYPT_THREADS 4
+#define CRYPT_CHUNK 0x100000
+
+/* a built NCCH that was written in plaintext, since building it requires
+ * seeking, and still has to be encrypted; all others are encrypted while
+ * they're written */
+struct crypt_job {
+	u8 iv[0x10];
+	u8 *hash; /* the plaintext is hashed into this if it isn't NULL */
+	u32 off, size;
+};
+
+struct crypt_pass {
+	nnc_wstream *ws;
+	u8 *key;
+	struct crypt_job *jobs;
+	u32 count, next;
+	result ret;
+};
+
+/* the output stream can only be used by one thread at a time */
+static nnc_mutex crypt_lock = MUTEX_INIT;
+
+static result crypt_read(struct crypt_pass *pass, u32 off, u8 *buf, u32 len)
+{
+	nnc_subview sv;
+	result ret;
+	mutex_lock(&crypt_lock);
+	if((ret = NNC_WS_PCALL(pass->ws, subreadstream, &sv, off, len)) == NNC_R_OK)
+	{
+		ret = read_exact(NNC_RSP(&sv), buf, len);
+		NNC_RS_CALL0(sv, close);
+	}
+	mutex_unlock(&crypt_lock);
+	return ret;
+}
+
+static result crypt_write(struct crypt_pass *pass, u32 off, u8 *buf, u32 len)
+{
+	result ret;
+	mutex_lock(&crypt_lock);
+	if((ret = NNC_WS_PCALL(pass->ws, seek, off)) == NNC_R_OK)
+		ret = NNC_WS_PCALL(pass->ws, write, buf, len);
+	mutex_unlock(&crypt_lock);
+	return ret;
+}
+
+static result crypt_content(struct crypt_pass *pass, struct crypt_job *job, u8 *buf)
+{
+	nnc_sha256_incremental_hash hasher = NULL;
+	result ret = NNC_R_OK;
+	u32 off, left, len;
+
+	if(job->hash) TRY(nnc_crypto_sha256_incremental(&hasher));
+	for(off = job->off, left = job->size; left != 0; off += len, left -= len)
+	{
+		len = MIN(left, CRYPT_CHUNK);
+		TRYLBL(crypt_read(pass, off, buf, len), out);
+		if(hasher) nnc_crypto_sha256_feed(hasher, buf, len);
+		/* `iv' is updated, so the next chunk continues the chain */
+		TRYLBL(nnc_aes_cbc_encrypt_buffer(pass->key, job->iv, buf, len), out);
+		TRYLBL(crypt_write(pass, off, buf, len), out);
+	}
+	if(hasher) nnc_crypto_sha256_finish(hasher, job->hash);
+out:
+	if(hasher) nnc_crypto_sha256_free(hasher);
+	return ret;
+}
+
+/* CBC is serial within a content but the contents are independent of each
+ * other, so every thread takes the next content until none are left */
+static void crypt_worker(void *arg)
+{
+	struct crypt_pass *pass = *(struct crypt_pass **) arg;
+	struct crypt_job *job;
+	u8 *buf = malloc(CRYPT_CHUNK);
+	result ret;
+
+	for(;;)
+	{
+		mutex_lock(&crypt_lock);
+		if(!buf && pass->ret == NNC_R_OK) pass->ret = NNC_R_NOMEM;
+		job = pass->ret == NNC_R_OK && pass->next != pass->count ? &pass->jobs[pass->next++] : NULL;
+		mutex_unlock(&crypt_lock);
+		if(!job) break;
+		if((ret = crypt_content(pass, job, buf)) != NNC_R_OK)
+		{
+			mutex_lock(&crypt_lock);
+			if(pass->ret == NNC_R_OK) pass->ret = ret;
+			mutex_unlock(&crypt_lock);
+		}
+	}
+	free(buf);
+}
+
+static result encrypt_built_contents(nnc_wstream *ws, u8 key[0x10], struct crypt_job *jobs, u32 count)
+{
+	struct crypt_pass pass = { ws, key, jobs, count, 0, NNC_R_OK };
+	struct crypt_pass *workers[CRYPT_THREADS];
+	u32 end = NNC_WS_PCALL0(ws, tell), nworkers = MIN(count, CRYPT_THREADS);
+
+	for(u32 i = 0; i < nworkers; ++i)
+		workers[i] = &pass;
+	run_jobs(crypt_worker, workers, sizeof(workers[0]), nworkers);
+	if(pass.ret != NNC_R_OK) return pass.ret;
+	return NNC_WS_PCALL(ws, seek, end);
+}
+
 nnc_result nnc_write_cia(
-	nnc_u8 wflags,
+	nnc_u16 wflags,
 	nnc_certchain_or_stream certchain,
 	nnc_ticket_or_stream ticket,
 	nnc_tmd_or_stream tmd,
+	nnc_meta_or_stream meta,
 	nnc_u16 amount_contents,
 	nnc_cia_writable_ncch *contents,
 	nnc_wstream *ws)
@@ -151,13 +370,22 @@ nnc_result nnc_write_cia(
 	DO_VALIDATE_FOR(certchain, NNC_CIA_WF_CERTCHAIN_BUILD, NNC_CIA_WF_CERTCHAIN_STREAM);
 	DO_VALIDATE_FOR(ticket, NNC_CIA_WF_TICKET_BUILD, NNC_CIA_WF_TICKET_STREAM);
 	DO_VALIDATE_FOR(tmd, NNC_CIA_WF_TMD_BUILD, NNC_CIA_WF_TMD_STREAM);
+	/* the meta section is optional */
+	if(meta || (wflags & (NNC_CIA_WF_META_BUILD | NNC_CIA_WF_META_STREAM)))
+		DO_VALIDATE_FOR(meta, NNC_CIA_WF_META_BUILD, NNC_CIA_WF_META_STREAM);
 #undef DO_VALIDATE_FOR
 
 	result ret;
-	nnc_u32 certchain_size, ticket_size, tmd_size, hdr_off, tmd_off, off, size, chunkcount = 0, startpos, endpos;
+	nnc_u32 certchain_size, ticket_size, tmd_size, meta_size = 0, hdr_off, tmd_off, off, size, chunkcount = 0, startpos, endpos;
+	nnc_u32 first_off = 0, first_size = 0;
+	nnc_u16 first_index = 0;
 	nnc_chunk_record *chunk_records = NULL;
-	nnc_wstream *content_writer;
+	struct crypt_job *crypt_jobs = NULL;
+	nnc_u32 crypt_count = 0;
+	u8 tkey[0x10], iv[0x10];
+	nnc_wstream *content_writer, *plain_writer;
 	nnc_hasher_writer hasher = { NULL };
+	nnc_aes_cbc encryptor = { NULL };
 	nnc_u64 content_size = 0;
 	u8 header[0x2020];
 
@@ -185,25 +413,53 @@ nnc_result nnc_write_cia(
 		ticket_size = NNC_WS_PCALL0(ws, tell) - off;
 	}
 	else
+	{
+		off = NNC_WS_PCALL0(ws, tell);
 		TRY(nnc_copy((nnc_rstream *) ticket, ws, &ticket_size));
+	}
 	TRY(PERFORM_ALIGNMENT(ticket_size));
 
+	if(wflags & NNC_CIA_WF_ENCRYPT_CONTENTS)
+	{
+		if(wflags & NNC_CIA_WF_TICKET_BUILD)
+		{
+			TRY(nnc_decrypt_tkey((nnc_ticket *) ticket, nnc_get_default_keyset(), tkey));
+		}
+		else
+		{
+			/* the ticket stream was already consumed, read it back */
+			nnc_ticket tik;
+			nnc_subview sv;
+			u32 end = NNC_WS_PCALL0(ws, tell);
+			TRY(NNC_WS_PCALL(ws, subreadstream, &sv, off, ticket_size));
+			ret = nnc_read_ticket(NNC_RSP(&sv), &tik);
+			NNC_RS_CALL0(sv, close);
+			if(ret != NNC_R_OK) return ret;
+			TRY(NNC_WS_PCALL(ws, seek, end));
+			TRY(nnc_decrypt_tkey(&tik, nnc_get_default_keyset(), tkey));
+		}
+		if(amount_contents && !(crypt_jobs = malloc(sizeof(struct crypt_job) * amount_contents)))
+			return NNC_R_NOMEM;
+	}
+
 	if(wflags & NNC_CIA_WF_TMD_BUILD)
 	{
 		tmd_off = NNC_WS_PCALL0(ws, tell);
 		/* If this TMD is built, there is no way to sign the signature so it should always be zero'd out */
 		tmd_size = nnc_calculate_tmd_size(amount_contents, NNC_SIG_NONE);
-		TRY(nnc_write_padding(ws, CALIGN(tmd_size)));
+		TRYLBL(nnc_write_padding(ws, CALIGN(tmd_size)), out);
 		chunk_records = malloc(sizeof(nnc_chunk_record) * amount_contents);
-		if(!chunk_records) return NNC_R_NOMEM;
+		if(!chunk_records) { ret = NNC_R_NOMEM; goto out; }
 		TRYLBL(nnc_open_hasher_writer(&hasher, ws, 0), out);
 		content_writer = NNC_WSP(&hasher);
 	}
 	else
 	{
-		TRY(nnc_copy((nnc_rstream *) tmd, ws, &tmd_size));
+		TRYLBL(nnc_copy((nnc_rstream *) tmd, ws, &tmd_size), out);
 		content_writer = ws;
 	}
+	/* what the hasher (if any) passes the plaintext to */
+	plain_writer = ws;
 
 	/* Now we can start writing the contents */
 	for(u32 i = 0; i < amount_contents; ++i)
@@ -213,12 +469,28 @@ nnc_result nnc_write_cia(
 		case NNC_CIA_NCCHBUILD_NONE:
 			continue; /* nothing to be done */
 		case NNC_CIA_NCCHBUILD_STREAM:
-			TRYLBL(nnc_copy((nnc_rstream *) contents[i].ncch, content_writer, &size), out);
+			off = NNC_WS_PCALL0(ws, tell);
+			if(wflags & NNC_CIA_WF_ENCRYPT_CONTENTS)
+			{
+				/* encrypted on the way to `ws', after the hasher saw the plaintext */
+				nnc_cia_get_iv(iv, i);
+				TRYLBL(nnc_aes_cbc_open_w(&encryptor, ws, tkey, iv), out);
+				plain_writer = NNC_WSP(&encryptor);
+				if(wflags & NNC_CIA_WF_TMD_BUILD)
+					hasher.child = plain_writer;
+				ret = nnc_copy((nnc_rstream *) contents[i].ncch, (wflags & NNC_CIA_WF_TMD_BUILD) ? content_writer : plain_writer, &size);
+				NNC_WS_CALL0(encryptor, close);
+				encryptor.funcs = NULL;
+				hasher.child = plain_writer = ws;
+				if(ret != NNC_R_OK) goto out;
+			}
+			else
+				TRYLBL(nnc_copy((nnc_rstream *) contents[i].ncch, content_writer, &size), out);
 			break;
 		case NNC_CIA_NCCHBUILD_BUILD:
 			off = NNC_WS_PCALL0(ws, tell);
 			/* this requires seeking... which our content_writer may not have since it may be a hasher */
-			if(wflags & NNC_CIA_WF_TMD_BUILD)
+			if(wflags & (NNC_CIA_WF_TMD_BUILD | NNC_CIA_WF_ENCRYPT_CONTENTS))
 			{
 				startpos = NNC_WS_PCALL0(ws, tell);
 				TRYLBL(nnc_write_ncch_from_buildable((nnc_buildable_ncch *) contents[i].ncch, ws), out);
@@ -231,23 +503,39 @@ nnc_result nnc_write_cia(
 		}
 		/* we don't need to hash the alignment bytes, so we can just use `ws` always */
 		TRYLBL(PERFORM_ALIGNMENT(size), out);
+		/* the meta section may need the icon from the first content */
+		if(first_size == 0) { first_off = off; first_size = size; first_index = i; }
+
+		if(contents[i].type == NNC_CIA_NCCHBUILD_BUILD && (wflags & NNC_CIA_WF_ENCRYPT_CONTENTS))
+		{
+			if(IS_UNALIGNED(size, 0x10)) { ret = NNC_R_BAD_ALIGN; goto out; }
+			nnc_cia_get_iv(crypt_jobs[crypt_count].iv, i);
+			crypt_jobs[crypt_count].off = off;
+			crypt_jobs[crypt_count].size = size;
+			/* the chunk record is hashed while it's encrypted */
+			crypt_jobs[crypt_count].hash = (wflags & NNC_CIA_WF_TMD_BUILD) ? chunk_records[chunkcount].hash : NULL;
+			++crypt_count;
+		}
 
 		if(wflags & NNC_CIA_WF_TMD_BUILD)
 		{
 			/* now we write the chunk record for this content */
 			chunk_records[chunkcount].id = i;
 			chunk_records[chunkcount].index = i;
-			chunk_records[chunkcount].flags = 0; /* we don't set any flags */
+			chunk_records[chunkcount].flags = (wflags & NNC_CIA_WF_ENCRYPT_CONTENTS) ? NNC_CHUNKF_ENCRYPTED : 0;
 			chunk_records[chunkcount].size = size;
 			if(contents[i].type == NNC_CIA_NCCHBUILD_BUILD)
 			{
-				/* we need to read back and hash */
-				nnc_subview sv;
-				TRYLBL(NNC_WS_PCALL(ws, subreadstream, &sv, startpos, endpos - startpos), out);
-				ret = nnc_crypto_sha256_stream(NNC_RSP(&sv), chunk_records[chunkcount].hash);
-				NNC_RS_CALL0(sv, close);
-				if(ret != NNC_R_OK)
-					goto out;
+				/* we need to read back and hash, unless that happens while it's encrypted */
+				if(!(wflags & NNC_CIA_WF_ENCRYPT_CONTENTS))
+				{
+					nnc_subview sv;
+					TRYLBL(NNC_WS_PCALL(ws, subreadstream, &sv, startpos, endpos - startpos), out);
+					ret = nnc_crypto_sha256_stream(NNC_RSP(&sv), chunk_records[chunkcount].hash);
+					NNC_RS_CALL0(sv, close);
+					if(ret != NNC_R_OK)
+						goto out;
+				}
 			}
 			else
 				nnc_hasher_writer_digest_reset(&hasher, chunk_records[chunkcount].hash);
@@ -258,6 +546,9 @@ nnc_result nnc_write_cia(
 		content_size += CALIGN(size);
 	}
 
+	if(crypt_count != 0)
+		TRYLBL(encrypt_built_contents(ws, tkey, crypt_jobs, crypt_count), out);
+
 	/* now we can write the TMD, if required */
 	if(wflags & NNC_CIA_WF_TMD_BUILD)
 	{
@@ -274,10 +565,17 @@ nnc_result nnc_write_cia(
 		free(chunk_records);
 		chunk_records = NULL;
 		/* alignment not required as it was already done before */
-		TRY(NNC_WS_PCALL(ws, seek, off));
+		TRYLBL(NNC_WS_PCALL(ws, seek, off), out);
 	}
 
-	/* We would (optionally) write the meta here, but we don't have support for it yet */
+	/* meta */
+	if(wflags & NNC_CIA_WF_META_BUILD)
+	{
+		TRYLBL(write_meta((nnc_buildable_cia_meta *) meta, ws, first_off, first_size, first_index,
+			(wflags & NNC_CIA_WF_ENCRYPT_CONTENTS) ? tkey : NULL, &meta_size), out);
+	}
+	else if(wflags & NNC_CIA_WF_META_STREAM)
+		TRYLBL(nnc_copy((nnc_rstream *) meta, ws, &meta_size), out);
 
 #undef PERFORM_ALIGNMENT
 
@@ -288,21 +586,197 @@ nnc_result nnc_write_cia(
 	U32P(&header[0x08]) = LE32(certchain_size);
 	U32P(&header[0x0C]) = LE32(ticket_size);
 	U32P(&header[0x10]) = LE32(tmd_size);
-	U32P(&header[0x14]) = 0; /* no support for the meta section (yet) */
+	U32P(&header[0x14]) = LE32(meta_size);
 	U64P(&header[0x18]) = LE64(content_size);
 	/* content index is already written... */
 
 	off = NNC_WS_PCALL0(ws, tell);
-	TRY(NNC_WS_PCALL(ws, seek, hdr_off));
-	TRY(NNC_WS_PCALL(ws, write, header, sizeof(header)));
+	TRYLBL(NNC_WS_PCALL(ws, seek, hdr_off), out);
+	TRYLBL(NNC_WS_PCALL(ws, write, header, sizeof(header)), out);
 	/* bellow call not needed since we already padded it before */
 	/* TRY(nnc_write_padding(ws, HDRSIZE_AL - HDRSIZE)); */
-	TRY(NNC_WS_PCALL(ws, seek, off));
+	TRYLBL(NNC_WS_PCALL(ws, seek, off), out);
 
 out:
 	if(hasher.funcs) NNC_WS_CALL0(hasher, close);
 	free(chunk_records);
+	free(crypt_jobs);
+	return ret;
+}
+
+
+/* finds the TMD in a CDN directory: "tmd" or the highest "tmd.<version>" */
+static nnc_vfs_file_node *find_cdn_tmd(nnc_vfs_directory_node *dir)
+{
+	nnc_vfs_file_node *ret = NULL;
+	long best = -2, ver;
+	char *end;
+	for(unsigned i = 0; i < dir->filecount; ++i)
+	{
+		const char *name = dir->file_children[i].vname;
+		if(strcmp(name, "tmd") == 0)
+			ver = -1;
+		else if(strncmp(name, "tmd.", 4) == 0 && name[4] != '\0')
+		{
+			ver = strtol(&name[4], &end, 10);
+			if(*end != '\0') continue;
+		}
+		else continue;
+		if(ver > best)
+		{
+			ret = &dir->file_children[i];
+			best = ver;
+		}
+	}
 	return ret;
 }
 
+static nnc_vfs_file_node *find_cdn_content(nnc_vfs_directory_node *dir, u32 id)
+{
+	char lower[9], upper[9];
+	sprintf(lower, "%08lx", (unsigned long) id);
+	sprintf(upper, "%08lX", (unsigned long) id);
+	for(unsigned i = 0; i < dir->filecount; ++i)
+	{
+		const char *name = dir->file_children[i].vname;
+		if(strcmp(name, lower) == 0 || strcmp(name, upper) == 0)
+			return &dir->file_children[i];
+	}
+	return NULL;
+}
+
+/* copies the first `size' bytes of `rs' */
+static result copy_part(rstream *rs, u32 size, nnc_wstream *ws)
+{
+	nnc_subview sv;
+	nnc_subview_open(&sv, rs, 0, size);
+	return nnc_copy(NNC_RSP(&sv), ws, NULL);
+}
+
+nnc_result nnc_cia_from_cdn(
+	nnc_u8 cflags,
+	nnc_cdn_dir_or_vfs cdn,
+	nnc_rstream *ticket,
+	nnc_rstream *certchain,
+	nnc_wstream *ws)
+{
+	u8 type = cflags & (NNC_CDN_DIRECTORY | NNC_CDN_VFS);
+	if(!cdn || !ticket || !certchain || type == 0 || type == (NNC_CDN_DIRECTORY | NNC_CDN_VFS))
+		return NNC_R_INVAL;
+
+	nnc_vfs_directory_node *dir = (nnc_vfs_directory_node *) cdn;
+	nnc_u32 certchain_size, ticket_size, tmd_size, size;
+	nnc_vfs_file_node **nodes = NULL, *tmdnode;
+	nnc_chunk_record *chunks = NULL;
+	nnc_vfs_stream *tmd, *content;
+	nnc_hasher_writer verifier;
+	nnc_u64 content_size = 0;
+	nnc_sha256_hash digest;
+	nnc_tmd_header tmdhdr;
+	u8 header[HDRSIZE];
+	u8 key[0x10], iv[0x10];
+	nnc_ticket tik;
+	nnc_vfs vfs;
+	result ret;
+
+	if(cflags & NNC_CDN_DIRECTORY)
+	{
+		TRY(nnc_vfs_init(&vfs));
+		TRYLBL(nnc_vfs_link_directory(&vfs.root_directory, (const char *) cdn, nnc_vfs_identity_transform, NULL), free_vfs);
+		dir = &vfs.root_directory;
+	}
+
+	if(!(tmdnode = find_cdn_tmd(dir))) { ret = NNC_R_NOT_FOUND; goto free_vfs; }
+	TRYLBL(nnc_vfs_open_node(tmdnode, &tmd), free_vfs);
+	TRYLBL(nnc_read_tmd_header(tmd, &tmdhdr), out);
+	/* the CDN appends the certificates to the TMD, those shouldn't be copied */
+	tmd_size = nnc_calculate_tmd_size(tmdhdr.content_count, tmdhdr.sig.type);
+	if(tmd_size > NNC_RS_PCALL0(tmd, size)) { ret = NNC_R_CORRUPT; goto out; }
+	chunks = malloc(sizeof(nnc_chunk_record) * tmdhdr.content_count);
+	nodes = malloc(sizeof(nnc_vfs_file_node *) * tmdhdr.content_count);
+	if(!chunks || !nodes) { ret = NNC_R_NOMEM; goto out; }
+	TRYLBL(nnc_read_tmd_chunk_records(tmd, &tmdhdr, chunks), out);
+
+	TRYLBL(nnc_ticket_size(ticket, &ticket_size), out);
+	certchain_size = NNC_RS_PCALL0(certchain, size);
+
+	if(cflags & NNC_CDN_VERIFY)
+	{
+		TRYLBL(NNC_RS_PCALL(ticket, seek_abs, 0), out);
+		TRYLBL(nnc_read_ticket(ticket, &tik), out);
+		if(tik.title_id != tmdhdr.title_id) { ret = NNC_R_MISMATCH; goto out; }
+		TRYLBL(nnc_decrypt_tkey(&tik, nnc_get_default_keyset(), key), out);
+	}
+
+	/* we know the size of everything from the TMD, so the header can be written
+	 * first and the rest doesn't require seeking */
+	u8 *content_index = &header[0x20];
+	memset(content_index, 0x00, 0x2000);
+	for(u16 i = 0; i < tmdhdr.content_count; ++i)
+	{
+		if(!(nodes[i] = find_cdn_content(dir, chunks[i].id)))
+		{
+			if(chunks[i].flags & NNC_CHUNKF_OPTIONAL) continue;
+			ret = NNC_R_NOT_FOUND;
+			goto out;
+		}
+		if(nnc_vfs_node_size(nodes[i]) < chunks[i].size) { ret = NNC_R_CORRUPT; goto out; }
+		content_index[chunks[i].index / 8] |= 1 << (7 - (chunks[i].index % 8));
+		content_size += CALIGN(chunks[i].size);
+	}
+
+	U32P(&header[0x00]) = LE32(HDRSIZE);
+	U16P(&header[0x04]) = 0; /* type */
+	U16P(&header[0x06]) = 0; /* version */
+	U32P(&header[0x08]) = LE32(certchain_size);
+	U32P(&header[0x0C]) = LE32(ticket_size);
+	U32P(&header[0x10]) = LE32(tmd_size);
+	U32P(&header[0x14]) = 0; /* the CDN has no meta section */
+	U64P(&header[0x18]) = LE64(content_size);
+	TRYLBL(NNC_WS_PCALL(ws, write, header, sizeof(header)), out);
+	TRYLBL(nnc_write_padding(ws, HDRSIZE_AL - HDRSIZE), out);
+
+#define PERFORM_ALIGNMENT(written_size) nnc_write_padding(ws, CALIGN(written_size) - written_size)
+
+	TRYLBL(copy_part(certchain, certchain_size, ws), out);
+	TRYLBL(PERFORM_ALIGNMENT(certchain_size), out);
+	TRYLBL(copy_part(ticket, ticket_size, ws), out);
+	TRYLBL(PERFORM_ALIGNMENT(ticket_size), out);
+	TRYLBL(copy_part(tmd, tmd_size, ws), out);
+	TRYLBL(PERFORM_ALIGNMENT(tmd_size), out);
+
+	for(u16 i = 0; i < tmdhdr.content_count; ++i)
+	{
+		if(!nodes[i]) continue;
+		size = chunks[i].size;
+		TRYLBL(nnc_vfs_open_node(nodes[i], &content), out);
+		if(cflags & NNC_CDN_VERIFY)
+		{
+			nnc_cia_get_iv(iv, chunks[i].index);
+			if((ret = nnc_open_cbc_hasher_writer(&verifier, ws, key, iv)) == NNC_R_OK)
+			{
+				ret = copy_part(content, size, NNC_WSP(&verifier));
+				nnc_hasher_writer_digest(&verifier, digest);
+				if(ret == NNC_R_OK && !nnc_crypto_hasheq(digest, chunks[i].hash))
+					ret = NNC_R_CORRUPT;
+			}
+		}
+		else
+			ret = copy_part(content, size, ws);
+		nnc_vfs_close_node(content);
+		if(ret != NNC_R_OK) goto out;
+		TRYLBL(PERFORM_ALIGNMENT(size), out);
+	}
+
+#undef PERFORM_ALIGNMENT
+
+out:
+	nnc_vfs_close_node(tmd);
+	free(chunks);
+	free(nodes);
+free_vfs:
+	if(cflags & NNC_CDN_DIRECTORY)
+		nnc_vfs_free(&vfs);
+	return ret;
+}
 
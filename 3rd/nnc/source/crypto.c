@@ -1,56 +1,196 @@
-
-#include <mbedtls/version.h>
-#include <mbedtls/sha256.h>
-#include <mbedtls/sha1.h>
-#include <mbedtls/aes.h>
 #include <nnc/crypto.h>
 #include <nnc/ticket.h>
 #include <nnc/ncch.h>
 #include <stdlib.h>
 #include <string.h>
 #include "./internal.h"
+#include "./backend.h"
+
+/* Expanding an AES key is a lot more expensive than en/decrypting a
+ * handful of blocks, and the same few keys are used over and over for
+ * every section of every NCCH, so expanded keys are shared between all
+ * streams through a small cache. This is only done for backends that
+ * never write to a context while en/decrypting (BE_AES_SHAREABLE),
+ * in which case a context may be used by multiple threads. */
+
+#define KEYCACHE_SLOTS 32
+
+static struct keycache_slot {
+	nnc_be_aes ctx;
+	u8 key[0x10];
+	bool decrypt;
+	bool valid;
+	u32 refs;
+	u32 last_use;
+} keycache[KEYCACHE_SLOTS];
+static nnc_mutex keycache_lock = MUTEX_INIT;
+static u32 keycache_clock;
+
+/* contexts are put in nnc_crypto_ctx_storage if they fit, which they do for
+ * every backend configuration we know of, otherwise they go on the heap */
+#define FITS_STORAGE(type) (sizeof(type) <= sizeof(nnc_crypto_ctx_storage))
+
+/* heap contexts are kept here once they're freed, so that streams can be
+ * moved around while they're open yet opening one doesn't allocate */
+#define CTX_POOL_SLOTS 16
+
+struct ctx_pool {
+	void *free[CTX_POOL_SLOTS];
+	u32 count;
+	nnc_mutex lock;
+};
 
-/* In MbedTLS version 2 the normal functions were marked deprecated
- * you were supposed to use *_ret, but in mbedTLS version 3+ the
- * *_ret functions had the functions renamed to have the _ret suffix removed */
-#if MBEDTLS_VERSION_MAJOR == 2
-	#define mbedtls_sha256_starts mbedtls_sha256_starts_ret
-	#define mbedtls_sha256_update mbedtls_sha256_update_ret
-	#define mbedtls_sha256_finish mbedtls_sha256_finish_ret
-	#define mbedtls_sha1_starts mbedtls_sha1_starts_ret
-	#define mbedtls_sha1_update mbedtls_sha1_update_ret
-	#define mbedtls_sha1_finish mbedtls_sha1_finish_ret
-#endif
+static struct ctx_pool aes_pool = { .lock = MUTEX_INIT };
+static struct ctx_pool sha256_pool = { .lock = MUTEX_INIT };
+
+static void *pool_get(struct ctx_pool *pool, size_t size)
+{
+	void *ctx = NULL;
+	if(HAVE_MUTEX)
+	{
+		mutex_lock(&pool->lock);
+		if(pool->count != 0)
+			ctx = pool->free[--pool->count];
+		mutex_unlock(&pool->lock);
+	}
+	return ctx ? ctx : malloc(size);
+}
+
+static void pool_put(struct ctx_pool *pool, void *ctx)
+{
+	if(HAVE_MUTEX)
+	{
+		mutex_lock(&pool->lock);
+		if(pool->count != CTX_POOL_SLOTS)
+		{
+			pool->free[pool->count++] = ctx;
+			ctx = NULL;
+		}
+		mutex_unlock(&pool->lock);
+	}
+	free(ctx);
+}
+
+/* returns an expanded key that must be given back with aes_ctx_put(),
+ * or NULL if we're out of memory; `storage' is used if every slot is in use,
+ * if it's NULL (because the caller may be moved) the context is pooled */
+static nnc_be_aes *aes_ctx_get(const u8 key[0x10], bool decrypt, nnc_crypto_ctx_storage *storage)
+{
+	struct keycache_slot *victim = NULL, *slot;
+	if(!BE_AES_SHAREABLE || !HAVE_MUTEX) goto own;
+	mutex_lock(&keycache_lock);
+	++keycache_clock;
+	for(u32 i = 0; i < KEYCACHE_SLOTS; ++i)
+	{
+		slot = &keycache[i];
+		if(slot->valid && slot->decrypt == decrypt && memcmp(slot->key, key, 0x10) == 0)
+		{
+			++slot->refs;
+			slot->last_use = keycache_clock;
+			mutex_unlock(&keycache_lock);
+			return &slot->ctx;
+		}
+		/* evict the least recently used key no one is using */
+		if(slot->refs == 0 && (!victim || !slot->valid
+				|| (victim->valid && slot->last_use < victim->last_use)))
+			victim = slot;
+	}
+	if(victim)
+	{
+		if(victim->valid) be_aes_free(&victim->ctx);
+		if(!be_aes_setkey(&victim->ctx, key, decrypt))
+		{
+			victim->valid = false;
+			mutex_unlock(&keycache_lock);
+			return NULL;
+		}
+		memcpy(victim->key, key, 0x10);
+		victim->decrypt = decrypt;
+		victim->valid = true;
+		victim->refs = 1;
+		victim->last_use = keycache_clock;
+		mutex_unlock(&keycache_lock);
+		return &victim->ctx;
+	}
+	mutex_unlock(&keycache_lock);
+
+	/* every slot is in use, so this one gets its own context */
+own:;
+	nnc_be_aes *ctx = storage && FITS_STORAGE(nnc_be_aes)
+		? (nnc_be_aes *) storage : pool_get(&aes_pool, sizeof(nnc_be_aes));
+	if(ctx && !be_aes_setkey(ctx, key, decrypt))
+	{
+		if(ctx != (nnc_be_aes *) storage)
+			pool_put(&aes_pool, ctx);
+		ctx = NULL;
+	}
+	return ctx;
+}
+
+static void aes_ctx_put(nnc_be_aes *ctx, nnc_crypto_ctx_storage *storage)
+{
+	struct keycache_slot *slot = (struct keycache_slot *) ctx;
+	if(slot >= keycache && slot < keycache + KEYCACHE_SLOTS)
+	{
+		mutex_lock(&keycache_lock);
+		--slot->refs;
+		mutex_unlock(&keycache_lock);
+	}
+	else
+	{
+		be_aes_free(ctx);
+		if(ctx != (nnc_be_aes *) storage)
+			pool_put(&aes_pool, ctx);
+	}
+}
 
 nnc_result nnc_crypto_sha256_incremental(nnc_sha256_incremental_hash *self)
 {
-	*self = malloc(sizeof(mbedtls_sha256_context));
+	*self = pool_get(&sha256_pool, sizeof(nnc_be_sha256));
 	if(!*self) return NNC_R_NOMEM;
-	mbedtls_sha256_init(*self);
-	mbedtls_sha256_starts(*self, 0);
+	if(!be_sha256_init(*self))
+	{
+		pool_put(&sha256_pool, *self);
+		return NNC_R_NOMEM;
+	}
 	return NNC_R_OK;
 }
 
 void nnc_crypto_sha256_feed(nnc_sha256_incremental_hash self, u8 *data, u32 length)
 {
-	mbedtls_sha256_update(self, data, length);
+	be_sha256_update(self, data, length);
 }
 
 void nnc_crypto_sha256_finish(nnc_sha256_incremental_hash self, nnc_sha256_hash digest)
 {
-	mbedtls_sha256_finish(self, digest);
-	mbedtls_sha256_free(self);
+	be_sha256_finish(self, digest);
 }
 
 void nnc_crypto_sha256_reset(nnc_sha256_incremental_hash self)
 {
-	mbedtls_sha256_init(self);
-	mbedtls_sha256_starts(self, 0);
+	be_sha256_reset(self);
 }
 
 void nnc_crypto_sha256_free(nnc_sha256_incremental_hash self)
 {
-	free(self);
+	be_sha256_free(self);
+	pool_put(&sha256_pool, self);
+}
+
+nnc_result nnc_crypto_sha256_incremental_in(nnc_sha256_incremental_hash *self, nnc_crypto_ctx_storage *storage)
+{
+	if(!FITS_STORAGE(nnc_be_sha256))
+		return nnc_crypto_sha256_incremental(self);
+	*self = storage;
+	return be_sha256_init(*self) ? NNC_R_OK : NNC_R_NOMEM;
+}
+
+void nnc_crypto_sha256_free_in(nnc_sha256_incremental_hash self, nnc_crypto_ctx_storage *storage)
+{
+	if(self != (void *) storage)
+		nnc_crypto_sha256_free(self);
+	else
+		be_sha256_free(self);
 }
 
 static result hasher_writer_write(nnc_hasher_writer *self, u8 *buf, u32 size)
@@ -61,7 +201,30 @@ static result hasher_writer_write(nnc_hasher_writer *self, u8 *buf, u32 size)
 	return self->child->funcs->write(self->child, buf, size);
 }
 
-static result hasher_writer_wclose(nnc_hasher_writer *self) { nnc_crypto_sha256_free(self->hash); return NNC_R_OK; }
+static result cbc_hasher_writer_write(nnc_hasher_writer *self, u8 *buf, u32 size)
+{
+	if(size % 0x10 != 0) return NNC_R_BAD_ALIGN;
+	u8 block[0x1000];
+	u32 pos, next;
+	/* we may not modify `buf', so decrypt in small parts that stay in cache */
+	for(pos = 0; pos != size; pos += next)
+	{
+		next = MIN(size - pos, sizeof(block));
+		be_aes_cbc(self->crypto_ctx, true, next, self->iv, &buf[pos], block);
+		nnc_crypto_sha256_feed(self->hash, block, next);
+	}
+	self->hashed += size;
+	return self->child->funcs->write(self->child, buf, size);
+}
+
+static result hasher_writer_wclose(nnc_hasher_writer *self)
+{
+	nnc_crypto_sha256_free(self->hash);
+	if(self->crypto_ctx)
+		aes_ctx_put(self->crypto_ctx, NULL);
+	return NNC_R_OK;
+}
+
 static result hasher_writer_wtell(nnc_hasher_writer *self)  { return self->child->funcs->tell(self->child); }
 
 static const nnc_wstream_funcs hasher_writer_wfuncs = {
@@ -70,13 +233,35 @@ static const nnc_wstream_funcs hasher_writer_wfuncs = {
 	.tell  = (nnc_wtell_func)  hasher_writer_wtell,
 };
 
+static const nnc_wstream_funcs cbc_hasher_writer_wfuncs = {
+	.write = (nnc_write_func)  cbc_hasher_writer_write,
+	.close = (nnc_wclose_func) hasher_writer_wclose,
+	.tell  = (nnc_wtell_func)  hasher_writer_wtell,
+};
+
 nnc_result nnc_open_hasher_writer(nnc_hasher_writer *self, nnc_wstream *child, nnc_u32 limit)
 {
-	self->funcs  = &hasher_writer_wfuncs;
+	self->funcs      = &hasher_writer_wfuncs;
+	self->child      = child;
+	self->lim        = limit;
+	self->hashed     = 0;
+	self->crypto_ctx = NULL;
+	return nnc_crypto_sha256_incremental(&self->hash);
+}
+
+nnc_result nnc_open_cbc_hasher_writer(nnc_hasher_writer *self, nnc_wstream *child, u8 key[0x10], u8 iv[0x10])
+{
+	result ret;
+	self->funcs  = &cbc_hasher_writer_wfuncs;
 	self->child  = child;
-	self->lim    = limit;
+	self->lim    = 0;
 	self->hashed = 0;
-	return nnc_crypto_sha256_incremental(&self->hash);
+	memcpy(self->iv, iv, 0x10);
+	if(!(self->crypto_ctx = aes_ctx_get(key, true, NULL)))
+		return NNC_R_NOMEM;
+	if((ret = nnc_crypto_sha256_incremental(&self->hash)) != NNC_R_OK)
+		aes_ctx_put(self->crypto_ctx, NULL);
+	return ret;
 }
 
 void nnc_hasher_writer_digest(nnc_hasher_writer *self, nnc_sha256_hash digest)
@@ -92,35 +277,44 @@ void nnc_hasher_writer_digest_reset(nnc_hasher_writer *self, nnc_sha256_hash dig
 }
 
 
-result nnc_crypto_sha256_part(nnc_rstream *rs, nnc_sha256_hash digest, u32 size)
+/* small enough that a chunk is still in the L1/L2 cache after it's been
+ * decrypted by the stream when it's hashed and (optionally) written */
+#define HASH_CHUNK_SZ 0x4000
+
+static result sha256_part_to(nnc_rstream *rs, nnc_sha256_hash digest, u32 size, nnc_wstream *sink)
 {
-	mbedtls_sha256_context ctx;
-	mbedtls_sha256_init(&ctx);
-	mbedtls_sha256_starts(&ctx, 0);
-	u8 block[BLOCK_SZ];
-	u32 read_left = size, next_read = MIN(size, BLOCK_SZ), read_ret;
+	nnc_be_sha256 ctx;
+	if(!be_sha256_init(&ctx)) return NNC_R_NOMEM;
+	u8 block[HASH_CHUNK_SZ];
+	u32 read_left = size, next_read = MIN(size, HASH_CHUNK_SZ), read_ret;
 	result ret;
 	while(read_left != 0)
 	{
 		ret = NNC_RS_PCALL(rs, read, block, next_read, &read_ret);
 		if(ret != NNC_R_OK) goto out;
 		if(read_ret != next_read) { ret = NNC_R_TOO_SMALL; goto out; }
-		mbedtls_sha256_update(&ctx, block, read_ret);
+		be_sha256_update(&ctx, block, read_ret);
+		if(sink && (ret = NNC_WS_PCALL(sink, write, block, read_ret)) != NNC_R_OK)
+			goto out;
 		read_left -= next_read;
-		next_read = MIN(read_left, BLOCK_SZ);
+		next_read = MIN(read_left, HASH_CHUNK_SZ);
 	}
-	mbedtls_sha256_finish(&ctx, digest);
+	be_sha256_finish(&ctx, digest);
 	ret = NNC_R_OK;
 out:
-	mbedtls_sha256_free(&ctx);
+	be_sha256_free(&ctx);
 	return ret;
 }
 
+result nnc_crypto_sha256_part(nnc_rstream *rs, nnc_sha256_hash digest, u32 size)
+{
+	return sha256_part_to(rs, digest, size, NULL);
+}
+
 result nnc_crypto_sha1_part(nnc_rstream *rs, nnc_sha1_hash digest, u32 size)
 {
-	mbedtls_sha1_context ctx;
-	mbedtls_sha1_init(&ctx);
-	mbedtls_sha1_starts(&ctx);
+	nnc_be_sha1 ctx;
+	if(!be_sha1_init(&ctx)) return NNC_R_NOMEM;
 	u8 block[BLOCK_SZ];
 	u32 read_left = size, next_read = MIN(size, BLOCK_SZ), read_ret;
 	result ret;
@@ -129,14 +323,14 @@ result nnc_crypto_sha1_part(nnc_rstream *rs, nnc_sha1_hash digest, u32 size)
 		ret = NNC_RS_PCALL(rs, read, block, next_read, &read_ret);
 		if(ret != NNC_R_OK) goto out;
 		if(read_ret != next_read) { ret = NNC_R_TOO_SMALL; goto out; }
-		mbedtls_sha1_update(&ctx, block, read_ret);
+		be_sha1_update(&ctx, block, read_ret);
 		read_left -= next_read;
 		next_read = MIN(read_left, BLOCK_SZ);
 	}
-	mbedtls_sha1_finish(&ctx, digest);
+	be_sha1_finish(&ctx, digest);
 	ret = NNC_R_OK;
 out:
-	mbedtls_sha1_free(&ctx);
+	be_sha1_free(&ctx);
 	return ret;
 }
 
@@ -146,6 +340,11 @@ result nnc_crypto_sha256_stream(nnc_rstream *rs, nnc_sha256_hash digest)
 	return nnc_crypto_sha256_part(rs, digest, NNC_RS_PCALL0(rs, size) - NNC_RS_PCALL0(rs, tell));
 }
 
+result nnc_crypto_decrypt_hash(nnc_rstream *rs, nnc_sha256_hash digest, nnc_wstream *sink)
+{
+	return sha256_part_to(rs, digest, NNC_RS_PCALL0(rs, size) - NNC_RS_PCALL0(rs, tell), sink);
+}
+
 void nnc_crypto_sha256_buffer(nnc_u8 *data, nnc_u32 size, nnc_sha256_hash digest)
 {
 	nnc_memory mem;
@@ -160,37 +359,76 @@ bool nnc_crypto_hasheq(nnc_sha256_hash a, nnc_sha256_hash b)
 
 result nnc_crypto_sha256(const u8 *buf, nnc_sha256_hash digest, u32 size)
 {
-	mbedtls_sha256_context ctx;
-	mbedtls_sha256_init(&ctx);
-	mbedtls_sha256_starts(&ctx, 0);
-	mbedtls_sha256_update(&ctx, buf, size);
-	mbedtls_sha256_finish(&ctx, digest);
-	mbedtls_sha256_free(&ctx);
+	nnc_be_sha256 ctx;
+	if(!be_sha256_init(&ctx)) return NNC_R_NOMEM;
+	be_sha256_update(&ctx, buf, size);
+	be_sha256_finish(&ctx, digest);
+	be_sha256_free(&ctx);
 	return NNC_R_OK;
 }
 
+#define SEEDDB_ENTRY_SIZE 0x20
+
+static int seeddb_entry_cmp(const void *a, const void *b)
+{
+	u64 atid = ((const struct nnc_seeddb_entry *) a)->title_id;
+	u64 btid = ((const struct nnc_seeddb_entry *) b)->title_id;
+	return atid < btid ? -1 : atid > btid;
+}
+
+void nnc_sort_seeddb(nnc_seeddb *seeddb)
+{
+	if(seeddb->size > 1)
+		qsort(seeddb->entries, seeddb->size, sizeof(struct nnc_seeddb_entry), seeddb_entry_cmp);
+	seeddb->sorted = seeddb->entries;
+}
+
 nnc_result nnc_seeds_seeddb(nnc_rstream *rs, nnc_seeddb *seeddb)
 {
-	u8 buf[0x20];
+	u8 buf[0x10], *raw;
 	result ret;
 	seeddb->size = 0;
+	seeddb->entries = seeddb->sorted = NULL;
 	u32 expected_size;
 	TRY(read_exact(rs, buf, 0x10));
 	expected_size = LE32P(&buf[0x00]);
-	if(!(seeddb->entries = malloc(expected_size * sizeof(struct nnc_seeddb_entry))))
+	if(expected_size > (0xFFFFFFFF - 0x10) / SEEDDB_ENTRY_SIZE)
+		return NNC_R_CORRUPT;
+	/* read all entries at once and convert them in place; an entry
+	 * is never bigger than a record so we never overwrite a record
+	 * that has not been converted yet */
+	if(expected_size && !(raw = malloc(expected_size * SEEDDB_ENTRY_SIZE)))
 		return NNC_R_NOMEM;
-	for(u32 i = 0; i < expected_size; ++i, ++seeddb->size)
+	if(expected_size && (ret = read_exact(rs, raw, expected_size * SEEDDB_ENTRY_SIZE)) != NNC_R_OK)
+	{
+		free(raw);
+		return ret;
+	}
+	struct nnc_seeddb_entry *entries = (struct nnc_seeddb_entry *) raw, entry;
+	for(u32 i = 0; i < expected_size; ++i)
 	{
-		TRY(read_exact(rs, buf, 0x20));
-		memcpy(seeddb->entries[i].seed, &buf[0x08], NNC_SEED_SIZE);
-		seeddb->entries[i].title_id = LE64P(&buf[0x00]);
+		u8 *record = &raw[i * SEEDDB_ENTRY_SIZE];
+		memcpy(entry.seed, &record[0x08], NNC_SEED_SIZE);
+		entry.title_id = LE64P(&record[0x00]);
+		entries[i] = entry;
 	}
+	if(expected_size)
+	{
+		/* give back the space the conversion freed up, if shrinking
+		 * fails the original allocation is still valid */
+		void *shrunk = realloc(raw, expected_size * sizeof(struct nnc_seeddb_entry));
+		seeddb->entries = shrunk ? shrunk : (void *) raw;
+	}
+	seeddb->size = expected_size;
+	nnc_sort_seeddb(seeddb);
 	return NNC_R_OK;
 }
 
 result nnc_scan_seeddb(nnc_seeddb *seeddb)
 {
 	char path[SUP_FILE_NAME_LEN];
+	seeddb->size = 0;
+	seeddb->entries = seeddb->sorted = NULL;
 	if(!find_support_file("seeddb.bin", path))
 		return NNC_R_NOT_FOUND;
 	nnc_file f;
@@ -203,6 +441,20 @@ result nnc_scan_seeddb(nnc_seeddb *seeddb)
 
 u8 *nnc_get_seed(nnc_seeddb *seeddb, u64 tid)
 {
+	/* garbage left in `sorted' is practically never equal to `entries' */
+	if(seeddb->sorted == seeddb->entries && seeddb->entries)
+	{
+		u32 lo = 0, hi = seeddb->size;
+		while(lo < hi)
+		{
+			u32 mid = lo + (hi - lo) / 2;
+			if(seeddb->entries[mid].title_id < tid) lo = mid + 1;
+			else                                    hi = mid;
+		}
+		if(lo != seeddb->size && seeddb->entries[lo].title_id == tid)
+			return seeddb->entries[lo].seed;
+		return NULL;
+	}
 	for(u32 i = 0; i < seeddb->size; ++i)
 	{
 		if(seeddb->entries[i].title_id == tid)
@@ -211,6 +463,15 @@ u8 *nnc_get_seed(nnc_seeddb *seeddb, u64 tid)
 	return NULL;
 }
 
+u32 nnc_get_seeds(nnc_seeddb *seeddb, const u64 *tids, u8 **seeds, u32 count)
+{
+	u32 found = 0;
+	for(u32 i = 0; i < count; ++i)
+		if((seeds[i] = nnc_get_seed(seeddb, tids[i])))
+			++found;
+	return found;
+}
+
 void nnc_free_seeddb(nnc_seeddb *seeddb)
 {
 	free(seeddb->entries);
@@ -226,6 +487,19 @@ enum keyfield {
 
 #define TYPE_FLAG(sel) (sel == NNC_KEYSET_RETAIL ? RETAIL : DEV)
 
+/* shared between default_keys and the statically initialized default keyset */
+#define RETAIL_KEYS \
+	.kx_ncch0 = NNC_HEX128(0xB98E95CECA3E4D17,1F76A94DE934C053), \
+	.kx_ncch1 = NNC_HEX128(0xCEE7D8AB30C00DAE,850EF5E382AC5AF3), \
+	.kx_ncchA = NNC_HEX128(0x82E9C9BEBFB8BDB8,75ECC0A07D474374), \
+	.kx_ncchB = NNC_HEX128(0x45AD04953992C7C8,93724A9A7BCE6182), \
+	.ky_comy0 = NNC_HEX128(0x64C5FD55DD3AD988,325BAAEC5243DB98), \
+	.ky_comy1 = NNC_HEX128(0x4AAA3D0E27D4D728,D0B1B433F0F9CBC8), \
+	.ky_comy2 = NNC_HEX128(0xFBB0EF8CDBB0D8E4,53CD99344371697F), \
+	.ky_comy3 = NNC_HEX128(0x25959B7AD0409F72,684198BA2ECD7DC6), \
+	.ky_comy4 = NNC_HEX128(0x7ADA22CAFFC476CC,8297A0C7CEEEEEBE), \
+	.ky_comy5 = NNC_HEX128(0xA5051CA1B37DCF3A,FBCF8CC1EDD9CE02),
+
 static const struct _kstore {
 	const u128 kx_ncch0;
 	const u128 kx_ncch1;
@@ -240,16 +514,7 @@ static const struct _kstore {
 } default_keys[2] =
 {
 	{	/* retail */
-		.kx_ncch0 = NNC_HEX128(0xB98E95CECA3E4D17,1F76A94DE934C053),
-		.kx_ncch1 = NNC_HEX128(0xCEE7D8AB30C00DAE,850EF5E382AC5AF3),
-		.kx_ncchA = NNC_HEX128(0x82E9C9BEBFB8BDB8,75ECC0A07D474374),
-		.kx_ncchB = NNC_HEX128(0x45AD04953992C7C8,93724A9A7BCE6182),
-		.ky_comy0 = NNC_HEX128(0x64C5FD55DD3AD988,325BAAEC5243DB98),
-		.ky_comy1 = NNC_HEX128(0x4AAA3D0E27D4D728,D0B1B433F0F9CBC8),
-		.ky_comy2 = NNC_HEX128(0xFBB0EF8CDBB0D8E4,53CD99344371697F),
-		.ky_comy3 = NNC_HEX128(0x25959B7AD0409F72,684198BA2ECD7DC6),
-		.ky_comy4 = NNC_HEX128(0x7ADA22CAFFC476CC,8297A0C7CEEEEEBE),
-		.ky_comy5 = NNC_HEX128(0xA5051CA1B37DCF3A,FBCF8CC1EDD9CE02),
+		RETAIL_KEYS
 	},
 	{	/* dev */
 		.kx_ncch0 = NNC_HEX128(0x510207515507CBB1,8E243DCB85E23A1D),
@@ -320,8 +585,44 @@ static void hwkgen(nnc_ncch_header *ncch, u128 *output, u128 *kx, u128 *ky)
 		hwkgen_3ds(output, kx, ky);
 }
 
+/* deriving a seeded keyY takes two SHA-256 passes and happens again
+ * for every keypair filled for the same NCCH, so remember the last few */
+#define SEEDKEY_SLOTS 16
+
+static struct seedkey_slot {
+	u64 title_id;
+	u128 keyy, result;
+	u8 seed[NNC_SEED_SIZE];
+	u8 seed_hash[4];
+	bool valid;
+} seedkey_cache[SEEDKEY_SLOTS];
+static nnc_mutex seedkey_lock = MUTEX_INIT;
+
+static struct seedkey_slot *seedkey_find(nnc_ncch_header *ncch, u8 seed[NNC_SEED_SIZE])
+{
+	return &seedkey_cache[(ncch->title_id ^ seed[0]) % SEEDKEY_SLOTS];
+}
+
+static bool seedkey_match(struct seedkey_slot *slot, nnc_ncch_header *ncch, u8 seed[NNC_SEED_SIZE])
+{
+	return slot->valid && slot->title_id == ncch->title_id
+		&& memcmp(&slot->keyy, &ncch->keyy, sizeof(u128)) == 0
+		&& memcmp(slot->seed, seed, NNC_SEED_SIZE) == 0
+		&& memcmp(slot->seed_hash, ncch->seed_hash, 4) == 0;
+}
+
 nnc_result nnc_keyy_seed(nnc_ncch_header *ncch, nnc_u128 *keyy, u8 seed[NNC_SEED_SIZE])
 {
+	struct seedkey_slot *slot = seedkey_find(ncch, seed);
+	mutex_lock(&seedkey_lock);
+	if(HAVE_MUTEX && seedkey_match(slot, ncch, seed))
+	{
+		*keyy = slot->result;
+		mutex_unlock(&seedkey_lock);
+		return NNC_R_OK;
+	}
+	mutex_unlock(&seedkey_lock);
+
 	nnc_sha256_hash hashbuf;
 	nnc_u8 strbuf[0x20];
 	memcpy(strbuf, seed, NNC_SEED_SIZE);
@@ -333,7 +634,18 @@ nnc_result nnc_keyy_seed(nnc_ncch_header *ncch, nnc_u128 *keyy, u8 seed[NNC_SEED
 	nnc_u128_bytes_be(&ncch->keyy, strbuf);
 	memcpy(strbuf + 0x10, seed, NNC_SEED_SIZE);
 	nnc_crypto_sha256(strbuf, hashbuf, 0x20);
-	*keyy = nnc_u128_import_be(hashbuf);
+	u128 res = nnc_u128_import_be(hashbuf);
+
+	*keyy = res;
+	if(!HAVE_MUTEX) return NNC_R_OK;
+	mutex_lock(&seedkey_lock);
+	slot->title_id = ncch->title_id;
+	slot->keyy = ncch->keyy;
+	slot->result = res;
+	memcpy(slot->seed, seed, NNC_SEED_SIZE);
+	memcpy(slot->seed_hash, ncch->seed_hash, 4);
+	slot->valid = true;
+	mutex_unlock(&seedkey_lock);
 	return NNC_R_OK;
 }
 
@@ -476,9 +788,10 @@ static result do_crypto_seek(struct generic_crypto_obj *self, u32 pos, crypto_re
 		u32 aligned = ALIGN_DOWN(pos, 0x10);
 		NNC_RS_PCALL(self->child, seek_abs, aligned);
 		TRY(redo_iv(self, aligned));
-		u32 totalRead;
-		ret = NNC_RS_PCALL(self, read, self->last_unaligned_block, 0x10, &totalRead);
-		if(ret != NNC_R_OK || totalRead != 0x10)
+		/* the last block may be partial */
+		u32 totalRead, want = MIN(0x10, NNC_RS_PCALL0(self->child, size) - aligned);
+		ret = NNC_RS_PCALL(self, read, self->last_unaligned_block, want, &totalRead);
+		if(ret != NNC_R_OK || totalRead != want)
 			return NNC_R_TOO_SMALL;
 	}
 	return NNC_RS_PCALL(self->child, seek_abs, pos);
@@ -532,7 +845,8 @@ static result do_crypto_read(struct generic_crypto_obj *self, u8 *buf, u32 max,
 		decrypt(self, 0x10, self->last_unaligned_block);
 		u8 applicable_read = MIN(*totalRead, max);
 		/* "unread" the extra bytes we read so we get the correct offset */
-		TRY(NNC_RS_PCALL(self->child, seek_abs, NNC_RS_PCALL0(self->child, tell) - (0x10 - applicable_read)));
+		if(*totalRead != applicable_read)
+			TRY(NNC_RS_PCALL(self->child, seek_abs, NNC_RS_PCALL0(self->child, tell) - (*totalRead - applicable_read)));
 		memcpy(buf, self->last_unaligned_block, applicable_read);
 		real_read += applicable_read;
 	}
@@ -554,7 +868,7 @@ static void aes_ctr_decrypt(nnc_aes_ctr *self, u32 size, u8 *buf)
 {
 	size_t of = 0;
 	u8 block[0x10];
-	mbedtls_aes_crypt_ctr(self->crypto_ctx, size, &of, self->ctr, block, buf, buf);
+	be_aes_ctr(self->crypto_ctx, size, &of, self->ctr, block, buf, buf);
 }
 
 static result aes_ctr_read(nnc_aes_ctr *self, u8 *buf, u32 max, u32 *totalRead)
@@ -584,8 +898,7 @@ static u32 aes_ctr_tell(nnc_aes_ctr *self)
 
 static void aes_ctr_close(nnc_aes_ctr *self)
 {
-	mbedtls_aes_free(self->crypto_ctx);
-	free(self->crypto_ctx);
+	aes_ctx_put(self->crypto_ctx, NULL);
 }
 
 static const nnc_rstream_funcs aes_ctr_funcs = {
@@ -599,20 +912,89 @@ static const nnc_rstream_funcs aes_ctr_funcs = {
 
 nnc_result nnc_aes_ctr_open(nnc_aes_ctr *self, nnc_rstream *child, u128 *key, u8 iv[0x10])
 {
+	u8 buf[0x10];
+	nnc_u128_bytes_be(key, buf);
 	self->funcs = &aes_ctr_funcs;
-	if(!(self->crypto_ctx = malloc(sizeof(mbedtls_aes_context))))
+	if(!(self->crypto_ctx = aes_ctx_get(buf, false, NULL)))
 		return NNC_R_NOMEM;
 	self->iv = nnc_u128_import_be(iv);
 	self->child = child;
 
-	u8 buf[0x10];
-	nnc_u128_bytes_be(key, buf);
-	mbedtls_aes_setkey_enc(self->crypto_ctx, buf, 128);
-
 	redo_ctr_iv(self, 0);
 	return NNC_R_OK;
 }
 
+static result aes_ctr_write(nnc_aes_ctr *self, u8 *buf, u32 size)
+{
+	/* the position in the current keystream block follows from the position in the child */
+	size_t of = (NNC_WS_PCALL0((nnc_wstream *) self->child, tell) - self->offset) % 0x10;
+	result ret;
+	u8 block[BLOCK_SZ];
+	u32 next_write;
+	while(size != 0)
+	{
+		next_write = MIN(BLOCK_SZ, size);
+		be_aes_ctr(self->crypto_ctx, next_write, &of, self->ctr,
+			self->last_unaligned_block, buf, block);
+		TRY(NNC_WS_PCALL((nnc_wstream *) self->child, write, block, next_write));
+		buf += next_write;
+		size -= next_write;
+	}
+	return NNC_R_OK;
+}
+
+static result aes_ctr_wseek(nnc_aes_ctr *self, u32 pos)
+{
+	if(pos < self->offset) return NNC_R_SEEK_RANGE;
+	result ret;
+	TRY(NNC_WS_PCALL((nnc_wstream *) self->child, seek, pos));
+	u32 rel = pos - self->offset;
+	redo_ctr_iv(self, rel);
+	if(rel % 0x10 != 0)
+	{
+		/* generate the keystream block we're in the middle of */
+		u8 dummy[0x10] = { 0 };
+		size_t of = 0;
+		be_aes_ctr(self->crypto_ctx, rel % 0x10, &of, self->ctr,
+			self->last_unaligned_block, dummy, dummy);
+	}
+	return NNC_R_OK;
+}
+
+static result aes_ctr_wclose(nnc_aes_ctr *self)
+{
+	aes_ctr_close(self);
+	return NNC_R_OK;
+}
+
+static u32 aes_ctr_wtell(nnc_aes_ctr *self)
+{
+	return NNC_WS_PCALL0((nnc_wstream *) self->child, tell);
+}
+
+static const nnc_wstream_funcs aes_ctr_wfuncs_seekable = {
+	.write = (nnc_write_func) aes_ctr_write,
+	.close = (nnc_wclose_func) aes_ctr_wclose,
+	.seek  = (nnc_wseek_func) aes_ctr_wseek,
+	.tell  = (nnc_wtell_func) aes_ctr_wtell,
+};
+
+static const nnc_wstream_funcs aes_ctr_wfuncs = {
+	.write = (nnc_write_func) aes_ctr_write,
+	.close = (nnc_wclose_func) aes_ctr_wclose,
+	.tell  = (nnc_wtell_func) aes_ctr_wtell,
+};
+
+nnc_result nnc_aes_ctr_open_w(nnc_aes_ctr *self, nnc_wstream *child, u128 *key, u8 iv[0x10])
+{
+	result ret;
+	/* nnc_aes_ctr_open only uses the child to store it */
+	TRY(nnc_aes_ctr_open(self, (nnc_rstream *) child, key, iv));
+	self->funcs = child->funcs->seek ? &aes_ctr_wfuncs_seekable : &aes_ctr_wfuncs;
+	self->offset = NNC_WS_PCALL0(child, tell);
+	return NNC_R_OK;
+}
+
 static nnc_result redo_cbc_iv(nnc_aes_cbc *self, u32 offset)
 {
 	if(offset == 0) memcpy(self->iv, self->init_iv, 0x10);
@@ -631,7 +1013,7 @@ static nnc_result redo_cbc_iv(nnc_aes_cbc *self, u32 offset)
 
 static void aes_cbc_decrypt(nnc_aes_cbc *self, u32 size, u8 *buf)
 {
-	mbedtls_aes_crypt_cbc(self->crypto_ctx, MBEDTLS_AES_DECRYPT, size, self->iv, buf, buf);
+	be_aes_cbc(self->crypto_ctx, true, size, self->iv, buf, buf);
 }
 
 static result aes_cbc_read(nnc_aes_cbc *self, u8 *buf, u32 max, u32 *totalRead)
@@ -661,8 +1043,7 @@ static u32 aes_cbc_tell(nnc_aes_cbc *self)
 
 static void aes_cbc_close(nnc_aes_cbc *self)
 {
-	mbedtls_aes_free(self->crypto_ctx);
-	free(self->crypto_ctx);
+	aes_ctx_put(self->crypto_ctx, NULL);
 }
 
 static const nnc_rstream_funcs aes_cbc_funcs = {
@@ -676,14 +1057,11 @@ static const nnc_rstream_funcs aes_cbc_funcs = {
 
 static result init_aes_cbc(nnc_aes_cbc *self, void *child, u8 key[0x10], u8 iv[0x10], bool set_deckey)
 {
-	if(!(self->crypto_ctx = malloc(sizeof(mbedtls_aes_context))))
+	if(!(self->crypto_ctx = aes_ctx_get(key, set_deckey, NULL)))
 		return NNC_R_NOMEM;
 	memcpy(self->init_iv, iv, 0x10);
 	memcpy(self->iv, iv, 0x10);
 	self->child = child;
-
-	if(set_deckey) mbedtls_aes_setkey_dec(self->crypto_ctx, key, 128);
-	else           mbedtls_aes_setkey_enc(self->crypto_ctx, key, 128);
 	return NNC_R_OK;
 }
 
@@ -702,7 +1080,7 @@ static result aes_cbc_write(nnc_aes_cbc *self, u8 *buf, u32 size)
 	while(size != 0)
 	{
 		next_read = MIN(BLOCK_SZ, size);
-		mbedtls_aes_crypt_cbc(self->crypto_ctx, MBEDTLS_AES_ENCRYPT, next_read, self->iv,
+		be_aes_cbc(self->crypto_ctx, false, next_read, self->iv,
 			&buf[pos], block);
 		TRY(NNC_WS_PCALL(self->child, write, block, next_read));
 		pos += next_read;
@@ -734,66 +1112,164 @@ nnc_result nnc_aes_cbc_open_w(nnc_aes_cbc *self, nnc_wstream *child, u8 key[0x10
 	return init_aes_cbc(self, child, key, iv, false);
 }
 
-result nnc_decrypt_tkey(nnc_ticket *tik, nnc_keyset *ks, nnc_u8 decrypted[0x10])
+nnc_result nnc_aes_cbc_encrypt_buffer(u8 key[0x10], u8 iv[0x10], u8 *buf, u32 size)
+{
+	if(size % 0x10 != 0) return NNC_R_BAD_ALIGN;
+	nnc_crypto_ctx_storage storage;
+	nnc_be_aes *ctx = aes_ctx_get(key, false, &storage);
+	if(!ctx) return NNC_R_NOMEM;
+	be_aes_cbc(ctx, false, size, iv, buf, buf);
+	aes_ctx_put(ctx, &storage);
+	return NNC_R_OK;
+}
+
+#define COMMON_KEYS 6
+
+static u128 *common_keyy(nnc_keyset *ks, u8 index)
 {
-	u128 *used_keyy;
-	switch(tik->common_keyy)
+	switch(index)
 	{
-	case 0: used_keyy = &ks->ky_comy0; break;
-	case 1: used_keyy = &ks->ky_comy1; break;
-	case 2: used_keyy = &ks->ky_comy2; break;
-	case 3: used_keyy = &ks->ky_comy3; break;
-	case 4: used_keyy = &ks->ky_comy4; break;
-	case 5: used_keyy = &ks->ky_comy5; break;
-	default: return NNC_R_CORRUPT; /* invalid key selected */
+	case 0: return &ks->ky_comy0;
+	case 1: return &ks->ky_comy1;
+	case 2: return &ks->ky_comy2;
+	case 3: return &ks->ky_comy3;
+	case 4: return &ks->ky_comy4;
+	case 5: return &ks->ky_comy5;
 	}
+	return NULL; /* invalid key selected */
+}
+
+static void decrypt_tkey(nnc_be_aes *ctx, nnc_ticket *tik, u8 decrypted[0x10])
+{
 	u64 iv[2] = { BE64(tik->title_id), 0 };
-	mbedtls_aes_context ctx;
+	be_aes_cbc(ctx, true, 0x10, (u8 *) iv,
+		tik->title_key, decrypted);
+}
+
+result nnc_decrypt_tkey(nnc_ticket *tik, nnc_keyset *ks, nnc_u8 decrypted[0x10])
+{
+	u128 *used_keyy = common_keyy(ks, tik->common_keyy);
+	if(!used_keyy) return NNC_R_CORRUPT;
+	nnc_crypto_ctx_storage storage;
+	nnc_be_aes *ctx;
 	u8 buf[0x10];
 
 	nnc_u128_bytes_be(used_keyy, buf);
-	mbedtls_aes_setkey_dec(&ctx, buf, 128);
-	mbedtls_aes_crypt_cbc(&ctx, MBEDTLS_AES_DECRYPT, 0x10, (u8 *) iv,
-		tik->title_key, decrypted);
-	mbedtls_aes_free(&ctx);
+	if(!(ctx = aes_ctx_get(buf, true, &storage)))
+		return NNC_R_NOMEM;
+	decrypt_tkey(ctx, tik, decrypted);
+	aes_ctx_put(ctx, &storage);
 	return NNC_R_OK;
 }
 
+result nnc_decrypt_tkeys(nnc_ticket *tiks, u32 count, nnc_keyset *ks, nnc_u8 (*decrypted)[0x10])
+{
+	nnc_crypto_ctx_storage storage[COMMON_KEYS];
+	nnc_be_aes *ctxs[COMMON_KEYS] = { NULL };
+	result ret = NNC_R_OK;
+	u8 buf[0x10];
+
+	/* the contexts are set up on first use and kept
+	 * for the rest of the batch */
+	for(u32 i = 0; i < count; ++i)
+	{
+		u8 index = tiks[i].common_keyy;
+		if(index >= COMMON_KEYS)
+		{
+			memset(decrypted[i], 0, 0x10);
+			ret = NNC_R_CORRUPT;
+			continue;
+		}
+		if(!ctxs[index])
+		{
+			nnc_u128_bytes_be(common_keyy(ks, index), buf);
+			if(!(ctxs[index] = aes_ctx_get(buf, true, &storage[index])))
+			{
+				ret = NNC_R_NOMEM;
+				break;
+			}
+		}
+		decrypt_tkey(ctxs[index], &tiks[i], decrypted[i]);
+	}
+
+	for(u32 i = 0; i < COMMON_KEYS; ++i)
+		if(ctxs[i]) aes_ctx_put(ctxs[i], &storage[i]);
+	return ret;
+}
+
+#if defined(_MSC_VER)
+	#define THREAD_LOCAL __declspec(thread)
+#elif defined(__GNUC__)
+	#define THREAD_LOCAL __thread
+#else
+	/* no thread local storage; nnc_set_thread_context affects all threads */
+	#define THREAD_LOCAL
+#endif
+
 static nnc_seeddb nnc_empty_seeddb = {
 	.size    = 0,
 	.entries = NULL,
+	.sorted  = NULL,
 };
+
+/* statically initialized so nothing has to be set up lazily (and racily) on first use */
+static nnc_keyset nnc_gkset = {
+	.flags = DEFAULT | RETAIL,
+	RETAIL_KEYS
+};
+
+static nnc_mutex defaults_lock = MUTEX_INIT;
 static nnc_seeddb *nnc_default_seeddb = &nnc_empty_seeddb;
+static nnc_keyset *nnc_default_kset = &nnc_gkset;
+static THREAD_LOCAL nnc_context *thread_context = NULL;
 
 nnc_seeddb *nnc_set_default_seeddb(nnc_seeddb *sdb)
 {
 	if(!sdb) sdb = &nnc_empty_seeddb;
+	mutex_lock(&defaults_lock);
 	nnc_seeddb *ret = nnc_default_seeddb;
 	nnc_default_seeddb = sdb;
+	mutex_unlock(&defaults_lock);
 	return ret;
 }
 
-nnc_seeddb *nnc_get_default_seeddb(void) { return nnc_default_seeddb; }
-
-static nnc_keyset nnc_gkset = {
-	.flags = 0,
-};
-static nnc_keyset *nnc_default_kset = &nnc_gkset;
+nnc_seeddb *nnc_get_default_seeddb(void)
+{
+	if(thread_context && thread_context->seeddb)
+		return thread_context->seeddb;
+	mutex_lock(&defaults_lock);
+	nnc_seeddb *ret = nnc_default_seeddb;
+	mutex_unlock(&defaults_lock);
+	return ret;
+}
 
 nnc_keyset *nnc_set_default_keyset(nnc_keyset *kset)
 {
 	if(!kset) kset = &nnc_gkset;
+	/* aka not yet initialized */
+	else if(!(kset->flags & TYPE_FIELD))
+		nnc_keyset_default(kset, NNC_KEYSET_RETAIL);
+	mutex_lock(&defaults_lock);
 	nnc_keyset *ret = nnc_default_kset;
 	nnc_default_kset = kset;
+	mutex_unlock(&defaults_lock);
 	return ret;
 }
 
 nnc_keyset *nnc_get_default_keyset(void)
 {
-	/* aka not yet initialized; this check is done here because nnc_set_default_keyset() is
-	 * not done for nnc_gkset */
-	if(!(nnc_default_kset->flags & TYPE_FIELD))
-		nnc_keyset_default(nnc_default_kset, false);
-	return nnc_default_kset;
+	if(thread_context && thread_context->kset)
+		return thread_context->kset;
+	mutex_lock(&defaults_lock);
+	nnc_keyset *ret = nnc_default_kset;
+	mutex_unlock(&defaults_lock);
+	return ret;
+}
+
+nnc_context *nnc_set_thread_context(nnc_context *ctx)
+{
+	nnc_context *ret = thread_context;
+	thread_context = ctx;
+	return ret;
 }
 
@@ -1,4 +1,8 @@
 
+#if defined(_3DS) || defined(__3DS__)
+	/* before internal.h, its u8 & co. macros break libctru's typedefs */
+	#include <3ds/synchronization.h>
+#endif
 #include <nnc/stream.h>
 #include <nnc/base.h>
 #include <stdlib.h>
@@ -27,8 +31,7 @@ result nnc_read_at_exact(nnc_rstream *rs, u32 offset, u8 *data, u32 dsize)
 {
 	result ret;
 	u32 size;
-	TRY(NNC_RS_PCALL(rs, seek_abs, offset));
-	TRY(NNC_RS_PCALL(rs, read, data, dsize, &size));
+	TRY(nnc_read_at(rs, offset, data, dsize, &size));
 	return size == dsize ? NNC_R_OK : NNC_R_TOO_SMALL;
 }
 
@@ -250,3 +253,89 @@ void nnc_dynbuf_free(struct dynbuf *db)
 }
 
 
+#if NNC_PLATFORM_UNIX
+	#include <pthread.h>
+	#define THREADS
+	typedef pthread_t thread_handle;
+	#define THREAD_RETURN void *
+	#define thread_start(t, f, a) (pthread_create(t, NULL, f, a) == 0)
+	#define thread_join(t) pthread_join(t, NULL)
+#elif NNC_PLATFORM_WINDOWS
+	#include <windows.h>
+	#define THREADS
+	typedef HANDLE thread_handle;
+	#define THREAD_RETURN DWORD WINAPI
+	#define thread_start(t, f, a) ((*(t) = CreateThread(NULL, 0, f, a, 0, NULL)) != NULL)
+	#define thread_join(t) do { WaitForSingleObject(t, INFINITE); CloseHandle(t); } while(0)
+#endif
+
+#ifdef THREADS
+struct job_thread {
+	thread_handle handle;
+	nnc_job_func func;
+	void *job;
+	bool started;
+};
+
+static THREAD_RETURN job_thread_main(void *arg)
+{
+	struct job_thread *self = arg;
+	self->func(self->job);
+	return 0;
+}
+#endif
+
+void nnc_run_jobs(nnc_job_func func, void *jobs, u32 job_size, u32 count)
+{
+	u8 *job = jobs;
+#ifdef THREADS
+	struct job_thread *threads;
+	if(count > 1 && (threads = malloc(sizeof(struct job_thread) * (count - 1))))
+	{
+		/* the first job is run on this thread */
+		for(u32 i = 1; i < count; ++i)
+		{
+			threads[i - 1].func = func;
+			threads[i - 1].job = &job[i * job_size];
+			threads[i - 1].started = thread_start(&threads[i - 1].handle, job_thread_main, &threads[i - 1]);
+			/* if we can't start a thread it'll just be done on this one */
+			if(!threads[i - 1].started)
+				func(&job[i * job_size]);
+		}
+		func(job);
+		for(u32 i = 0; i < count - 1; ++i)
+			if(threads[i].started)
+				thread_join(threads[i].handle);
+		free(threads);
+		return;
+	}
+#endif
+	for(u32 i = 0; i < count; ++i)
+		func(&job[i * job_size]);
+}
+
+void nnc_mutex_lock(nnc_mutex *mutex)
+{
+#if NNC_PLATFORM_UNIX
+	pthread_mutex_lock(mutex);
+#elif NNC_PLATFORM_WINDOWS
+	AcquireSRWLockExclusive((PSRWLOCK) mutex);
+#elif NNC_PLATFORM_3DS
+	LightLock_Lock((LightLock *) mutex);
+#else
+	(void) mutex;
+#endif
+}
+
+void nnc_mutex_unlock(nnc_mutex *mutex)
+{
+#if NNC_PLATFORM_UNIX
+	pthread_mutex_unlock(mutex);
+#elif NNC_PLATFORM_WINDOWS
+	ReleaseSRWLockExclusive((PSRWLOCK) mutex);
+#elif NNC_PLATFORM_3DS
+	LightLock_Unlock((LightLock *) mutex);
+#else
+	(void) mutex;
+#endif
+}
@@ -95,6 +95,40 @@ bool nnc_find_support_file(const char *name, char *output);
 #define strdup nnc_strdup
 char *nnc_strdup(const char *s);
 
+typedef void (*nnc_job_func)(void *job);
+#define run_jobs nnc_run_jobs
+/* runs `func' once for every element of `jobs' (`count' elements of `job_size' bytes),
+ * on separate threads where supported; returns once all jobs are done */
+void nnc_run_jobs(nnc_job_func func, void *jobs, u32 job_size, u32 count);
+
+/* a lock that can be initialised statically with MUTEX_INIT; HAVE_MUTEX is 0
+ * on platforms where it does nothing, process-global caches must not be
+ * used there since the caller may still use threads of its own */
+#if NNC_PLATFORM_UNIX
+	#include <pthread.h>
+	typedef pthread_mutex_t nnc_mutex;
+	#define MUTEX_INIT PTHREAD_MUTEX_INITIALIZER
+	#define HAVE_MUTEX 1
+#elif NNC_PLATFORM_WINDOWS
+	/* same layout as an SRWLOCK so we don't need windows.h in here */
+	typedef struct nnc_mutex { void *ptr; } nnc_mutex;
+	#define MUTEX_INIT { NULL }
+	#define HAVE_MUTEX 1
+#elif NNC_PLATFORM_3DS
+	/* same layout as a libctru LightLock, which is unlocked at 1 */
+	typedef i32 nnc_mutex;
+	#define MUTEX_INIT 1
+	#define HAVE_MUTEX 1
+#else
+	typedef u8 nnc_mutex;
+	#define MUTEX_INIT 0
+	#define HAVE_MUTEX 0
+#endif
+#define mutex_lock nnc_mutex_lock
+void nnc_mutex_lock(nnc_mutex *mutex);
+#define mutex_unlock nnc_mutex_unlock
+void nnc_mutex_unlock(nnc_mutex *mutex);
+
 struct dynbuf {
 	u8 *buffer;
 	u32 alloc, used;
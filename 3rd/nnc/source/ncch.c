@@ -112,159 +112,66 @@ nnc_result nnc_ncch_section_exheader(nnc_ncch_header *ncch, nnc_rstream *rs,
 		&kp->primary, iv);
 }
 
-static result efs_strm_read(nnc_ncch_exefs_stream *self, u8 *buf, u32 max, u32 *totalRead)
-{
-	u32 willread = MIN(max, self->size - self->pos);
-	*totalRead = willread;
-	nnc_result ret;
-	u32 bufoff = 0;
-
-	while(willread)
-	{
-		nnc_ncch_exefs_substream *sstream = &self->substreams[self->curstream];
-		/* internal error */
-		if(sstream->readoff == sstream->size) return NNC_R_INTERNAL;
-		u32 left_in_ss = sstream->size - sstream->readoff;
-		u32 this_read = MIN(willread, left_in_ss);
-		TRY(read_exact(NNC_RSP(&sstream->stream), buf + bufoff, this_read));
-		bufoff += this_read;
-		willread -= this_read;
-		sstream->readoff += this_read;
-		self->pos += this_read;
-		/* we need to move over to the next substream */
-		if(sstream->readoff == sstream->size)
-		{
-			++self->curstream;
-			if(self->curstream != self->streamcount)
-			{
-				sstream = &self->substreams[self->curstream];
-				sstream->readoff = 0;
-				TRY(NNC_RS_CALL(sstream->stream, seek_abs, 0));
-			}
-		}
-	}
-	return NNC_R_OK;
-}
-
-static result efs_strm_seek_abs(nnc_ncch_exefs_stream *self, u32 pos)
-{
-	if(pos > self->size) return NNC_R_SEEK_RANGE;
-	/* find the correct bucket */
-	for(u8 i = 0; i < self->streamcount; ++i)
-		if(self->substreams[i].offset >= pos)
-		{
-			/* found it; seek to this bucket */
-			u32 amount_in = self->substreams[i].offset - pos;
-			result res = NNC_RS_CALL(self->substreams[i].stream, seek_abs, amount_in);
-			if(res != NNC_R_OK) return res;
-			self->substreams[i].readoff = amount_in;
-			self->pos = pos;
-			self->curstream = i;
-			return NNC_R_OK;
-		}
-	/* shouldn't happen */
-	return NNC_R_SEEK_RANGE;
-}
-
-static result efs_strm_seek_rel(nnc_ncch_exefs_stream *self, u32 pos)
-{
-	return efs_strm_seek_abs(self, self->pos + pos);
-}
-
-static u32 efs_strm_size(nnc_ncch_exefs_stream *self)
-{
-	return self->size;
-}
-
-static void efs_strm_close(nnc_ncch_exefs_stream *self)
-{
-	for(u8 i = 0; i < self->streamcount; ++i)
-		NNC_RS_CALL0(self->substreams[i].stream, close);
-}
-
-static u32 efs_strm_tell(nnc_ncch_exefs_stream *self) { return self->pos; }
-
-static const nnc_rstream_funcs efs_strm_funcs = {
-	.read = (nnc_read_func) efs_strm_read,
-	.seek_abs = (nnc_seek_abs_func) efs_strm_seek_abs,
-	.seek_rel = (nnc_seek_rel_func) efs_strm_seek_rel,
-	.size = (nnc_size_func) efs_strm_size,
-	.close = (nnc_close_func) efs_strm_close,
-	.tell = (nnc_tell_func) efs_strm_tell,
+/* the parts of a full ExeFS stream, on the heap since they point at each other */
+struct exefs_parts {
+	nnc_ncch_exefs_substream substreams[NNC_EXEFS_MAX_SUBSTREAMS];
+	nnc_rstream *children[NNC_EXEFS_MAX_SUBSTREAMS];
+	nnc_u32 offsets[NNC_EXEFS_MAX_SUBSTREAMS + 1];
 };
 
 nnc_result nnc_ncch_exefs_full_stream(nnc_ncch_exefs_stream *self, nnc_ncch_header *ncch, nnc_rstream *rs, nnc_keypair *kp)
 {
-	nnc_ncch_section_stream *header_stream = &self->substreams[0].stream.section;
 	nnc_exefs_file_header headers[NNC_EXEFS_MAX_FILES];
-	u8 filecount;
+	u32 exefs_offset = NNC_MU_TO_BYTE(ncch->exefs_offset);
+	u32 mpos = NNC_EXEFS_HEADER_SIZE, tpos;
+	u8 filecount, count = 0;
+	struct exefs_parts *p;
 	result ret;
 
-	self->funcs = &efs_strm_funcs;
-	self->streamcount = 0;
-
-	TRY(nnc_ncch_section_exefs_header(ncch, rs, kp, header_stream)); self->streamcount = 1;
-	TRYLBL(nnc_read_exefs_header(NNC_RSP(header_stream), headers, &filecount), out);
-	NNC_RS_PCALL(header_stream, seek_abs, 0);
-
-	self->substreams[0].offset = 0;
-	self->substreams[0].size = NNC_EXEFS_HEADER_SIZE;
-	u32 mpos = NNC_EXEFS_HEADER_SIZE;
+	if(!(p = malloc(sizeof(struct exefs_parts))))
+		return NNC_R_NOMEM;
+	if((ret = nnc_ncch_section_exefs_header(ncch, rs, kp, &p->substreams[0].section)) != NNC_R_OK)
+	{
+		free(p);
+		return ret;
+	}
+	p->children[count++] = NNC_RSP(&p->substreams[0].section);
+	TRYLBL(nnc_read_exefs_header(p->children[0], headers, &filecount), out);
 
-	u8 sindex = 1;
-	u32 tpos, nsiz;
 	for(u8 i = 0; i < filecount; ++i)
 	{
 		tpos = NNC_EXEFS_HEADER_SIZE + headers[i].offset;
+		/* something is wrong if files overlap */
+		if(mpos > tpos) { ret = NNC_R_CORRUPT; goto out; }
 		if(mpos < tpos)
 		{
-			/* we need to add an "in-between" section */
-			nsiz = tpos - mpos;
-			self->substreams[sindex].offset = mpos;
-			self->substreams[sindex].size = nsiz;
-			self->substreams[sindex].readoff = 0;
-			/* open a substream in the raw exefs */
-			nnc_subview_open(&self->substreams[sindex].stream.raw, rs, NNC_MU_TO_BYTE(ncch->exefs_offset) + mpos, nsiz);
-			mpos += nsiz;
-			++sindex;
-			++self->streamcount;
+			/* the data in between files is not encrypted */
+			nnc_subview_open(&p->substreams[count].raw, rs, exefs_offset + mpos, tpos - mpos);
+			p->children[count] = NNC_RSP(&p->substreams[count].raw);
+			++count;
 		}
-		else if(mpos > tpos)
-		{
-			/* in this case something is wrong */
-			ret = NNC_R_CORRUPT;
-			break;
-		}
-		self->substreams[sindex].offset = mpos;
-		self->substreams[sindex].size = headers[i].size;
-		self->substreams[sindex].readoff = 0;
-		TRYLBL(nnc_ncch_exefs_subview(ncch, rs, kp, &self->substreams[sindex].stream.section, &headers[i]), out);
-		++self->streamcount;
-		++sindex;
-		mpos += headers[i].size;
+		TRYLBL(nnc_ncch_exefs_subview(ncch, rs, kp, &p->substreams[count].section, &headers[i]), out);
+		p->children[count] = NNC_RSP(&p->substreams[count].section);
+		++count;
+		mpos = tpos + headers[i].size;
 	}
 	/* Add the last section */
 	tpos = NNC_MU_TO_BYTE(ncch->exefs_size);
+	if(mpos > tpos) { ret = NNC_R_CORRUPT; goto out; }
 	if(mpos < tpos)
 	{
-		nsiz = tpos - mpos;
-		self->substreams[sindex].offset = mpos;
-		self->substreams[sindex].size = nsiz;
-		self->substreams[sindex].readoff = 0;
-		nnc_subview_open(&self->substreams[sindex].stream.raw, rs, NNC_MU_TO_BYTE(ncch->exefs_offset) + mpos, nsiz);
-		++self->streamcount;
-		mpos += nsiz;
+		nnc_subview_open(&p->substreams[count].raw, rs, exefs_offset + mpos, tpos - mpos);
+		p->children[count] = NNC_RSP(&p->substreams[count].raw);
+		++count;
 	}
-	else if(mpos > tpos)
-		ret = NNC_R_CORRUPT;
-
-	self->size = mpos;
-	self->pos = 0;
-	self->curstream = 0;
 
 out:
+	/* nnc_concat_open needs all children to be open for their sizes, and
+	 * closing the concat stream closes everything opened so far */
+	nnc_concat_open(&self->concat, p->children, p->offsets, count);
+	nnc_concat_free_on_close(&self->concat, p);
 	if(ret != NNC_R_OK)
-		efs_strm_close(self);
+		NNC_RS_CALL0(self->concat, close);
 	return ret;
 }
 
@@ -325,6 +232,189 @@ void nnc_condense_ncch(nnc_condensed_ncch_header *cnd, nnc_ncch_header *hdr)
 	cnd->type = hdr->type;
 	strncpy(cnd->product_code, hdr->product_code, sizeof(cnd->product_code));
 	strncpy(cnd->maker_code, hdr->maker_code, sizeof(hdr->maker_code));
+	cnd->crypt_method = hdr->crypt_method;
+	cnd->crypt_flags = hdr->flags & (NNC_NCCH_FIXED_KEY | NNC_NCCH_USES_SEED);
+	cnd->keyy = hdr->keyy;
+	cnd->seed = NULL;
+}
+
+/* fills in everything required to derive the keys & counters with */
+static result setup_ncch_crypto(nnc_condensed_ncch_header *chdr, nnc_ncch_header *ncch, nnc_keypair *kp)
+{
+	u8 seedbuf[NNC_SEED_SIZE + sizeof(u64)];
+	struct nnc_seeddb_entry entry;
+	nnc_seeddb *seeddb = NULL;
+	nnc_sha256_hash hash;
+	nnc_seeddb single;
+	u8 *seed;
+	result ret;
+
+	memset(ncch, 0x00, sizeof(*ncch));
+	ncch->keyy = chdr->keyy;
+	ncch->partition_id = chdr->partition_id;
+	ncch->title_id = chdr->title_id;
+	ncch->version = 2;
+	ncch->crypt_method = chdr->crypt_method;
+	ncch->flags = chdr->crypt_flags & (NNC_NCCH_FIXED_KEY | NNC_NCCH_USES_SEED);
+
+	if((ncch->flags & NNC_NCCH_USES_SEED) && !(ncch->flags & NNC_NCCH_FIXED_KEY))
+	{
+		if(!(seed = chdr->seed) && !(seed = nnc_get_seed(nnc_get_default_seeddb(), chdr->title_id)))
+			return NNC_R_SEED_NOT_FOUND;
+		/* the check hash is the first u32 of sha256(seed || title id) */
+		u64 tid = LE64(chdr->title_id);
+		memcpy(seedbuf, seed, NNC_SEED_SIZE);
+		memcpy(&seedbuf[NNC_SEED_SIZE], &tid, sizeof(tid));
+		TRY(nnc_crypto_sha256(seedbuf, hash, sizeof(seedbuf)));
+		memcpy(ncch->seed_hash, hash, sizeof(ncch->seed_hash));
+		/* a SeedDB with only our seed in it */
+		memcpy(entry.seed, seed, NNC_SEED_SIZE);
+		entry.title_id = chdr->title_id;
+		single.size = 1;
+		single.entries = &entry;
+		single.sorted = &entry;
+		seeddb = &single;
+	}
+
+	return nnc_fill_keypair(kp, nnc_get_default_keyset(), seeddb, ncch);
+}
+
+/* the ExeFS header, "icon" and "banner" use the primary key while all other files use
+ * the secondary key, so the header is parsed as it passes through to know which key to use.
+ * The padding in between files is left as plaintext, like nnc_ncch_exefs_full_stream() reads it */
+#define EFS_PLAIN 2
+typedef struct exefs_crypt_writer {
+	const nnc_wstream_funcs *funcs;
+	nnc_aes_ctr keys[2]; /* primary, secondary */
+	nnc_wstream *child;
+	nnc_exefs_file_header headers[NNC_EXEFS_MAX_FILES];
+	u8 header[NNC_EXEFS_HEADER_SIZE];
+	u32 start, pos;
+	u8 filecount, current;
+} exefs_crypt_writer;
+
+/* returns the key to use at `pos' (or EFS_PLAIN) and how many bytes it's used for */
+static u8 efs_crypt_key(exefs_crypt_writer *self, u32 pos, u32 *left)
+{
+	u32 next = 0xFFFFFFFF, start, end;
+	if(pos < NNC_EXEFS_HEADER_SIZE)
+	{
+		*left = NNC_EXEFS_HEADER_SIZE - pos;
+		return 0;
+	}
+	for(u8 i = 0; i < self->filecount; ++i)
+	{
+		start = NNC_EXEFS_HEADER_SIZE + self->headers[i].offset;
+		end = start + self->headers[i].size;
+		if(pos >= start && pos < end)
+		{
+			*left = end - pos;
+			return strcmp(self->headers[i].name, "icon") != 0 && strcmp(self->headers[i].name, "banner") != 0;
+		}
+		if(start > pos) next = MIN(next, start);
+	}
+	/* padding in between files */
+	*left = next - pos;
+	return EFS_PLAIN;
+}
+
+static result efs_crypt_write(exefs_crypt_writer *self, u8 *buf, u32 size)
+{
+	u32 left, now;
+	result ret;
+	u8 key;
+
+	while(size != 0)
+	{
+		key = efs_crypt_key(self, self->pos, &left);
+		now = MIN(left, size);
+		if(self->pos < NNC_EXEFS_HEADER_SIZE)
+			memcpy(&self->header[self->pos], buf, now);
+		if(key == EFS_PLAIN)
+		{
+			TRY(NNC_WS_PCALL(self->child, write, buf, now));
+		}
+		else
+		{
+			/* the keys share the same child, so the counter must be moved along when switching */
+			if(key != self->current)
+			{
+				TRY(NNC_WS_CALL(self->keys[key], seek, self->start + self->pos));
+			}
+			TRY(NNC_WS_CALL(self->keys[key], write, buf, now));
+		}
+		self->current = key;
+		self->pos += now;
+		buf += now;
+		size -= now;
+
+		if(self->pos == NNC_EXEFS_HEADER_SIZE)
+		{
+			nnc_memory hdr;
+			nnc_mem_open(&hdr, self->header, NNC_EXEFS_HEADER_SIZE);
+			TRY(nnc_read_exefs_header(NNC_RSP(&hdr), self->headers, &self->filecount));
+		}
+	}
+	return NNC_R_OK;
+}
+
+static result efs_crypt_close(exefs_crypt_writer *self)
+{
+	NNC_WS_CALL0(self->keys[0], close);
+	NNC_WS_CALL0(self->keys[1], close);
+	return NNC_R_OK;
+}
+
+static u32 efs_crypt_tell(exefs_crypt_writer *self)
+{
+	return self->start + self->pos;
+}
+
+static const nnc_wstream_funcs efs_crypt_funcs = {
+	.write = (nnc_write_func) efs_crypt_write,
+	.close = (nnc_wclose_func) efs_crypt_close,
+	.tell  = (nnc_wtell_func) efs_crypt_tell,
+};
+
+static result open_efs_crypt_writer(exefs_crypt_writer *self, nnc_wstream *child, nnc_ncch_header *ncch, nnc_keypair *kp)
+{
+	u8 iv[0x10];
+	result ret;
+	TRY(nnc_get_ncch_iv(ncch, NNC_SECTION_EXEFS, iv));
+	TRY(nnc_aes_ctr_open_w(&self->keys[0], child, &kp->primary, iv));
+	if((ret = nnc_aes_ctr_open_w(&self->keys[1], child, &kp->secondary, iv)) != NNC_R_OK)
+	{
+		NNC_WS_CALL0(self->keys[0], close);
+		return ret;
+	}
+	self->funcs = &efs_crypt_funcs;
+	self->child = child;
+	self->start = NNC_WS_PCALL0(child, tell);
+	self->pos = 0;
+	self->filecount = 0;
+	self->current = 0;
+	return NNC_R_OK;
+}
+
+/* opens an encrypting writer for a section if required, else just passes `ws' */
+static result open_section_writer(nnc_aes_ctr *crypt, nnc_wstream **out, nnc_wstream *ws,
+	nnc_ncch_header *ncch, nnc_u128 *key, u8 section)
+{
+	u8 iv[0x10];
+	result ret;
+	*out = ws;
+	if(ncch->flags & NNC_NCCH_NO_CRYPTO)
+		return NNC_R_OK;
+	TRY(nnc_get_ncch_iv(ncch, section, iv));
+	TRY(nnc_aes_ctr_open_w(crypt, ws, key, iv));
+	*out = NNC_WSP(crypt);
+	return NNC_R_OK;
+}
+
+static void close_section_writer(nnc_wstream *section, nnc_wstream *ws)
+{
+	if(section != ws)
+		NNC_WS_PCALL0(section, close);
 }
 
 nnc_result nnc_write_ncch(
@@ -343,6 +433,11 @@ nnc_result nnc_write_ncch(
 	nnc_hasher_writer hwrite;
 	nnc_header_saver hsaver;
 	u8 header[0x200], exheader_in_use = 0;
+	nnc_wstream *section;
+	exefs_crypt_writer efs_crypt;
+	nnc_ncch_header crypt_hdr;
+	nnc_aes_ctr crypt;
+	nnc_keypair kp;
 
 	if(!ws->funcs->seek)
 		return NNC_R_INVAL;
@@ -358,6 +453,13 @@ nnc_result nnc_write_ncch(
 	memset(&exefs_super_hash, 0x00, sizeof(exefs_super_hash));
 	memset(&romfs_super_hash, 0x00, sizeof(romfs_super_hash));
 
+	if(wflags & NNC_NCCH_WF_ENCRYPT)
+	{
+		TRY(setup_ncch_crypto(ncch_header, &crypt_hdr, &kp));
+	}
+	else
+		crypt_hdr.flags = NNC_NCCH_NO_CRYPTO;
+
 	/* we'll reserve space for the header as we'll write it last */
 	header_off = NNC_WS_PCALL0(ws, tell);
 	/* the exheader resides directly after the header */
@@ -371,9 +473,13 @@ nnc_result nnc_write_ncch(
 		{
 			if(NNC_RS_PCALL0((nnc_rstream *) exheader, size) != EXHEADER_FULL_SIZE)
 				return NNC_R_INVAL;
-			TRY(nnc_open_hasher_writer(&hwrite, ws, EXHEADER_NCCH_SIZE));
-			ret = nnc_copy((nnc_rstream *) exheader, NNC_WSP(&hwrite), NULL);
-			nnc_hasher_writer_digest(&hwrite, exheader_hash);
+			TRY(open_section_writer(&crypt, &section, ws, &crypt_hdr, &kp.primary, NNC_SECTION_EXHEADER));
+			if((ret = nnc_open_hasher_writer(&hwrite, section, EXHEADER_NCCH_SIZE)) == NNC_R_OK)
+			{
+				ret = nnc_copy((nnc_rstream *) exheader, NNC_WSP(&hwrite), NULL);
+				nnc_hasher_writer_digest(&hwrite, exheader_hash);
+			}
+			close_section_writer(section, ws);
 			if(ret != NNC_R_OK) return ret;
 		}
 		exheader_in_use = 1;
@@ -402,54 +508,69 @@ nnc_result nnc_write_ncch(
 	if(exefs)
 	{
 		exefs_off = NNC_WS_PCALL0(ws, tell);
+		section = ws;
+		if(!(crypt_hdr.flags & NNC_NCCH_NO_CRYPTO))
+		{
+			TRY(open_efs_crypt_writer(&efs_crypt, ws, &crypt_hdr, &kp));
+			section = NNC_WSP(&efs_crypt);
+		}
 		if(wflags & NNC_NCCH_WF_EXEFS_VFS)
 		{
-			TRY(nnc_open_header_saver(&hsaver, ws, NNC_MEDIA_UNIT));
-			ret = nnc_write_exefs((nnc_vfs *) exefs, NNC_WSP(&hsaver));
-			exefs_size = NNC_WS_PCALL0(ws, tell) - exefs_off;
-			if(exefs_size >= NNC_MEDIA_UNIT)
-				nnc_crypto_sha256_buffer(hsaver.buffer, NNC_MEDIA_UNIT, exefs_super_hash);
-			NNC_WS_CALL0(hsaver, close);
-			if(ret == NNC_R_OK && exefs_size < NNC_MEDIA_UNIT)
-				ret = NNC_R_INVAL; /* shouldn't happen afaik */
-			if(ret != NNC_R_OK) return ret;
+			if((ret = nnc_open_header_saver(&hsaver, section, NNC_MEDIA_UNIT)) == NNC_R_OK)
+			{
+				ret = nnc_write_exefs((nnc_vfs *) exefs, NNC_WSP(&hsaver));
+				exefs_size = NNC_WS_PCALL0(ws, tell) - exefs_off;
+				if(exefs_size >= NNC_MEDIA_UNIT)
+					nnc_crypto_sha256_buffer(hsaver.buffer, NNC_MEDIA_UNIT, exefs_super_hash);
+				NNC_WS_CALL0(hsaver, close);
+				if(ret == NNC_R_OK && exefs_size < NNC_MEDIA_UNIT)
+					ret = NNC_R_INVAL; /* shouldn't happen afaik */
+			}
 		}
 		else
 		{
 			if((exefs_size = NNC_RS_PCALL0((nnc_rstream *) exefs, size)) < NNC_MEDIA_UNIT)
-				return NNC_R_INVAL; /* a valid ExeFS has at least NNC_MEDIA_UNIT bytes */
-			TRY(nnc_open_hasher_writer(&hwrite, ws, NNC_MEDIA_UNIT));
-			ret = nnc_copy((nnc_rstream *) exefs, NNC_WSP(&hwrite), NULL);
-			nnc_hasher_writer_digest(&hwrite, exefs_super_hash);
-			if(ret != NNC_R_OK) return ret;
+				ret = NNC_R_INVAL; /* a valid ExeFS has at least NNC_MEDIA_UNIT bytes */
+			else if((ret = nnc_open_hasher_writer(&hwrite, section, NNC_MEDIA_UNIT)) == NNC_R_OK)
+			{
+				ret = nnc_copy((nnc_rstream *) exefs, NNC_WSP(&hwrite), NULL);
+				nnc_hasher_writer_digest(&hwrite, exefs_super_hash);
+			}
 		}
+		close_section_writer(section, ws);
+		if(ret != NNC_R_OK) return ret;
 		TRY(nnc_write_padding(ws, ALIGN(exefs_size, NNC_MEDIA_UNIT) - exefs_size));
 	}
 
 	if(romfs)
 	{
 		romfs_off = NNC_WS_PCALL0(ws, tell);
+		TRY(open_section_writer(&crypt, &section, ws, &crypt_hdr, &kp.secondary, NNC_SECTION_ROMFS));
 		if(wflags & NNC_NCCH_WF_ROMFS_VFS)
 		{
-			TRY(nnc_open_header_saver(&hsaver, ws, NNC_MEDIA_UNIT));
-			ret = nnc_write_romfs((nnc_vfs *) romfs, NNC_WSP(&hsaver));
-			romfs_size = NNC_WS_PCALL0(ws, tell) - romfs_off;
-			if(romfs_size >= NNC_MEDIA_UNIT)
-				nnc_crypto_sha256_buffer(hsaver.buffer, NNC_MEDIA_UNIT, romfs_super_hash);
-			NNC_WS_CALL0(hsaver, close);
-			if(ret == NNC_R_OK && romfs_size < NNC_MEDIA_UNIT)
-				ret = NNC_R_INVAL; /* shouldn't happen afaik */
-			if(ret != NNC_R_OK) return ret;
+			if((ret = nnc_open_header_saver(&hsaver, section, NNC_MEDIA_UNIT)) == NNC_R_OK)
+			{
+				ret = nnc_write_romfs((nnc_vfs *) romfs, NNC_WSP(&hsaver));
+				romfs_size = NNC_WS_PCALL0(ws, tell) - romfs_off;
+				if(romfs_size >= NNC_MEDIA_UNIT)
+					nnc_crypto_sha256_buffer(hsaver.buffer, NNC_MEDIA_UNIT, romfs_super_hash);
+				NNC_WS_CALL0(hsaver, close);
+				if(ret == NNC_R_OK && romfs_size < NNC_MEDIA_UNIT)
+					ret = NNC_R_INVAL; /* shouldn't happen afaik */
+			}
 		}
 		else
 		{
 			if((romfs_size = NNC_RS_PCALL0((nnc_rstream *) romfs, size)) < NNC_MEDIA_UNIT)
-				return NNC_R_INVAL; /* a valid RomFS has at least NNC_MEDIA_UNIT bytes */
-			TRY(nnc_open_hasher_writer(&hwrite, ws, NNC_MEDIA_UNIT));
-			ret = nnc_copy((nnc_rstream *) romfs, NNC_WSP(&hwrite), NULL);
-			nnc_hasher_writer_digest(&hwrite, romfs_super_hash);
-			if(ret != NNC_R_OK) return ret;
+				ret = NNC_R_INVAL; /* a valid RomFS has at least NNC_MEDIA_UNIT bytes */
+			else if((ret = nnc_open_hasher_writer(&hwrite, section, NNC_MEDIA_UNIT)) == NNC_R_OK)
+			{
+				ret = nnc_copy((nnc_rstream *) romfs, NNC_WSP(&hwrite), NULL);
+				nnc_hasher_writer_digest(&hwrite, romfs_super_hash);
+			}
 		}
+		close_section_writer(section, ws);
+		if(ret != NNC_R_OK) return ret;
 		TRY(nnc_write_padding(ws, ALIGN(romfs_size, NNC_MEDIA_UNIT) - romfs_size));
 		if(romfs_size == 0) romfs_off = 0;
 	}
@@ -474,12 +595,17 @@ nnc_result nnc_write_ncch(
 	strncpy(product_code, ncch_header->product_code, sizeof(product_code));
 
 	/* 0x000 */ memset(&header[0x000], 0x00, 0x100);
+	/* 0x000 */ if(!(crypt_hdr.flags & NNC_NCCH_NO_CRYPTO))
+	/* 0x000 */ 	nnc_u128_bytes_be(&crypt_hdr.keyy, &header[0x000]); /* the keyY is the start of the signature */
 	/* 0x100 */ memcpy(&header[0x100], "NCCH", 4);
 	/* 0x104 */ U32P(&header[0x104]) = LE32(romfs_off + romfs_size); /* content size */
 	/* 0x108 */ U64P(&header[0x108]) = LE64(ncch_header->partition_id);
 	/* 0x110 */ memcpy(&header[0x110], ncch_header->maker_code, 2);
 	/* 0x112 */ U16P(&header[0x112]) = LE16(2);
-	/* 0x114 */ memset(&header[0x114], 0x00, 4); /* seed hash, crypto not supported yet */
+	/* 0x114 */ if(crypt_hdr.flags & NNC_NCCH_NO_CRYPTO)
+	/* 0x114 */ 	memset(&header[0x114], 0x00, 4);
+	/* 0x114 */ else
+	/* 0x114 */ 	memcpy(&header[0x114], crypt_hdr.seed_hash, 4); /* seed hash, zero if no seed is used */
 	/* 0x118 */ U64P(&header[0x118]) = LE64(ncch_header->title_id);
 	/* 0x120 */ memset(&header[0x120], 0x00, 0x10); /* reserved */
 	/* 0x130 */ memcpy(&header[0x130], logo_hash, 0x20); /* logo region hash */
@@ -490,11 +616,11 @@ nnc_result nnc_write_ncch(
 	/* 0x188 */ header[0x188] = 0; /* ncchflags[0] */
 	/* 0x189 */ header[0x189] = 0; /* ncchflags[1] */
 	/* 0x18A */ header[0x18A] = 0; /* ncchflags[2] */
-	/* 0x18B */ header[0x18B] = NNC_CRYPT_INITIAL; /* crypto method, unsupported for now */
+	/* 0x18B */ header[0x18B] = crypt_hdr.flags & NNC_NCCH_NO_CRYPTO ? NNC_CRYPT_INITIAL : crypt_hdr.crypt_method;
 	/* 0x18C */ header[0x18C] = ncch_header->platform;
 	/* 0x18D */ header[0x18D] = ncch_header->type;
 	/* 0x18E */ header[0x18E] = 0; /* content unit size; 0x200*2^0=0x200 (=NNC_MEDIA_UNIT) */
-	/* 0x18F */ header[0x18F] = NNC_NCCH_NO_CRYPTO; /* flags */
+	/* 0x18F */ header[0x18F] = crypt_hdr.flags; /* flags */
 	/* 0x18F */ if(!romfs_size) header[0x18F] |= NNC_NCCH_NO_ROMFS;
 	/* 0x190 */ U32P(&header[0x190]) = LE32(plain_off);
 	/* 0x194 */ U32P(&header[0x194]) = LE32(plain_size);
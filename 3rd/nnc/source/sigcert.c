@@ -1,17 +1,9 @@
 
-#include <mbedtls/version.h>
 #include <nnc/sigcert.h>
-#include <mbedtls/pk.h>
 #include <string.h>
 #include <stdlib.h>
 #include "./internal.h"
-
-/* In MbedTLS version 3 struct members are now accessed with MBEDTLS_PRIVATE */
-#if MBEDTLS_VERSION_MAJOR == 3
-	#define ACCESS_PRIV(name) MBEDTLS_PRIVATE(name)
-#else
-	#define ACCESS_PRIV(name) name
-#endif
+#include "./backend.h"
 
 #define NNC_SIGTYPE_IS_NONE(s) ((s) >= NNC_SIG_NONE && (s) <= NNC_SIG_NONE + NNC_SIG_ECDSA_SHA256)
 
@@ -105,101 +97,325 @@ const char *nnc_sigstr(enum nnc_sigtype sig)
 	return NULL;
 }
 
-static void import_rsa(mbedtls_rsa_context *ctx, u8 *mod, u16 mod_size, u8 *exp)
+/* whether a certificate of type `type' can verify `sig' */
+static bool cert_fits_sig(enum nnc_certificate_type type, enum nnc_sigtype sig)
 {
-	mbedtls_mpi_read_binary(&ctx->ACCESS_PRIV(N), mod, mod_size);
-	mbedtls_mpi_read_binary(&ctx->ACCESS_PRIV(E), exp, 0x4);
-	ctx->ACCESS_PRIV(len) = mod_size;
+	switch(type)
+	{
+	case NNC_CERT_RSA_2048:
+		return sig == NNC_SIG_RSA_2048_SHA1 || sig == NNC_SIG_RSA_2048_SHA256;
+	case NNC_CERT_RSA_4096:
+		return sig == NNC_SIG_RSA_4096_SHA1 || sig == NNC_SIG_RSA_4096_SHA256;
+	case NNC_CERT_ECDSA:
+		return sig == NNC_SIG_ECDSA_SHA1 || sig == NNC_SIG_ECDSA_SHA256;
+	}
+	return false;
 }
 
-static bool setup_pk(nnc_certchain *chain, nnc_signature *sig, mbedtls_pk_context *ctx)
+/* size of the public key (and exponent) of a certificate */
+static u16 cert_key_size(enum nnc_certificate_type type)
 {
-	nnc_certificate *cert;
-	/* (usually?) in the form (issuer user)-(certificate used to verify certificate)-(certificate name) */
-	char *signame = strrchr(sig->issuer, '-');
-	if(signame) ++signame;
-	else        signame = sig->issuer; /* fall back to full issuer */
-	for(int i = 0; i < chain->len; ++i)
+	switch(type)
 	{
-		cert = &chain->certs[i];
-		if(strcmp(cert->name, signame) == 0)
-		{
-			/* found cert we want to import */
-			switch(cert->type)
-			{
-			case NNC_CERT_RSA_2048:
-				if(!(sig->type == NNC_SIG_RSA_2048_SHA1 || sig->type == NNC_SIG_RSA_2048_SHA256))
-					continue; /* invalid cert/sig pair */
-				import_rsa(mbedtls_pk_rsa(*ctx), cert->data.rsa2048.modulus,
-					0x100, cert->data.rsa2048.exp);
-				return true;
-			case NNC_CERT_RSA_4096:
-				if(!(sig->type == NNC_SIG_RSA_4096_SHA1 || sig->type == NNC_SIG_RSA_4096_SHA256))
-					continue; /* invalid cert/sig pair */
-				import_rsa(mbedtls_pk_rsa(*ctx), cert->data.rsa4096.modulus,
-					0x200, cert->data.rsa4096.exp);
-				return true;
-			case NNC_CERT_ECDSA:
-				if(!(sig->type == NNC_SIG_ECDSA_SHA1 || sig->type == NNC_SIG_ECDSA_SHA256))
-					continue; /* invalid cert/sig pair */
-				/* TODO: implement ECDSA certificates */
-				continue;
-			}
-		}
+	case NNC_CERT_RSA_2048: return sizeof(struct nnc_certificate_rsa2048);
+	case NNC_CERT_RSA_4096: return sizeof(struct nnc_certificate_rsa4096);
+	case NNC_CERT_ECDSA:    return sizeof(struct nnc_certificate_ecdsa);
+	}
+	return 0;
+}
+
+/* (usually?) in the form (issuer user)-(certificate used to verify certificate)-(certificate name) */
+static const char *sig_cert_name(nnc_signature *sig)
+{
+	const char *signame = strrchr(sig->issuer, '-');
+	if(signame) return signame + 1;
+	return sig->issuer; /* fall back to full issuer */
+}
+
+/* sets up `ctx' with the public key in `data', returns false if
+ * the key type isn't supported or allocation failed */
+static bool import_pk(enum nnc_certificate_type type, union nnc_certificate_data *data, nnc_be_pk *ctx)
+{
+	switch(type)
+	{
+	case NNC_CERT_RSA_2048:
+		return be_pk_import_rsa(ctx, data->rsa2048.modulus, 0x100, data->rsa2048.exp);
+	case NNC_CERT_RSA_4096:
+		return be_pk_import_rsa(ctx, data->rsa4096.modulus, 0x200, data->rsa4096.exp);
+	case NNC_CERT_ECDSA:
+		/* TODO: implement ECDSA certificates */
+		return false;
 	}
 	return false;
 }
 
-result nnc_verify_signature(nnc_certchain *chain, nnc_signature *sig, nnc_sha_hash hash)
+static result pk_verify_sig(nnc_be_pk *ctx, nnc_signature *sig, const u8 *hash)
 {
-	const mbedtls_pk_info_t *pkinfo;
+	bool ret;
+
 	switch(sig->type)
 	{
 	case NNC_SIG_RSA_4096_SHA1:
 	case NNC_SIG_RSA_2048_SHA1:
+	case NNC_SIG_ECDSA_SHA1:
+		ret = be_pk_verify(ctx, false, hash, sig->data, nnc_sig_dsize(sig->type));
+		break;
 	case NNC_SIG_RSA_4096_SHA256:
 	case NNC_SIG_RSA_2048_SHA256:
-		pkinfo = mbedtls_pk_info_from_type(MBEDTLS_PK_RSA);
-		break;
-	case NNC_SIG_ECDSA_SHA1:
 	case NNC_SIG_ECDSA_SHA256:
-		pkinfo = mbedtls_pk_info_from_type(MBEDTLS_PK_ECDSA);
+		ret = be_pk_verify(ctx, true, hash, sig->data, nnc_sig_dsize(sig->type));
 		break;
 	default:
-		pkinfo = NULL;
-		break;
+		ret = false;
 	}
-	if(!pkinfo) return NNC_R_INVALID_SIG;
 
-	mbedtls_pk_context ctx;
-	mbedtls_pk_init(&ctx);
-	mbedtls_pk_setup(&ctx, pkinfo);
-	if(!setup_pk(chain, sig, &ctx))
+	return ret ? NNC_R_OK : NNC_R_BAD_SIG;
+}
+
+/* the part of a nnc_sha_hash that's defined for a signature type */
+static u16 sig_hash_size(enum nnc_sigtype sig)
+{
+	switch(sig)
 	{
-		mbedtls_pk_free(&ctx);
-		return NNC_R_CERT_NOT_FOUND;
+	case NNC_SIG_RSA_4096_SHA1:
+	case NNC_SIG_RSA_2048_SHA1:
+	case NNC_SIG_ECDSA_SHA1:
+		return sizeof(nnc_sha1_hash);
+	default:
+		return sizeof(nnc_sha256_hash);
 	}
+}
 
-	bool ret;
-
-	switch(sig->type)
+static bool sigtype_valid(enum nnc_sigtype sig)
+{
+	switch(sig)
 	{
 	case NNC_SIG_RSA_4096_SHA1:
 	case NNC_SIG_RSA_2048_SHA1:
-	case NNC_SIG_ECDSA_SHA1:
-		ret = mbedtls_pk_verify(&ctx, MBEDTLS_MD_SHA1, hash, sizeof(nnc_sha1_hash), sig->data, nnc_sig_dsize(sig->type)) == 0;
-		break;
 	case NNC_SIG_RSA_4096_SHA256:
 	case NNC_SIG_RSA_2048_SHA256:
+	case NNC_SIG_ECDSA_SHA1:
 	case NNC_SIG_ECDSA_SHA256:
-		ret = mbedtls_pk_verify(&ctx, MBEDTLS_MD_SHA256, hash, sizeof(nnc_sha256_hash), sig->data, nnc_sig_dsize(sig->type)) == 0;
+		return true;
+	case NNC_SIG_NONE:
 		break;
-	default:
-		ret = false;
 	}
+	return false;
+}
 
-	mbedtls_pk_free(&ctx);
-	return ret ? NNC_R_OK : NNC_R_BAD_SIG;
+result nnc_verify_signature(nnc_certchain *chain, nnc_signature *sig, nnc_sha_hash hash)
+{
+	if(!sigtype_valid(sig->type)) return NNC_R_INVALID_SIG;
+
+	const char *signame = sig_cert_name(sig);
+	nnc_be_pk ctx;
+	nnc_certificate *cert;
+	result ret;
+	for(int i = 0; i < chain->len; ++i)
+	{
+		cert = &chain->certs[i];
+		if(strcmp(cert->name, signame) != 0 || !cert_fits_sig(cert->type, sig->type))
+			continue;
+		be_pk_init(&ctx);
+		if(!import_pk(cert->type, &cert->data, &ctx))
+		{
+			be_pk_free(&ctx);
+			continue;
+		}
+		ret = pk_verify_sig(&ctx, sig, hash);
+		be_pk_free(&ctx);
+		return ret;
+	}
+	return NNC_R_CERT_NOT_FOUND;
+}
+
+struct nnc_certstore_key {
+	char name[0x41];
+	enum nnc_certificate_type type;
+	union nnc_certificate_data data;
+	int index; /* position in the source chain, so lookups prefer earlier certificates like nnc_verify_signature */
+	bool usable;
+	nnc_sha256_hash fingerprint; /* hash of the public key, see nnc_sigcache */
+	nnc_be_pk pk;
+};
+
+static int certstore_key_cmp(const void *a, const void *b)
+{
+	const struct nnc_certstore_key *ka = a, *kb = b;
+	int r = strcmp(ka->name, kb->name);
+	return r != 0 ? r : ka->index - kb->index;
+}
+
+result nnc_certstore_open(nnc_certstore *store, nnc_certchain *chain)
+{
+	store->len = 0;
+	store->keys = NULL;
+	if(chain->len == 0) return NNC_R_OK;
+	if(!(store->keys = malloc(sizeof(struct nnc_certstore_key) * chain->len)))
+		return NNC_R_NOMEM;
+
+	struct nnc_certstore_key *key;
+	for(int i = 0; i < chain->len; ++i)
+	{
+		key = &store->keys[i];
+		memcpy(key->name, chain->certs[i].name, sizeof(key->name));
+		key->type = chain->certs[i].type;
+		key->data = chain->certs[i].data;
+		key->index = i;
+	}
+	qsort(store->keys, chain->len, sizeof(struct nnc_certstore_key), certstore_key_cmp);
+
+	/* the public keys are only parsed after sorting as the contexts can't be moved */
+	for(int i = 0; i < chain->len; ++i)
+	{
+		key = &store->keys[i];
+		be_pk_init(&key->pk);
+		key->usable = import_pk(key->type, &key->data, &key->pk);
+		nnc_crypto_sha256_buffer(key->data.raw, cert_key_size(key->type), key->fingerprint);
+	}
+	store->len = chain->len;
+	return NNC_R_OK;
+}
+
+/* binary search for the first usable key with the name from the issuer of `sig' */
+static int certstore_find(nnc_certstore *store, nnc_signature *sig)
+{
+	const char *signame = sig_cert_name(sig);
+	int lo = 0, hi = store->len, mid;
+	while(lo < hi)
+	{
+		mid = lo + (hi - lo) / 2;
+		if(strcmp(store->keys[mid].name, signame) < 0) lo = mid + 1;
+		else                                           hi = mid;
+	}
+	for(; lo < store->len && strcmp(store->keys[lo].name, signame) == 0; ++lo)
+		if(store->keys[lo].usable && cert_fits_sig(store->keys[lo].type, sig->type))
+			return lo;
+	return -1;
+}
+
+result nnc_certstore_verify(nnc_certstore *store, nnc_signature *sig, nnc_sha_hash hash)
+{
+	if(!sigtype_valid(sig->type)) return NNC_R_INVALID_SIG;
+	int i = certstore_find(store, sig);
+	if(i == -1) return NNC_R_CERT_NOT_FOUND;
+	return pk_verify_sig(&store->keys[i].pk, sig, hash);
+}
+
+#define VERIFY_THREADS_MAX 16
+
+struct verify_job {
+	nnc_certstore *store;
+	nnc_sigcheck *checks;
+	u32 count;
+	/* mbedTLS caches values in the RSA context on use, so every thread but
+	 * the first one imports its own copies of the keys it needs; NULL for
+	 * the first job, which uses the store's contexts */
+	nnc_be_pk *own;
+	bool *own_ready;
+};
+
+static void verify_job_run(void *arg)
+{
+	struct verify_job *job = arg;
+	nnc_certstore *store = job->store;
+	nnc_be_pk *pk;
+	nnc_sigcheck *check;
+	int i;
+
+	for(u32 j = 0; j < job->count; ++j)
+	{
+		check = &job->checks[j];
+		if(!sigtype_valid(check->sig->type))
+		{
+			check->res = NNC_R_INVALID_SIG;
+			continue;
+		}
+		if((i = certstore_find(store, check->sig)) == -1)
+		{
+			check->res = NNC_R_CERT_NOT_FOUND;
+			continue;
+		}
+		pk = &store->keys[i].pk;
+		if(job->own)
+		{
+			if(!job->own_ready[i])
+			{
+				be_pk_init(&job->own[i]);
+				if(!import_pk(store->keys[i].type, &store->keys[i].data, &job->own[i]))
+				{
+					be_pk_free(&job->own[i]);
+					check->res = NNC_R_NOMEM;
+					continue;
+				}
+				job->own_ready[i] = true;
+			}
+			pk = &job->own[i];
+		}
+		check->res = pk_verify_sig(pk, check->sig, check->hash);
+	}
+}
+
+u32 nnc_certstore_verify_batch(nnc_certstore *store, nnc_sigcheck *checks, u32 count, u8 threads)
+{
+	struct verify_job jobs[VERIFY_THREADS_MAX];
+	u32 per_job, amount, ok = 0;
+
+	if(threads > VERIFY_THREADS_MAX) threads = VERIFY_THREADS_MAX;
+	if(threads == 0) threads = 1;
+	if(threads > count) threads = count;
+	if(threads == 0) return 0;
+
+	per_job = (count + threads - 1) / threads;
+	amount = 0;
+	for(u32 base = 0; base < count; base += per_job, ++amount)
+	{
+		jobs[amount].store = store;
+		jobs[amount].checks = &checks[base];
+		jobs[amount].count = MIN(count - base, per_job);
+		jobs[amount].own = NULL;
+		jobs[amount].own_ready = NULL;
+		if(amount == 0) continue;
+		if((jobs[amount].own = malloc(sizeof(nnc_be_pk) * store->len)))
+		{
+			if(!(jobs[amount].own_ready = calloc(store->len, sizeof(bool))))
+			{
+				free(jobs[amount].own);
+				jobs[amount].own = NULL;
+			}
+		}
+		/* if allocating fails the checks are appended to the previous job instead */
+		if(!jobs[amount].own)
+		{
+			jobs[amount - 1].count += jobs[amount].count;
+			--amount;
+		}
+	}
+
+	run_jobs(verify_job_run, jobs, sizeof(struct verify_job), amount);
+
+	for(u32 i = 0; i < amount; ++i)
+	{
+		if(!jobs[i].own) continue;
+		for(int j = 0; j < store->len; ++j)
+			if(jobs[i].own_ready[j])
+				be_pk_free(&jobs[i].own[j]);
+		free(jobs[i].own_ready);
+		free(jobs[i].own);
+	}
+	for(u32 i = 0; i < count; ++i)
+		if(checks[i].res == NNC_R_OK)
+			++ok;
+	return ok;
+}
+
+void nnc_certstore_free(nnc_certstore *store)
+{
+	for(int i = 0; i < store->len; ++i)
+		be_pk_free(&store->keys[i].pk);
+	free(store->keys);
+	store->keys = NULL;
+	store->len = 0;
 }
 
 nnc_result nnc_sighash(nnc_rstream *rs, enum nnc_sigtype sig, nnc_sha_hash digest, u32 size)
@@ -295,6 +511,127 @@ err:
 	return res;
 }
 
+#define SIGCACHE_MAGIC   0x43475353 /* "SSGC" */
+#define SIGCACHE_VERSION 1
+#define SIGCACHE_EMPTY   0
+#define SIGCACHE_GOOD    1
+#define SIGCACHE_BAD     2
+
+/* this is also the on-disk layout, the file is just a header followed by all entries */
+struct nnc_sigcache_entry {
+	nnc_sha256_hash key;
+	u32 last_use;
+	u8 state;
+	u8 reserved[3];
+};
+
+struct sigcache_header {
+	u32 magic;
+	u32 version;
+	u32 sets;
+	u32 clock;
+};
+
+result nnc_sigcache_init(nnc_sigcache *cache, u32 entries)
+{
+	cache->sets = MAX(ALIGN(entries, NNC_SIGCACHE_WAYS) / NNC_SIGCACHE_WAYS, 1);
+	cache->clock = 0;
+	if(!(cache->entries = calloc(cache->sets * NNC_SIGCACHE_WAYS, sizeof(struct nnc_sigcache_entry))))
+		return NNC_R_NOMEM;
+	return NNC_R_OK;
+}
+
+result nnc_sigcache_load(nnc_sigcache *cache, nnc_rstream *rs)
+{
+	struct sigcache_header hdr;
+	result ret;
+
+	TRY(NNC_RS_PCALL(rs, seek_abs, 0));
+	TRY(read_exact(rs, (u8 *) &hdr, sizeof(hdr)));
+	if(LE32(hdr.magic) != SIGCACHE_MAGIC || LE32(hdr.version) != SIGCACHE_VERSION || LE32(hdr.sets) == 0)
+		return NNC_R_CORRUPT;
+	u32 sets = LE32(hdr.sets);
+	if(NNC_RS_PCALL0(rs, size) != sizeof(hdr) + (u64) sets * NNC_SIGCACHE_WAYS * sizeof(struct nnc_sigcache_entry))
+		return NNC_R_CORRUPT;
+	if(!(cache->entries = malloc(sets * NNC_SIGCACHE_WAYS * sizeof(struct nnc_sigcache_entry))))
+		return NNC_R_NOMEM;
+	if((ret = read_exact(rs, (u8 *) cache->entries, sets * NNC_SIGCACHE_WAYS * sizeof(struct nnc_sigcache_entry))) != NNC_R_OK)
+	{
+		free(cache->entries);
+		cache->entries = NULL;
+		return ret;
+	}
+	cache->sets = sets;
+	cache->clock = LE32(hdr.clock);
+	return NNC_R_OK;
+}
+
+result nnc_sigcache_save(nnc_sigcache *cache, nnc_wstream *ws)
+{
+	struct sigcache_header hdr;
+	result ret;
+
+	hdr.magic = LE32(SIGCACHE_MAGIC);
+	hdr.version = LE32(SIGCACHE_VERSION);
+	hdr.sets = LE32(cache->sets);
+	hdr.clock = LE32(cache->clock);
+	TRY(NNC_WS_PCALL(ws, write, (u8 *) &hdr, sizeof(hdr)));
+	return NNC_WS_PCALL(ws, write, (u8 *) cache->entries, cache->sets * NNC_SIGCACHE_WAYS * sizeof(struct nnc_sigcache_entry));
+}
+
+result nnc_sigcache_verify(nnc_sigcache *cache, nnc_certstore *store, nnc_signature *sig, nnc_sha_hash hash)
+{
+	if(!sigtype_valid(sig->type)) return NNC_R_INVALID_SIG;
+	int i = certstore_find(store, sig);
+	if(i == -1) return NNC_R_CERT_NOT_FOUND;
+
+	/* the key covers everything the result depends on: the signature,
+	 * the signed digest and the public key it was checked against */
+	u8 keydata[1 + 0x200 + sizeof(nnc_sha256_hash) * 2];
+	u16 dsize = nnc_sig_dsize(sig->type);
+	nnc_sha256_hash key;
+	keydata[0] = sig->type;
+	memcpy(&keydata[1], sig->data, dsize);
+	/* the tail of a SHA1 digest is whatever the caller left there */
+	memset(&keydata[1 + dsize], 0, sizeof(nnc_sha256_hash));
+	memcpy(&keydata[1 + dsize], hash, sig_hash_size(sig->type));
+	memcpy(&keydata[1 + dsize + sizeof(nnc_sha256_hash)], store->keys[i].fingerprint, sizeof(nnc_sha256_hash));
+	nnc_crypto_sha256_buffer(keydata, 1 + dsize + sizeof(nnc_sha256_hash) * 2, key);
+
+	struct nnc_sigcache_entry *set = &cache->entries[(LE32P(key) % cache->sets) * NNC_SIGCACHE_WAYS];
+	struct nnc_sigcache_entry *victim = &set[0];
+	if(++cache->clock == 0)
+	{
+		/* the clock wrapped around, forget the ordering instead of evicting the wrong entries forever */
+		for(u32 j = 0; j < cache->sets * NNC_SIGCACHE_WAYS; ++j)
+			cache->entries[j].last_use = 0;
+		cache->clock = 1;
+	}
+	for(int j = 0; j < NNC_SIGCACHE_WAYS; ++j)
+	{
+		if(set[j].state != SIGCACHE_EMPTY && memcmp(set[j].key, key, sizeof(key)) == 0)
+		{
+			set[j].last_use = LE32(cache->clock);
+			return set[j].state == SIGCACHE_GOOD ? NNC_R_OK : NNC_R_BAD_SIG;
+		}
+		if(victim->state != SIGCACHE_EMPTY && (set[j].state == SIGCACHE_EMPTY || LE32(set[j].last_use) < LE32(victim->last_use)))
+			victim = &set[j];
+	}
+
+	result ret = pk_verify_sig(&store->keys[i].pk, sig, hash);
+	memcpy(victim->key, key, sizeof(key));
+	victim->last_use = LE32(cache->clock);
+	victim->state = ret == NNC_R_OK ? SIGCACHE_GOOD : SIGCACHE_BAD;
+	memset(victim->reserved, 0, sizeof(victim->reserved));
+	return ret;
+}
+
+void nnc_sigcache_free(nnc_sigcache *cache)
+{
+	free(cache->entries);
+	cache->entries = NULL;
+}
+
 void nnc_scan_certchains(nnc_certchain *chain)
 {
 	chain->len = 0;
@@ -8,6 +8,11 @@
 #include <string.h>
 #include "./internal.h"
 
+#if NNC_PLATFORM_UNIX
+	#include <unistd.h>
+	#include <errno.h>
+#endif
+
 enum nnc_file_flags {
 	NNC_FILE_KEEP_ALIVE = 1,
 };
@@ -37,6 +42,33 @@ static result file_seek_rel(nnc_file *self, u32 pos)
 	return NNC_R_OK;
 }
 
+#if NNC_PLATFORM_UNIX
+/* pread() doesn't touch the position of the FILE, so multiple
+ * threads may read from the same file at once this way */
+static result file_read_at(nnc_file *self, u32 offset, u8 *buf, u32 max, u32 *totalRead)
+{
+	u32 total = 0;
+	ssize_t got;
+	/* shared with an nnc_wfile, which may still have buffered writes */
+	if(self->flags & NNC_FILE_KEEP_ALIVE)
+		fflush(self->f);
+	while(total < max)
+	{
+		got = pread(fileno(self->f), buf + total, max - total, (off_t) offset + total);
+		if(got == 0) break;
+		if(got < 0)
+		{
+			if(errno == EINTR) continue;
+			*totalRead = total;
+			return NNC_R_FAIL_READ;
+		}
+		total += got;
+	}
+	*totalRead = total;
+	return NNC_R_OK;
+}
+#endif
+
 static u32 file_size(nnc_file *self)
 { return self->size; }
 
@@ -56,6 +88,9 @@ static const nnc_rstream_funcs file_funcs = {
 	.size = (nnc_size_func) file_size,
 	.close = (nnc_close_func) file_close,
 	.tell = (nnc_tell_func) file_tell,
+#if NNC_PLATFORM_UNIX
+	.read_at = (nnc_read_at_func) file_read_at,
+#endif
 };
 
 static u32 get_file_size(FILE *file)
@@ -166,10 +201,16 @@ nnc_result nnc_open_header_saver(nnc_header_saver *self, nnc_wstream *child, nnc
 	return self->buffer ? NNC_R_OK : NNC_R_NOMEM;
 }
 
+static result mem_read_at(nnc_memory *self, u32 offset, u8 *buf, u32 max, u32 *totalRead)
+{
+	*totalRead = offset < self->size ? MIN(max, self->size - offset) : 0;
+	memcpy(buf, ((u8 *) self->un.ptr_const) + offset, *totalRead);
+	return NNC_R_OK;
+}
+
 static result mem_read(nnc_memory *self, u8 *buf, u32 max, u32 *totalRead)
 {
-	*totalRead = MIN(max, self->size);
-	memcpy(buf, ((u8 *) self->un.ptr_const) + self->pos, *totalRead);
+	mem_read_at(self, self->pos, buf, max, totalRead);
 	self->pos += *totalRead;
 	return NNC_R_OK;
 }
@@ -217,6 +258,7 @@ static const nnc_rstream_funcs mem_funcs = {
 	.size = (nnc_size_func) mem_size,
 	.close = (nnc_close_func) mem_close,
 	.tell = (nnc_tell_func) mem_tell,
+	.read_at = (nnc_read_at_func) mem_read_at,
 };
 
 static const nnc_rstream_funcs mem_own_funcs = {
@@ -226,6 +268,7 @@ static const nnc_rstream_funcs mem_own_funcs = {
 	.size = (nnc_size_func) mem_size,
 	.close = (nnc_close_func) mem_own_close,
 	.tell = (nnc_tell_func) mem_tell,
+	.read_at = (nnc_read_at_func) mem_read_at,
 };
 
 void nnc_mem_open(nnc_memory *self, const void *ptr, u32 size)
@@ -252,14 +295,22 @@ static result subview_read(nnc_subview *self, u8 *buf, u32 max, u32 *totalRead)
 {
 	u32 sizeleft = self->size - self->pos;
 	max = MIN(max, sizeleft);
-	result ret;
-	/* seek to correct offset in child */
-	TRY(NNC_RS_PCALL(self->child, seek_abs, self->off + self->pos));
-	ret = NNC_RS_PCALL(self->child, read, buf, max, totalRead);
+	/* positioned so subviews sharing a child don't fight over its position */
+	result ret = nnc_read_at(self->child, self->off + self->pos, buf, max, totalRead);
 	self->pos += *totalRead;
 	return ret;
 }
 
+static result subview_read_at(nnc_subview *self, u32 offset, u8 *buf, u32 max, u32 *totalRead)
+{
+	if(offset >= self->size)
+	{
+		*totalRead = 0;
+		return NNC_R_OK;
+	}
+	return nnc_read_at(self->child, self->off + offset, buf, MIN(max, self->size - offset), totalRead);
+}
+
 static result subview_seek_abs(nnc_subview *self, u32 pos)
 {
 	if(pos >= self->size) return NNC_R_SEEK_RANGE;
@@ -301,6 +352,7 @@ static const nnc_rstream_funcs subview_funcs = {
 	.size = (nnc_size_func) subview_size,
 	.close = (nnc_close_func) subview_close,
 	.tell = (nnc_tell_func) subview_tell,
+	.read_at = (nnc_read_at_func) subview_read_at,
 };
 
 void nnc_subview_open(nnc_subview *self, nnc_rstream *child, nnc_u32 off, nnc_u32 len)
@@ -318,6 +370,123 @@ void nnc_subview_delete_on_close(nnc_subview *self)
 	self->flags |= NNC_SUBVIEW_DELETE_ON_CLOSE;
 }
 
+/* finds the last child starting at or before pos, which skips over empty children */
+static u32 concat_find(nnc_concat *self, u32 pos)
+{
+	/* sequential access usually stays in the same child */
+	if(self->current < self->count && self->offsets[self->current] <= pos && pos < self->offsets[self->current + 1])
+		return self->current;
+	u32 lo = 0, hi = self->count;
+	while(hi - lo > 1)
+	{
+		u32 mid = lo + (hi - lo) / 2;
+		if(self->offsets[mid] <= pos) lo = mid;
+		else                          hi = mid;
+	}
+	return lo;
+}
+
+static result concat_read_at(nnc_concat *self, u32 offset, u8 *buf, u32 max, u32 *totalRead)
+{
+	u32 size = self->offsets[self->count], done = 0, i, this_read, got;
+	result ret;
+
+	*totalRead = 0;
+	if(offset >= size) return NNC_R_OK;
+	max = MIN(max, size - offset);
+
+	for(i = concat_find(self, offset); done != max; ++i)
+	{
+		/* the offsets array does not agree with the children */
+		if(i == self->count) return NNC_R_INTERNAL;
+		this_read = MIN(max - done, self->offsets[i + 1] - offset);
+		if(this_read == 0) continue;
+		TRY(nnc_read_at(self->children[i], offset - self->offsets[i], buf + done, this_read, &got));
+		done += got; offset += got;
+		*totalRead = done;
+		if(got != this_read) return NNC_R_TOO_SMALL;
+		self->current = i;
+	}
+	return NNC_R_OK;
+}
+
+static result concat_read(nnc_concat *self, u8 *buf, u32 max, u32 *totalRead)
+{
+	result ret = concat_read_at(self, self->pos, buf, max, totalRead);
+	self->pos += *totalRead;
+	return ret;
+}
+
+static result concat_seek_abs(nnc_concat *self, u32 pos)
+{
+	if(pos > self->offsets[self->count]) return NNC_R_SEEK_RANGE;
+	self->current = concat_find(self, pos);
+	self->pos = pos;
+	return NNC_R_OK;
+}
+
+static result concat_seek_rel(nnc_concat *self, u32 pos)
+{
+	return concat_seek_abs(self, self->pos + pos);
+}
+
+static u32 concat_size(nnc_concat *self)
+{
+	return self->offsets[self->count];
+}
+
+static void concat_close(nnc_concat *self)
+{
+	for(u32 i = 0; i < self->count; ++i)
+		NNC_RS_PCALL0(self->children[i], close);
+	free(self->owned);
+}
+
+static u32 concat_tell(nnc_concat *self)
+{
+	return self->pos;
+}
+
+static const nnc_rstream_funcs concat_funcs = {
+	.read = (nnc_read_func) concat_read,
+	.seek_abs = (nnc_seek_abs_func) concat_seek_abs,
+	.seek_rel = (nnc_seek_rel_func) concat_seek_rel,
+	.size = (nnc_size_func) concat_size,
+	.close = (nnc_close_func) concat_close,
+	.tell = (nnc_tell_func) concat_tell,
+	.read_at = (nnc_read_at_func) concat_read_at,
+};
+
+void nnc_concat_open(nnc_concat *self, nnc_rstream **children, nnc_u32 *offsets, nnc_u32 count)
+{
+	self->funcs = &concat_funcs;
+	self->children = children;
+	self->offsets = offsets;
+	self->count = count;
+	self->current = 0;
+	self->pos = 0;
+	self->owned = NULL;
+	offsets[0] = 0;
+	for(u32 i = 0; i < count; ++i)
+		offsets[i + 1] = offsets[i] + NNC_RS_PCALL0(children[i], size);
+}
+
+void nnc_concat_free_on_close(nnc_concat *self, void *block)
+{
+	self->owned = block;
+}
+
+result nnc_read_at(nnc_rstream *rs, u32 offset, u8 *buf, u32 max, u32 *totalRead)
+{
+	if(rs->funcs->read_at)
+		return rs->funcs->read_at(rs, offset, buf, max, totalRead);
+	result ret;
+	/* streams like nnc_aes_ctr are expensive to seek, so don't if we're already there */
+	if(NNC_RS_PCALL0(rs, tell) != offset)
+		TRY(NNC_RS_PCALL(rs, seek_abs, offset));
+	return NNC_RS_PCALL(rs, read, buf, max, totalRead);
+}
+
 /* ... vfs code ... */
 
 #define DEFAULT_FILE_CHILDREN_ALLOC 8
@@ -772,6 +941,67 @@ const nnc_vfs_reader_generator nnc__internal_vfs_generator_subview = {
 
 //
 
+#if defined(__linux__)
+	#include <sys/sendfile.h>
+	#include <sys/syscall.h>
+	#include <unistd.h>
+	#include <errno.h>
+	#define COPY_OFFLOAD 1
+#endif
+
+#if COPY_OFFLOAD
+/* Lets the kernel copy `count' bytes at `off' in `from' to the current position of `to',
+ * so the data doesn't have to pass through userspace. copy_file_range(2) may even share
+ * the extents on filesystems that support it, otherwise we fall back to sendfile(2).
+ * NNC_R_UNSUPPORTED is returned if the kernel can't do it for these files, in which
+ * case nothing has been copied yet. */
+static result copy_offload(FILE *from, u32 off, FILE *to, u32 count)
+{
+	int infd = fileno(from), outfd = fileno(to);
+	off_t inoff = off, outoff;
+	bool use_sendfile = false;
+	long outpos;
+	ssize_t done;
+	u32 left = count;
+
+	if(fflush(to) != 0 || (outpos = ftell(to)) < 0)
+		return NNC_R_FAIL_WRITE;
+	outoff = outpos;
+
+	while(left != 0)
+	{
+#ifdef SYS_copy_file_range
+		if(!use_sendfile)
+		{
+			done = syscall(SYS_copy_file_range, infd, &inoff, outfd, &outoff, (size_t) left, 0u);
+			if(done < 0 && (errno == ENOSYS || errno == EXDEV || errno == EINVAL || errno == EOPNOTSUPP))
+			{
+				use_sendfile = true;
+				continue;
+			}
+		}
+		else
+#endif
+		{
+			/* sendfile(2) writes at the current position of the output */
+			if(lseek(outfd, outoff, SEEK_SET) < 0)
+				done = -1;
+			else if((done = sendfile(outfd, infd, &inoff, left)) > 0)
+				outoff += done;
+			if(done < 0 && left == count && (errno == ENOSYS || errno == EINVAL))
+				return NNC_R_UNSUPPORTED;
+		}
+		if(done < 0)  return NNC_R_FAIL_WRITE;
+		if(done == 0) return NNC_R_TOO_SMALL;
+		left -= done;
+	}
+
+	/* the FILEs don't know the kernel moved the offsets */
+	fseek(from, inoff, SEEK_SET);
+	return fseek(to, outoff, SEEK_SET) == 0 ? NNC_R_OK : NNC_R_FAIL_WRITE;
+}
+#endif
+
 nnc_result nnc_copy(nnc_rstream *from, nnc_wstream *to, u32 *copied)
 {
 	u8 block[BLOCK_SZ];
@@ -780,6 +1010,32 @@ nnc_result nnc_copy(nnc_rstream *from, nnc_wstream *to, u32 *copied)
 	TRY(NNC_RS_PCALL(from, seek_abs, 0));
 
 	if(copied) *copied = left;
+
+#if COPY_OFFLOAD
+	/* file to file copies (optionally through a subview) can be done by the kernel */
+	if(left != 0 && to->funcs == &wfile_funcs)
+	{
+		nnc_subview *sv = NULL;
+		nnc_file *f = NULL;
+		if(from->funcs == &file_funcs)
+			f = (nnc_file *) from;
+		else if(from->funcs == &subview_funcs && ((nnc_subview *) from)->child->funcs == &file_funcs)
+		{
+			sv = (nnc_subview *) from;
+			f = (nnc_file *) sv->child;
+		}
+		if(f)
+		{
+			ret = copy_offload(f->f, sv ? sv->off : 0, ((nnc_wfile *) to)->f, left);
+			if(ret != NNC_R_UNSUPPORTED)
+			{
+				if(sv && ret == NNC_R_OK) sv->pos = left;
+				return ret;
+			}
+		}
+	}
+#endif
+
 	while(left != 0)
 	{
 		next = MIN(left, BLOCK_SZ);
@@ -1,15 +1,14 @@
 
 #include <nnc/ticket.h>
+#include <stdlib.h>
 #include <string.h>
 #include "./internal.h"
 
 
-nnc_result nnc_read_ticket(nnc_rstream *rs, nnc_ticket *tik)
+#define TICKET_DATA_SIZE 0x124
+
+static void parse_ticket_data(const u8 buf[TICKET_DATA_SIZE], nnc_ticket *tik)
 {
-	result ret;
-	TRY(nnc_read_sig(rs, &tik->sig));
-	u8 buf[0x124];
-	TRY(read_exact(rs, buf, sizeof(buf)));
 	/* 0x00 */ memcpy(tik->ecc_pubkey, &buf[0x00], 0x3C);
 	/* 0x3C */ tik->version = buf[0x3C];
 	/* 0x3D */ tik->cacrlversion = buf[0x3D];
@@ -30,6 +29,40 @@ nnc_result nnc_read_ticket(nnc_rstream *rs, nnc_ticket *tik)
 	/* 0xA1 */ tik->audit = buf[0xA1];
 	/* 0xA2 */ /* reserved */ /* content_permissions + u8[3] reserved */
 	/* 0xE4 */ memcpy(tik->limits, &buf[0xE4], 0x40);
+}
+
+nnc_result nnc_read_ticket(nnc_rstream *rs, nnc_ticket *tik)
+{
+	result ret;
+	TRY(nnc_read_sig(rs, &tik->sig));
+	u8 buf[TICKET_DATA_SIZE];
+	TRY(read_exact(rs, buf, sizeof(buf)));
+	parse_ticket_data(buf, tik);
+	return NNC_R_OK;
+}
+
+nnc_result nnc_ticket_size(nnc_rstream *rs, nnc_u32 *size)
+{
+	u32 pos, total = NNC_RS_PCALL0(rs, size);
+	result ret;
+	u8 buf[8];
+
+	TRY(read_at_exact(rs, 0, buf, 4));
+	if(buf[0] != 0x00 || buf[1] != 0x01 || buf[2] != 0x00 || !(pos = nnc_sig_size(buf[3])))
+		return NNC_R_INVALID_SIG;
+	/* signature, issuer, ticket data */
+	pos += 0x40 + TICKET_DATA_SIZE;
+	if(pos > total) return NNC_R_TOO_SMALL;
+	/* the content index is variable in size, and tickets written by
+	 * nnc_write_ticket() don't have one at all */
+	if(pos + sizeof(buf) <= total)
+	{
+		TRY(read_at_exact(rs, pos, buf, sizeof(buf)));
+		/* 0x00 */ if(BE16P(&buf[0x00]) == 0x0001 && BE16P(&buf[0x02]) == 0x0014)
+		/* 0x04 */ 	pos += BE32P(&buf[0x04]);
+		if(pos > total) return NNC_R_TOO_SMALL;
+	}
+	*size = pos;
 	return NNC_R_OK;
 }
 
@@ -74,3 +107,131 @@ result nnc_ticket_signature_hash(nnc_rstream *rs, nnc_ticket *tik, nnc_sha_hash
 	return nnc_sighash(rs, tik->sig.type, digest, NNC_RS_PCALL0(rs, size) - pos);
 }
 
+
+/* big enough for a RSA-4096 signed ticket with the largest content index we accept */
+#define SCAN_INDEX_MAX 0x10000
+#define SCAN_TICKET_MAX (0x240 + 0x40 + TICKET_DATA_SIZE + SCAN_INDEX_MAX)
+#define SCAN_BUFFER_SIZE 0x40000
+
+/* same as nnc_ticket_size() but on a buffer of `avail' bytes */
+static result ticket_size_mem(const u8 *data, u32 avail, u32 *size)
+{
+	u32 pos;
+	if(avail < 4) return NNC_R_TOO_SMALL;
+	if(data[0] != 0x00 || data[1] != 0x01 || data[2] != 0x00 || !(pos = nnc_sig_size(data[3])))
+		return NNC_R_INVALID_SIG;
+	pos += 0x40 + TICKET_DATA_SIZE;
+	if(pos > avail) return NNC_R_TOO_SMALL;
+	if(pos + 8 <= avail && BE16P(&data[pos]) == 0x0001 && BE16P(&data[pos + 2]) == 0x0014)
+	{
+		u32 index_size = BE32P(&data[pos + 4]);
+		if(index_size > SCAN_INDEX_MAX) return NNC_R_CORRUPT;
+		pos += index_size;
+		if(pos > avail) return NNC_R_TOO_SMALL;
+	}
+	*size = pos;
+	return NNC_R_OK;
+}
+
+result nnc_ticket_scan(rstream *rs, nnc_ticket_scan_func callback, void *udata)
+{
+	u32 total = NNC_RS_PCALL0(rs, size), start = 0, buf_start = 0, have = 0;
+	u8 *buf = malloc(SCAN_BUFFER_SIZE);
+	if(!buf) return NNC_R_NOMEM;
+	result ret = NNC_R_OK;
+	nnc_memory mem;
+	nnc_ticket tik;
+	u32 size;
+
+	/* `buf' holds `have' bytes of the stream starting at `buf_start', and is only
+	 * refilled once it may not hold the entire ticket at `start' anymore */
+	while(start < total)
+	{
+		u32 rel = start - buf_start;
+		if(have - rel < MIN(SCAN_TICKET_MAX, total - start))
+		{
+			memmove(buf, buf + rel, have - rel);
+			have -= rel;
+			buf_start = start;
+			rel = 0;
+			u32 len = MIN(SCAN_BUFFER_SIZE - have, total - (buf_start + have));
+			TRYLBL(read_at_exact(rs, buf_start + have, buf + have, len), out);
+			have += len;
+		}
+		u8 *cur = buf + rel;
+		TRYLBL(ticket_size_mem(cur, have - rel, &size), out);
+		nnc_mem_open(&mem, cur, size);
+		TRYLBL(nnc_read_sig(NNC_RSP(&mem), &tik.sig), out);
+		parse_ticket_data(cur + nnc_sig_size(tik.sig.type) + 0x40, &tik);
+		TRYLBL(callback(&tik, start, size, udata), out);
+		start += size;
+	}
+
+out:
+	free(buf);
+	return ret;
+}
+
+static result index_ticket(nnc_ticket *tik, u32 offset, u32 size, void *udata)
+{
+	nnc_ticket_index *index = udata;
+	if(index->count == index->alloc)
+	{
+		u32 alloc = index->alloc ? index->alloc * 2 : 256;
+		struct nnc_ticket_index_entry *entries = realloc(index->entries, alloc * sizeof(struct nnc_ticket_index_entry));
+		if(!entries) return NNC_R_NOMEM;
+		index->entries = entries;
+		index->alloc = alloc;
+	}
+	struct nnc_ticket_index_entry *ent = &index->entries[index->count++];
+	ent->title_id = tik->title_id;
+	ent->offset = offset;
+	ent->size = size;
+	return NNC_R_OK;
+}
+
+static int index_entry_cmp(const void *a, const void *b)
+{
+	const struct nnc_ticket_index_entry *ea = a, *eb = b;
+	if(ea->title_id != eb->title_id)
+		return ea->title_id < eb->title_id ? -1 : 1;
+	return ea->offset < eb->offset ? -1 : ea->offset > eb->offset;
+}
+
+result nnc_index_tickets(rstream *rs, nnc_ticket_index *index)
+{
+	result ret;
+	index->entries = NULL;
+	index->count = 0;
+	index->alloc = 0;
+	if((ret = nnc_ticket_scan(rs, index_ticket, index)) != NNC_R_OK)
+	{
+		nnc_free_ticket_index(index);
+		return ret;
+	}
+	if(index->count > 1)
+		qsort(index->entries, index->count, sizeof(struct nnc_ticket_index_entry), index_entry_cmp);
+	return NNC_R_OK;
+}
+
+struct nnc_ticket_index_entry *nnc_find_ticket(nnc_ticket_index *index, u64 tid)
+{
+	u32 lo = 0, hi = index->count;
+	while(lo < hi)
+	{
+		u32 mid = lo + (hi - lo) / 2;
+		if(index->entries[mid].title_id < tid) lo = mid + 1;
+		else                                   hi = mid;
+	}
+	if(lo != index->count && index->entries[lo].title_id == tid)
+		return &index->entries[lo];
+	return NULL;
+}
+
+void nnc_free_ticket_index(nnc_ticket_index *index)
+{
+	free(index->entries);
+	index->entries = NULL;
+	index->count = 0;
+	index->alloc = 0;
+}
@@ -99,48 +99,105 @@ bool nnc_verify_tmd_info_records(rstream *rs, nnc_tmd_header *tmd)
 	u32 pos = get_cinfo_pos(tmd);
 	if(!pos) return false;
 
+	u8 data[CINFO_SIZE];
 	nnc_sha256_hash digest;
-	TRYB(NNC_RS_PCALL(rs, seek_abs, pos));
-	TRYB(nnc_crypto_sha256_part(rs, digest, CINFO_SIZE));
+	TRYB(read_at_exact(rs, pos, data, CINFO_SIZE));
+	TRYB(nnc_crypto_sha256(data, digest, CINFO_SIZE));
 	return memcmp(digest, tmd->hash, sizeof(digest)) == 0;
 }
 
-bool nnc_verify_tmd_chunk_records(rstream *rs, nnc_tmd_header *tmd, nnc_cinfo_record *records)
+/* reads all chunk records in one go, `*data' must be free()'d */
+static result read_chunk_area(rstream *rs, nnc_tmd_header *tmd, u8 **data)
 {
 	u32 pos = get_crec_pos(tmd);
-	if(!pos) return false;
-	TRYB(NNC_RS_PCALL(rs, seek_abs, pos));
-	u32 to_hash = tmd->content_count;
-	for(u32 i = 0; records[i].count != 0 && to_hash != 0; ++i)
+	if(!pos) return NNC_R_INVALID_SIG;
+	/* sizeof(chunk_record) = 0x30 */
+	u32 size = tmd->content_count * 0x30;
+	result ret;
+	if(!(*data = malloc(size ? size : 1)))
+		return NNC_R_NOMEM;
+	if((ret = read_at_exact(rs, pos, *data, size)) != NNC_R_OK)
+		free(*data);
+	return ret;
+}
+
+/* hashing in parallel only pays off once there's enough to hash
+ * to make up for starting the threads */
+#define CREC_THREADS 4
+#define CREC_PARALLEL_MIN 0x40000
+
+struct crec_job {
+	u8 *data;
+	nnc_cinfo_record *records;
+	u32 *offsets;
+	u32 count, first, step;
+	bool ok;
+};
+
+static void crec_job_run(void *arg)
+{
+	struct crec_job *job = arg;
+	nnc_sha256_hash digest;
+	job->ok = true;
+	for(u32 i = job->first; i < job->count && job->ok; i += job->step)
 	{
-		to_hash -= records[i].count;
-		/* sizeof(chunk_record) = 0x30 */
-		u32 hash_size = records[i].count * 0x30;
-		nnc_sha256_hash digest;
-		TRYB(nnc_crypto_sha256_part(rs, digest, hash_size));
-		if(memcmp(digest, records[i].hash, sizeof(digest)) != 0)
+		nnc_crypto_sha256(&job->data[job->offsets[i]], digest, job->records[i].count * 0x30);
+		job->ok = memcmp(digest, job->records[i].hash, sizeof(digest)) == 0;
+	}
+}
+
+bool nnc_verify_tmd_chunk_records(rstream *rs, nnc_tmd_header *tmd, nnc_cinfo_record *records)
+{
+	u32 offsets[NNC_CINFO_MAX_SIZE];
+	u32 to_hash = tmd->content_count, count = 0;
+	for(; count < NNC_CINFO_MAX_SIZE && records[count].count != 0 && to_hash != 0; ++count)
+	{
+		if(records[count].count > to_hash)
 			return false;
+		/* the records cover the chunk records back to back */
+		offsets[count] = (tmd->content_count - to_hash) * 0x30;
+		to_hash -= records[count].count;
 	}
-	return to_hash == 0;
+	if(to_hash != 0) return false;
+
+	u8 *data;
+	TRYB(read_chunk_area(rs, tmd, &data));
+
+	struct crec_job jobs[CREC_THREADS];
+	u32 njobs = tmd->content_count * 0x30 >= CREC_PARALLEL_MIN ? MIN(count, CREC_THREADS) : 1;
+	bool ok = true;
+	for(u32 i = 0; i < njobs; ++i)
+	{
+		jobs[i].data = data;
+		jobs[i].records = records;
+		jobs[i].offsets = offsets;
+		jobs[i].count = count;
+		jobs[i].first = i;
+		jobs[i].step = njobs;
+	}
+	run_jobs(crec_job_run, jobs, sizeof(struct crec_job), njobs);
+	for(u32 i = 0; i < njobs; ++i)
+		ok = ok && jobs[i].ok;
+	free(data);
+	return ok;
 }
 
 result nnc_read_tmd_chunk_records(rstream *rs, nnc_tmd_header *tmd, nnc_chunk_record *records)
 {
-	u32 pos = get_crec_pos(tmd);
-	if(!pos) return NNC_R_INVALID_SIG;
 	result ret;
-	TRY(NNC_RS_PCALL(rs, seek_abs, pos));
+	u8 *data;
+	TRY(read_chunk_area(rs, tmd, &data));
 	for(u16 i = 0; i < tmd->content_count; ++i)
 	{
 		nnc_chunk_record *rec = &records[i];
-		u8 blk[0x30];
-		TRY(read_exact(rs, blk, sizeof(blk)));
+		u8 *blk = &data[i * 0x30];
 		/* 0x00 */ rec->id = BE32P(&blk[0x00]);
 		/* 0x04 */ rec->index = BE16P(&blk[0x04]);
 		/* 0x06 */ rec->flags = BE16P(&blk[0x06]);
 		/* 0x08 */ rec->size = BE64P(&blk[0x08]);
 		/* 0x10 */ memcpy(rec->hash, &blk[0x10], sizeof(nnc_sha256_hash));
 	}
+	free(data);
 	return NNC_R_OK;
 }
 
@@ -16,25 +16,22 @@ void die(const char *fmt, ...);
 
 static void extract(nnc_rstream *rs, const char *to, const char *type, nnc_sha256_hash hash)
 {
-	nnc_u32 len = NNC_RS_PCALL0(rs, size), rlen;
+	nnc_u32 len = NNC_RS_PCALL0(rs, size);
 	printf("Saving %s (0x%X) to %s... ", type, len, to);
-	nnc_u8 *buf = malloc(len);
-	if(NNC_RS_PCALL(rs, read, buf, len, &rlen) != NNC_R_OK || len != rlen)
-		die("read failure for %s", to);
+	nnc_sha256_hash digest;
+	nnc_wfile out;
+	if(nnc_wfile_open(&out, to) != NNC_R_OK)
+		die("failed to open %s", to);
+	if(nnc_crypto_decrypt_hash(rs, digest, NNC_WSP(&out)) != NNC_R_OK)
+		die("read or write failure for %s", to);
+	NNC_WS_CALL0(out, close);
 	if(hash)
 	{
-		nnc_sha256_hash digest;
-		nnc_crypto_sha256(buf, digest, len);
 		if(nnc_crypto_hasheq(digest, hash))
 			printf("hash match... ");
 		else
 			printf("hash mismatch... ");
 	}
-	FILE *out = fopen(to, "w");
-	if(fwrite(buf, len, 1, out) != 1)
-		die("write failure for %s", to);
-	fclose(out);
-	free(buf);
 	puts("done");
 }
 
@@ -98,7 +95,29 @@ int cia_main(int argc, char *argv[])
 
 	snprintf(pathbuf, sizeof(pathbuf), "%s/meta", output);
 	if(nnc_cia_open_meta(&header, NNC_RSP(&f), &sv) == NNC_R_OK)
+	{
 		extract(NNC_RSP(&sv), pathbuf, "CIA meta section", NULL);
+
+		nnc_cia_meta meta;
+		if(nnc_read_cia_meta(NNC_RSP(&sv), &meta) == NNC_R_OK)
+		{
+			printf(" Core Version            : %" PRIu32 "\n"
+			       " Dependencies            : [", meta.core_version);
+			comma = 0;
+			for(int i = 0; i < NNC_CIA_META_DEPENDENCIES && meta.dependencies[i]; ++i)
+			{
+				printf(comma ? ", %016" PRIX64 : "%016" PRIX64, meta.dependencies[i]);
+				comma = 1;
+			}
+			puts("]");
+		}
+		else fprintf(stderr, "WARN: failed to parse meta.\n");
+
+		nnc_subview icon;
+		snprintf(pathbuf, sizeof(pathbuf), "%s/icon", output);
+		if(nnc_cia_meta_icon(NNC_RSP(&sv), &icon) == NNC_R_OK)
+			extract(NNC_RSP(&icon), pathbuf, "SMDH", NULL);
+	}
 	else fprintf(stderr, "WARN: no meta in CIA.\n");
 
 	nnc_cia_content_reader reader;
@@ -149,26 +168,29 @@ int cia_main(int argc, char *argv[])
 
 int rewrite_cia_main(int argc, char *argv[])
 {
-	if(argc != 3) die("usage: %s <cia-file> <output-cia-file>", argv[0]);
+	if(argc != 3 && !(argc == 4 && strcmp(argv[3], "-e") == 0))
+		die("usage: %s <cia-file> <output-cia-file> [-e]", argv[0]);
 	const char *cia_file = argv[1];
 	const char *output = argv[2];
 
 	nnc_cia_content_reader reader;
 	nnc_cia_content_stream *streams;
 	nnc_cia_writable_ncch *ncchs;
-	nnc_subview certchain, ticket, tmd;
+	nnc_subview certchain, ticket, tmd, meta;
 	nnc_tmd_header tmdhdr;
 	nnc_cia_header hdr;
 	nnc_wfile ocia;
 	nnc_file cia;
 	nnc_result res;
 	nnc_u32 i, j = 0;
+	nnc_u8 meta_flag;
 
 	MUST(nnc_file_open(&cia, cia_file), "open cia");
 	MUST(nnc_read_cia_header(NNC_RSP(&cia), &hdr), "parse cia header");
 	nnc_cia_open_certchain(&hdr, NNC_RSP(&cia), &certchain);
 	nnc_cia_open_ticket(&hdr, NNC_RSP(&cia), &ticket);
 	nnc_cia_open_tmd(&hdr, NNC_RSP(&cia), &tmd);
+	meta_flag = nnc_cia_open_meta(&hdr, NNC_RSP(&cia), &meta) == NNC_R_OK ? NNC_CIA_WF_META_STREAM : NNC_CIA_WF_META_OMIT;
 	MUST(nnc_read_tmd_header(NNC_RSP(&tmd), &tmdhdr), "parse tmd header");
 	MUST(nnc_wfile_open(&ocia, output), "open output");
 	MUST(nnc_cia_make_reader(&hdr, NNC_RSP(&cia), nnc_get_default_keyset(), &reader), "make content reader");
@@ -184,8 +206,9 @@ int rewrite_cia_main(int argc, char *argv[])
 	}
 
 	MUST(nnc_write_cia(
-		NNC_CIA_WF_CERTCHAIN_STREAM | NNC_CIA_WF_TICKET_STREAM | NNC_CIA_WF_TMD_BUILD,
-		&certchain, &ticket, &tmdhdr, j, ncchs, NNC_WSP(&ocia)
+		NNC_CIA_WF_CERTCHAIN_STREAM | NNC_CIA_WF_TICKET_STREAM | NNC_CIA_WF_TMD_BUILD | meta_flag
+			| (argc == 4 ? NNC_CIA_WF_ENCRYPT_CONTENTS : 0),
+		&certchain, &ticket, &tmdhdr, meta_flag ? &meta : NULL, j, ncchs, NNC_WSP(&ocia)
 	), "write cia");
 	MUST(NNC_WS_CALL0(ocia, close), "close cia");
 
@@ -199,3 +222,25 @@ int rewrite_cia_main(int argc, char *argv[])
 	return 0;
 }
 
+
+int cdn_cia_main(int argc, char *argv[])
+{
+	if(argc != 5 && !(argc == 6 && strcmp(argv[5], "-v") == 0))
+		die("usage: %s <cdn-directory> <ticket-file> <certchain-file> <output-cia-file> [-v]", argv[0]);
+
+	nnc_file ticket, certchain;
+	nnc_wfile ocia;
+	nnc_result res;
+
+	MUST(nnc_file_open(&ticket, argv[2]), "open ticket");
+	MUST(nnc_file_open(&certchain, argv[3]), "open certificate chain");
+	MUST(nnc_wfile_open(&ocia, argv[4]), "open output");
+	MUST(nnc_cia_from_cdn(NNC_CDN_DIRECTORY | (argc == 6 ? NNC_CDN_VERIFY : 0), argv[1],
+		NNC_RSP(&ticket), NNC_RSP(&certchain), NNC_WSP(&ocia)), "assemble cia");
+	MUST(NNC_WS_CALL0(ocia, close), "close cia");
+
+	NNC_RS_CALL0(certchain, close);
+	NNC_RS_CALL0(ticket, close);
+
+	return 0;
+}
@@ -6,7 +6,7 @@
 
 #define BUILD_OPTS "build exefs | build romfs"
 
-#define DIE_USAGE() die("usage: [ extract-exefs | exheader-info | extract-romfs | romfs-info | ncch-info | tmd-info | smdh-info | test-u128 | tik-info | cia-unpack | " BUILD_OPTS " ]")
+#define DIE_USAGE() die("usage: [ extract-exefs | exheader-info | extract-romfs | romfs-info | ncch-info | tmd-info | smdh-info | test-u128 | tik-info | cia-unpack | cdn-to-cia | " BUILD_OPTS " ]")
 #define DIE_BUILD_USAGE() die("usage: [ " BUILD_OPTS " ]")
 
 static const char *opt = "nnc-test";
@@ -30,6 +30,7 @@ void print_hash(unsigned char *b)
 
 int extract_exefs_main(int argc, char *argv[]); /* exefs.c */
 int rewrite_cia_main(int argc, char *argv[]); /* cia.c */
+int cdn_cia_main(int argc, char *argv[]); /* cia.c */
 int ncch_info_main(int argc, char *argv[]); /* ncch.c */
 int exheader_main(int argc, char *argv[]); /* exheader.c */
 int tmd_info_main(int argc, char *argv[]); /* tmd.c */
@@ -74,6 +75,7 @@ int main(int argc, char *argv[])
 	CASE("tik-info", tik_main);
 	CASE("cia-unpack", cia_main);
 	CASE("rewrite-cia", rewrite_cia_main);
+	CASE("cdn-to-cia", cdn_cia_main);
 	CASE("build", build_main);
 #undef CASE
 	DIE_USAGE();